@@ -0,0 +1,125 @@
+// Helpers for benchmarks
+//
+// Each benchmark is a program that prints one JSON object per line to stdout, describing one
+// measured case. Cases are run in a forked child process so that peak RSS and allocation
+// counts are attributed to that case alone.
+//
+// bench_time()            Monotonic time in seconds
+// bench_peak_rss_kb()     Peak resident set size of the process in kB
+// bench_allocs            Number of and bytes requested from the global `operator new` in this
+//                         process. Allocations made through alloc:: (see alloc.hh) don't go
+//                         through it; add alloc::stats() for those.
+// bench_run(name, fn)     Runs fn() in a child process (unless filtered out by SAT_BENCH_FILTER)
+// BenchRand               Small deterministic PRNG for corpus generators
+// BenchJSON               Builds a one-line JSON object
+//
+#ifndef _SAT_BENCH_H_
+#define _SAT_BENCH_H_
+
+#include "../src/common.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <new>
+#include <string>
+#include <sstream>
+
+namespace sat {
+
+inline static double SAT_UNUSED bench_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+inline static long SAT_UNUSED bench_peak_rss_kb() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  #if SAT_TARGET_OS_DARWIN
+  return ru.ru_maxrss / 1024; // bytes on darwin
+  #else
+  return ru.ru_maxrss;
+  #endif
+}
+
+struct BenchAllocs {
+  size_t count = 0;
+  size_t bytes = 0;
+};
+static BenchAllocs bench_allocs;
+
+// Size of input to generate, in bytes. Configured with SAT_BENCH_SIZE=<MB>
+inline static size_t SAT_UNUSED bench_size() {
+  const char* s = getenv("SAT_BENCH_SIZE");
+  double mb = s ? atof(s) : 0;
+  return (size_t)((mb > 0 ? mb : 8) * 1024 * 1024);
+}
+
+// Runs `f` in a child process, unless SAT_BENCH_FILTER is set and is not a substring of `name`.
+// Returns false if the case failed.
+template <typename F> bool bench_run(const char* name, F f) {
+  const char* filter = getenv("SAT_BENCH_FILTER");
+  if (filter && !strstr(name, filter)) {
+    return true;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    bench_allocs = BenchAllocs();
+    bool ok = f();
+    fflush(stdout);
+    _exit(ok ? 0 : 1);
+  }
+  int status = 0;
+  if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+  {
+    printf("{\"case\":\"%s\",\"error\":\"failed\"}\n", name);
+    return false;
+  }
+  return true;
+}
+
+struct BenchRand {
+  // xorshift64*
+  BenchRand(u64 seed=0x9e3779b97f4a7c15ull) : _s(seed) {}
+  u64 next() {
+    _s ^= _s >> 12; _s ^= _s << 25; _s ^= _s >> 27;
+    return _s * 0x2545f4914f6cdd1dull;
+  }
+  size_t below(size_t n) { return (size_t)(next() % n); }
+  u64 _s;
+};
+
+struct BenchJSON {
+  template <typename T> BenchJSON& operator()(const char* key, const T& value) {
+    _ss << (_n++ ? "," : "{") << '"' << key << "\":" << value;
+    return *this;
+  }
+  BenchJSON& operator()(const char* key, const char* value) {
+    _ss << (_n++ ? "," : "{") << '"' << key << "\":\"" << value << '"';
+    return *this;
+  }
+  void print() { printf("%s}\n", _ss.str().c_str()); }
+  std::ostringstream _ss;
+  int _n = 0;
+};
+
+} // namespace sat
+
+// Count allocations made through `operator new` in the benchmark process.
+// Only define these in the one translation unit that includes this file.
+void* operator new(size_t z) {
+  sat::bench_allocs.count++;
+  sat::bench_allocs.bytes += z;
+  void* p = malloc(z);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+
+#endif // _SAT_BENCH_H_
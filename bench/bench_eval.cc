@@ -0,0 +1,110 @@
+//!DEP ../src/eval.cc ../src/parse.cc ../src/hashcons.cc ../src/str.cc ../src/expr.cc ../src/trace.cc ../src/alloc.cc
+// Evaluation of a generated program: walking the trees with TreeInterp, compiling and running
+// each result, and running already compiled code again (the cost of the VM alone.)
+//
+#include "bench.hh"
+#include "../src/eval.hh"
+#include <string>
+#include <vector>
+
+using namespace sat;
+
+static std::string make_source(size_t nresults) {
+  // Namespaces with definitions which refer to each other, and lines with where blocks
+  std::string s;
+  for (size_t i = 0; i < nresults; i++) {
+    std::string n = std::to_string(i);
+    std::string ns = "ns" + std::to_string(i % 64);
+    if (i % 2 == 0) {
+      s += ns + ":\n";
+      s += "  x" + n + " = Value" + n + " y\n";
+      s += "  y = x" + n + " ns" + std::to_string((i + 1) % 64) + ":y\n";
+      s += "  z = a = b = y\n";
+    } else {
+      s += "print Got " + ns + ":z And w From " + ns + ": y\n";
+      s += "  w = (" + ns + ":x" + std::to_string(i - 1) + " more) v\n";
+      s += "  v = \"" + n + "\"\n";
+    }
+  }
+  s += "end\n";
+  return s;
+}
+
+static std::vector<Expr*> parse_source(const std::string& src) {
+  std::vector<Expr*> results;
+  Parser P(kStr_user_ns);
+  Parser::Status status = Parser::Status::MORE;
+  size_t offs = 0;
+  while (status == Parser::Status::MORE) {
+    size_t bufsize;
+    char* buf = P.get_read_buf(bufsize);
+    size_t len = SAT_MIN(bufsize, src.size() - offs);
+    memcpy(buf, src.data() + offs, len);
+    offs += len;
+    P.fill(buf, len, offs == src.size());
+    while ((status = P.parse()) == Parser::Status::RESULT) {
+      while (Expr* e = P.next_result()) { results.push_back(e); }
+    }
+  }
+  return results;
+}
+
+static bool bench_case(const char* case_name, size_t nresults) {
+  char name[128];
+  snprintf(name, sizeof(name), "%s/%zu", case_name, nresults);
+  return bench_run(name, [&]{
+    std::vector<Expr*> results = parse_source(make_source(nresults));
+    std::ostream null(nullptr); // discards what print writes
+    Env env(null);
+    std::vector<Code*> codes;
+    double t = 0;
+
+    if (strcmp(case_name, "tree") == 0) {
+      TreeInterp interp(env);
+      t = bench_time();
+      for (Expr* e : results) { interp.eval(e); }
+      t = bench_time() - t;
+    } else if (strcmp(case_name, "compile_run") == 0) {
+      Compiler compiler(env);
+      t = bench_time();
+      for (Expr* e : results) {
+        Code code(env);
+        compiler.compile(e, code);
+        run(env, code);
+      }
+      t = bench_time() - t;
+    } else { // run
+      Compiler compiler(env);
+      for (Expr* e : results) {
+        codes.push_back(new Code(env));
+        compiler.compile(e, *codes.back());
+        run(env, *codes.back());
+      }
+      t = bench_time();
+      for (Code* code : codes) { run(env, *code); }
+      t = bench_time() - t;
+    }
+
+    BenchJSON()
+      ("bench", "eval")
+      ("case", case_name)
+      ("results", results.size())
+      ("seconds", t)
+      ("ns_per_result", t * 1e9 / (double)results.size())
+      .print();
+
+    for (size_t i = codes.size(); i > 0; i--) { delete codes[i-1]; }
+    for (Expr* e : results) { delete e; }
+    return true;
+  });
+}
+
+int main(int argc, const char** argv) {
+  bool ok = true;
+  for (size_t n : { 1000, 100000 }) {
+    ok = bench_case("tree", n) && ok;
+    ok = bench_case("compile_run", n) && ok;
+    ok = bench_case("run", n) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+//!DEP ../src/io.cc ../src/trace.cc ../src/alloc.cc
+// Reading many files: fread() of one file after another, like `sat` did, versus FileReader with
+// io_uring and with its pread() thread pool.
+//
+// Files are written to a temporary directory first, so they are usually in the page cache and
+// this measures the overhead of issuing reads rather than the disk. For cold-cache numbers, drop
+// the caches between writing and reading (e.g. with SAT_BENCH_KEEP=1 and a second run.)
+//
+#include "bench.hh"
+#include "../src/io.hh"
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+using namespace sat;
+
+static std::vector<std::string> make_files(size_t nfiles, size_t file_size) {
+  std::string dir = "/tmp/sat_bench_io." + std::to_string(nfiles) + "x" +
+                    std::to_string(file_size);
+  mkdir(dir.c_str(), 0700);
+  std::vector<std::string> paths;
+  std::string contents(file_size, 'x');
+  for (size_t i = 0; i < nfiles; i++) {
+    paths.push_back(dir + "/" + std::to_string(i) + ".sat");
+    struct stat st;
+    if (stat(paths.back().c_str(), &st) == 0 && (size_t)st.st_size == file_size) {
+      continue;
+    }
+    FILE* fp = fopen(paths.back().c_str(), "w");
+    fwrite(contents.data(), 1, contents.size(), fp);
+    fclose(fp);
+  }
+  return paths;
+}
+
+static void remove_files(const std::vector<std::string>& paths) {
+  if (getenv("SAT_BENCH_KEEP") || paths.empty()) {
+    return;
+  }
+  for (const std::string& path : paths) { unlink(path.c_str()); }
+  rmdir(paths[0].substr(0, paths[0].rfind('/')).c_str());
+}
+
+static u64 checksum(const char* p, size_t len) {
+  // Touch every byte, standing in for the parser
+  u64 h = 0;
+  for (size_t i = 0; i < len; i++) { h = h * 31 + (u8)p[i]; }
+  return h;
+}
+
+static bool bench_case(const char* case_name, size_t nfiles, size_t file_size) {
+  char name[128];
+  snprintf(name, sizeof(name), "%s/%zux%zu", case_name, nfiles, file_size);
+  return bench_run(name, [&]{
+    std::vector<std::string> paths = make_files(nfiles, file_size);
+    u64 h = 0;
+    size_t bytes = 0;
+    const char* backend = case_name;
+    double t = bench_time();
+    if (strcmp(case_name, "fread") == 0) {
+      char buf[4096];
+      for (const std::string& path : paths) {
+        FILE* fp = fopen(path.c_str(), "r");
+        if (!fp) { return false; }
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+          h += checksum(buf, n);
+          bytes += n;
+        }
+        fclose(fp);
+      }
+    } else {
+      FileReader::Options opt;
+      opt.use_uring = strcmp(case_name, "uring") == 0;
+      FileReader r(paths, opt);
+      FileReader::Chunk c;
+      while (r.next(c)) {
+        if (c.error) { return false; }
+        h += checksum(c.data, c.len);
+        bytes += c.len;
+        r.release(c);
+      }
+      backend = r.stats().backend;
+    }
+    t = bench_time() - t;
+    remove_files(paths);
+
+    BenchJSON()
+      ("bench", "io")
+      ("case", case_name)
+      ("backend", backend)
+      ("files", nfiles)
+      ("bytes", bytes)
+      ("seconds", t)
+      ("mb_s", ((double)bytes / (1024*1024)) / t)
+      ("files_s", (double)nfiles / t)
+      ("checksum", h & 0xffff)
+      .print();
+    return bytes == nfiles * file_size;
+  });
+}
+
+int main(int argc, const char** argv) {
+  bool ok = true;
+  for (const char* c : { "fread", "pread", "uring" }) {
+    ok = bench_case(c, 4000, 4 * 1024) && ok;
+    ok = bench_case(c, 100, 1024 * 1024) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+// Lock and unlock throughput of sat::Lock, Spinlock and std::mutex, with threads contending for
+// a critical section about as long as an interner lookup. With more threads than cores, a lock
+// holder is often descheduled; Lock then parks its waiters while Spinlock keeps them spinning.
+//
+#include "bench.hh"
+#include "../src/lock.hh"
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace sat;
+
+struct SpinlockAdapter {
+  Spinlock l = SB_SPINLOCK_INIT;
+  void lock() { spinlock_lock(l); }
+  void unlock() { spinlock_unlock(l); }
+};
+
+template <typename L>
+static bool bench_case(const char* lock_name, size_t nthreads, L& lock,
+                       std::function<void(BenchJSON&)> extra = nullptr)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "lock/%s/%zut", lock_name, nthreads);
+  return bench_run(name, [&]{
+    const size_t kOps = 2000000 / nthreads; // per thread
+    u64 shared[8] = {};
+    std::vector<std::thread> threads;
+    double t = bench_time();
+    for (size_t i = 0; i < nthreads; i++) {
+      threads.emplace_back([&]{
+        for (size_t n = 0; n < kOps; n++) {
+          std::lock_guard<L> g(lock);
+          for (u64& v : shared) { v = v * 31 + n; }
+        }
+      });
+    }
+    for (auto& th : threads) { th.join(); }
+    t = bench_time() - t;
+
+    BenchJSON j;
+    j("bench", "lock")
+     ("lock", lock_name)
+     ("threads", nthreads)
+     ("ops", kOps * nthreads)
+     ("seconds", t)
+     ("ns_per_op", t * 1e9 / (double)(kOps * nthreads));
+    if (extra) { extra(j); }
+    j.print();
+    return true;
+  });
+}
+
+int main(int argc, const char** argv) {
+  bool ok = true;
+  for (size_t nthreads : { 1, 2, 4, 8 }) {
+    Lock l;
+    l.set_counting(true);
+    ok = bench_case("Lock", nthreads, l, [&](BenchJSON& j) {
+      Lock::Stats st = l.stats();
+      j("contended", st.contended)
+       ("spun", st.spun)
+       ("parks", st.parks)
+       ("wait_us", (double)st.wait_ns / 1000.0);
+    }) && ok;
+    Lock ln;
+    ok = bench_case("Lock-nocount", nthreads, ln) && ok;
+    SpinlockAdapter sl;
+    ok = bench_case("Spinlock", nthreads, sl) && ok;
+    std::mutex m;
+    ok = bench_case("std::mutex", nthreads, m) && ok;
+  }
+  return ok ? 0 : 1;
+}
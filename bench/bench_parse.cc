@@ -0,0 +1,346 @@
+//!DEP ../src/parse.cc ../src/hashcons.cc ../src/str.cc ../src/expr.cc ../src/trace.cc ../src/alloc.cc
+// End-to-end parser throughput over synthetic corpora.
+//
+// Every case generates its input in memory, then feeds it to a Parser in chunks of a fixed size
+// through get_read_buf() and fill(), the same way `sat` does when reading a file.
+//
+#include "bench.hh"
+#include "../src/parse.hh"
+#include <vector>
+
+using namespace sat;
+
+static const char* kWords[] = {
+  "kind", "Dairy", "Spice", "has_a_dry_sensation", "Yes", "No", "x", "y", "print", "using",
+  "name", "location", "Hello", "From", "Or", "map", "upcase", "join", "List", "tail",
+};
+static const size_t kWordsCount = sizeof(kWords) / sizeof(*kWords);
+
+static void gen_symbol(std::string& s, size_t n) {
+  // Unique symbol from a counter, e.g. "s1z4"
+  s.append(1, 's');
+  do { s.append(1, "0123456789abcdefghijklmnopqrstuvwxyz"[n % 36]); n /= 36; } while (n);
+}
+
+// ------------------------------------------------------------------------------------------------
+// Corpus generators. Each appends roughly `size` bytes of source text to `s`.
+
+static void gen_realistic(std::string& s, size_t size, BenchRand& r) {
+  // Namespaces with assignments, comments, groups and nested blocks, like foo.sat
+  size_t ns = 0;
+  while (s.size() < size) {
+    s.append("# namespace number "); gen_symbol(s, ns); s.append("\n");
+    gen_symbol(s, ns++); s.append(":\n");
+    size_t nlines = 2 + r.below(8);
+    for (size_t i = 0; i < nlines; i++) {
+      s.append("  "); s.append(kWords[r.below(kWordsCount)]); s.append(" = ");
+      s.append(kWords[r.below(kWordsCount)]);
+      switch (r.below(4)) {
+        case 0: s.append(" (a b c)"); break;
+        case 1: s.append(" { d e; f g }"); break;
+        case 2: s.append("  # trailing comment"); break;
+        default: break;
+      }
+      s.append("\n");
+      if (r.below(4) == 0) {
+        s.append("  sub:\n    x = "); s.append(kWords[r.below(kWordsCount)]);
+        s.append("\n    y = a:b:c:x\n");
+      }
+    }
+    s.append("print "); s.append(kWords[r.below(kWordsCount)]); s.append(" a:b:c:x\n\n");
+  }
+}
+
+static void gen_deep_nesting(std::string& s, size_t size, BenchRand&) {
+  // Indentation increasing by one level per line, then a sudden dedent back to level 0
+  const size_t depth = 256;
+  while (s.size() < size) {
+    for (size_t i = 0; i < depth; i++) {
+      s.append(i*2, ' '); s.append("a b:\n");
+    }
+    s.append("z\n");
+  }
+}
+
+static void gen_wide_lines(std::string& s, size_t size, BenchRand& r) {
+  // Very long lines of symbols
+  const size_t words_per_line = 4096;
+  while (s.size() < size) {
+    for (size_t i = 0; i < words_per_line; i++) {
+      if (i) s.append(1, ' ');
+      s.append(kWords[r.below(kWordsCount)]);
+    }
+    s.append("\n");
+  }
+}
+
+static void gen_long_comments(std::string& s, size_t size, BenchRand& r) {
+  // Comment lines of 16kB each, separated by short expressions
+  while (s.size() < size) {
+    s.append("# ");
+    for (size_t n = 0; n < 16*1024; ) {
+      const char* w = kWords[r.below(kWordsCount)];
+      s.append(w); s.append(1, ' ');
+      n += strlen(w) + 1;
+    }
+    s.append("\nx = y\n");
+  }
+}
+
+static void gen_unique_symbols(std::string& s, size_t size, BenchRand&) {
+  // Every symbol is new to the interner
+  size_t n = 0;
+  while (s.size() < size) {
+    for (size_t i = 0; i < 16; i++) {
+      if (i) s.append(1, ' ');
+      gen_symbol(s, n++);
+    }
+    s.append("\n");
+  }
+}
+
+static void gen_repeated_symbols(std::string& s, size_t size, BenchRand& r) {
+  // The same few symbols over and over
+  while (s.size() < size) {
+    for (size_t i = 0; i < 16; i++) {
+      if (i) s.append(1, ' ');
+      s.append(kWords[r.below(4)]);
+    }
+    s.append("\n");
+  }
+}
+
+static void gen_groups(std::string& s, size_t size, BenchRand& r) {
+  // Heavy use of ( ) and { } groups
+  while (s.size() < size) {
+    s.append(kWords[r.below(kWordsCount)]);
+    s.append(" (b c (d e (f g))) { h i; j (k l); m { n o } } (p) {q}\n");
+  }
+}
+
+static void gen_repeated_blocks(std::string& s, size_t size, BenchRand& r) {
+  // Namespaces with one of a few identical bodies, like generated configuration
+  size_t ns = 0;
+  while (s.size() < size) {
+    gen_symbol(s, ns++); s.append(":\n");
+    switch (r.below(3)) {
+      case 0: s.append("  kind = Dairy\n  has_a_dry_sensation = No\n  tags = (a b c)\n"); break;
+      case 1: s.append("  kind = Spice\n  has_a_dry_sensation = Yes\n  tags = (d e)\n"); break;
+      default: s.append("  kind = Dairy\n  has_a_dry_sensation = No\n  sub:\n    x = y\n");
+    }
+  }
+  s.append("end\n");
+}
+
+static void gen_unicode(std::string& s, size_t size, BenchRand& r) {
+  // Non-ASCII symbols and comments, with some Unicode spaces, so that UTF-8 validation can't
+  // skip over runs of ASCII
+  static const char* words[] = {
+    "größe", "naïve", "façade", "日本語", "ключ", "λ", "значение", "🙂", "東京", "Ωmega",
+  };
+  const size_t nwords = sizeof(words) / sizeof(*words);
+  while (s.size() < size) {
+    s.append("# ");
+    for (size_t i = 0; i < 8; i++) { s.append(words[r.below(nwords)]); s.append(1, ' '); }
+    s.append("\n");
+    s.append(words[r.below(nwords)]); s.append(" = ");
+    for (size_t i = 0; i < 8; i++) {
+      if (i) { s.append(r.below(4) ? " " : "\xe3\x80\x80"); } // U+3000 ideographic space
+      s.append(words[r.below(nwords)]);
+    }
+    s.append("\n");
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+static void alloc_totals(size_t& calls, size_t& bytes) {
+  // Allocations made through alloc::, which is where strings, the source buffer, expressions and
+  // the parser's stacks come from, plus those made with plain `operator new`
+  calls = bench_allocs.count;
+  bytes = bench_allocs.bytes;
+  for (size_t i = 0; i < (size_t)alloc::Tag::_COUNT; i++) {
+    alloc::Stats st = alloc::stats((alloc::Tag)i);
+    calls += (size_t)st.calls;
+    bytes += (size_t)st.bytes;
+  }
+}
+
+struct Counts {
+  size_t tokens = 0;
+  size_t results = 0;
+  double dedup_ratio = 1.0;
+};
+
+static void count_tokens(const Expr* e, Counts& c) {
+  for (; e; e = e->next()) {
+    if (e->is_list()) {
+      count_tokens(e->_value.head, c);
+    } else {
+      c.tokens++;
+    }
+  }
+}
+
+static bool parse_tree(const std::string& input, size_t chunk_size, Counts& c,
+                       std::vector<Expr*>* keep, HashCons* hc)
+{
+  // Builds expression trees and deletes each result, unless `keep` is set
+  Parser P(kStr_user_ns);
+  P.set_hashcons(hc);
+  size_t offs = 0;
+  bool is_end = false;
+  while (!is_end) {
+    size_t bufsize;
+    char* buf = P.get_read_buf(bufsize);
+    size_t len = SAT_MIN(SAT_MIN(bufsize, chunk_size), input.size() - offs);
+    memcpy(buf, input.data() + offs, len);
+    offs += len;
+    is_end = (offs == input.size());
+    P.fill(buf, len, is_end);
+
+    parse:
+    switch (P.parse()) {
+      case Parser::Status::ERROR: return false;
+      case Parser::Status::RESULT: {
+        Expr* e;
+        while ( (e = P.next_result()) ) {
+          c.results++;
+          count_tokens(e, c);
+          if (keep) {
+            keep->push_back(e);
+          } else {
+            delete e;
+          }
+        }
+        goto parse;
+      }
+      case Parser::Status::MORE: break;
+      case Parser::Status::DONE: break;
+      case Parser::Status::DOCUMENT: goto parse;
+    }
+  }
+  return true;
+}
+
+static bool parse_all(const std::string& input, size_t chunk_size, Counts& c) {
+  return parse_tree(input, chunk_size, c, 0, 0);
+}
+
+static bool keep_all(const std::string& input, size_t chunk_size, Counts& c) {
+  // Keeps all results until the end, like a tool which looks at the whole file
+  std::vector<Expr*> results;
+  bool ok = parse_tree(input, chunk_size, c, &results, 0);
+  for (Expr* e : results) { delete e; }
+  return ok;
+}
+
+static bool hashcons_all(const std::string& input, size_t chunk_size, Counts& c) {
+  // keep_all with identical lists shared
+  HashCons hc;
+  std::vector<Expr*> results;
+  bool ok = parse_tree(input, chunk_size, c, &results, &hc);
+  c.dedup_ratio = hc.stats().dedup_ratio();
+  for (Expr* e : results) { delete e; }
+  return ok;
+}
+
+static bool validate_all(const std::string& input, size_t chunk_size, Counts& c) {
+  // Parse without building expressions, using the event interface with a no-op handler
+  BasicParser<ParseHandler> P(kStr_user_ns);
+  size_t offs = 0;
+  Parser::Status status = Parser::Status::MORE;
+  while (status == Parser::Status::MORE) {
+    size_t bufsize;
+    char* buf = P.get_read_buf(bufsize);
+    size_t len = SAT_MIN(SAT_MIN(bufsize, chunk_size), input.size() - offs);
+    memcpy(buf, input.data() + offs, len);
+    offs += len;
+    P.fill(buf, len, offs == input.size());
+    status = P.parse();
+  }
+  for (size_t n : P.stats().tokens) {
+    c.tokens += n;
+  }
+  return status == Parser::Status::DONE;
+}
+
+typedef void(*Generator)(std::string&, size_t, BenchRand&);
+typedef bool(*ParseFunc)(const std::string&, size_t, Counts&);
+
+static bool bench_case(const char* name, Generator gen, size_t size, size_t chunk_size,
+                       ParseFunc parse_func = parse_all)
+{
+  const char* mode = parse_func == validate_all ? "events" :
+                     parse_func == keep_all     ? "keep" :
+                     parse_func == hashcons_all ? "hashcons" :
+                                                  "tree";
+  char case_name[128];
+  snprintf(case_name, sizeof(case_name), "%s%s/%zu",
+           parse_func == validate_all ? "validate_" :
+           parse_func == parse_all    ? "" :
+           parse_func == keep_all     ? "keep_" : "hashcons_",
+           name, chunk_size);
+  return bench_run(case_name, [&]{
+    std::string input;
+    BenchRand r;
+    input.reserve(size + size/8);
+    gen(input, size, r);
+
+    Counts c;
+    alloc::enable(true);
+    size_t allocs0, alloc_bytes0;
+    alloc_totals(allocs0, alloc_bytes0);
+    double t = bench_time();
+    if (!parse_func(input, chunk_size, c)) {
+      return false;
+    }
+    t = bench_time() - t;
+    size_t allocs, alloc_bytes;
+    alloc_totals(allocs, alloc_bytes);
+
+    BenchJSON()
+      ("bench", "parse")
+      ("case", name)
+      ("mode", mode)
+      ("chunk", chunk_size)
+      ("bytes", input.size())
+      ("seconds", t)
+      ("mb_s", ((double)input.size() / (1024*1024)) / t)
+      ("tokens", c.tokens)
+      ("tokens_s", (double)c.tokens / t)
+      ("results", c.results)
+      ("results_s", (double)c.results / t)
+      ("peak_rss_kb", bench_peak_rss_kb())
+      ("allocs", allocs - allocs0)
+      ("alloc_bytes", alloc_bytes - alloc_bytes0)
+      ("dedup_ratio", c.dedup_ratio)
+      .print();
+    return true;
+  });
+}
+
+int main(int argc, const char** argv) {
+  size_t size = bench_size();
+  bool ok = true;
+  ok = bench_case("realistic",        gen_realistic,        size, 4096) && ok;
+  ok = bench_case("deep_nesting",     gen_deep_nesting,     size, 4096) && ok;
+  ok = bench_case("wide_lines",       gen_wide_lines,       size, 4096) && ok;
+  ok = bench_case("long_comments",    gen_long_comments,    size, 4096) && ok;
+  ok = bench_case("unique_symbols",   gen_unique_symbols,   size, 4096) && ok;
+  ok = bench_case("repeated_symbols", gen_repeated_symbols, size, 4096) && ok;
+  ok = bench_case("groups",           gen_groups,           size, 4096) && ok;
+  ok = bench_case("unicode",          gen_unicode,          size, 4096) && ok;
+  // Tiny fill() chunks stress the resumable MORE path
+  ok = bench_case("realistic",        gen_realistic,        size/8, 1) && ok;
+  ok = bench_case("realistic",        gen_realistic,        size/8, 16) && ok;
+  // Events only, no expression trees
+  ok = bench_case("realistic",        gen_realistic,        size, 4096, validate_all) && ok;
+  ok = bench_case("unique_symbols",   gen_unique_symbols,   size, 4096, validate_all) && ok;
+  // All results kept at once, with and without sharing of identical lists
+  ok = bench_case("realistic",        gen_realistic,        size, 4096, keep_all) && ok;
+  ok = bench_case("realistic",        gen_realistic,        size, 4096, hashcons_all) && ok;
+  ok = bench_case("repeated_blocks",  gen_repeated_blocks,  size, 4096, keep_all) && ok;
+  ok = bench_case("repeated_blocks",  gen_repeated_blocks,  size, 4096, hashcons_all) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+//!DEP ../src/str.cc ../src/trace.cc ../src/alloc.cc
+// Namespace imports: copying a SymMap versus sharing a PMap. Each case makes `imports` copies
+// of a namespace of `names` names and shadows one name in each copy, like `using` followed by
+// a definition would.
+//
+#include "bench.hh"
+#include "../src/symmap.hh"
+#include "../src/pmap.hh"
+#include <string>
+#include <vector>
+
+using namespace sat;
+
+static constexpr auto kStr_x = ConstStr("x");
+static Str::WeakSet syms{&kStr_x};
+
+static const size_t kImports = 1000;
+
+static void insert(PMap<size_t>& m, const Str& k, size_t v) { m.set(k, v); }
+static void insert(SymMap<size_t>& m, const Str& k, size_t v) { m[k] = v; }
+
+template <typename Map>
+static bool bench_case(const char* map_name, size_t nnames) {
+  char case_name[128];
+  snprintf(case_name, sizeof(case_name), "%s/%zu", map_name, nnames);
+  return bench_run(case_name, [&]{
+    std::vector<Str> names;
+    for (size_t i = 0; i < nnames; i++) {
+      std::string s = "name_" + std::to_string(i);
+      names.push_back(syms.get(s.c_str(), (u32)s.size()));
+    }
+    Map base;
+    for (size_t i = 0; i < nnames; i++) { insert(base, names[i], i); }
+
+    alloc::enable(true);
+    alloc::Stats st0 = alloc::stats(alloc::Tag::MAP);
+    std::vector<Map> imports;
+    imports.reserve(kImports);
+    double t = bench_time();
+    for (size_t i = 0; i < kImports; i++) {
+      imports.push_back(base);
+      insert(imports.back(), names[i % nnames], i);
+    }
+    t = bench_time() - t;
+    alloc::Stats st1 = alloc::stats(alloc::Tag::MAP);
+
+    BenchJSON()
+      ("bench", "pmap")
+      ("case", map_name)
+      ("names", nnames)
+      ("imports", kImports)
+      ("seconds", t)
+      ("us_per_import", t * 1e6 / (double)kImports)
+      ("bytes_per_import", (double)(st1.live - st0.live) / (double)kImports)
+      .print();
+    return true;
+  });
+}
+
+int main(int argc, const char** argv) {
+  bool ok = true;
+  for (size_t n : { 32, 1024, 65536 }) {
+    ok = bench_case<SymMap<size_t>>("symmap_copy", n) && ok;
+    ok = bench_case<PMap<size_t>>("pmap_share", n) && ok;
+  }
+  return ok ? 0 : 1;
+}
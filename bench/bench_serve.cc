@@ -0,0 +1,106 @@
+//!DEP ../src/serve.cc ../src/io.cc ../src/parse.cc ../src/hashcons.cc ../src/str.cc ../src/expr.cc ../src/trace.cc ../src/alloc.cc
+// Request latency of the parse daemon as seen by its clients, for configs sent over a few
+// concurrent connections. The target for small configs (kSmallLines) is a p99 under 1ms; those
+// cases fail if it's not met. Larger configs are measured for reference. Note that with more
+// clients than cores, requests wait for each other.
+//
+#include "bench.hh"
+#include "../src/serve.hh"
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace sat;
+
+static const size_t kSmallLines = 10; // entries of 3 lines each
+
+static std::string make_config(BenchRand& r, size_t nlines) {
+  std::string s;
+  for (size_t i = 0; i < nlines; i++) {
+    s += "service" + std::to_string(r.below(20)) + ":\n";
+    s += "  port = " + std::to_string(8000 + r.below(1000)) + "\n";
+    s += "  tags = (web api " + std::to_string(r.below(7)) + ")\n";
+  }
+  return s + "end\n";
+}
+
+static bool bench_case(size_t nthreads, size_t nclients, size_t nlines) {
+  char name[128];
+  snprintf(name, sizeof(name), "serve/%zuw/%zuc/%zul", nthreads, nclients, nlines);
+  return bench_run(name, [&]{
+    std::string path = "/tmp/sat_bench_serve." + std::to_string(getpid()) + ".sock";
+    Server::Options opt;
+    opt.path = path;
+    opt.nthreads = nthreads;
+    Server server(opt);
+    std::string err;
+    if (!server.listen(err)) {
+      fprintf(stderr, "%s: %s\n", path.c_str(), err.c_str());
+      return false;
+    }
+    std::thread st([&]{ server.run(); });
+
+    const size_t kRequests = 2000; // per client
+    std::vector<std::vector<double>> times(nclients);
+    std::vector<size_t> errors(nclients);
+    std::vector<std::thread> clients;
+    size_t bytes = 0;
+    double t = bench_time();
+    for (size_t i = 0; i < nclients; i++) {
+      BenchRand r(i + 1);
+      std::string src = make_config(r, nlines);
+      bytes += src.size() * kRequests;
+      clients.emplace_back([&, i, src]{
+        Client c;
+        if (!c.connect(path)) { errors[i] = kRequests; return; }
+        Client::Response resp;
+        std::string id = std::to_string(i);
+        for (size_t n = 0; n < kRequests; n++) {
+          double t1 = bench_time();
+          if (!c.parse(id, "text", 0, src, resp) || !resp.ok) { errors[i]++; }
+          times[i].push_back(bench_time() - t1);
+        }
+      });
+    }
+    for (auto& c : clients) { c.join(); }
+    t = bench_time() - t;
+    server.stop();
+    st.join();
+
+    std::vector<double> all;
+    size_t nerrors = 0;
+    for (size_t i = 0; i < nclients; i++) {
+      all.insert(all.end(), times[i].begin(), times[i].end());
+      nerrors += errors[i];
+    }
+    std::sort(all.begin(), all.end());
+    auto pct = [&](double p) { return all[(size_t)((double)(all.size() - 1) * p / 100.0)] * 1e6; };
+    double p99 = pct(99);
+
+    BenchJSON()
+      ("bench", "serve")
+      ("workers", nthreads)
+      ("clients", nclients)
+      ("requests", all.size())
+      ("errors", nerrors)
+      ("bytes_per_request", bytes / all.size())
+      ("seconds", t)
+      ("requests_s", (double)all.size() / t)
+      ("p50_us", pct(50))
+      ("p90_us", pct(90))
+      ("p99_us", p99)
+      ("max_us", all.back() * 1e6)
+      .print();
+    return nerrors == 0 && (p99 < 1000 || nlines > kSmallLines);
+  });
+}
+
+int main(int argc, const char** argv) {
+  bool ok = true;
+  ok = bench_case(1, 1, kSmallLines) && ok;
+  ok = bench_case(4, 4, kSmallLines) && ok;
+  ok = bench_case(4, 16, kSmallLines) && ok;
+  ok = bench_case(4, 4, kSmallLines * 10) && ok;
+  return ok ? 0 : 1;
+}
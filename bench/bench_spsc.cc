@@ -0,0 +1,49 @@
+//!DEP ../src/alloc.cc
+// Items per second through an SPSCQueue between two threads, for a few capacities. Each item is
+// a pointer, like the results passed between the stages of `sat --pipeline`. The wait counts
+// show how often either side found nothing to do; on a single core most items wait.
+//
+#include "bench.hh"
+#include "../src/spsc.hh"
+#include <thread>
+
+using namespace sat;
+
+static bool bench_case(size_t capacity) {
+  char name[64];
+  snprintf(name, sizeof(name), "spsc/%zu", capacity);
+  return bench_run(name, [&]{
+    const size_t kItems = 10000000;
+    SPSCQueue<size_t*> q(capacity);
+    size_t sum = 0;
+    double t = bench_time();
+    std::thread producer([&]{
+      for (size_t i = 0; i < kItems; i++) { q.push((size_t*)(uintptr_t)(i + 1)); }
+      q.close();
+    });
+    size_t* p;
+    while (q.pop(p)) { sum += (size_t)(uintptr_t)p; }
+    producer.join();
+    t = bench_time() - t;
+
+    SPSCQueue<size_t*>::Stats st = q.stats();
+    BenchJSON()
+      ("bench", "spsc")
+      ("capacity", capacity)
+      ("items", st.items)
+      ("seconds", t)
+      ("items_s", (double)kItems / t)
+      ("full_waits", st.full_waits)
+      ("empty_waits", st.empty_waits)
+      .print();
+    return sum == kItems * (kItems + 1) / 2;
+  });
+}
+
+int main(int argc, const char** argv) {
+  bool ok = true;
+  ok = bench_case(64) && ok;
+  ok = bench_case(1024) && ok;
+  ok = bench_case(16384) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+//!DEP ../src/str.cc ../src/trace.cc ../src/alloc.cc
+// Namespace-style lookups: SymMap and PMap versus Str::Map, for namespaces of a few sizes.
+//
+#include "bench.hh"
+#include "../src/symmap.hh"
+#include "../src/pmap.hh"
+#include <string>
+#include <vector>
+
+using namespace sat;
+
+static constexpr auto kStr_x = ConstStr("x");
+static Str::WeakSet syms{&kStr_x};
+
+static const size_t kLookups = 20*1000*1000;
+
+static size_t lookup(SymMap<size_t>& m, Str::Imp* k) {
+  size_t* v = m.find(k);
+  return v ? *v : 0;
+}
+
+static size_t lookup(PMap<size_t>& m, Str::Imp* k) {
+  const size_t* v = m.find(k);
+  return v ? *v : 0;
+}
+
+static void insert(PMap<size_t>& m, const Str& k, size_t v) { m.set(k, v); }
+template <typename Map> static void insert(Map& m, const Str& k, size_t v) { m[k] = v; }
+
+static size_t lookup(Str::Map<size_t>& m, Str::Imp* k) {
+  auto I = m.find(Str{k, true});
+  return I != m.end() ? I->second : 0;
+}
+
+template <typename Map>
+static bool bench_case(const char* map_name, size_t nnames) {
+  char case_name[128];
+  snprintf(case_name, sizeof(case_name), "%s/%zu", map_name, nnames);
+  return bench_run(case_name, [&]{
+    std::vector<Str> names;
+    for (size_t i = 0; i < nnames; i++) {
+      std::string s = "name_" + std::to_string(i);
+      names.push_back(syms.get(s.c_str(), (u32)s.size()));
+    }
+    Map m;
+    for (size_t i = 0; i < nnames; i++) { insert(m, names[i], i); }
+
+    // Lookups in a random order, mostly hits
+    BenchRand r;
+    std::vector<Str::Imp*> order;
+    for (size_t i = 0; i < 4096; i++) { order.push_back(names[r.below(nnames)].self); }
+
+    size_t sum = 0;
+    double t = bench_time();
+    for (size_t i = 0; i < kLookups; i++) {
+      sum += lookup(m, order[i & 4095]);
+    }
+    t = bench_time() - t;
+
+    BenchJSON()
+      ("bench", "symmap")
+      ("case", map_name)
+      ("names", nnames)
+      ("lookups", kLookups)
+      ("seconds", t)
+      ("ns_per_lookup", t * 1e9 / (double)kLookups)
+      ("checksum", sum)
+      .print();
+    return true;
+  });
+}
+
+int main(int argc, const char** argv) {
+  bool ok = true;
+  for (size_t n : { 4, 32, 1024, 65536 }) {
+    ok = bench_case<SymMap<size_t>>("symmap", n) && ok;
+    ok = bench_case<PMap<size_t>>("pmap", n) && ok;
+    ok = bench_case<Str::Map<size_t>>("str_map", n) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,38 @@
+#!/bin/bash
+set -e
+cd "$(dirname "$0")"
+if [ "$CXX" == "" ]; then CXX=clang; fi
+if [ "$CXXFLAGS" == "" ]; then CXXFLAGS="-std=c++11 -stdlib=libc++"; fi
+if [ "$LDFLAGS" == "" ]; then LDFLAGS="-stdlib=libc++ -lc++"; fi
+if [ "$SFLAGS" == "" ]; then SFLAGS="-O3 -DNDEBUG"; fi
+CXXFLAGS="$CXXFLAGS $SFLAGS"
+
+# Each benchmark prints one JSON object per line to stdout. Build logs go to stderr so that
+# stdout can be collected as-is, e.g. `make bench > bench_output.txt`
+function run_bench {
+  set -e
+  bn="$(basename "$1" .cc)"
+  if [ "$1" == "$bn" ]; then
+    echo "Invalid name '$1' (not ending in '.cc')" >&2
+    exit 1
+  fi
+  SOURCES="$1"
+  # Find dependencies from first line starting with "//!DEP " followed by a space-separated list
+  # of source files to compile together with the benchmark
+  if deps=$(python -c 'f = open("'"$1"'"); s = f.readline().split(); f.close(); print(" ".join(s[1:])) if len(s) and s[0] == "//!DEP" else exit(1)'); then
+    SOURCES="$SOURCES $deps"
+  fi
+  echo "$bn:" >&2
+  echo " " $CXX $CXXFLAGS $LDFLAGS -o "$bn.bin" $SOURCES >&2
+  $CXX $CXXFLAGS $LDFLAGS -o "$bn.bin" $SOURCES
+  "./$bn.bin"
+}
+
+if [ $# -lt 1 ]; then
+  echo "usage: $0 <bench_foo.cc> ..." >&2
+  exit 1
+else
+  for f in $@; do
+    run_bench "$f"
+  done
+fi
@@ -0,0 +1,73 @@
+#include "alloc.hh"
+#include <iomanip>
+
+namespace sat {
+namespace alloc {
+
+bool  _enabled = false;
+Stats _stats[(size_t)Tag::_COUNT];
+
+const char* tag_name(Tag t) { switch (t) {
+  #define _(name) case Tag::name: return #name;
+  SAT_ALLOC_TAGS
+  #undef _
+  case Tag::_COUNT: break;
+} return "?"; }
+
+void enable(bool enabled) {
+  _enabled = enabled;
+}
+
+void _record(Tag tag, i64 delta_live, size_t size, bool is_free) {
+  Stats& st = _stats[(size_t)tag];
+  if (is_free) {
+    sat_atomic_add_fetch(&st.frees, (u64)1);
+  } else {
+    sat_atomic_add_fetch(&st.calls, (u64)1);
+    sat_atomic_add_fetch(&st.bytes, (u64)size);
+  }
+  i64 live = sat_atomic_add_fetch(&st.live, delta_live);
+  i64 peak;
+  while (live > (peak = st.peak) && !sat_atomic_cas_bool(&st.peak, peak, live)) {}
+}
+
+Stats stats(Tag tag) {
+  return _stats[(size_t)tag];
+}
+
+void reset_peaks() {
+  for (auto& st : _stats) {
+    st.peak = st.live;
+  }
+}
+
+void print_stats(std::ostream& os) {
+  Stats total;
+  os << std::left << std::setw(10) << "alloc" << std::right
+     << std::setw(12) << "calls"
+     << std::setw(12) << "frees"
+     << std::setw(14) << "bytes"
+     << std::setw(14) << "live"
+     << std::setw(14) << "peak" << '\n';
+  auto row = [&](const char* name, const Stats& st) {
+    os << std::left << std::setw(10) << name << std::right
+       << std::setw(12) << st.calls
+       << std::setw(12) << st.frees
+       << std::setw(14) << st.bytes
+       << std::setw(14) << st.live
+       << std::setw(14) << st.peak << '\n';
+  };
+  for (size_t i = 0; i < (size_t)Tag::_COUNT; i++) {
+    const Stats& st = _stats[i];
+    row(tag_name((Tag)i), st);
+    total.calls += st.calls;
+    total.frees += st.frees;
+    total.bytes += st.bytes;
+    total.live  += st.live;
+    total.peak  += st.peak;
+      // Note: The sum of peaks is an upper bound as subsystems might not peak at the same time
+  }
+  row("total", total);
+}
+
+}} // namespace sat::alloc
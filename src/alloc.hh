@@ -0,0 +1,126 @@
+// Opt-in allocation accounting, tagged by subsystem.
+//
+// Heap allocations made by the parser, expressions and strings go through the functions in this
+// file rather than directly to malloc/new, so that they can be attributed to the subsystem that
+// made them. Accounting is off by default, in which case these are plain malloc/realloc/free
+// calls plus a predictable branch.
+//
+// Example:
+//
+//   alloc::enable(true);
+//   alloc::reset_peaks();
+//   ... parse something ...
+//   alloc::print_stats(std::cerr);
+//
+// Counters are relative to when accounting was enabled, so `live` can be negative for a
+// subsystem that frees memory it allocated before that.
+//
+#pragma once
+#include "common.h"
+#include <new>
+#include <ostream>
+
+namespace sat {
+namespace alloc {
+
+#define SAT_ALLOC_TAGS \
+  _(PARSER)     /* Parser internals, like the scope stack */ \
+  _(BUF)        /* Parser::Buf source text buffer */ \
+  _(NAMESPACE)  /* Namespace objects */ \
+  _(EXPR)       /* Expr nodes */ \
+  _(STR)        /* Str::Imp string data */ \
+  _(INTERN)     /* Hash sets of Str::Set and Str::WeakSet, and the HashCons table */ \
+  _(MAP)        /* Str::Map and other maps */ \
+  _(EVAL)       /* Evaluator namespaces, values and bytecode */ \
+  _(IO)         /* FileReader buffers */ \
+  _(QUEUE)      /* SPSCQueue slots and pipeline blocks */ \
+  _(TRACE)      /* Events recorded by trace::Span and trace::instant */ \
+
+enum class Tag {
+  #define _(name) name,
+  SAT_ALLOC_TAGS
+  #undef _
+  _COUNT
+};
+
+const char* tag_name(Tag);
+
+struct Stats {
+  u64 calls = 0; // number of allocations, including reallocations
+  u64 frees = 0; // number of deallocations
+  u64 bytes = 0; // total number of bytes allocated
+  i64 live  = 0; // bytes currently allocated
+  i64 peak  = 0; // highest value of `live` since last call to reset_peaks()
+};
+
+extern bool _enabled;
+extern Stats _stats[(size_t)Tag::_COUNT];
+
+inline static bool is_enabled() { return _enabled; }
+void enable(bool);
+
+Stats stats(Tag);
+  // Return a snapshot of the counters for `tag`
+
+void reset_peaks();
+  // Set peaks to current live values, i.e. to measure the peak of a single parse
+
+void print_stats(std::ostream&);
+  // Write a table of all counters to `os`
+
+void _record(Tag, i64 delta_live, size_t size, bool is_free);
+
+inline static void* SAT_UNUSED malloc(Tag tag, size_t size) {
+  void* p = ::malloc(size);
+  if (_enabled && p) { _record(tag, (i64)size, size, false); }
+  return p;
+}
+
+inline static void* SAT_UNUSED aligned_malloc(Tag tag, size_t alignment, size_t size) {
+  // Like malloc, for alignments greater than malloc's. `alignment` is a power of two and a
+  // multiple of sizeof(void*). Free with alloc::free.
+  void* p = 0;
+  if (posix_memalign(&p, alignment, size) != 0) { return 0; }
+  if (_enabled) { _record(tag, (i64)size, size, false); }
+  return p;
+}
+
+inline static void* SAT_UNUSED realloc(Tag tag, void* p, size_t oldsize, size_t newsize) {
+  void* p2 = ::realloc(p, newsize);
+  if (_enabled && p2) { _record(tag, (i64)newsize - (i64)oldsize, newsize, false); }
+  return p2;
+}
+
+inline static void SAT_UNUSED free(Tag tag, void* p, size_t size) {
+  if (_enabled && p) { _record(tag, -(i64)size, size, true); }
+  ::free(p);
+}
+
+// Allocator for use with stl containers, i.e.
+//   std::deque<Scope*, alloc::Allocator<Scope*, alloc::Tag::PARSER>>
+template <typename T, Tag tag> struct Allocator {
+  typedef T value_type;
+  template <typename U> struct rebind { typedef Allocator<U,tag> other; };
+
+  Allocator() {}
+  template <typename U> Allocator(const Allocator<U,tag>&) {}
+
+  T* allocate(size_t n) { return (T*)alloc::malloc(tag, n * sizeof(T)); }
+  void deallocate(T* p, size_t n) { alloc::free(tag, (void*)p, n * sizeof(T)); }
+
+  template <typename U> bool operator==(const Allocator<U,tag>&) const { return true; }
+  template <typename U> bool operator!=(const Allocator<U,tag>&) const { return false; }
+};
+
+}} // namespace sat::alloc
+
+
+// Declares class-specific operator new and delete which account allocations to `tag`.
+#define SAT_ALLOC_TAGGED(tag) \
+  static void* operator new(size_t z) { \
+    void* p = ::sat::alloc::malloc(::sat::alloc::Tag::tag, z); \
+    if (!p) throw std::bad_alloc(); \
+    return p; \
+  } \
+  static void operator delete(void* p, size_t z) { \
+    ::sat::alloc::free(::sat::alloc::Tag::tag, p, z); }
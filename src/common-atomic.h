@@ -22,6 +22,16 @@ T sat_atomic_cas(T* ptr, T oldval, T newval)
   If the current value of *ptr is oldval, then write newval into *ptr. Returns the contents of
   *ptr before the operation.
 
+T sat_atomic_load_acq(T* ptr)
+  Read *ptr. Writes made by another thread before it stored the value with sat_atomic_store_rel
+  are visible after this returns.
+
+void sat_atomic_store_rel(T* ptr, T value)
+  Write value to *ptr after all writes before it, as seen by sat_atomic_load_acq in other threads.
+
+void sat_cpu_relax()
+  Hint to the CPU that this is a spin-wait loop.
+
 -----------------------------------------------------------------------------*/
 
 #ifndef _SAT_INDIRECT_INCLUDE_
@@ -125,6 +135,28 @@ T sat_atomic_cas(T* ptr, T oldval, T newval)
 #endif
 
 
+// T sat_atomic_load_acq(T* ptr), void sat_atomic_store_rel(T* ptr, T value)
+#if SAT_WITHOUT_SMP
+  #define sat_atomic_load_acq(ptr) (*(ptr))
+  #define sat_atomic_store_rel(ptr, value) (*(ptr) = (value))
+#elif _SAT_ATOMIC_HAS_SYNC_BUILTINS
+  #define sat_atomic_load_acq(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+  #define sat_atomic_store_rel(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#else
+  #error "Unsupported compiler: Missing support for atomic operations"
+#endif
+
+
+// void sat_cpu_relax()
+#if SAT_TARGET_ARCH_X64 || SAT_TARGET_ARCH_X86
+  #define sat_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+  #define sat_cpu_relax() __asm__ __volatile__("yield")
+#else
+  #define sat_cpu_relax() do{}while(0)
+#endif
+
+
 // void sat_atomic_barrier()
 #if SAT_WITHOUT_SMP
 #define sat_atomic_barrier() do{}while(0)
@@ -134,6 +166,10 @@ T sat_atomic_cas(T* ptr, T oldval, T newval)
 
 
 // Spinlock
+//
+// For very short critical sections which are rarely contended. Waiting threads spin with
+// exponential backoff, only retrying the CAS when they have seen the lock free. Where a thread
+// may have to wait for long, use sat::Lock (lock.hh), which puts waiting threads to sleep.
 #ifdef __cplusplus
 namespace sat {
 typedef volatile i32 Spinlock;
@@ -158,16 +194,23 @@ private:
 inline bool SAT_UNUSED spinlock_try_lock(Spinlock& lock) {
   return sat_atomic_cas_bool(&lock, (i32)0, (i32)1); }
 inline void SAT_UNUSED spinlock_lock(Spinlock& lock) {
-  while (!spinlock_try_lock(lock)); }
+  u32 delay = 1;
+  while (!spinlock_try_lock(lock)) {
+    do {
+      for (u32 i = 0; i < delay; i++) { sat_cpu_relax(); }
+      if (delay < 1024) { delay <<= 1; }
+    } while (sat_atomic_load_acq(&lock) != 0);
+  }
+}
 inline void SAT_UNUSED spinlock_unlock(Spinlock& lock) {
-  lock = 0; }
+  sat_atomic_store_rel(&lock, (i32)0); }
 
 inline bool SAT_UNUSED spinlock_try_lock(Spinlock* lock) {
-  return sat_atomic_cas_bool(lock, (i32)0, (i32)1); }
+  return spinlock_try_lock(*lock); }
 inline void SAT_UNUSED spinlock_lock(Spinlock* lock) {
-  while (!spinlock_try_lock(lock)); }
+  spinlock_lock(*lock); }
 inline void SAT_UNUSED spinlock_unlock(Spinlock* lock) {
-  *lock = 0; }
+  spinlock_unlock(*lock); }
 
 } // namespace
 #endif // __cplusplus
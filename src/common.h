@@ -86,6 +86,13 @@
   #define SAT_UNREACHABLE assert(!"Declared UNREACHABLE but was reached");
 #endif
 
+#if __has_builtin(__builtin_prefetch) || defined(__GNUC__)
+  // Hint that memory at address p is about to be read
+  #define SAT_PREFETCH(p) __builtin_prefetch(p)
+#else
+  #define SAT_PREFETCH(p) ((void)(p))
+#endif
+
 #if __has_attribute(noreturn)
   #define SAT_NORETURN __attribute__((noreturn))
 #else
@@ -0,0 +1,676 @@
+#include "eval.hh"
+#include <iomanip>
+
+namespace sat {
+
+struct Value::List {
+  u32 refs;
+  u32 size;
+  Value* items() { return (Value*)(this + 1); }
+};
+
+Value::Value(const Str::Imp* s) : _kind{s ? Kind::SYM : Kind::NIL}, _p{(void*)s} {
+  Str::__retain(const_cast<Str::Imp*>(s));
+}
+
+Value Value::list(const Value* items, size_t n) {
+  List* l = (List*)alloc::malloc(alloc::Tag::EVAL, sizeof(List) + sizeof(Value) * n);
+  if (!l) { throw std::bad_alloc(); }
+  l->refs = 1;
+  l->size = (u32)n;
+  for (size_t i = 0; i < n; i++) { new (&l->items()[i]) Value(items[i]); }
+  Value v;
+  v._kind = Kind::LIST;
+  v._p = l;
+  return v;
+}
+
+Value& Value::operator=(const Value& v) {
+  if (this != &v) {
+    Value tmp{v};
+    *this = std::move(tmp);
+  }
+  return *this;
+}
+
+Value& Value::operator=(Value&& v) {
+  if (this != &v) {
+    _release();
+    _kind = v._kind; v._kind = Kind::NIL;
+    _p = v._p;       v._p = 0;
+  }
+  return *this;
+}
+
+void Value::_retain() {
+  if (_kind == Kind::SYM) {
+    Str::__retain((Str::Imp*)_p);
+  } else if (_kind == Kind::LIST) {
+    ((List*)_p)->refs++;
+  }
+}
+
+void Value::_release() {
+  if (_kind == Kind::SYM) {
+    Str::__release((Str::Imp*)_p);
+  } else if (_kind == Kind::LIST) {
+    List* l = (List*)_p;
+    if (--l->refs == 0) {
+      for (u32 i = 0; i < l->size; i++) { l->items()[i].~Value(); }
+      alloc::free(alloc::Tag::EVAL, (void*)l, sizeof(List) + sizeof(Value) * l->size);
+    }
+  }
+}
+
+size_t Value::size() const {
+  assert(_kind == Kind::LIST);
+  return ((List*)_p)->size;
+}
+
+const Value& Value::operator[](size_t i) const {
+  assert(i < size());
+  return ((List*)_p)->items()[i];
+}
+
+bool Value::operator==(const Value& v) const {
+  if (_kind != v._kind) { return false; }
+  if (_kind != Kind::LIST || _p == v._p) { return _p == v._p; }
+  if (size() != v.size()) { return false; }
+  for (size_t i = 0; i < size(); i++) {
+    if ((*this)[i] != v[i]) { return false; }
+  }
+  return true;
+}
+
+std::ostream& operator<< (std::ostream& os, const Value& v) {
+  switch (v.kind()) {
+    case Value::Kind::NIL: return os << "nil";
+    case Value::Kind::SYM: return os << v.sym();
+    case Value::Kind::LIST: {
+      os << '(';
+      for (size_t i = 0; i < v.size(); i++) {
+        if (i) { os << ' '; }
+        os << v[i];
+      }
+      return os << ')';
+    }
+  }
+  return os;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+Env::Env(std::ostream& out) : _out{&out} {
+  _root = new_ns(0, Str::imp_cast(kStr_user));
+}
+
+Env::~Env() {
+  free_ns(_root);
+}
+
+Env::Ns* Env::new_ns(Ns* parent, const Str::Imp* name) {
+  Ns* ns = new Ns;
+  ns->parent = parent;
+  ns->name = Str{const_cast<Str::Imp*>(name), true};
+  if (parent && name) {
+    parent->children.set(ns->name, ns);
+  }
+  return ns;
+}
+
+void Env::free_ns(Ns* ns) {
+  // Collect children first as free_ns removes them from ns->children
+  EvalVector<Ns*> children;
+  ns->children.foreach([&](Str::Imp*, Ns* c) { children.push_back(c); });
+  for (Ns* c : children) { free_ns(c); }
+  ns->names.foreach([&](Str::Imp*, u32 slot) {
+    _slots[slot].value = Value();
+    _slots[slot].defined = false;
+    _free_slots.push_back(slot);
+  });
+  if (ns->parent && ns->name) {
+    ns->parent->children.erase(ns->name);
+  }
+  delete ns;
+}
+
+Env::Ns* Env::child(Ns* ns, const Str::Imp* name, bool create) {
+  Ns* const* c = ns->children.find(name);
+  if (c) { return *c; }
+  return create ? new_ns(ns, name) : 0;
+}
+
+u32 Env::slot(Ns* ns, const Str::Imp* name, bool create) {
+  const u32* s = ns->names.find(name);
+  if (s) { return *s; }
+  if (!create) { return ~0u; }
+  u32 slot;
+  if (_free_slots.empty()) {
+    slot = (u32)_slots.size();
+    _slots.emplace_back();
+  } else {
+    slot = _free_slots.back();
+    _free_slots.pop_back();
+  }
+  ns->names.set(const_cast<Str::Imp*>(name), slot);
+  return slot;
+}
+
+Value Env::get(const char* qname) {
+  Ns* ns = 0;
+  u32 slot = ~0u;
+  size_t len = strlen(qname);
+  bool ok = split_qname(qname, len, [&](const char* p, size_t n) {
+    Str part = strings.find(p, (u32)n);
+    if (!part || slot != ~0u) { return false; } // unknown symbol, or a name followed by more
+    if (!ns) {
+      ns = (part.self == _root->name.self) ? _root : 0;
+    } else if (p + n == qname + len) {
+      slot = this->slot(ns, part.self, false);
+      return slot != ~0u;
+    } else {
+      ns = child(ns, part.self, false);
+    }
+    return ns != 0;
+  });
+  return (ok && slot != ~0u && _slots[slot].defined) ? _slots[slot].value : Value();
+}
+
+Builtin Env::builtin(const Str::Imp* name) {
+  #define F(n) if (name == Str::imp_cast(kStr_##n)) { return Builtin::n; }
+  SAT_BUILTINS
+  #undef F
+  return Builtin::NONE;
+}
+
+Value Env::call(Builtin b, const Value* args, size_t nargs) {
+  switch (b) {
+    case Builtin::print: {
+      for (size_t i = 0; i < nargs; i++) {
+        if (i) { *_out << ' '; }
+        *_out << args[i];
+      }
+      *_out << '\n';
+      return Value();
+    }
+    case Builtin::NONE: break;
+  }
+  return Value();
+}
+
+// ------------------------------------------------------------------------------------------------
+
+static bool is_name(const Str::Imp* s) {
+  // Symbols which are looked up (as opposed to being values of their own) start with a lowercase
+  // letter or underscore
+  char c = s->c_str()[0];
+  return (c >= 'a' && c <= 'z') || c == '_';
+}
+
+static const Expr* skip_comments(const Expr* e) {
+  while (e && e->type() == Expr::Type::COMMENT) { e = e->next(); }
+  return e;
+}
+
+static const Expr* block_of(const Expr* line) {
+  // The block which ends `line`, if any
+  for (const Expr* e = line->_value.head; e; e = e->next()) {
+    if (e->type() == Expr::Type::BLOCK) { return e; }
+  }
+  return 0;
+}
+
+static bool is_assignment(const Expr* first, const Expr* second) {
+  // name = ...
+  return first->type() == Expr::Type::SYM && second->type() == Expr::Type::SYM
+      && second->str_value() == Str::imp_cast(kStr_eq);
+}
+
+static size_t count_terms(const Expr* first, const Expr* end) {
+  size_t n = 0;
+  for (const Expr* e = skip_comments(first); e != end; e = skip_comments(e->next())) { n++; }
+  return n;
+}
+
+static bool too_deep(const Expr* result) {
+  // True if expressions in `result` are nested more than SAT_EVAL_MAX_DEPTH levels deep. This is
+  // checked before evaluating, with the non-recursive Expr::walk, so that a result is evaluated
+  // either fully or not at all.
+  size_t depth = 0, max_depth = 0;
+  result->walk(
+    [&](const Expr*, const Expr*) { max_depth = SAT_MAX(max_depth, ++depth); },
+    [&](const Expr*, const Expr*) { depth--; });
+  return max_depth > SAT_EVAL_MAX_DEPTH;
+}
+
+static const char* last_part(const Str::Imp* s) {
+  // "x" of "a:b:x", or null if `s` is not qualified
+  for (const char* p = s->c_str() + s->_size; p > s->c_str(); p--) {
+    if (p[-1] == ':') { return p; }
+  }
+  return 0;
+}
+
+template <typename Ev>
+static Env::Ns* qualified_ns(Env& env, Env::Ns* ns, const char* s, size_t len, bool create) {
+  // Namespace named by s[0..len), e.g. "a:b". Definitions (create=true) are relative to `ns`;
+  // references start from the nearest namespace which has a child named like the first part.
+  bool first = true;
+  bool ok = split_qname(s, len, [&](const char* p, size_t n) {
+    Str part = create ? strings.get(p, (u32)n) : strings.find(p, (u32)n);
+    if (!part) { return false; }
+    ns = (first && !create) ? env.resolve_ns(ns, part.self) : env.child(ns, part.self, create);
+    first = false;
+    return ns != 0;
+  });
+  return ok ? ns : 0;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+bool TreeInterp::eval(const Expr* result, Value* value) {
+  if (too_deep(result)) {
+    return false;
+  }
+  Value v = _line(_env.root(), result);
+  if (value) { *value = std::move(v); }
+  return true;
+}
+
+Env::Ns* TreeInterp::_qualified_ns(Env::Ns* ns, const Str::Imp* qname, size_t len, bool create) {
+  return qualified_ns<TreeInterp>(_env, ns, qname->c_str(), len, create);
+}
+
+Value TreeInterp::_line(Env::Ns* ns, const Expr* line) {
+  const Expr* first = skip_comments(line->_value.head);
+  const Expr* block = block_of(line);
+  if (!block) {
+    return _terms(ns, first, 0);
+  }
+  if (first->type() == Expr::Type::ASSIGNMENT && skip_comments(first->next()) == block) {
+    // ns:
+    Env::Ns* child = _qualified_ns(ns, first->str_value(), first->str_value()->_size, true);
+    if (child) {
+      for (const Expr* l = block->_value.head; l; l = l->next()) { _line(child, l); }
+    }
+    return Value();
+  }
+  // Where block. For `name = terms...` only the terms are evaluated in it; name is bound in ns.
+  Env::Ns* w = _env.new_ns(ns, 0);
+  for (const Expr* l = block->_value.head; l; l = l->next()) { _line(w, l); }
+  const Expr* second = skip_comments(first->next());
+  Value v;
+  if (second != block && is_assignment(first, second)) {
+    v = _terms(w, second->next(), block);
+    _bind(ns, first->str_value(), v);
+  } else {
+    v = _terms(w, first, block);
+  }
+  _env.free_ns(w);
+  return v;
+}
+
+void TreeInterp::_bind(Env::Ns* ns, const Str::Imp* name, const Value& v) {
+  if (const char* last = last_part(name)) {
+    ns = _qualified_ns(ns, name, (size_t)(last - 1 - name->c_str()), true);
+    if (!ns) { return; }
+    name = strings.get(last, (u32)(name->c_str() + name->_size - last)).self;
+  }
+  Env::Slot& slot = _env[_env.slot(ns, name, true)];
+  slot.value = v;
+  slot.defined = true;
+}
+
+Value TreeInterp::_terms(Env::Ns* ns, const Expr* first, const Expr* end) {
+  // "name =" and "ns:" in front of the terms are taken in a loop rather than recursively, as a
+  // line can have any number of them. The names are bound last to first, each in its namespace.
+  EvalVector<std::pair<Env::Ns*, const Str::Imp*>> names;
+  for (;;) {
+    first = skip_comments(first);
+    const Expr* second = first == end ? end : skip_comments(first->next());
+    if (second == end) {
+      break;
+    }
+    if (is_assignment(first, second)) {
+      // name = terms...
+      names.emplace_back(ns, first->str_value());
+      first = second->next();
+      continue;
+    }
+    if (first->type() == Expr::Type::ASSIGNMENT) {
+      // ns: terms...
+      Env::Ns* target = _qualified_ns(ns, first->str_value(), first->str_value()->_size, false);
+      if (target) {
+        ns = target;
+        first = second;
+        continue;
+      }
+    }
+    break;
+  }
+  Value v = _plain_terms(ns, first, end);
+  for (size_t i = names.size(); i > 0; i--) { _bind(names[i-1].first, names[i-1].second, v); }
+  return v;
+}
+
+Value TreeInterp::_plain_terms(Env::Ns* ns, const Expr* first, const Expr* end) {
+  // Terms without "name =" or "ns:" in front
+  if (first == end) {
+    return Value();
+  }
+  const Expr* second = skip_comments(first->next());
+  if (first->type() == Expr::Type::SYM) {
+    Builtin b = Env::builtin(first->str_value());
+    if (b != Builtin::NONE && _env.resolve(ns, first->str_value(), [&](u32 s) {
+          return _is_defined(s); }) == ~0u) {
+      // Application of a builtin
+      EvalVector<Value> args;
+      for (const Expr* e = second; e != end; e = skip_comments(e->next())) {
+        args.push_back(_term(ns, e));
+      }
+      return _env.call(b, args.data(), args.size());
+    }
+  }
+  if (second == end) {
+    return _term(ns, first);
+  }
+  EvalVector<Value> items;
+  for (const Expr* e = first; e != end; e = skip_comments(e->next())) {
+    items.push_back(_term(ns, e));
+  }
+  return Value::list(items.data(), items.size());
+}
+
+Value TreeInterp::_term(Env::Ns* ns, const Expr* e) {
+  switch (e->type()) {
+    case Expr::Type::SYM: {
+      const Str::Imp* s = e->str_value();
+      if (!is_name(s)) {
+        return Value(s);
+      }
+      u32 slot = ~0u;
+      if (const char* last = last_part(s)) {
+        Env::Ns* target = _qualified_ns(ns, s, (size_t)(last - 1 - s->c_str()), false);
+        Str name = target ? strings.find(last, (u32)(s->c_str() + s->_size - last)) : Str();
+        if (name) {
+          slot = _env.slot(target, name.self, false);
+          if (slot != ~0u && !_is_defined(slot)) { slot = ~0u; }
+        }
+      } else {
+        slot = _env.resolve(ns, s, [&](u32 s) { return _is_defined(s); });
+      }
+      return slot == ~0u ? Value(s) : _env[slot].value;
+    }
+    case Expr::Type::ATOM:
+    case Expr::Type::ASSIGNMENT:
+      return Value(e->str_value());
+    case Expr::Type::GROUP:
+    case Expr::Type::INLINE_BLOCK: {
+      Value v;
+      for (const Expr* l = e->_value.head; l; l = l->next()) { v = _line(ns, l); }
+      return v;
+    }
+    default:
+      return Value();
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+const char* op_name(Op op) { switch (op) {
+  #define F(name, nargs) case Op::name: return #name;
+  SAT_VM_OPS
+  #undef F
+}}
+
+size_t op_nargs(Op op) { switch (op) {
+  #define F(name, nargs) case Op::name: return nargs;
+  SAT_VM_OPS
+  #undef F
+}}
+
+Code::~Code() {
+  for (size_t i = scopes.size(); i > 0; i--) { _env.free_ns(scopes[i-1]); }
+}
+
+std::ostream& operator<< (std::ostream& os, const Code& c) {
+  for (size_t pc = 0; pc < c.code.size(); ) {
+    Op op = (Op)c.code[pc];
+    os << std::setw(4) << pc << "  " << std::left << std::setw(6) << op_name(op) << std::right;
+    for (size_t i = 1; i <= op_nargs(op); i++) { os << ' ' << c.code[pc + i]; }
+    if (op == Op::CONST) { os << "  ; " << c.consts[c.code[pc + 2]]; }
+    os << '\n';
+    pc += 1 + op_nargs(op);
+  }
+  return os;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+bool Compiler::compile(const Expr* result, Code& out) {
+  _code = &out;
+  _top = 0;
+  _stored.clear();
+  u32 dst = _alloc_regs(1);
+  bool ok = !too_deep(result);
+  if (ok) {
+    _line(_env.root(), result, dst);
+  } else {
+    _emit(Op::NIL, dst);
+  }
+  _emit(Op::END);
+  _code = 0;
+  return ok;
+}
+
+Env::Ns* Compiler::_qualified_ns(Env::Ns* ns, const Str::Imp* qname, size_t len, bool create) {
+  return qualified_ns<Compiler>(_env, ns, qname->c_str(), len, create);
+}
+
+void Compiler::_const(u32 dst, const Str::Imp* s) {
+  _emit(Op::CONST, dst, (u32)_code->consts.size());
+  _code->consts.emplace_back(s);
+}
+
+void Compiler::_line(Env::Ns* ns, const Expr* line, u32 dst) {
+  const Expr* first = skip_comments(line->_value.head);
+  const Expr* block = block_of(line);
+  if (!block) {
+    return _terms(ns, first, 0, dst);
+  }
+  if (first->type() == Expr::Type::ASSIGNMENT && skip_comments(first->next()) == block) {
+    Env::Ns* child = _qualified_ns(ns, first->str_value(), first->str_value()->_size, true);
+    if (child) {
+      for (const Expr* l = block->_value.head; l; l = l->next()) { _line(child, l, dst); }
+    }
+    _emit(Op::NIL, dst);
+    return;
+  }
+  Env::Ns* w = _env.new_ns(ns, 0);
+  _code->scopes.push_back(w);
+  for (const Expr* l = block->_value.head; l; l = l->next()) { _line(w, l, dst); }
+  const Expr* second = skip_comments(first->next());
+  if (second != block && is_assignment(first, second)) {
+    _terms(w, second->next(), block, dst);
+    _store(ns, first->str_value(), dst);
+  } else {
+    _terms(w, first, block, dst);
+  }
+}
+
+void Compiler::_store(Env::Ns* ns, const Str::Imp* name, u32 src) {
+  if (const char* last = last_part(name)) {
+    ns = _qualified_ns(ns, name, (size_t)(last - 1 - name->c_str()), true);
+    if (!ns) { return; }
+    name = strings.get(last, (u32)(name->c_str() + name->_size - last)).self;
+  }
+  u32 slot = _env.slot(ns, name, true);
+  if (slot >= _stored.size()) { _stored.resize(slot + 1); }
+  _stored[slot] = true;
+  _emit(Op::STORE, slot, src);
+}
+
+void Compiler::_terms(Env::Ns* ns, const Expr* first, const Expr* end, u32 dst) {
+  // Like TreeInterp::_terms
+  EvalVector<std::pair<Env::Ns*, const Str::Imp*>> names;
+  for (;;) {
+    first = skip_comments(first);
+    const Expr* second = first == end ? end : skip_comments(first->next());
+    if (second == end) {
+      break;
+    }
+    if (is_assignment(first, second)) {
+      names.emplace_back(ns, first->str_value());
+      first = second->next();
+      continue;
+    }
+    if (first->type() == Expr::Type::ASSIGNMENT) {
+      Env::Ns* target = _qualified_ns(ns, first->str_value(), first->str_value()->_size, false);
+      if (target) {
+        ns = target;
+        first = second;
+        continue;
+      }
+    }
+    break;
+  }
+  _plain_terms(ns, first, end, dst);
+  for (size_t i = names.size(); i > 0; i--) { _store(names[i-1].first, names[i-1].second, dst); }
+}
+
+void Compiler::_plain_terms(Env::Ns* ns, const Expr* first, const Expr* end, u32 dst) {
+  if (first == end) {
+    return _emit(Op::NIL, dst);
+  }
+  const Expr* second = skip_comments(first->next());
+  if (first->type() == Expr::Type::SYM) {
+    Builtin b = Env::builtin(first->str_value());
+    if (b != Builtin::NONE && _env.resolve(ns, first->str_value(), [&](u32 s) {
+          return _is_defined(s); }) == ~0u) {
+      u32 n = (u32)count_terms(second, end);
+      u32 base = _alloc_regs(n);
+      u32 i = 0;
+      for (const Expr* e = second; e != end; e = skip_comments(e->next())) {
+        _term(ns, e, base + i++);
+      }
+      _emit(Op::CALL, dst, (u32)b, base, n);
+      _top = base;
+      return;
+    }
+  }
+  if (second == end) {
+    return _term(ns, first, dst);
+  }
+  u32 n = (u32)count_terms(first, end);
+  u32 base = _alloc_regs(n);
+  u32 i = 0;
+  for (const Expr* e = first; e != end; e = skip_comments(e->next())) {
+    _term(ns, e, base + i++);
+  }
+  _emit(Op::LIST, dst, base, n);
+  _top = base;
+}
+
+void Compiler::_term(Env::Ns* ns, const Expr* e, u32 dst) {
+  switch (e->type()) {
+    case Expr::Type::SYM: {
+      const Str::Imp* s = e->str_value();
+      if (!is_name(s)) {
+        return _const(dst, s);
+      }
+      u32 slot = ~0u;
+      if (const char* last = last_part(s)) {
+        Env::Ns* target = _qualified_ns(ns, s, (size_t)(last - 1 - s->c_str()), false);
+        Str name = target ? strings.find(last, (u32)(s->c_str() + s->_size - last)) : Str();
+        if (name) {
+          slot = _env.slot(target, name.self, false);
+          if (slot != ~0u && !_is_defined(slot)) { slot = ~0u; }
+        }
+      } else {
+        slot = _env.resolve(ns, s, [&](u32 s) { return _is_defined(s); });
+      }
+      if (slot == ~0u) {
+        return _const(dst, s);
+      }
+      return _emit(Op::LOAD, dst, slot);
+    }
+    case Expr::Type::ATOM:
+    case Expr::Type::ASSIGNMENT:
+      return _const(dst, e->str_value());
+    case Expr::Type::GROUP:
+    case Expr::Type::INLINE_BLOCK: {
+      _emit(Op::NIL, dst);
+      for (const Expr* l = e->_value.head; l; l = l->next()) { _line(ns, l, dst); }
+      return;
+    }
+    default:
+      return _emit(Op::NIL, dst);
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+Value run(Env& env, const Code& code) {
+  if (env._regs.size() < code.nregs) {
+    env._regs.resize(code.nregs);
+  }
+  Value* r = env._regs.data();
+  Env::Slot* slots = env._slots.data();
+  const Value* k = code.consts.data();
+  const u32* pc = code.code.data();
+
+  #if SAT_VM_COMPUTED_GOTO
+    static void* const op_labels[] = {
+      #define F(name, nargs) &&op_##name,
+      SAT_VM_OPS
+      #undef F
+    };
+    #define OP(name) op_##name:
+    #define NEXT(nargs) { pc += 1 + (nargs); goto *op_labels[*pc]; }
+    goto *op_labels[*pc];
+  #else
+    #define OP(name) case Op::name:
+    #define NEXT(nargs) { pc += 1 + (nargs); continue; }
+    for (;;) switch ((Op)*pc) {
+  #endif
+
+  OP(END) {
+    Value v = std::move(r[0]);
+    for (u32 i = 1; i < code.nregs; i++) { r[i] = Value(); }
+    return v;
+  }
+  OP(NIL) {
+    r[pc[1]] = Value();
+    NEXT(1)
+  }
+  OP(CONST) {
+    r[pc[1]] = k[pc[2]];
+    NEXT(2)
+  }
+  OP(LOAD) {
+    r[pc[1]] = slots[pc[2]].value;
+    NEXT(2)
+  }
+  OP(STORE) {
+    Env::Slot& s = slots[pc[1]];
+    s.value = r[pc[2]];
+    s.defined = true;
+    NEXT(2)
+  }
+  OP(LIST) {
+    r[pc[1]] = Value::list(&r[pc[2]], pc[3]);
+    NEXT(3)
+  }
+  OP(CALL) {
+    r[pc[1]] = env.call((Builtin)pc[2], &r[pc[3]], pc[4]);
+    NEXT(4)
+  }
+
+  #if !SAT_VM_COMPUTED_GOTO
+    } // switch
+  #endif
+  #undef OP
+  #undef NEXT
+}
+
+} // namespace sat
@@ -0,0 +1,279 @@
+// Evaluation of parsed results
+//
+// There are two evaluators which give the same results: TreeInterp walks the expressions of a
+// result directly and looks up every symbol by name as it goes, and Compiler turns a result into
+// bytecode with all names resolved to slots ahead of time, which run() then executes on a
+// register machine. TreeInterp is the reference; it's simple enough to read as a spec.
+//
+// What a line means:
+//
+//   ns:                  Evaluate the lines of the block in namespace "ns:", a child of the
+//     ...                current namespace, creating it if needed. Evaluates to nil.
+//   name = terms...      Bind `name` in the current namespace to the value of `terms` (which may
+//                        itself be an assignment, e.g. `a = b = c`). `name` may be qualified
+//                        (`a:b:x = 1`), in which case namespaces are created as needed.
+//   ns: terms...         The value of `terms` in namespace "ns:", e.g. `a:b:c: x`.
+//   print terms...       Application of a builtin function to the values of `terms`.
+//   term                 The value of `term`.
+//   term term...         A list of the values of the terms.
+//
+// A line followed by a block which doesn't define a namespace evaluates the block first, in a
+// new namespace which is only visible to the line (a "where" block).
+//
+// A symbol which starts with a lowercase letter or '_' is a name; its value is the value it's
+// bound to in the nearest namespace which defines it, starting with the current one. A
+// qualified symbol `a:b:x` is the name `x` in namespace `a:b:`, where `a:` is found the same way.
+// Names which are not bound, and all other symbols (`Hello`, `"Smith"`, `45`), are values of
+// their own. Groups evaluate to the value of their last line.
+//
+#pragma once
+#include "common.h"
+#include "str.hh"
+#include "expr.hh"
+#include "symmap.hh"
+#include "alloc.hh"
+#include "parse.hh"
+#include <vector>
+#include <ostream>
+
+// Set to 0 to dispatch instructions with a switch statement instead of computed goto
+#ifndef SAT_VM_COMPUTED_GOTO
+  #if defined(__GNUC__) || defined(__clang__)
+    #define SAT_VM_COMPUTED_GOTO 1
+  #else
+    #define SAT_VM_COMPUTED_GOTO 0
+  #endif
+#endif
+
+// Results with expressions nested deeper than this (groups in groups, blocks in blocks) are not
+// evaluated, as the evaluators recurse once per level and would run out of stack
+#ifndef SAT_EVAL_MAX_DEPTH
+  #define SAT_EVAL_MAX_DEPTH 1000
+#endif
+
+namespace sat {
+
+template <typename T>
+using EvalVector = std::vector<T, alloc::Allocator<T, alloc::Tag::EVAL>>;
+
+struct Value {
+  // nil, a symbol or a list of values
+  enum class Kind : u8 { NIL, SYM, LIST };
+  struct List;
+
+  Value() {}
+  explicit Value(const Str::Imp* s);
+  static Value list(const Value* items, size_t n);
+  Value(const Value& v) : _kind{v._kind}, _p{v._p} { _retain(); }
+  Value(Value&& v) : _kind{v._kind}, _p{v._p} { v._kind = Kind::NIL; v._p = 0; }
+  ~Value() { _release(); }
+  Value& operator=(const Value& v);
+  Value& operator=(Value&& v);
+
+  Kind kind() const { return _kind; }
+  bool is_nil() const { return _kind == Kind::NIL; }
+  const Str::Imp* sym() const { assert(_kind == Kind::SYM); return (const Str::Imp*)_p; }
+  size_t size() const; // number of items of a list
+  const Value& operator[](size_t i) const;
+
+  bool operator==(const Value& v) const;
+  bool operator!=(const Value& v) const { return !(*this == v); }
+
+  void _retain();
+  void _release();
+
+  Kind  _kind = Kind::NIL;
+  void* _p = 0; // Str::Imp* or List*
+};
+
+std::ostream& operator<< (std::ostream& os, const Value& v);
+
+// ------------------------------------------------------------------------------------------------
+
+#define SAT_BUILTINS \
+  F(print) /* write the values of the arguments to Env::out() */ \
+
+enum class Builtin : u8 {
+  #define F(name) name,
+  SAT_BUILTINS
+  #undef F
+  NONE,
+};
+
+struct Env {
+  // Namespaces and the values bound in them, shared by everything evaluated in the Env
+
+  struct Ns {
+    SAT_ALLOC_TAGGED(EVAL)
+    Ns*                          parent;
+    Str                          name;     // null for where blocks
+    SymMap<u32,8,alloc::Tag::EVAL> names;    // index in Env::_slots of each name
+    SymMap<Ns*,4,alloc::Tag::EVAL> children; // namespaces defined in this one
+  };
+
+  struct Slot {
+    Value value;
+    bool  defined = false;
+  };
+
+  Env(std::ostream& out = std::cout);
+  ~Env();
+  Env(const Env&) = delete;
+  Env& operator=(const Env&) = delete;
+
+  Ns* root() { return _root; }
+  std::ostream& out() { return *_out; }
+  void set_out(std::ostream& os) { _out = &os; }
+
+  Value get(const char* qname);
+    // Value bound to a fully qualified name like "user:a:x", or nil if it's not bound
+
+  size_t slot_count() const { return _slots.size() - _free_slots.size(); } // slots in use
+
+  // Used by the evaluators
+
+  Ns* new_ns(Ns* parent, const Str::Imp* name);
+    // New namespace. Named namespaces are added to the children of `parent`.
+  void free_ns(Ns*);
+    // Frees a namespace made with new_ns, along with its children and the values bound in them
+  Ns* child(Ns* ns, const Str::Imp* name, bool create);
+  u32 slot(Ns* ns, const Str::Imp* name, bool create);
+    // Index of the slot for `name` in `ns`, or ~0u if there's none and `create` is false
+
+  template <typename IsDefined>
+  u32 resolve(Ns* ns, const Str::Imp* name, IsDefined is_defined) {
+    // Slot of `name` in the nearest namespace from `ns` and up in which is_defined(slot) is true,
+    // or ~0u
+    for (; ns; ns = ns->parent) {
+      const u32* s = ns->names.find(name);
+      if (s && is_defined(*s)) { return *s; }
+    }
+    return ~0u;
+  }
+
+  Ns* resolve_ns(Ns* ns, const Str::Imp* name) {
+    // Child namespace `name` of the nearest namespace from `ns` and up which has one
+    for (; ns; ns = ns->parent) {
+      Ns* const* c = ns->children.find(name);
+      if (c) { return *c; }
+    }
+    return 0;
+  }
+
+  static Builtin builtin(const Str::Imp* name);
+    // The builtin function called `name`, or Builtin::NONE
+  Value call(Builtin, const Value* args, size_t nargs);
+
+  Slot& operator[](u32 slot) { return _slots[slot]; }
+
+  Ns*                  _root;
+  std::ostream*        _out;
+  EvalVector<Slot>     _slots;
+  EvalVector<u32>      _free_slots;
+  EvalVector<Value>    _regs; // register file of run()
+};
+
+// ------------------------------------------------------------------------------------------------
+
+struct TreeInterp {
+  // Reference evaluator which walks expressions (see top of this file)
+  TreeInterp(Env& env) : _env(env) {}
+
+  bool eval(const Expr* result, Value* value = 0);
+    // Evaluate a top-level result from Parser::next_result() in the root namespace and store its
+    // value in *value. Returns false without evaluating anything if the result is nested more
+    // than SAT_EVAL_MAX_DEPTH levels deep.
+
+  Value _line(Env::Ns*, const Expr* line);
+  Value _terms(Env::Ns*, const Expr* first, const Expr* end);
+  Value _plain_terms(Env::Ns*, const Expr* first, const Expr* end);
+  Value _term(Env::Ns*, const Expr*);
+  void _bind(Env::Ns*, const Str::Imp* name, const Value& v);
+  Env::Ns* _qualified_ns(Env::Ns*, const Str::Imp* qname, size_t len, bool create);
+  bool _is_defined(u32 slot) { return _env[slot].defined; }
+
+  Env& _env;
+};
+
+// ------------------------------------------------------------------------------------------------
+// Bytecode
+//
+// An instruction is a word holding its opcode followed by one word per operand. Registers are
+// numbered from 0 and the value of a result ends up in register 0.
+
+#define SAT_VM_OPS \
+  F(END,   0) /* return r0 */ \
+  F(NIL,   1) /* rA = nil */ \
+  F(CONST, 2) /* rA = consts[B] */ \
+  F(LOAD,  2) /* rA = slots[B] */ \
+  F(STORE, 2) /* slots[A] = rB */ \
+  F(LIST,  3) /* rA = (rB .. rB+C-1) */ \
+  F(CALL,  4) /* rA = builtin B(rC .. rC+D-1) */ \
+
+enum class Op : u32 {
+  #define F(name, nargs) name,
+  SAT_VM_OPS
+  #undef F
+};
+
+const char* op_name(Op);
+size_t op_nargs(Op);
+
+struct Code {
+  // Compiled result
+  Code(Env& env) : _env(env) {}
+  ~Code();
+  Code(const Code&) = delete;
+  Code& operator=(const Code&) = delete;
+
+  EvalVector<u32>      code;
+  EvalVector<Value>    consts;
+  u32                  nregs = 0;
+  EvalVector<Env::Ns*> scopes; // where blocks, freed with the code
+
+  Env& _env;
+};
+
+std::ostream& operator<< (std::ostream& os, const Code& c); // disassembly
+
+struct Compiler {
+  // Compiles results to bytecode for run(). A result must be compiled right before it's run,
+  // i.e. after all results before it have been run, as names are resolved at compile time.
+  Compiler(Env& env) : _env(env) {}
+
+  bool compile(const Expr* result, Code& out);
+    // Returns false if the result is nested more than SAT_EVAL_MAX_DEPTH levels deep, in which
+    // case `out` is code which evaluates to nil
+
+  void _line(Env::Ns*, const Expr* line, u32 dst);
+  void _terms(Env::Ns*, const Expr* first, const Expr* end, u32 dst);
+  void _plain_terms(Env::Ns*, const Expr* first, const Expr* end, u32 dst);
+  void _term(Env::Ns*, const Expr*, u32 dst);
+  void _store(Env::Ns*, const Str::Imp* name, u32 src);
+  void _emit(Op op) { _code->code.push_back((u32)op); }
+  void _emit(Op op, u32 a) { _emit(op); _code->code.push_back(a); }
+  void _emit(Op op, u32 a, u32 b) { _emit(op, a); _code->code.push_back(b); }
+  void _emit(Op op, u32 a, u32 b, u32 c) { _emit(op, a, b); _code->code.push_back(c); }
+  void _emit(Op op, u32 a, u32 b, u32 c, u32 d) { _emit(op, a, b, c); _code->code.push_back(d); }
+  void _const(u32 dst, const Str::Imp* s);
+  u32 _alloc_regs(u32 n) {
+    u32 r = _top;
+    _top += n;
+    if (_top > _code->nregs) { _code->nregs = _top; }
+    return r;
+  }
+  bool _is_defined(u32 slot) {
+    return _env[slot].defined || (slot < _stored.size() && _stored[slot]);
+  }
+  Env::Ns* _qualified_ns(Env::Ns*, const Str::Imp* qname, size_t len, bool create);
+
+  Env&              _env;
+  Code*             _code = 0;
+  u32               _top = 0;  // first free register
+  std::vector<bool> _stored;   // slots which the code compiled so far stores to
+};
+
+Value run(Env& env, const Code& code);
+  // Execute code and return its value
+
+} // namespace sat
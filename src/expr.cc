@@ -3,114 +3,134 @@
 
 namespace sat {
 
-static std::ostream& _repr_each(std::ostream&, const Expr* head, int, Expr::Type parent_type);
+struct Printer {
+  // Pretty-prints an expression as it's walked. Lists print their opening and separators when
+  // entered and their closing when left.
+  std::ostream& os;
+  int indent_level;
+  std::vector<Expr::Type> parent_types; // type which children of the current list consider
+                                        // their parent, as LISTs are transparent to their items
 
-static std::ostream& _repr(
-  const Expr& e,
-  std::ostream& os,
-  int indent_level,
-  bool is_first,
-  bool is_last,
-  Expr::Type parent_type)
-{
-  // os << '<' << Expr::type_name(e.type()) << '>';
-  // defer [&]{ os << "</" << Expr::type_name(e.type()) << '>'; };
+  Printer(std::ostream& os, int indent_level)
+    : os(os), indent_level(indent_level), parent_types{Expr::Type::UNDEFINED} {}
 
-  switch (e.type()) {
-    // Pretty-print like this when we rewrite this function to keep track of printing indentation
-    // level:
-    case Expr::Type::BLOCK: {
-      assert(e._value.head);
-      // if (!is_first) os << '\n';
-      return _repr_each(os, e._value.head, indent_level+1, e.type());
-    }
-    case Expr::Type::INLINE_BLOCK: {
-      if (!is_first) os << ' ';
-      os << "{ ";
-      return _repr_each(os, e._value.head, indent_level, e.type()) << " }";
-    }
-    case Expr::Type::LIST: {
-      if (parent_type == Expr::Type::INLINE_BLOCK) {
-        if (!is_first)
-          os << "; ";
-      } else if ( (indent_level > 0 || !is_first) && parent_type != Expr::Type::GROUP) {
-        os << '\n' << std::setw(indent_level*2) << "";
+  void enter(const Expr& e, bool is_first) {
+    Expr::Type parent_type = parent_types.back();
+    bool is_last = !e._next_link;
+    switch (e.type()) {
+      case Expr::Type::BLOCK: {
+        assert(e._value.head);
+        indent_level++;
+        break;
       }
-      return _repr_each(os, e._value.head, indent_level, parent_type);
-    }
-    case Expr::Type::GROUP: {
-      if (!is_first) os << ' ';
-      os << '(';
-      return _repr_each(os, e._value.head, indent_level, e.type()) << ")";
-    }
-    case Expr::Type::COMMENT: {
-      if (!is_first) os << ' ';
-      os << "#" << e.str_value();
-      assert(is_last); // os << '\n';
-      return os;
-    }
-    case Expr::Type::SYM:
-    case Expr::Type::ATOM: {
-      if (!is_first) os << ' ';
-      return os << e.str_value();
+      case Expr::Type::INLINE_BLOCK: {
+        if (!is_first) os << ' ';
+        os << "{ ";
+        break;
+      }
+      case Expr::Type::LIST: {
+        if (parent_type == Expr::Type::INLINE_BLOCK) {
+          if (!is_first)
+            os << "; ";
+        } else if ( (indent_level > 0 || !is_first) && parent_type != Expr::Type::GROUP) {
+          os << '\n' << std::setw(indent_level*2) << "";
+        }
+        break;
+      }
+      case Expr::Type::GROUP: {
+        if (!is_first) os << ' ';
+        os << '(';
+        break;
+      }
+      case Expr::Type::COMMENT: {
+        if (!is_first) os << ' ';
+        os << "#" << e.str_value();
+        assert(is_last); // os << '\n';
+        break;
+      }
+      case Expr::Type::SYM:
+      case Expr::Type::ATOM: {
+        if (!is_first) os << ' ';
+        os << e.str_value();
+        break;
+      }
+      case Expr::Type::ASSIGNMENT: {
+        if (!is_first) os << ' ';
+        os << e.str_value() << ':';
+        break;
+      }
+      default: {
+        if (!is_first) os << ' ';
+        os << "#!" << Expr::type_name(e.type());
+        if (!is_last) os << '\n';
+        break;
+      }
+    } // switch (type)
+    if (e.is_list()) {
+      parent_types.push_back(e.type() == Expr::Type::LIST ? parent_type : e.type());
     }
-    case Expr::Type::ASSIGNMENT: {
-      if (!is_first) os << ' ';
-      return os << e.str_value() << ':';
+  }
+
+  void leave(const Expr& e) {
+    if (!e.is_list()) {
+      return;
     }
-    default: {
-      if (!is_first) os << ' ';
-      os << "#!" << Expr::type_name(e.type());
-      if (!is_last) os << '\n';
-      return os;
+    parent_types.pop_back();
+    switch (e.type()) {
+      case Expr::Type::BLOCK:        indent_level--; break;
+      case Expr::Type::INLINE_BLOCK: os << " }"; break;
+      case Expr::Type::GROUP:        os << ")"; break;
+      default: break;
     }
-  } // switch (type)
-}
+  }
+};
 
 
-static std::ostream& _repr_each(
-  std::ostream& os,
-  const Expr* head,
-  int indent_level,
-  Expr::Type parent_type)
-{
-  list::foreach(head, 0, [&](const Expr* e, size_t i) {
-    _repr(*e, os, indent_level, i == 0, !e->_next_link, parent_type);
-  });
+std::ostream& Expr::print(std::ostream& os, int indent_level) const {
+  Printer p{os, indent_level};
+  walk(
+    [&](const Expr* e, const Expr* parent) { p.enter(*e, !parent || parent->_value.head == e); },
+    [&](const Expr* e, const Expr*) { p.leave(*e); });
   return os;
 }
 
 
-std::ostream& Expr::print(std::ostream& os, int indent_level) const {
-  return _repr(*this, os, indent_level, true, !_next_link, Expr::Type::UNDEFINED);
+static Expr* take_children(Expr* e, Expr* pending) {
+  // Puts the children of e in front of `pending`, unless they are shared and still referenced
+  // by some other list
+  Expr* head = e->_value.head;
+  e->_value.head = 0;
+  if (!head || (head->is_shared() && --head->_refs > 0)) {
+    return pending;
+  }
+  Expr* tail = head;
+  while (tail->_next_link) { tail = tail->_next_link; }
+  tail->_next_link = pending;
+  return head;
 }
 
 
 Expr::~Expr() {
-  // printf("~Expr: this = %p\n"
-  //        "       _type = %s\n"
-  //        "       _next_link = %p\n"
-  //        "       repr => "
-  //        ,this
-  //        ,type_name(_type)
-  //        ,_next_link );
-  // std::cout << this << std::endl;
-
-  if (is_list()) {
-    if (_value.head) {
-      delete _value.head;
-    }
-  } else if (is_str()) {
-    // printf("~Expr: _value.s->__release() where\n"
-    //        "  s = %p\n"
-    //        "  s->c_str() = '%s'\n"
-    //        "  s->__refcount = %u\n",
-    //        _value.s, _value.s->c_str(), _value.s->__refcount);
+  // Frees the children of this expression and the expressions after it without recursion:
+  // the expressions left to free form a list, linked through _next_link, and the children of
+  // each one are put in front of that list before it's freed. No expression is visited twice, so
+  // this is linear in the number of expressions and uses constant stack space.
+  if (is_str()) {
     Str::__release(_value.s);
   }
-
-  if (_next_link) {
-    delete _next_link;
+  Expr* pending = _next_link;
+  if (is_list()) {
+    pending = take_children(this, pending);
+  }
+  while (pending) {
+    Expr* e = pending;
+    pending = e->_next_link;
+    if (pending) { SAT_PREFETCH(pending); }
+    if (e->is_list()) {
+      pending = take_children(e, pending);
+    }
+    e->_next_link = 0;
+    delete e; // only releases its string, if any
   }
 }
 
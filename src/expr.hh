@@ -2,8 +2,10 @@
 #include "common.h"
 #include "str.hh"
 #include "list.hh"
+#include "alloc.hh"
 #include <ostream>
 #include <iomanip>
+#include <vector>
 
 namespace sat {
 
@@ -19,7 +21,7 @@ namespace sat {
 
 struct Expr {
   // types
-  enum class Type {
+  enum class Type : u8 {
     UNDEFINED,
     #define _(name) name,
     SAT_EXPR_TYPES
@@ -27,14 +29,18 @@ struct Expr {
   };
 
   // type creation and destruction
-  Expr(Type t) : _type(t) {}
-  Expr(Type t, Str::Imp* s) : _type{t}, _value{s} {}
+  Expr(Type t, u32 offset=0) : _type(t), _offset(offset) {}
+  Expr(Type t, Str::Imp* s, u32 offset=0) : _type{t}, _offset{offset}, _value{s} {}
   ~Expr();
+  SAT_ALLOC_TAGGED(EXPR)
 
   // properties
   Type type() const { return _type; }
+  u32 offset() const { return _offset; }
   const Expr* next() const { return _next_link; }
   Expr* next() { return _next_link; }
+  const Expr* head() const { return is_list() ? _value.head : 0; } // first child of a list
+  Expr* head() { return is_list() ? _value.head : 0; }
 
   bool is_list() const {
     return (_type == Type::LIST
@@ -52,8 +58,19 @@ struct Expr {
     return _value.s;
   }
 
+  enum Flag : u8 {
+    SHARED = 1 << 0, // first expression of a list's contents which are shared (see HashCons)
+  };
+
+  bool is_shared() const { return _flags & SHARED; }
+
   // data
   Type _type;
+  u8   _flags = 0;
+  u16  _refs = 0; // references to the shared contents this expression heads, if SHARED
+  u32  _offset = 0;
+    // Byte offset in the source text, or 0xffffffff if it's beyond that. For lists, the offset
+    // of the byte which opened the list.
   Expr* _next_link = 0;
   union Value {
     Expr* head; // used by LIST
@@ -74,9 +91,57 @@ struct Expr {
   }}
 
   std::ostream& print(std::ostream& os, int indent_level=0) const;
+
+  // Traversal of this expression and its descendants (but not the expressions after it.)
+  // The stack holds one entry per level of nesting, so a line with a million terms is as cheap to
+  // visit as a million lines.
+
+  template <typename Enter, typename Leave>
+  void walk(Enter enter, Leave leave) const;
+    // Depth-first; calls enter(e, parent) before the children of e and leave(e, parent) after
+    // them. parent is null for this expression.
+
+  template <typename F> void visit_pre(F f) const {
+    walk([&](const Expr* e, const Expr*) { f(e); }, [](const Expr*, const Expr*) {}); }
+    // f(const Expr*) with every expression, parents before children
+
+  template <typename F> void visit_post(F f) const {
+    walk([](const Expr*, const Expr*) {}, [&](const Expr* e, const Expr*) { f(e); }); }
+    // f(const Expr*) with every expression, children before parents
 };
 
 
+template <typename Enter, typename Leave>
+void Expr::walk(Enter enter, Leave leave) const {
+  std::vector<const Expr*, alloc::Allocator<const Expr*, alloc::Tag::EXPR>> parents;
+  const Expr* e = this;
+  for (;;) {
+    const Expr* parent = parents.empty() ? 0 : parents.back();
+    enter(e, parent);
+    if (e->is_list() && e->_value.head) {
+      parents.push_back(e);
+      e = e->_value.head;
+      continue;
+    }
+    leave(e, parent);
+    // Continue with the next sibling of e, or of its nearest ancestor which has one
+    for (;;) {
+      if (e == this) {
+        return;
+      }
+      if (e->_next_link) {
+        e = e->_next_link;
+        if (e->_next_link) { SAT_PREFETCH(e->_next_link); }
+        break;
+      }
+      e = parents.back();
+      parents.pop_back();
+      leave(e, parents.empty() ? 0 : parents.back());
+    }
+  }
+}
+
+
 inline static std::ostream& operator<< (std::ostream& os, const Expr& e) {
   return e.print(os); }
 
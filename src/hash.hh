@@ -8,6 +8,9 @@ constexpr uint32_t fnv1a32(const char *const cstr);
 constexpr uint32_t fnv1a32(const char *const p, const size_t len);
 constexpr uint64_t fnv1a64(const char *const cstr);
 constexpr uint64_t fnv1a64(const char *const p, const size_t len);
+inline uint32_t fnv1a32_iter(const char* p, size_t len);
+  // Same as fnv1a32(p, len) but iterative. For runtime use, where the recursive constexpr
+  // implementation uses stack space proportional to `len` in unoptimized builds.
 constexpr intptr_t twang(intptr_t);
 constexpr uint32_t twang(uint32_t);
 constexpr uint64_t twang(uint64_t);
@@ -30,6 +33,12 @@ constexpr inline uint32_t fnv1a32_(const char* const str, const size_t len, cons
 constexpr inline uint32_t fnv1a32(const char* const str, const size_t len) {
   return fnv1a32_(str, len, FNV1A_INIT_32); }
 
+inline uint32_t fnv1a32_iter(const char* p, size_t len) {
+  uint32_t v = FNV1A_INIT_32;
+  for (const char* e = p + len; p != e; ++p) { v = (v ^ uint8_t(*p)) * FNV1A_PRIME_32; }
+  return v;
+}
+
 constexpr inline uint64_t fnv1a64_(const char* const str, const uint64_t v, const bool) {
   return *str ? fnv1a64_(str+1, (v ^ uint8_t(*str)) * FNV1A_PRIME_64, true) : v; }
 constexpr inline uint64_t fnv1a64(const char* const str) {
@@ -0,0 +1,140 @@
+#include "hashcons.hh"
+#include <iomanip>
+
+namespace sat {
+
+static u32 contents_hash(const Expr* e) {
+  u32 h = 0x811c9dc5;
+  for (; e; e = e->next()) {
+    u64 v = (u64)e->type();
+    if (e->is_str()) {
+      v = (v << 32) | e->_value.s->_hash;
+    } else if (e->is_list()) {
+      v ^= (u64)(uintptr_t)e->_value.head;
+    }
+    h = (h ^ (u32)v ^ (u32)(v >> 32)) * 0x01000193;
+  }
+  return h;
+}
+
+static bool contents_equal(const Expr* a, const Expr* b) {
+  for (; a && b; a = a->next(), b = b->next()) {
+    if (!HashCons::equal(a, b)) { return false; }
+  }
+  return a == b; // both ended
+}
+
+HashCons::~HashCons() {
+  for (size_t i = 0; i < _capacity; i++) {
+    if (_entries[i].head) { _release(_entries[i].head); }
+  }
+  alloc::free(alloc::Tag::INTERN, (void*)_entries, sizeof(Entry) * _capacity);
+}
+
+void HashCons::_release(Expr* head) {
+  assert(head->is_shared() && head->_refs > 0);
+  if (--head->_refs == 0) {
+    delete head;
+  }
+}
+
+HashCons::Entry* HashCons::_find(u32 hash, const Expr* head) {
+  // Entry with contents equal to `head`, or the empty entry where they belong
+  size_t mask = _capacity - 1;
+  for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+    Entry* e = &_entries[i];
+    if (!e->head || (e->hash == hash && contents_equal(e->head, head))) {
+      return e;
+    }
+  }
+}
+
+void HashCons::_rehash() {
+  // Drop contents which are only referenced by the table, then size the table for what is left:
+  // at most a quarter full, so that there are many interns in between sweeps. The table follows
+  // the contents which are in use, shrinking when they do, rather than all that were ever seen.
+  Entry* old = _entries;
+  size_t old_capacity = _capacity;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].head && old[i].head->_refs == 1) {
+      _release(old[i].head);
+      old[i].head = 0;
+      _size--;
+    }
+  }
+  size_t capacity = 64;
+  while (_size * 4 > capacity) { capacity *= 2; }
+  _entries = (Entry*)alloc::malloc(alloc::Tag::INTERN, sizeof(Entry) * capacity);
+  if (!_entries) { throw std::bad_alloc(); }
+  memset((void*)_entries, 0, sizeof(Entry) * capacity);
+  _capacity = capacity;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].head) {
+      size_t mask = _capacity - 1;
+      size_t j = old[i].hash & mask;
+      while (_entries[j].head) { j = (j + 1) & mask; }
+      _entries[j] = old[i];
+    }
+  }
+  alloc::free(alloc::Tag::INTERN, (void*)old, sizeof(Entry) * old_capacity);
+}
+
+void HashCons::intern(Expr* list) {
+  assert(list->is_list());
+  Expr* head = list->_value.head;
+  if (!head) {
+    return;
+  }
+  size_t n = 0;
+  for (const Expr* e = head; e; e = e->next()) { n++; }
+  _stats.lists++;
+  _stats.exprs += n;
+
+  if ((_size + 1) * 2 > _capacity) {
+    _rehash();
+  }
+  u32 hash = contents_hash(head);
+  Entry* e = _find(hash, head);
+  if (e->head) {
+    if (e->head->_refs < 0xffff) {
+      e->head->_refs++;
+      list->_value.head = e->head;
+      delete head; // and the expressions after it
+      _stats.hits++;
+      _stats.exprs_freed += n;
+      return;
+    }
+    // The shared contents can't take more references. These contents replace them in the table,
+    // while lists which already reference them keep doing so.
+    _release(e->head);
+  } else {
+    _size++;
+  }
+  head->_flags |= Expr::SHARED;
+  head->_refs = 2; // list and table
+  e->hash = hash;
+  e->head = head;
+}
+
+HashCons::Stats HashCons::stats() const {
+  Stats st = _stats;
+  st.size = _size;
+  st.capacity = _capacity;
+  return st;
+}
+
+std::ostream& operator<< (std::ostream& os, const HashCons::Stats& st) {
+  #define ROW(name, value) \
+    os << std::left << std::setw(26) << name << std::right << std::setw(14) << value << '\n';
+  ROW("hashcons.lists", st.lists)
+  ROW("hashcons.hits", st.hits)
+  ROW("hashcons.exprs", st.exprs)
+  ROW("hashcons.exprs_freed", st.exprs_freed)
+  ROW("hashcons.size", st.size)
+  ROW("hashcons.capacity", st.capacity)
+  ROW("hashcons.dedup_ratio", st.dedup_ratio())
+  #undef ROW
+  return os;
+}
+
+} // namespace sat
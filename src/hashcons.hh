@@ -0,0 +1,86 @@
+// Hash-consing of expression trees
+//
+// Sources often repeat the same lists many times over, like the blocks of definitions which make
+// up generated configuration. With a HashCons attached, a Parser shares the contents of identical
+// lists: when a list is closed, its children are looked up in a table of the contents of lists
+// seen so far, and if they are there the list is made to point at those instead of its own.
+//
+// Expressions are linked to the next one in their list, so individual expressions can't be
+// shared, only the complete contents of lists. A list whose contents are shared is still an
+// expression of its own, while the contents are headed by an expression flagged Expr::SHARED
+// which holds a count of references to them. Deleting an expression frees shared contents once
+// the last list referencing them is gone.
+//
+// Contents are compared by pointer: symbols are interned and the contents of nested lists are
+// already shared by the time the list containing them is closed. So two lists from the same
+// HashCons have equal structure if and only if their heads are the same (see equal().)
+//
+// Shared expressions must not be modified. Their offsets are those of the first occurrence.
+//
+// Example:
+//
+//   HashCons hc;
+//   Parser P(kStr_user_ns);
+//   P.set_hashcons(&hc);
+//   ...
+//   std::cerr << hc.stats(); // dedup ratio
+//
+#pragma once
+#include "common.h"
+#include "str.hh"
+#include "expr.hh"
+#include "alloc.hh"
+#include <ostream>
+
+namespace sat {
+
+struct HashCons {
+  struct Stats {
+    size_t lists = 0;       // lists interned
+    size_t hits = 0;        // lists whose contents were replaced by shared ones
+    size_t exprs = 0;       // expressions in the contents of interned lists
+    size_t exprs_freed = 0; // ... of which were freed as their list took shared contents
+    size_t size = 0;        // contents in the table
+    size_t capacity = 0;    // slots in the table
+    double dedup_ratio() const {
+      // Expressions as parsed per expression kept
+      return exprs > exprs_freed ? (double)exprs / (double)(exprs - exprs_freed) : 1.0;
+    }
+  };
+
+  HashCons() {}
+  ~HashCons();
+  HashCons(const HashCons&) = delete;
+  HashCons& operator=(const HashCons&) = delete;
+
+  void intern(Expr* list);
+    // Replace the contents of `list`, which must not be modified after this, with shared contents
+    // that are equal to it, or add its contents to the table if there are none
+
+  static bool equal(const Expr* a, const Expr* b) {
+    // Structural equality of expressions whose lists were interned by the same HashCons
+    if (a->type() != b->type()) { return false; }
+    if (a->type() == Expr::Type::COMMENT) { return a->_value.s->equals(b->_value.s); }
+    return a->_value.head == b->_value.head; // or the same symbol
+  }
+
+  Stats stats() const;
+
+  struct Entry {
+    u32   hash;
+    Expr* head; // holds a reference
+  };
+
+  Entry* _find(u32 hash, const Expr* head);
+  void   _rehash();
+  void   _release(Expr* head);
+
+  Entry* _entries = 0;
+  size_t _capacity = 0; // power of two, or 0
+  size_t _size = 0;
+  Stats  _stats;
+};
+
+std::ostream& operator<< (std::ostream& os, const HashCons::Stats&);
+
+} // namespace sat
@@ -0,0 +1,535 @@
+#include "io.hh"
+#include "trace.hh"
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#if SAT_IO_URING
+  #include <linux/io_uring.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+#endif
+
+namespace sat {
+
+// ------------------------------------------------------------------------------------------------
+// io_uring, with the syscalls made directly rather than through liburing
+
+#if SAT_IO_URING
+
+struct FileReader::Uring {
+  int            fd = -1;
+  unsigned*      sq_head = nullptr;
+  unsigned*      sq_tail = nullptr;
+  unsigned*      sq_mask = nullptr;
+  unsigned*      sq_array = nullptr;
+  io_uring_sqe*  sqes = nullptr; // null until mapped; ~Uring unmaps it only if set
+  unsigned*      cq_head = nullptr;
+  unsigned*      cq_tail = nullptr;
+  unsigned*      cq_mask = nullptr;
+  io_uring_cqe*  cqes = nullptr;
+  void*          sq_ptr = MAP_FAILED;
+  size_t         sq_len = 0;
+  void*          cq_ptr = MAP_FAILED;
+  size_t         cq_len = 0;
+  size_t         sqes_len = 0;
+  unsigned       to_submit = 0;
+  bool           fixed = false; // buffers are registered
+
+  static Uring* create(unsigned entries, std::vector<Buf>& bufs, size_t buf_size) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+      return 0;
+    }
+    Uring* u = new Uring;
+    u->fd = fd;
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      u->sq_len = u->cq_len = SAT_MAX(u->sq_len, u->cq_len);
+    }
+    u->sq_ptr = mmap(0, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                     IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) {
+      delete u;
+      return 0;
+    }
+    if (!single_mmap) {
+      u->cq_ptr = mmap(0, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_CQ_RING);
+      if (u->cq_ptr == MAP_FAILED) {
+        delete u;
+        return 0;
+      }
+    }
+    char* cq = (char*)(single_mmap ? u->sq_ptr : u->cq_ptr);
+    u->sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    u->sqes = (io_uring_sqe*)mmap(0, u->sqes_len, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+      u->sqes = 0;
+      delete u;
+      return 0;
+    }
+    char* sq = (char*)u->sq_ptr;
+    u->sq_head  = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->cq_head  = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes     = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Registered buffers save the kernel from mapping them on every read. This can fail, e.g.
+    // with a low RLIMIT_MEMLOCK, in which case plain reads into the same buffers are used.
+    std::vector<iovec> iov(bufs.size());
+    for (size_t i = 0; i < bufs.size(); i++) {
+      iov[i].iov_base = bufs[i].data;
+      iov[i].iov_len = buf_size;
+    }
+    u->fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS,
+                       iov.data(), (unsigned)iov.size()) == 0;
+    return u;
+  }
+
+  ~Uring() {
+    if (sqes) { munmap(sqes, sqes_len); }
+    if (cq_ptr != MAP_FAILED) { munmap(cq_ptr, cq_len); }
+    if (sq_ptr != MAP_FAILED) { munmap(sq_ptr, sq_len); }
+    if (fd != -1) { close(fd); }
+  }
+
+  void read(int buf_index, int fd, char* p, size_t len, u64 offset) {
+    // There's always room, as the rings hold an entry per buffer and a buffer has at most one
+    // read in flight
+    unsigned tail = *sq_tail;
+    unsigned i = tail & *sq_mask;
+    io_uring_sqe* sqe = &sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (u64)(uintptr_t)p;
+    sqe->len = (u32)len;
+    sqe->off = offset;
+    sqe->buf_index = fixed ? (u16)buf_index : 0;
+    sqe->user_data = (u64)buf_index;
+    sq_array[i] = i;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+  }
+
+  void enter(unsigned min_complete) {
+    // Submit queued reads and, if min_complete > 0, wait for completions
+    for (;;) {
+      unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+      int n = (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+      if (n >= 0) {
+        to_submit -= SAT_MIN((unsigned)n, to_submit);
+        if (to_submit == 0 || min_complete) { return; }
+      } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        SAT_ABORT("io_uring_enter: %s", strerror(errno));
+      }
+    }
+  }
+
+  template <typename F> void reap(F f) {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      io_uring_cqe* cqe = &cqes[head & *cq_mask];
+      f((int)cqe->user_data, (ssize_t)cqe->res);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+};
+
+#else
+
+struct FileReader::Uring {
+  bool fixed = false;
+  static Uring* create(unsigned, std::vector<Buf>&, size_t) { return 0; }
+  void read(int, int, char*, size_t, u64) {}
+  void enter(unsigned) {}
+  template <typename F> void reap(F) {}
+};
+
+#endif // SAT_IO_URING
+
+// ------------------------------------------------------------------------------------------------
+// Thread pool calling pread()
+
+struct FileReader::Pool {
+  struct Done { int buf; ssize_t result; };
+
+  std::vector<std::thread> threads;
+  std::mutex               mu;
+  std::condition_variable  work_cv;
+  std::condition_variable  done_cv;
+  std::deque<int>          work;
+  std::vector<Done>        done;
+  bool                     stop = false;
+
+  Pool(FileReader* r, size_t nthreads) {
+    for (size_t i = 0; i < nthreads; i++) {
+      threads.emplace_back([this, r]{ run(r); });
+    }
+  }
+
+  ~Pool() {
+    {
+      std::lock_guard<std::mutex> lock(mu);
+      stop = true;
+    }
+    work_cv.notify_all();
+    for (auto& t : threads) { t.join(); }
+  }
+
+  void run(FileReader* r) {
+    trace::set_thread_name("io");
+    std::unique_lock<std::mutex> lock(mu);
+    for (;;) {
+      work_cv.wait(lock, [&]{ return stop || !work.empty(); });
+      if (stop) {
+        return;
+      }
+      int b = work.front();
+      work.pop_front();
+      lock.unlock();
+      // The main thread leaves a buffer alone while its read is in flight
+      const Buf& buf = r->_bufs[b];
+      char* p = buf.data + buf.len;
+      size_t len = buf.want - buf.len;
+      trace::Span span("io", buf.offset == (u64)-1 ? "read" : "pread");
+      ssize_t n = (buf.offset == (u64)-1) ? ::read(buf.fd, p, len) :
+                                            ::pread(buf.fd, p, len, (off_t)(buf.offset + buf.len));
+      if (n < 0) {
+        n = -errno;
+      }
+      span.arg("bytes", (i64)n);
+      span.end();
+      lock.lock();
+      done.push_back(Done{b, n});
+      done_cv.notify_one();
+    }
+  }
+};
+
+// ------------------------------------------------------------------------------------------------
+
+FileReader::FileReader(std::vector<std::string> paths, Options opt)
+  : _paths{std::move(paths)}, _opt{opt}
+{
+  _opt.queue_depth = SAT_MAX(_opt.queue_depth, (size_t)1);
+  _opt.chunk_size = SAT_MAX(_opt.chunk_size, (size_t)1);
+  _mem = (char*)alloc::malloc(alloc::Tag::IO, _opt.queue_depth * _opt.chunk_size);
+  if (!_mem) { throw std::bad_alloc(); }
+  _bufs.resize(_opt.queue_depth);
+  for (size_t i = 0; i < _bufs.size(); i++) {
+    _bufs[i].data = _mem + i * _opt.chunk_size;
+    _free.push_back((int)(_bufs.size() - 1 - i));
+  }
+  if (_opt.use_uring) {
+    _uring = Uring::create((unsigned)_opt.queue_depth, _bufs, _opt.chunk_size);
+  }
+  if (_uring) {
+    _stats.backend = _uring->fixed ? "io_uring" : "io_uring_unregistered";
+  } else {
+    _pool = new Pool(this, SAT_MAX(SAT_MIN(_opt.nthreads, _opt.queue_depth), (size_t)1));
+    _stats.backend = "pread";
+  }
+}
+
+FileReader::~FileReader() {
+  while (_inflight > 0) {
+    _wait();
+  }
+  for (const Pending& p : _pending) {
+    if (p.buf >= 0 && _bufs[p.buf].is_last) { close(_bufs[p.buf].fd); }
+  }
+  if (_fd != -1) {
+    close(_fd);
+  }
+  delete _pool;
+  delete _uring;
+  alloc::free(alloc::Tag::IO, _mem, _opt.queue_depth * _opt.chunk_size);
+}
+
+void FileReader::_issue() {
+  while (!_free.empty()) {
+    if (_fd == -1) {
+      if (_next_file == _paths.size()) {
+        break;
+      }
+      size_t file = _next_file++;
+      _stats.files++;
+      int fd = open(_paths[file].c_str(), O_RDONLY | O_CLOEXEC);
+      struct stat st;
+      if (fd == -1 || fstat(fd, &st) != 0) {
+        int err = errno;
+        if (fd != -1) { close(fd); }
+        _pending.push_back(Pending{file, -1, err});
+        continue;
+      }
+      _stream = !S_ISREG(st.st_mode); // pipes and such, read front to back until EOF
+      if (!_stream && st.st_size == 0) {
+        close(fd);
+        _pending.push_back(Pending{file, -1, 0});
+        continue;
+      }
+      _fd = fd;
+      _file = file;
+      _offset = 0;
+      _size = (u64)st.st_size;
+    }
+    if (_stream && _stream_busy) {
+      break; // one read at a time, since we don't know where the stream ends
+    }
+    int b = _free.back();
+    _free.pop_back();
+    Buf& buf = _bufs[b];
+    buf.file = _file;
+    buf.fd = _fd;
+    buf.len = 0;
+    buf.error = 0;
+    buf.done = false;
+    if (_stream) {
+      buf.offset = (u64)-1;
+      buf.want = _opt.chunk_size;
+      buf.is_last = false; // until the read returns 0
+      _stream_busy = true;
+    } else {
+      buf.offset = _offset;
+      buf.want = (size_t)SAT_MIN((u64)_opt.chunk_size, _size - _offset);
+      _offset += buf.want;
+      buf.is_last = _offset == _size;
+      if (buf.is_last) {
+        _fd = -1; // the last chunk closes it once delivered
+      }
+    }
+    _pending.push_back(Pending{_file, b, 0});
+    _submit(b);
+  }
+  if (_uring && _uring->to_submit) {
+    trace::Span span("io", "submit");
+    span.arg("reads", (i64)_uring->to_submit);
+    _uring->enter(0);
+  }
+}
+
+void FileReader::_submit(int b) {
+  Buf& buf = _bufs[b];
+  _inflight++;
+  _stats.reads++;
+  if (_uring) {
+    u64 offset = buf.offset == (u64)-1 ? (u64)-1 : buf.offset + buf.len;
+    _uring->read(b, buf.fd, buf.data + buf.len, buf.want - buf.len, offset);
+  } else {
+    {
+      std::lock_guard<std::mutex> lock(_pool->mu);
+      _pool->work.push_back(b);
+    }
+    _pool->work_cv.notify_one();
+  }
+}
+
+void FileReader::_complete(int b, ssize_t result) {
+  Buf& buf = _bufs[b];
+  _inflight--;
+  bool is_stream = buf.offset == (u64)-1;
+  if (result == -EINTR || result == -EAGAIN) {
+    return _submit(b);
+  }
+  if (result < 0) {
+    buf.error = (int)-result;
+  } else if (result > 0) {
+    buf.len += (size_t)result;
+    _stats.bytes += (size_t)result;
+    if (!is_stream && buf.len < buf.want) {
+      return _submit(b); // short read; get the rest
+    }
+  } else if (is_stream) {
+    buf.is_last = true; // EOF
+  } // else the file was truncated after we looked at its size
+  if (is_stream) {
+    _stream_busy = false;
+    if (buf.error) {
+      buf.is_last = true;
+    }
+    if (buf.is_last) {
+      _fd = -1;
+    }
+  }
+  buf.done = true;
+}
+
+void FileReader::_wait() {
+  assert(_inflight > 0);
+  if (_uring) {
+    _uring->enter(1);
+    _uring->reap([&](int b, ssize_t result) { _complete(b, result); });
+  } else {
+    std::vector<Pool::Done> done;
+    {
+      std::unique_lock<std::mutex> lock(_pool->mu);
+      _pool->done_cv.wait(lock, [&]{ return !_pool->done.empty(); });
+      done.swap(_pool->done);
+    }
+    for (const Pool::Done& d : done) { _complete(d.buf, d.result); }
+  }
+}
+
+bool FileReader::next(Chunk& c) {
+  for (;;) {
+    _issue();
+    if (_pending.empty()) {
+      return false;
+    }
+    Pending p = _pending.front();
+    if (p.buf >= 0 && !_bufs[p.buf].done) {
+      _stats.waits++;
+      trace::Span span("io", "wait"); // for the next chunk's read to complete
+      while (!_bufs[p.buf].done) { _wait(); }
+      continue; // issue reads into buffers freed up meanwhile
+    }
+    _pending.pop_front();
+    c = Chunk();
+    c.file = p.file;
+    c._buf = p.buf;
+    if (p.buf >= 0) {
+      Buf& buf = _bufs[p.buf];
+      c.data = buf.data;
+      c.len = buf.len;
+      c.error = buf.error;
+      c.is_last = buf.is_last || buf.error;
+      if (buf.is_last) {
+        close(buf.fd);
+      }
+    } else {
+      c.error = p.error;
+      c.is_last = true;
+    }
+    if (c.file == _failed_file) {
+      release(c); // the rest of a file which failed to read
+      continue;
+    }
+    if (c.error) {
+      c.len = 0;
+      _failed_file = c.file;
+    }
+    return true;
+  }
+}
+
+void FileReader::release(Chunk& c) {
+  if (c._buf >= 0) {
+    _free.push_back(c._buf);
+    c._buf = -1;
+  }
+  c.data = 0;
+}
+
+std::ostream& operator<< (std::ostream& os, const FileReader::Stats& st) {
+  #define ROW(name, value) \
+    os << std::left << std::setw(26) << name << std::right << std::setw(14) << value << '\n';
+  ROW("io.backend", st.backend)
+  ROW("io.files", st.files)
+  ROW("io.reads", st.reads)
+  ROW("io.bytes", st.bytes)
+  ROW("io.waits", st.waits)
+  #undef ROW
+  return os;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+StreamReader::StreamReader(int fd, size_t min_block, size_t max_block)
+  : _fd{fd}, _block{SAT_MAX(min_block, (size_t)1)}, _max_block{SAT_MAX(max_block, _block)}
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return;
+  }
+  if (S_ISREG(st.st_mode)) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos != -1 && pos <= st.st_size) {
+      _remaining = (u64)(st.st_size - pos);
+      _eof = _remaining == 0;
+    }
+  }
+  #if defined(__linux__) && defined(F_SETPIPE_SZ)
+  else if (S_ISFIFO(st.st_mode)) {
+    // Ask for a pipe as large as our largest read, settling for less if that is above the
+    // limit for unprivileged processes (/proc/sys/fs/pipe-max-size)
+    int size = fcntl(fd, F_GETPIPE_SZ);
+    for (size_t want = _max_block; size != -1 && want > (size_t)size; want /= 2) {
+      int n = fcntl(fd, F_SETPIPE_SZ, (int)want);
+      if (n != -1) {
+        size = n;
+        break;
+      }
+    }
+    _pipe_size = size == -1 ? 0 : (size_t)size;
+  }
+  #endif
+}
+
+ssize_t StreamReader::read(char* buf, size_t len) {
+  if (_eof) {
+    return 0;
+  }
+  len = SAT_MIN(len, _block);
+  trace::Span span("io", "read");
+  ssize_t n;
+  do {
+    n = ::read(_fd, buf, len);
+  } while (n == -1 && errno == EINTR);
+  span.arg("bytes", (i64)n);
+  span.end();
+  if (n < 0) {
+    return n;
+  }
+  _stats.reads++;
+  _stats.bytes += (size_t)n;
+  if (n == 0) {
+    _eof = true;
+  } else if (_remaining != (u64)-1) {
+    _remaining -= SAT_MIN((u64)n, _remaining);
+    _eof = _remaining == 0;
+  }
+  if ((size_t)n == len && len == _block && _block < _max_block) {
+    _block = SAT_MIN(_block * 2, _max_block); // the source is keeping up with us
+  }
+  return n;
+}
+
+StreamReader::Stats StreamReader::stats() const {
+  Stats st = _stats;
+  st.block_size = _block;
+  st.pipe_size = _pipe_size;
+  return st;
+}
+
+std::ostream& operator<< (std::ostream& os, const StreamReader::Stats& st) {
+  #define ROW(name, value) \
+    os << std::left << std::setw(26) << name << std::right << std::setw(14) << value << '\n';
+  ROW("stream.reads", st.reads)
+  ROW("stream.bytes", st.bytes)
+  ROW("stream.block_size", st.block_size)
+  ROW("stream.pipe_size", st.pipe_size)
+  #undef ROW
+  return os;
+}
+
+} // namespace sat
@@ -0,0 +1,187 @@
+// Batch file reading
+//
+// FileReader reads a list of files in chunks, keeping many reads in flight, and hands out the
+// chunks in order: all chunks of the first file, then all chunks of the second, and so on. While
+// the caller parses a chunk, reads for the chunks after it (usually of the next few files) are
+// already underway, so parsing overlaps with I/O instead of waiting for each read in turn.
+//
+// On Linux reads are submitted to an io_uring, into buffers registered with the kernel. Where
+// io_uring is not available (other systems, old kernels, or disabled by policy) a small pool of
+// threads calls pread() instead. Either way a chunk's memory belongs to the reader and must be
+// handed back with release() once the caller is done with it.
+//
+// StreamReader is for a single stream, like stdin, read front to back with read(2) into memory
+// of the caller (e.g. the parser's buffer.) It asks for larger blocks while the source keeps up.
+//
+// Example:
+//
+//   FileReader r(paths);
+//   FileReader::Chunk c;
+//   while (r.next(c)) {
+//     if (c.error) { ... }
+//     use(c.file, c.data, c.len, c.is_last);
+//     r.release(c);
+//   }
+//
+#pragma once
+#include "common.h"
+#include "alloc.hh"
+#include <string>
+#include <vector>
+#include <deque>
+#include <ostream>
+
+#if defined(__linux__) && defined(__has_include)
+  #if __has_include(<linux/io_uring.h>)
+    #define SAT_IO_URING 1
+  #endif
+#endif
+#ifndef SAT_IO_URING
+  #define SAT_IO_URING 0
+#endif
+
+namespace sat {
+
+struct FileReader {
+  struct Options {
+    size_t chunk_size = 256 * 1024; // bytes per read
+    size_t queue_depth = 32;        // reads in flight, and number of buffers
+    size_t nthreads = 4;            // threads of the pread() fallback
+    bool   use_uring = true;        // false to always use the pread() fallback
+  };
+
+  struct Chunk {
+    size_t      file = 0;     // index of the file in the list given to the reader
+    const char* data = 0;
+    size_t      len = 0;
+    bool        is_last = false; // last chunk of the file
+    int         error = 0;       // errno if the file could not be read (then len=0, is_last)
+    int         _buf = -1;
+  };
+
+  struct Stats {
+    const char* backend = "";
+    size_t files = 0;
+    size_t reads = 0;  // reads submitted, including resumed short reads
+    size_t bytes = 0;
+    size_t waits = 0;  // times next() had to wait for a read to complete
+  };
+
+  FileReader(std::vector<std::string> paths, Options);
+  FileReader(std::vector<std::string> paths) : FileReader(std::move(paths), Options()) {}
+  ~FileReader();
+  FileReader(const FileReader&) = delete;
+  FileReader& operator=(const FileReader&) = delete;
+
+  bool next(Chunk& c);
+    // Wait for the next chunk. Returns false after the last chunk of the last file.
+  void release(Chunk& c);
+    // Hand back the buffer of a chunk from next(). Chunks may be released in any order.
+
+  const std::string& path(size_t file) const { return _paths[file]; }
+  Stats stats() const { return _stats; }
+
+  // internal
+
+  struct Buf {
+    char*  data;
+    size_t file;
+    int    fd;
+    u64    offset;   // in the file, or -1 for streams (read at the current position)
+    size_t want;     // bytes requested
+    size_t len;      // bytes read so far
+    int    error;
+    bool   is_last;  // last chunk of the file; closes fd when delivered
+    bool   done;
+  };
+
+  struct Pending {
+    // A chunk to be delivered by next(), in order
+    size_t file;
+    int    buf;      // index in _bufs, or -1 for a chunk without data (empty file or error)
+    int    error;
+  };
+
+  void _issue();            // start reads while there are free buffers and files left
+  void _submit(int buf);    // start (or resume) the read of a buffer
+  void _wait();             // wait for at least one read to complete
+  void _complete(int buf, ssize_t result);
+
+  std::vector<std::string> _paths;
+  Options                  _opt;
+  Stats                    _stats;
+  char*                    _mem = 0;     // all buffers
+  std::vector<Buf>         _bufs;
+  std::vector<int>         _free;        // indices of free buffers
+  std::deque<Pending>      _pending;     // chunks issued but not yet delivered
+  size_t                   _next_file = 0;   // next file to start reading
+  size_t                   _file = 0;        // file being issued
+  int                      _fd = -1;         // ... its fd, or -1 when all its reads are issued
+  u64                      _offset = 0;      // ... next offset to read
+  u64                      _size = 0;        // ... size
+  bool                     _stream = false;  // ... is not a regular file
+  bool                     _stream_busy = false; // ... and has a read in flight
+  size_t                   _failed_file = (size_t)-1; // last file delivered with an error
+  int                      _inflight = 0;
+
+  struct Uring;
+  struct Pool;
+  Uring* _uring = 0;
+  Pool*  _pool = 0;
+};
+
+std::ostream& operator<< (std::ostream& os, const FileReader::Stats&);
+
+// ------------------------------------------------------------------------------------------------
+
+struct StreamReader {
+  // Reads a pipe, socket or file descriptor until EOF. Reads start out at `min_block` bytes and
+  // double, up to `max_block`, each time a read fills the whole block, which is what happens when
+  // the writer keeps the pipe full. On Linux a pipe is also enlarged (F_SETPIPE_SZ) so that the
+  // writer can get further ahead of us.
+  //
+  // Example:
+  //
+  //   StreamReader in(STDIN_FILENO);
+  //   for (;;) {
+  //     size_t len;
+  //     char* buf = P.get_read_buf(len, in.block_size());
+  //     ssize_t n = in.read(buf, len);
+  //     ...
+  //     P.fill(buf, n, in.at_end());
+  //   }
+  //
+  struct Stats {
+    size_t reads = 0;
+    size_t bytes = 0;
+    size_t block_size = 0; // current (largest) read size
+    size_t pipe_size = 0;  // capacity of the pipe, or 0 if not a pipe
+  };
+
+  StreamReader(int fd, size_t min_block = 64 * 1024, size_t max_block = 4 * 1024 * 1024);
+
+  size_t block_size() const { return _block; }
+    // Number of bytes the next read() would like room for
+
+  ssize_t read(char* buf, size_t len);
+    // Read up to SAT_MIN(len, block_size()) bytes. Returns the number of bytes read, or -1 on
+    // error with errno set.
+
+  bool at_end() const { return _eof; }
+    // True once all data has been read. For regular files this is known as soon as the last
+    // byte is read, for other streams when read() returns 0.
+
+  Stats stats() const;
+
+  int    _fd;
+  size_t _block;
+  size_t _max_block;
+  u64    _remaining = (u64)-1; // bytes left of a regular file, or -1
+  size_t _pipe_size = 0;
+  bool   _eof = false;
+  Stats  _stats;
+};
+
+std::ostream& operator<< (std::ostream& os, const StreamReader::Stats&);
+
+} // namespace sat
@@ -0,0 +1,200 @@
+// Tables for the table-driven lexer in Parser::parse()
+//
+// The lexer is a DFA over byte classes. Each input byte is mapped to a Class by a 256-entry
+// table, and the pair (State, Class) is mapped to an Action by a dense transition table. Both
+// tables are generated at compile time from the classify() and action() functions below.
+//
+// Input is valid UTF-8 (see utf8.hh), so bytes >= 0x80 are parts of multi-byte characters,
+// which are name characters but for non-ASCII spaces. Those start with one of a few lead bytes
+// (class USPACE), on which the lexer looks at the whole sequence with utf8::space_len.
+//
+#pragma once
+#include "common.h"
+#include "str.hh" // make_indices
+
+// Set to 0 to dispatch actions with a switch statement instead of computed goto
+#ifndef SAT_LEX_COMPUTED_GOTO
+  #if defined(__GNUC__) || defined(__clang__)
+    #define SAT_LEX_COMPUTED_GOTO 1
+  #else
+    #define SAT_LEX_COMPUTED_GOTO 0
+  #endif
+#endif
+
+namespace sat {
+namespace lex {
+
+#define SAT_LEX_STATES \
+  F(ROOT) \
+  F(COMMENT) \
+  F(LINEBREAK) \
+  F(NAME) \
+  F(QUALNAME) \
+  F(ASSIGNMENT) \
+
+#define SAT_LEX_CLASSES \
+  F(NAME)    /* any byte which can be part of a name and is not listed below */ \
+  F(COLON)   /* ':' */ \
+  F(HASH)    /* '#' */ \
+  F(NL)      /* '\n' */ \
+  F(SPACE)   /* ' ' '\t' */ \
+  F(USPACE)  /* 0xc2 0xe1-0xe3: lead byte of a sequence which may be a non-ASCII space */ \
+  F(CR)      /* '\r' */ \
+  F(CTRL)    /* other control characters */ \
+  F(LPAREN)  /* '(' */ \
+  F(RPAREN)  /* ')' */ \
+  F(LBRACE)  /* '{' */ \
+  F(RBRACE)  /* '}' */ \
+  F(SEMI)    /* ';' */ \
+  F(OTHER)   /* '\\' 0x7f, and 0xc0 0xc1 0xf5-0xff which are never in UTF-8 */ \
+
+#define SAT_LEX_ACTIONS \
+  F(SKIP)              /* consume byte and stay in the current state */ \
+  F(ROOT_NL)           \
+  F(ROOT_COMMENT)      \
+  F(ROOT_LPAREN)       \
+  F(ROOT_RPAREN)       \
+  F(ROOT_LBRACE)       \
+  F(ROOT_RBRACE)       \
+  F(ROOT_SEMI)         \
+  F(ROOT_NAME)         \
+  F(ROOT_BAD)          /* unexpected input */ \
+  F(ROOT_USPACE)       /* space, or first byte of a name */ \
+  F(NAME_END)          \
+  F(QUALNAME_END)      \
+  F(ASSIGNMENT_END)    \
+  F(TO_QUALNAME)       /* "x:y" */ \
+  F(TO_ASSIGNMENT)     /* "x:" */ \
+  F(EXTRA_COLON)       /* "x::" */ \
+  F(NAME_USPACE)       /* end of name, or part of it */ \
+  F(QUALNAME_USPACE)   \
+  F(ASSIGNMENT_USPACE) \
+  F(LINEBREAK_NL)      \
+  F(LINEBREAK_SPACE)   \
+  F(LINEBREAK_RPAREN)  \
+  F(LINEBREAK_LEAVE)   /* first byte of line content */ \
+  F(LINEBREAK_USPACE)  /* indentation, or first byte of line content */ \
+  F(COMMENT_END)       \
+
+enum class State : u8 {
+  #define F(n) n,
+  SAT_LEX_STATES
+  #undef F
+};
+
+enum class Class : u8 {
+  #define F(n) n,
+  SAT_LEX_CLASSES
+  #undef F
+};
+
+enum class Action : u8 {
+  #define F(n) n,
+  SAT_LEX_ACTIONS
+  #undef F
+};
+
+static constexpr size_t STATE_COUNT = 0
+  #define F(n) +1
+  SAT_LEX_STATES
+  #undef F
+  ;
+static constexpr size_t CLASS_COUNT = 0
+  #define F(n) +1
+  SAT_LEX_CLASSES
+  #undef F
+  ;
+
+
+constexpr Class classify(unsigned b) {
+  return b == '\n' ? Class::NL :
+         b == ' ' || b == '\t' ? Class::SPACE :
+         b == '\r' ? Class::CR :
+         b < 0x20 ? Class::CTRL :
+         b == ':' ? Class::COLON :
+         b == '#' ? Class::HASH :
+         b == '(' ? Class::LPAREN :
+         b == ')' ? Class::RPAREN :
+         b == '{' ? Class::LBRACE :
+         b == '}' ? Class::RBRACE :
+         b == ';' ? Class::SEMI :
+         b == 0xc2 || (b >= 0xe1 && b <= 0xe3) ? Class::USPACE :
+         b == '\\' || b == 0x7f || b == 0xc0 || b == 0xc1 || b >= 0xf5 ? Class::OTHER :
+         Class::NAME;
+}
+
+constexpr bool is_name(Class c) {
+  return c == Class::NAME || c == Class::COLON || c == Class::HASH;
+}
+
+constexpr Action root_action(Class c) {
+  return c == Class::NL ? Action::ROOT_NL :
+         c == Class::HASH ? Action::ROOT_COMMENT :
+         c == Class::LPAREN ? Action::ROOT_LPAREN :
+         c == Class::RPAREN ? Action::ROOT_RPAREN :
+         c == Class::LBRACE ? Action::ROOT_LBRACE :
+         c == Class::RBRACE ? Action::ROOT_RBRACE :
+         c == Class::SEMI ? Action::ROOT_SEMI :
+         c == Class::USPACE ? Action::ROOT_USPACE :
+         c == Class::SPACE || c == Class::CR || c == Class::CTRL ? Action::SKIP : // < 0x21
+         is_name(c) ? Action::ROOT_NAME :
+         Action::ROOT_BAD;
+}
+
+constexpr Action linebreak_action(Class c) {
+  return c == Class::NL ? Action::LINEBREAK_NL :
+         c == Class::SPACE ? Action::LINEBREAK_SPACE :
+         c == Class::USPACE ? Action::LINEBREAK_USPACE :
+         c == Class::RPAREN ? Action::LINEBREAK_RPAREN :
+         c == Class::CTRL ? Action::SKIP :
+         Action::LINEBREAK_LEAVE;
+}
+
+constexpr Action action(State s, Class c) {
+  return s == State::ROOT ? root_action(c) :
+         s == State::LINEBREAK ? linebreak_action(c) :
+         s == State::COMMENT ? (c == Class::NL ? Action::COMMENT_END : Action::SKIP) :
+         s == State::NAME ? (
+           c == Class::USPACE ? Action::NAME_USPACE :
+           !is_name(c) ? Action::NAME_END :
+           c == Class::COLON ? Action::TO_ASSIGNMENT :
+           Action::SKIP ) :
+         s == State::QUALNAME ? (
+           c == Class::USPACE ? Action::QUALNAME_USPACE :
+           !is_name(c) ? Action::QUALNAME_END :
+           c == Class::COLON ? Action::TO_ASSIGNMENT :
+           Action::SKIP ) :
+         /* s == State::ASSIGNMENT */ (
+           c == Class::USPACE ? Action::ASSIGNMENT_USPACE :
+           !is_name(c) ? Action::ASSIGNMENT_END :
+           c == Class::COLON ? Action::EXTRA_COLON :
+           Action::TO_QUALNAME );
+}
+
+constexpr Action action_at(size_t i) {
+  return action((State)(i / CLASS_COUNT), (Class)(i % CLASS_COUNT)); }
+
+struct ClassTable {
+  Class v[256];
+  constexpr Class operator[](u8 b) const { return v[b]; }
+};
+
+struct ActionTable {
+  Action v[STATE_COUNT * CLASS_COUNT];
+  const Action* row(State s) const { return &v[(size_t)s * CLASS_COUNT]; }
+    // Actions for state `s`, indexed by Class
+};
+
+template <size_t... I>
+constexpr ClassTable make_class_table(indices_holder<I...>) {
+  return ClassTable{{ classify(I)... }}; }
+
+template <size_t... I>
+constexpr ActionTable make_action_table(indices_holder<I...>) {
+  return ActionTable{{ action_at(I)... }}; }
+
+static constexpr ClassTable  kClasses = make_class_table(make_indices<256>());
+static constexpr ActionTable kActions = make_action_table(
+                                          make_indices<STATE_COUNT * CLASS_COUNT>());
+
+}} // namespace sat::lex
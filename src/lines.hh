@@ -0,0 +1,81 @@
+// Line index for turning byte offsets into line and column numbers
+#pragma once
+#include "common.h"
+#include "alloc.hh"
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+namespace sat {
+
+struct SrcPos {
+  size_t line; // 1-based
+  size_t col;  // 1-based, in bytes
+};
+
+// Calls f(offset) with the offset of each '\n' in s[0..len), in order
+template <typename F>
+inline static void find_linebreaks(const char* s, size_t len, F f) {
+  size_t i = 0;
+  #if defined(__SSE2__)
+  // 16 bytes at a time, then whatever is left with memchr
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+    unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    while (mask) {
+      f(i + (size_t)__builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+  #endif
+  while (i < len) {
+    const char* p = (const char*)memchr(s + i, '\n', len - i);
+    if (!p) { break; }
+    i = (size_t)(p - s);
+    f(i++);
+  }
+}
+
+
+struct LineIndex {
+  // Start offsets of the lines of some source text. Built incrementally by update(), which only
+  // needs to be called when a position is actually requested.
+
+  LineIndex() : _starts(1, 0) {}
+
+  void update(const char* s, size_t len) {
+    // Index the linebreaks of s[0..len) that have not yet been seen. `s` may move between calls
+    // but the bytes which have already been indexed must not change.
+    if (len <= _scanned) { return; }
+    size_t base = _scanned;
+    find_linebreaks(s + base, len - base, [&](size_t i) { _starts.push_back(base + i + 1); });
+    _scanned = len;
+  }
+
+  void clear() {
+    _starts.resize(1);
+    _scanned = 0;
+  }
+
+  size_t scanned() const { return _scanned; } // number of bytes indexed
+
+  SrcPos pos(size_t offset) const {
+    // Line and column of `offset`, which must be within the bytes indexed
+    assert(offset <= _scanned);
+    auto I = std::upper_bound(_starts.begin(), _starts.end(), offset);
+    size_t line = (size_t)(I - _starts.begin()); // >= 1 as _starts[0] == 0
+    return SrcPos{line, offset - _starts[line-1] + 1};
+  }
+
+  size_t line_start(size_t line) const { return _starts[line-1]; }
+    // Offset of the first byte of `line` (1-based)
+
+  std::vector<size_t,alloc::Allocator<size_t,alloc::Tag::PARSER>> _starts;
+  size_t _scanned = 0;
+};
+
+} // namespace sat
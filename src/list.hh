@@ -55,40 +55,53 @@ protected:
 //     | ?(const T&)
 //     | ?(T*)
 //     | ?(T&)
-
-// These lil' tricks allow for highly efficient compiler optimizations
-template <typename T, typename F>
-static inline void _foreach_const(const T* e, F f) {
-  f(e);
-  if ((e = e->_next_link)) _foreach_const<T,F>(e, f); }
-
-template <typename T, typename F>
-static inline void _foreach_const(const T* e, size_t i, F f) {
-  f(e, i);
-  if ((e = e->_next_link)) _foreach_const<T,F>(e, i+1, f); }
-
+//
+// Loops rather than recursion, so that stack use doesn't depend on the length of the list. The
+// next element is read before f is called, so f may unlink or free the element it's given.
 
 template <typename T, typename F> void foreach(const T& e, F f) {
-  f(e);
-  if (e._next_link) foreach<T,F>((const T&)*e._next_link, f);
+  for (const T* p = &e; p; ) {
+    const T* next = p->_next_link;
+    if (next) { SAT_PREFETCH(next); }
+    f(*p);
+    p = next;
+  }
 }
 
 template <typename T, typename F> void foreach(const T* e, F f) {
-  if (e) _foreach_const<T,F>(e, f); }
+  while (e) {
+    const T* next = e->_next_link;
+    if (next) { SAT_PREFETCH(next); }
+    f(e);
+    e = next;
+  }
+}
+
 template <typename T, typename F> void foreach(const T* e, size_t i, F f) {
-  if (e) _foreach_const<T,F>(e, i, f); }
+  while (e) {
+    const T* next = e->_next_link;
+    if (next) { SAT_PREFETCH(next); }
+    f(e, i++);
+    e = next;
+  }
+}
 
 template <typename T, typename F> void foreach(T& e, F f) {
-  T* e2 = e._next_link;
-  f(e);
-  if (e2) foreach<T,F>(*e2, f);
+  for (T* p = &e; p; ) {
+    T* next = p->_next_link;
+    if (next) { SAT_PREFETCH(next); }
+    f(*p);
+    p = next;
+  }
 }
 
 template <typename T, typename F> void foreach(T* e, F f) {
-  if (!e) return;
-  T* e2 = e->_next_link;
-  f(e);
-  foreach<T,F>(e2, f);
+  while (e) {
+    T* next = e->_next_link;
+    if (next) { SAT_PREFETCH(next); }
+    f(e);
+    e = next;
+  }
 }
 
 
@@ -0,0 +1,152 @@
+// Mutual exclusion lock which spins briefly before putting the waiting thread to sleep
+//
+// Most critical sections in sat are a few hundred instructions (an interner lookup, a queue
+// update), so a thread which finds the lock taken is likely to get it soon. lock() first spins
+// with exponential backoff, reading the lock word and pausing in between rather than retrying
+// the CAS, so that waiting threads don't keep taking the cache line away from the owner. If the
+// lock is still taken after kSpinRounds, the thread parks on a futex (Linux) until unlock()
+// wakes it. Elsewhere it sleeps for increasingly long instead.
+//
+// The lock word is 0 when unlocked, 1 when locked and 2 when locked with threads (maybe)
+// parked, so that unlock() only makes a syscall when someone is waiting ("Futexes Are Tricky",
+// Drepper, 2011).
+//
+// Lock has lock(), try_lock() and unlock(), so it can be used with std::lock_guard and
+// std::unique_lock. Counters of contention and time spent waiting are kept when turned on with
+// set_counting(true); they cost nothing when the lock is free.
+//
+#pragma once
+#include "common.h"
+#include <chrono>
+#include <mutex> // std::lock_guard, std::unique_lock
+#include <thread>
+
+#include <time.h>
+#if defined(__linux__)
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+namespace sat {
+
+struct Lock {
+  struct Stats {
+    u64 acquires = 0;  // lock() and successful try_lock() calls
+    u64 contended = 0; // acquires which found the lock taken
+    u64 spun = 0;      // contended acquires which got the lock while spinning
+    u64 parks = 0;     // times a thread went to sleep waiting for the lock
+    u64 wait_ns = 0;   // time spent waiting in contended acquires
+  };
+
+  static const u32 kSpinRounds = 10; // of 1, 2, 4 .. 512 pauses
+
+  constexpr Lock() {}
+  Lock(const Lock&) = delete;
+  Lock& operator=(const Lock&) = delete;
+
+  bool try_lock() {
+    if (sat_atomic_cas_bool(&_state, (i32)0, (i32)1)) {
+      if (_counting) { ++_stats.acquires; }
+      return true;
+    }
+    return false;
+  }
+
+  void lock() {
+    if (!sat_atomic_cas_bool(&_state, (i32)0, (i32)1)) {
+      _lock_contended();
+    }
+    if (_counting) { ++_stats.acquires; }
+  }
+
+  void unlock() {
+    if (sat_atomic_sub_fetch(&_state, 1) != 0) {
+      // Was 2: there may be threads parked
+      sat_atomic_store_rel(&_state, 0);
+      _wake();
+    }
+  }
+
+  void set_counting(bool on) { _counting = on; }
+    // Start or stop counting. Must not be called while other threads use the lock.
+
+  Stats stats() {
+    lock();
+    Stats st = _stats;
+    unlock();
+    if (_counting) { st.acquires--; } // this call's
+    return st;
+  }
+
+  volatile i32 _state = 0;
+  bool         _counting = false;
+  Stats        _stats; // guarded by the lock itself
+
+  void _lock_contended() {
+    std::chrono::steady_clock::time_point t0;
+    if (_counting) { t0 = std::chrono::steady_clock::now(); }
+    u64 parks = 0;
+    bool spun = false;
+    u32 delay = 1;
+    for (u32 round = 0; round < kSpinRounds; round++) {
+      for (u32 i = 0; i < delay; i++) {
+        sat_cpu_relax();
+      }
+      delay <<= 1;
+      if (sat_atomic_load_acq(&_state) == 0 && sat_atomic_cas_bool(&_state, (i32)0, (i32)1)) {
+        spun = true;
+        break;
+      }
+    }
+    if (!spun) {
+      // Mark the lock as having waiters and sleep until it's released. Taking it with state 2
+      // (rather than 1) is conservative: we can't tell whether other threads are still parked.
+      SleepBackoff backoff;
+      while (_exchange(2) != 0) {
+        ++parks;
+        _park(backoff);
+      }
+    }
+    if (_counting) {
+      ++_stats.contended;
+      _stats.spun += spun;
+      _stats.parks += parks;
+      _stats.wait_ns += (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - t0).count();
+    }
+  }
+
+  i32 _exchange(i32 v) {
+    i32 old;
+    do {
+      old = sat_atomic_load_acq(&_state);
+    } while (!sat_atomic_cas_bool(&_state, old, v));
+    return old;
+  }
+
+  struct SleepBackoff { u32 n = 0; }; // where there's no futex
+
+#if defined(__linux__)
+  void _park(SleepBackoff&) {
+    // Returns at once if _state is no longer 2, or on a spurious wakeup
+    syscall(SYS_futex, (i32*)&_state, FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+  }
+  void _wake() {
+    syscall(SYS_futex, (i32*)&_state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+  }
+#else
+  void _park(SleepBackoff& b) {
+    if (b.n < 4) {
+      std::this_thread::yield();
+    } else {
+      struct timespec ts = { 0, (long)1000 << SAT_MIN(b.n - 4, (u32)8) }; // 1us .. 256us
+      nanosleep(&ts, 0);
+    }
+    b.n++;
+  }
+  void _wake() {}
+#endif
+};
+
+} // namespace sat
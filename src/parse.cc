@@ -0,0 +1,133 @@
+#include "parse.hh"
+#include <unistd.h> // sysconf()
+
+namespace sat {
+
+const char* ErrorName(Error e) { switch (e) {
+  #define _(name) case Error::name: return #name;
+  SAT_ERRORS
+  #undef _
+}}
+
+#define F(name, cstr) \
+constexpr decltype(ConstStr(cstr)) kStr_##name = ConstStr(cstr);
+CONST_SYMBOLS
+#undef F
+
+Str::WeakSet strings{
+  // Initialize the map with our constant symbols
+  #define F(name, cstr) &kStr_##name,
+  CONST_SYMBOLS
+  #undef F
+};
+
+// Read system memory page size. Parser::Buf uses this value in an advisory manner.
+long MEM_PAGE_SIZE = -1;
+struct _MEM_PAGE_SIZE { _MEM_PAGE_SIZE() {
+  #if defined(PAGESIZE)
+  MEM_PAGE_SIZE = sysconf(PAGESIZE);
+  #elif defined(PAGE_SIZE)
+  MEM_PAGE_SIZE = sysconf(PAGE_SIZE);
+  #elif defined(_SC_PAGESIZE)
+  MEM_PAGE_SIZE = sysconf(_SC_PAGESIZE);
+  #else
+  MEM_PAGE_SIZE = -1;
+  #endif
+  if (MEM_PAGE_SIZE == -1 || (MEM_PAGE_SIZE/8)*8 != MEM_PAGE_SIZE) { MEM_PAGE_SIZE = 4096; }
+}} __MEM_PAGE_SIZE;
+
+
+ParserBase::Stats& ParserBase::Stats::operator+=(const Stats& b) {
+  bytes += b.bytes;
+  lines += b.lines;
+  for (size_t i = 0; i < TOKEN_COUNT; i++) { tokens[i] += b.tokens[i]; }
+  results += b.results;
+  max_scope_depth = SAT_MAX(max_scope_depth, b.max_scope_depth);
+  max_indent_level = SAT_MAX(max_indent_level, b.max_indent_level);
+  buf_reallocs += b.buf_reallocs;
+  buf_high_water = SAT_MAX(buf_high_water, b.buf_high_water);
+  documents += b.documents;
+  #if SAT_PARSE_PROFILE
+  profile += b.profile;
+  #endif
+  return *this;
+}
+
+std::ostream& operator<< (std::ostream& os, const Parser::Stats& st) {
+  os << std::dec;
+  #define ROW(name, value) \
+    os << std::left << std::setw(26) << name << std::right << std::setw(14) << value << '\n';
+  ROW("parser.bytes", st.bytes)
+  ROW("parser.lines", st.lines)
+  for (size_t i = 0; i < Parser::TOKEN_COUNT; i++) {
+    ROW(std::string("parser.tokens.") + Parser::token_name((Parser::Token)i), st.tokens[i])
+  }
+  ROW("parser.results", st.results)
+  ROW("parser.max_scope_depth", st.max_scope_depth)
+  ROW("parser.max_indent_level", st.max_indent_level)
+  ROW("parser.buf_reallocs", st.buf_reallocs)
+  ROW("parser.buf_high_water", st.buf_high_water)
+  ROW("parser.documents", st.documents)
+  #undef ROW
+  return os;
+}
+
+#if SAT_PARSE_PROFILE
+
+const char* ParserBase::Profile::slot_name(size_t slot) {
+  switch (slot) {
+    case SCOPE: return "SCOPE";
+    case TOKEN: return "TOKEN";
+    default:    return read_state_name((ReadState)slot);
+  }
+}
+
+ParserBase::Profile& ParserBase::Profile::operator+=(const Profile& b) {
+  for (size_t i = 0; i < SLOT_COUNT; i++) {
+    cycles[i] += b.cycles[i];
+    bytes[i] += b.bytes[i];
+    entries[i] += b.entries[i];
+  }
+  return *this;
+}
+
+std::ostream& operator<< (std::ostream& os, const ParserBase::Profile& pr) {
+  typedef ParserBase::Profile Profile;
+  std::ios::fmtflags flags = os.flags();
+  std::streamsize precision = os.precision();
+  u64 total_cycles = 0, total_bytes = 0, total_entries = 0;
+  for (size_t i = 0; i < Profile::SLOT_COUNT; i++) {
+    total_cycles += pr.cycles[i];
+    total_bytes += pr.bytes[i];
+    total_entries += pr.entries[i];
+  }
+  os << std::dec << std::left << std::setw(12) << "profile" << std::right
+     << std::setw(16) << "cycles"
+     << std::setw(8)  << "%"
+     << std::setw(14) << "bytes"
+     << std::setw(10) << "cycles/B"
+     << std::setw(14) << "entries" << '\n';
+  auto row = [&](const char* name, u64 cycles, u64 bytes, u64 entries) {
+    os << std::left << std::setw(12) << name << std::right
+       << std::setw(16) << cycles
+       << std::setw(8)  << std::fixed << std::setprecision(1)
+       << (total_cycles ? 100.0 * (double)cycles / (double)total_cycles : 0.0)
+       << std::setw(14) << bytes
+       << std::setw(10) << std::setprecision(2)
+       << (bytes ? (double)cycles / (double)bytes : 0.0)
+       << std::setw(14) << entries << '\n';
+  };
+  for (size_t i = 0; i < Profile::SLOT_COUNT; i++) {
+    row(Profile::slot_name(i), pr.cycles[i], pr.bytes[i], pr.entries[i]);
+  }
+  row("total", total_cycles, total_bytes, total_entries);
+    // Note: cycles/B of the total includes SCOPE and TOKEN, which consume no bytes of their own
+  os.flags(flags);
+  os.precision(precision);
+  return os;
+}
+
+#endif // SAT_PARSE_PROFILE
+
+
+} // namespace sat
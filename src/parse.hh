@@ -0,0 +1,1429 @@
+// Parser which turns sat source text into lists of expressions
+#pragma once
+#include "common.h"
+#include "hash.hh"
+#include "str.hh"
+#include "pmap.hh"
+#include "list.hh"
+#include "expr.hh"
+#include "hashcons.hh"
+#include "alloc.hh"
+#include "lex.hh"
+#include "utf8.hh"
+#include "lines.hh"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <assert.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+// Set to 1 to count the time spent and bytes consumed in each lexer state, and the time spent
+// changing scope and handling tokens, in Parser::Stats::profile. Costs a cycle counter read per
+// state change, so it's off in normal builds, where none of it is compiled in.
+#ifndef SAT_PARSE_PROFILE
+  #define SAT_PARSE_PROFILE 0
+#endif
+#if SAT_PARSE_PROFILE
+  #if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+  #else
+    #include <time.h>
+  #endif
+  #include "defer.hh"
+#endif
+
+namespace sat {
+
+// ----------------------------------------------------------------------------------------------
+
+#define SAT_ERRORS \
+  _(Parse) \
+  _(Syntax) \
+  _(Indentation) \
+  _(Memory) \
+  _(Encoding) /* input is not valid UTF-8 */ \
+
+enum class Error {
+  #define _(name) name,
+  SAT_ERRORS
+  #undef _
+};
+
+const char* ErrorName(Error e);
+
+// ----------------------------------------------------------------------------------------------
+// Interned strings and symbols
+
+#define CONST_SYMBOLS \
+  F(user, "user") \
+  F(user_ns, "user:") \
+  F(eq, "=") \
+  F(print, "print") \
+
+#define F(name, cstr) \
+extern const decltype(ConstStr(cstr)) kStr_##name;
+CONST_SYMBOLS
+#undef F
+
+extern Str::WeakSet strings;
+  // Interned symbols, initialized with our constant symbols
+
+// Words with a meaning to the parser. They are recognized in NAME tokens only.
+#define SAT_KEYWORDS \
+  K(END, "__END__") /* end of input, or of the document in multi-document mode */ \
+
+enum class Keyword : u8 {
+  // Reserved words recognized by find_keyword: the constant symbols and the keywords
+  NONE,
+  #define F(name, cstr) name,
+  CONST_SYMBOLS
+  #undef F
+  #define K(name, cstr) name,
+  SAT_KEYWORDS
+  #undef K
+};
+
+constexpr u32 keyword_key(size_t len, char first, char last) {
+  // Key of a token for find_keyword. Keys of reserved words must differ, or find_keyword's switch
+  // won't compile (duplicate case value); then add more bytes to the key.
+  return (u32)(len > 0xffff ? 0 : len) << 16 | (u32)(u8)first << 8 | (u32)(u8)last;
+}
+
+inline static Keyword find_keyword(const char* p, size_t len) {
+  // Returns the reserved word p[0..len) is, if any. Costs a jump on the token's length and first
+  // and last bytes, and a compare when those match a reserved word.
+  if (len == 0) {
+    return Keyword::NONE;
+  }
+  switch (keyword_key(len, p[0], p[len - 1])) {
+    #define F(name, cstr) \
+      case keyword_key(sizeof(cstr) - 1, cstr[0], cstr[sizeof(cstr) - 2]): \
+        return memcmp(p, cstr, len) == 0 ? Keyword::name : Keyword::NONE;
+    #define K F
+    CONST_SYMBOLS
+    SAT_KEYWORDS
+    #undef K
+    #undef F
+    default:
+      return Keyword::NONE;
+  }
+}
+
+inline static Str::Imp* keyword_symbol(Keyword k) {
+  // The interned symbol of a constant symbol, or null for NONE and keywords
+  switch (k) {
+    #define F(name, cstr) case Keyword::name: return Str::imp_cast(kStr_##name);
+    CONST_SYMBOLS
+    #undef F
+    default:
+      return nullptr;
+  }
+}
+
+template <typename F>
+static bool split_qname(const char* s, size_t len, F f) {
+  // Calls f(p, len) for each ':'-separated part of a qualified name s[0..len), e.g. "a:b:x". A
+  // trailing ':' is not a part. Returns false if a part is empty or f returns false.
+  const char* end = s + len;
+  while (s < end) {
+    const char* p = (const char*)memchr(s, ':', end - s);
+    if (!p) { p = end; }
+    if (p == s || !f(s, (size_t)(p - s))) { return false; }
+    s = p + 1;
+  }
+  return true;
+}
+
+// --------------------------------------------------------------------------------------------
+
+struct Namespace {
+  // Maps names to expressions
+
+  typedef PMap<Expr*,alloc::Tag::NAMESPACE> Names;
+
+  Namespace(Str&& qname) : _qname{qname} {}
+  SAT_ALLOC_TAGGED(NAMESPACE)
+  Namespace(Str&& qname, const Names& import_names)
+    : _qname{qname}, _names{import_names} {}
+    // Starts out with the names of another namespace. O(1) as the two share their names until
+    // either one changes.
+
+  const Str& name() const { return _qname; }
+  const Names& names() const { return _names; }
+
+  Expr* lookup(const Str::Imp* name) const {
+    // Expression for the interned unqualified `name`, or null if there is none
+    Expr* const* e = _names.find(name);
+    return e ? *e : 0;
+  }
+
+  void define(Str::Imp* name, Expr* e) { _names.set(name, e); }
+    // Set or shadow `name`, which must be interned. O(log n) and copies only what it changes.
+
+  Str             _qname;
+    // Qualified name, i.e. "user:foo:bar:". Always ends in ":".
+  Names           _names;
+    // Unqualified names to expressions defined in this namespace. Filled in during parsing and
+    // accessed during evaluation (for looking up symbols). Keys are interned.
+};
+
+
+#define SAT_SCOPE_TYPES \
+  /* Should match the names of the `Expr::Type` they represent */ \
+  _(LIST) \
+  _(BLOCK) \
+  _(INLINE_BLOCK) \
+  _(GROUP) \
+
+struct Scope {
+  // Represents some kind of list of expressions during parsing. Scopes are kept by value on the
+  // parser's scope stack; the expressions themselves are collected by TreeBuilder.
+
+  enum class Type {
+    #define _(NAME) NAME,
+    SAT_SCOPE_TYPES
+    #undef _
+  };
+  static const char* type_name(Type t) { switch (t) {
+    #define _(NAME) case Type::NAME: return #NAME;
+    SAT_SCOPE_TYPES
+    #undef _
+  }}
+
+  Scope(Type t, int il, Namespace* ns)
+    : _type(t), _indent_level(il), _ns(ns) {}
+
+  Type type() const { return _type; }
+  int indent_level() const { return _indent_level; }
+  Namespace* ns() const { return _ns; }
+
+  // data
+  Type        _type;
+  int         _indent_level;
+  Namespace*  _ns; // weak
+    // What namespace this scope is operating in. In most cases this is no different from its
+    // parent scope.
+};
+
+
+// Read system memory page size. Parser::Buf uses this value in an advisory manner.
+extern long MEM_PAGE_SIZE;
+
+struct ParserBase {
+  // Types shared by all BasicParser instantiations
+
+  enum class Status {
+    ERROR,  // There was an error. Caller should either stop parsing or repair the error and retry
+    RESULT, // There's results available by calling `next_result()`
+    MORE,   // Parser needs more data. Call `fill()` and `parse()` to resume.
+    DONE,   // There's nothing more to parse.
+    DOCUMENT, // A document ended at "__END__" in multi-document mode. Call `parse()` to go on
+              // with the next one.
+  };
+
+  static const char* status_name(Status v) {
+    switch (v) {
+      case Status::ERROR:    return "ERROR";
+      case Status::RESULT:   return "RESULT";
+      case Status::MORE:     return "MORE";
+      case Status::DONE:     return "DONE";
+      case Status::DOCUMENT: return "DOCUMENT";
+    }
+  }
+
+  #define TOKEN_NAMES \
+    F(COMMENT) \
+    F(NAME) \
+    F(QUALNAME) \
+    F(ASSIGNMENT) \
+
+  enum class Token {
+    #define F(n) n,
+    TOKEN_NAMES
+    #undef F
+  };
+
+  static const char* token_name(Token v) {
+    switch (v) {
+      #define F(n) case Token::n: return #n;
+      TOKEN_NAMES
+      #undef F
+    }
+  }
+
+  static const size_t TOKEN_COUNT = 0
+    #define F(n) +1
+    TOKEN_NAMES
+    #undef F
+    ;
+
+#if SAT_PARSE_PROFILE
+  struct Profile {
+    // Where parse() spends its time. Slots are the lexer states, then SCOPE for enter_scope and
+    // leave_scope and TOKEN for on_token (which includes interning names). Time in the latter
+    // two isn't counted towards the state they're called from. Cycles are TSC ticks on x86,
+    // counter ticks on ARM and nanoseconds elsewhere.
+    static const size_t SCOPE = lex::STATE_COUNT;
+    static const size_t TOKEN = lex::STATE_COUNT + 1;
+    static const size_t SLOT_COUNT = lex::STATE_COUNT + 2;
+
+    u64 cycles[SLOT_COUNT] = {};
+    u64 bytes[SLOT_COUNT] = {};   // consumed in each state
+    u64 entries[SLOT_COUNT] = {}; // switches to each state, or calls
+
+    static const char* slot_name(size_t slot);
+    Profile& operator+=(const Profile& b);
+
+    static u64 now() {
+      #if defined(__x86_64__) || defined(__i386__)
+        return (u64)__rdtsc();
+      #elif defined(__aarch64__)
+        u64 v;
+        __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+        return v;
+      #else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+      #endif
+    }
+  };
+#endif
+
+  struct Stats {
+    // Counters maintained during parsing. Cheap enough to always be on.
+    size_t bytes = 0;                 // bytes consumed
+    size_t lines = 0;                 // linebreaks consumed
+    size_t tokens[TOKEN_COUNT] = {};  // tokens by kind, indexed by Token
+    size_t results = 0;               // results yielded
+    size_t max_scope_depth = 0;       // deepest scope stack
+    int    max_indent_level = 0;      // deepest line indentation
+    size_t buf_reallocs = 0;          // times the source buffer was grown
+    size_t buf_high_water = 0;        // largest size of the source buffer, in bytes
+    size_t documents = 0;             // documents ended by "__END__" in multi-document mode
+    #if SAT_PARSE_PROFILE
+    Profile profile;
+    #endif
+
+    Stats& operator+=(const Stats& b);
+      // Combine the counters of another parser, e.g. one per input file
+  };
+
+  typedef lex::State ReadState;
+
+  static const char* read_state_name(ReadState v) {
+    switch (v) {
+      #define F(n) case ReadState::n: return #n;
+      SAT_LEX_STATES
+      #undef F
+    }
+  }
+};
+
+std::ostream& operator<< (std::ostream& os, const ParserBase::Stats&);
+#if SAT_PARSE_PROFILE
+std::ostream& operator<< (std::ostream& os, const ParserBase::Profile&);
+  // Table of cycles, share of the total, bytes and cycles per byte by slot
+#endif
+
+
+struct ParseHandler {
+  // Receives events from BasicParser. Derive from this and hide the events you are interested
+  // in; calls are resolved at compile time and inlined. Returning false from an event makes
+  // parse() return Status::ERROR.
+  typedef ParserBase::Token Token;
+
+  bool enter(Scope::Type, size_t offset) { return true; }
+    // A scope was entered at byte `offset`. The root BLOCK scope is entered at offset 0 when the
+    // parser is constructed and is never left.
+  bool leave(Scope::Type) { return true; }
+    // The innermost scope was left
+  bool token(Token, const char* p, size_t len, size_t offset) { return true; }
+    // A token was read. `p` and `len` is the token's source text, e.g. "x:" for an ASSIGNMENT
+    // and the text after "#" for a COMMENT. `p` is only valid until the next call to fill().
+    // `offset` is the byte offset of `p` from the start of input, or of the current document in
+    // multi-document mode.
+  bool has_results() const { return false; }
+    // Return true to make parse() return Status::RESULT at the next opportunity
+  void reset() {}
+    // The parser is starting over with a new input. enter() is called for the root scope next.
+};
+
+
+struct TreeBuilder : ParseHandler {
+  // Builds lists of Expr from parse events. Lists at the root level become results.
+
+  struct Frame {
+    Scope::Type type;
+    u32         offset;
+    Expr*       list; // Expr of the list type matching `type`, or null until the first append
+    Expr*       tail; // last expression in `list`
+  };
+
+  static u32 expr_offset(size_t offset) { return (u32)SAT_MIN(offset, (size_t)0xffffffffu); }
+
+  ~TreeBuilder() { discard(); }
+
+  void reset() {
+    discard();
+    _stack.clear(); // keeps its capacity
+    _nresults = 0;
+  }
+
+  void discard() {
+    // Delete partially built lists and results which have not been taken
+    for (auto& f : _stack) { delete f.list; }
+    while (Expr* e = _results.pop_front()) { delete e; }
+  }
+
+  bool enter(Scope::Type t, size_t offset) {
+    _stack.push_back(Frame{t, expr_offset(offset), 0, 0});
+    return true;
+  }
+
+  bool leave(Scope::Type t) {
+    assert(_stack.size() > 1);
+    assert(_stack.back().type == t);
+    Expr* list = _stack.back().list;
+    _stack.pop_back();
+    // Take care of any expressions in the scope we just left
+    if (list) {
+      if (hashcons) {
+        hashcons->intern(list);
+      }
+      if (_stack.size() == 1) {
+        // As we are at the root scope, yield results
+        yield_result(list);
+      } else {
+        append(_stack.back(), list);
+      }
+    }
+    return true;
+  }
+
+  bool token(Token t, const char* p, size_t len, size_t offset) {
+    Expr::Type type;
+    switch (t) {
+      case Token::COMMENT: type = Expr::Type::COMMENT; break;
+      case Token::ASSIGNMENT: {
+        assert(len > 0);
+        assert(p[len-1] == ':'); // or our parse code is bad
+        --len; // skip
+        type = Expr::Type::ASSIGNMENT;
+        break;
+      }
+      default: type = Expr::Type::SYM;
+    }
+    // Intern all but comments. Constant symbols are interned already.
+    Str s;
+    if (t == Token::COMMENT) {
+      s = Str{p, (u32)len};
+    } else if (Str::Imp* sym = keyword_symbol(find_keyword(p, len))) {
+      s = Str{sym};
+    } else {
+      s = strings.get(p, (u32)len);
+    }
+    append(_stack.back(), new Expr{type, s.steal_self(), expr_offset(offset)});
+    return true;
+  }
+
+  bool has_results() const { return !_results.empty(); }
+  Expr* next_result() { return _results.pop_front(); }
+  size_t results() const { return _nresults; } // number of results yielded
+
+  static void append(Frame& f, Expr* expr) {
+    if (!f.tail) {
+      Expr::Type list_type;
+      switch (f.type) {
+        #define _(NAME) case Scope::Type::NAME: list_type = Expr::Type::NAME; break;
+        SAT_SCOPE_TYPES
+        #undef _
+      }
+      f.list = new Expr{list_type, f.offset};
+      f.list->_value.head = expr;
+    } else {
+      f.tail->_next_link = expr;
+    }
+    f.tail = expr;
+  }
+
+  void yield_result(Expr* expr) {
+    _results.push_back(expr);
+    ++_nresults;
+  }
+
+  HashCons* hashcons = 0; // shares the contents of identical lists when set
+
+  std::vector<Frame,alloc::Allocator<Frame,alloc::Tag::PARSER>> _stack;
+  list::FIFO<Expr> _results;  // Queue of expressions ready to e.g. be evaulated
+  size_t           _nresults = 0;
+};
+
+
+template <typename Handler>
+struct BasicParser : ParserBase {
+  // Parser which reports what it reads as events to a Handler (see ParseHandler)
+
+  template <typename... Args>
+  BasicParser(Str ns_qname, Args&&... handler_args)
+    : _root_ns{std::move(ns_qname)}
+    , _handler(std::forward<Args>(handler_args)...)
+  {
+    _scope_stack.emplace_back(Scope::Type::BLOCK, 0, &_root_ns);
+    _handler.enter(Scope::Type::BLOCK, 0);
+  }
+  BasicParser(const BasicParser&) = delete; // scopes point to _root_ns
+  BasicParser& operator=(const BasicParser&) = delete;
+
+  void reset() {
+    // Start over with a new input, as if newly constructed. Results which have not been taken
+    // are deleted and counters are zeroed. Buffers and stacks keep their capacity, so that once
+    // a parser has seen an input, parsing another one of similar shape doesn't allocate other
+    // than for results and strings that are new to the interner. Settings are kept.
+    _handler.reset();
+    _buf.p = _buf.e = _buf.ts = _buf.te = _buf.s;
+    _buf.is_end = false;
+    _buf.pending = 0;
+    _buf.bad_encoding = false;
+    _buf.reallocs = 0;
+    _lines.clear();
+    _root_ns._names.clear();
+    _scope_stack.clear();
+    _scope_stack.emplace_back(Scope::Type::BLOCK, 0, &_root_ns);
+    _prev_indent_level = -1;
+    _curr_indent_level = 0;
+    _indent_c = 0;
+    _read_state = ReadState::LINEBREAK;
+    _doc_ended = false;
+    _document = 0;
+    _stats = Stats();
+    _handler.enter(Scope::Type::BLOCK, 0);
+  }
+
+  Handler& handler() { return _handler; }
+  const Handler& handler() const { return _handler; }
+
+  SrcPos pos(size_t offset) const {
+    // Line and column of byte `offset` of the input read so far. Builds the line index on first
+    // use, so this costs time linear in the size of the input the first time it's called.
+    _lines.update(_buf.s, (size_t)(_buf.e - _buf.s));
+    return _lines.pos(offset);
+  }
+  SrcPos pos(const Expr* e) const { return pos(e->offset()); }
+  SrcPos pos() const { return pos((size_t)(_buf.p - _buf.s)); } // current position
+
+  size_t lineno() const { return pos().line; }
+  size_t colno() const { return pos().col; }
+  void set_multi_document(bool on) { _multi_document = on; }
+    // In multi-document mode a line "__END__" ends the current document rather than the input.
+    // parse() returns DOCUMENT after the document's results, then continues with the next
+    // document as if it were the start of input: indentation, line numbers and offsets start
+    // over, while buffers and interned strings are kept.
+  size_t document() const { return _document; }
+    // Index of the current document, counting from 0. Results returned before DOCUMENT belong
+    // to the document which it ends.
+
+  const Scope& top_scope() const { assert(!_scope_stack.empty()); return _scope_stack.back(); }
+  const Scope& scope_at(size_t n) const {
+    // nth scope from the top; 0 is the top
+    assert(n < _scope_stack.size());
+    return _scope_stack[_scope_stack.size() - 1 - n];
+  }
+
+  // -------------------------------------------
+  // BEGIN logging
+
+  struct SEndl {
+    SEndl(std::ostream& os) : _valid(true), _os(os) {}
+    SEndl(const SEndl& other) : _valid(true), _os(other._os) {
+      const_cast<SEndl&>(other)._valid = false; }
+    ~SEndl() { if (_valid) { _os << std::endl; } }
+    template <typename... Args>
+    SEndl& operator<<(Args&&... args) { pass( (_os << args)... ); return *this; }
+    // template <typename T> SEndl& operator<<(T& v) { _os << v; return *this; }
+    bool _valid;
+    std::ostream& _os;
+  };
+
+  SEndl dlog(std::ostream& os=std::cerr) {
+    Namespace* ns = current_ns();
+    return SEndl{
+      os << std::left << std::setw(25) << (ns ? ns->name() : "")
+         << std::setw((top_scope().indent_level()*2)+1) << ' ' };
+         // << std::setw((_scope_stack.size()*2)+1) << ' ' };
+  }
+
+  // Trace logging of scopes and tokens. Only built with SAT_DEBUG as it otherwise dominates the
+  // cost of parsing.
+  #if SAT_DEBUG
+    #define DLOG dlog()
+  #else
+    #define DLOG while (0) dlog()
+  #endif
+
+  // Charges the time until the end of the enclosing block to Profile::slot rather than to the
+  // current lexer state. Only built with SAT_PARSE_PROFILE.
+  #if SAT_PARSE_PROFILE
+    #define PROFILE_SECTION(slot) ProfileSection _profile_section(*this, Profile::slot)
+  #else
+    #define PROFILE_SECTION(slot) do {} while (0)
+  #endif
+
+  struct ELog {
+    ELog(std::ostream& os, ssize_t lineno, ssize_t column, const char* startp, const char* endp)
+      : _valid(true), _os(os), _lineno(lineno), _column(column), _startp(startp), _endp(endp) {}
+    ELog(const ELog& other)
+      : _valid(true), _os(other._os), _lineno(other._lineno), _column(other._column)
+      , _startp(other._startp), _endp(other._endp)
+    {
+      const_cast<ELog&>(other)._valid = false;
+    }
+    ~ELog() {
+      if (_valid) {
+        _os << std::dec;
+        if (_lineno || _column) {
+          _os << " at " << _lineno << ':' << _column;
+        }
+        _os << std::endl;
+        if (_startp) {
+          if (!_endp) { _endp = _startp; while (*_endp && *_endp != '\n') { ++_endp; } }
+          _os << "  " << std::string(_startp, size_t(_endp - _startp)) << std::endl
+              << "  " << std::right << std::setw(_column) << "^" << std::endl;
+        }
+      }
+    }
+    template <typename... Args>
+    ELog& operator<<(Args&&... args) { pass( (_os << args)... ); return *this; }
+    operator bool() const { return false; }
+    operator Status() const { return Status::ERROR; }
+
+    bool _valid;
+    std::ostream& _os;
+    ssize_t _lineno;
+    ssize_t _column;
+    const char* _startp;
+    const char* _endp;
+  };
+
+  static std::string hex_byte(u8 b) {
+    // "0x.." for error messages, without changing the number base of the stream
+    char buf[8];
+    snprintf(buf, sizeof(buf), "0x%02x", (unsigned)b);
+    return buf;
+  }
+
+  ELog report_error(
+    Error e,
+    const char* startp = (const char*)-1,
+    const char* endp = 0,
+    ssize_t line = -1,
+    ssize_t col = 0)
+  {
+    // set to start and end of current line
+    if (startp == (const char*)-1) {
+      // use current values
+      startp = _buf.s + _lines.line_start(lineno());
+      endp = _buf.p > startp ? _buf.p : startp;
+      while (endp != _buf.e && *endp != '\n') { ++endp; }
+    }
+    if (line == -1) {
+      SrcPos p = pos();
+      line = p.line;
+      col = p.col;
+    }
+    return ELog{std::cerr, line, col, startp, endp} << ErrorName(e) << "Error: ";
+  }
+
+  // END logging
+  // -------------------------------------------
+
+
+  std::string scope_path() {
+    std::string s;
+    int i = 0;
+    auto I = _scope_stack.cbegin();
+    auto E = _scope_stack.cend();
+    for (;I != E; ++I) {
+      if (i++) {
+        s.append(1, '/');
+        s.append("_");
+      } else s.append("@");
+    }
+    return s;
+  }
+
+  bool is_root_scope(const Scope& s) const {
+    return &s == &_scope_stack.front();
+  }
+
+  Namespace* current_ns() {
+    if (_scope_stack.empty()) return 0;
+    return _scope_stack.back().ns();
+  }
+
+  bool enter_scope(Scope::Type scope_type) {
+    PROFILE_SECTION(SCOPE);
+    Namespace* ns = current_ns();
+    _scope_stack.emplace_back(scope_type, _curr_indent_level, ns);
+    size_t offset = (size_t)(_buf.p - _buf.s);
+    if (_scope_stack.size() > _stats.max_scope_depth) {
+      _stats.max_scope_depth = _scope_stack.size();
+    }
+    DLOG << "-> " << Scope::type_name(scope_type)
+           << " at level " << _curr_indent_level;
+    return _handler.enter(scope_type, offset);
+  }
+
+
+  bool leave_scope(Scope::Type scope_type) {
+    PROFILE_SECTION(SCOPE);
+    DLOG << "<< leave " << Scope::type_name(scope_type) << " scope"
+           << " to level " << _curr_indent_level;
+    assert(!_scope_stack.empty());
+    
+    if (top_scope().type() != scope_type) {
+      // Error: Type mis-match
+      auto descr = [](Scope::Type scope_type) -> const char* {
+        switch (scope_type) {
+        case Scope::Type::LIST:         return "linebreak to same indentation level or ';'";
+        case Scope::Type::BLOCK:        return "block dentation";
+        case Scope::Type::INLINE_BLOCK: return "'}'";
+        case Scope::Type::GROUP:        return "')'";
+      }};
+      return report_error(Error::Indentation)
+        << "Unexpected " << descr(scope_type)
+        << " when expecting " << descr(top_scope().type()) << ".";
+    }
+
+    do {
+      if (!pop_scope()) return false;
+      if (scope_type != Scope::Type::BLOCK) return true;
+
+      // Now, consider the parent scope. Are we at the target indent level?
+      const Scope& scope = top_scope();
+
+      if (scope.type() == Scope::Type::GROUP) {
+        DLOG << "-- inline group";
+        return true;
+      }
+
+      if (_curr_indent_level > scope.indent_level()) {
+        // Fell below target -- misalinged indentation. Break to error case.
+        break;
+      } else if (_curr_indent_level == scope.indent_level()) {
+        // We are at the correct scope. Return with success.
+        return true;
+      }
+    } while (!_scope_stack.empty());
+
+    return report_error(Error::Indentation)
+      << "unindent does not match any outer indentation level";
+  }
+
+
+  bool pop_scope() {
+    assert(_scope_stack.size() > 1);
+    Scope::Type type = top_scope().type();
+    DLOG << "<- " << Scope::type_name(type)
+           << " at level " << top_scope().indent_level();
+    _scope_stack.pop_back();
+    return _handler.leave(type);
+  }
+
+  Stats stats() const {
+    Stats st = _stats;
+    st.bytes += (size_t)(_buf.p - _buf.s);
+    st.lines += lineno() - 1;
+    st.buf_reallocs = _buf.reallocs;
+    st.buf_high_water = _buf.size;
+    return st;
+  }
+
+  bool on_token(Token t) {
+    PROFILE_SECTION(TOKEN);
+    DLOG << "■ " << token_name(t)
+           << " \"" << std::string(_buf.ts, size_t(_buf.te-_buf.ts)) << "\"";
+    assert(!_scope_stack.empty());
+    ++_stats.tokens[(size_t)t];
+
+    size_t len = (size_t)(_buf.te - _buf.ts);
+    if (len > (size_t)0xffffffffu) {
+      return report_error(Error::Memory, "String too large");
+    }
+    return _handler.token(t, _buf.ts, len, (size_t)(_buf.ts - _buf.s));
+  }
+
+  #if SAT_PARSE_PROFILE
+  // --------------------------------------------------------------------
+  // Profiling. Time is charged to the current slot whenever the slot changes, and bytes to the
+  // current state whenever the state changes, so each costs a counter read per change.
+
+  struct ProfileSection {
+    ProfileSection(BasicParser& P, size_t slot) : P(P), prev(P._profile_slot) {
+      if (P._profile_active) {
+        P._profile_charge();
+        P._profile_slot = slot;
+        P._stats.profile.entries[slot]++;
+      }
+    }
+    ~ProfileSection() {
+      if (P._profile_active) {
+        P._profile_charge();
+        P._profile_slot = prev;
+      }
+    }
+    BasicParser& P;
+    size_t       prev;
+  };
+
+  void _profile_charge() {
+    u64 t = Profile::now();
+    _stats.profile.cycles[_profile_slot] += t - _profile_t;
+    _profile_t = t;
+  }
+
+  void _profile_charge_state() {
+    _profile_charge();
+    _stats.profile.bytes[(size_t)_read_state] += (u64)(_buf.p - _profile_p);
+    _profile_p = _buf.p;
+  }
+
+  void _profile_switch(ReadState next) {
+    _profile_charge_state();
+    _profile_slot = (size_t)next;
+    _stats.profile.entries[(size_t)next]++;
+  }
+
+  void _profile_begin() {
+    _profile_active = true;
+    _profile_slot = (size_t)_read_state;
+    _profile_p = _buf.p;
+    _profile_t = Profile::now();
+  }
+
+  void _profile_end() {
+    _profile_charge_state();
+    _profile_active = false;
+  }
+  #endif
+
+  // --------------------------------------------------------------------
+  // Reading
+
+  struct Buf {
+    bool  is_end = false; // true if there will be no more buffer fills
+
+    char* ts = 0;    // current/last token start in buffer
+    char* te = 0;    // current/last token end in buffer
+
+    size_t size = 0; // size of memory region pointed to by `s`
+    size_t reallocs = 0; // number of times `s` has been grown
+    char* s = 0;     // buffer start
+    char* p = 0;     // current buffer position
+    char* e = 0;     // end of data in buffer
+
+    size_t pending = 0; // bytes after `e` of a UTF-8 sequence which the last fill cut off
+    bool bad_encoding = false; // the byte at `e` starts an ill-formed UTF-8 sequence
+
+    char* ensure_fillable(size_t& bytes_available, size_t min_bytes=512) {
+      // Returns where to fill to, which is after any pending bytes
+      bytes_available = size - (size_t)(e - s) - pending;
+      if (bytes_available < min_bytes) {
+        // Grow by a fraction of the current size rather than by a constant, so that the total
+        // cost of realloc moving the buffer stays linear in the size of the input.
+        size_t page_mask = (size_t)MEM_PAGE_SIZE - 1;
+        size_t growth = SAT_MAX((size_t)MEM_PAGE_SIZE, (size / 4) & ~page_mask);
+        growth = SAT_MAX(growth, (min_bytes - bytes_available + page_mask) & ~page_mask);
+        char* s2 = (char*)alloc::realloc(alloc::Tag::BUF, (void*)s, size, size + growth);
+        if (!s2) { return 0; } // errno ENOMEM
+        size += growth;
+        bytes_available += growth;
+        ++reallocs;
+        if (s2 != s) {
+          // reallocate pointers if we were moved to a different region
+          ts     = s2 + (ts - s);
+          te     = s2 + (te - s);
+          p      = s2 + (p - s);
+          e      = s2 + (e - s);
+        }
+        s = s2;
+      }
+      return e + pending;
+    }
+    ~Buf() { if (s) alloc::free(alloc::Tag::BUF, s, size); }
+  };
+
+
+  bool leave_to_root() {
+    // Leave the scopes which are open at the end of input (or of a document)
+    assert(!_scope_stack.empty());
+    if (!is_root_scope(top_scope())) {
+      // Special case: The source ends with an indented block. Leave to our root block.
+      _curr_indent_level = 0;
+      if (_prev_indent_level != -1) {
+        // There was at least one thing in the input, which means there's a line scope we must
+        // leave before leaving the root block scope.
+        if (!leave_scope(Scope::Type::LIST)) {
+          return false;
+        }
+      } // else: Empty input
+    }
+    return true;
+  }
+
+  void start_document() {
+    // Start over with the next document in the buffer. Bytes of the previous documents are
+    // moved out of the way, so that offsets and the line index start from 0 again.
+    _stats.bytes += (size_t)(_buf.p - _buf.s);
+    _stats.lines += lineno() - 1;
+    _stats.documents++;
+    size_t rest = (size_t)(_buf.e - _buf.p);
+    memmove(_buf.s, _buf.p, rest + _buf.pending);
+    _buf.p = _buf.ts = _buf.te = _buf.s;
+    _buf.e = _buf.s + rest;
+    _lines.clear();
+    _prev_indent_level = -1;
+    _curr_indent_level = 0;
+    _indent_c = 0;
+    _read_state = ReadState::LINEBREAK;
+    _doc_ended = false;
+    ++_document;
+  }
+
+  char* get_read_buf(size_t& bytes_available) {
+    assert(_buf.p == _buf.e); // or previous call to parse() failed with an error
+    return _buf.ensure_fillable(bytes_available);
+  }
+
+  char* get_read_buf(size_t& bytes_available, size_t min_bytes) {
+    // Like get_read_buf but with room for at least `min_bytes`, for reading in large blocks
+    assert(_buf.p == _buf.e);
+    return _buf.ensure_fillable(bytes_available, SAT_MAX(min_bytes, (size_t)1));
+  }
+
+
+  void fill(char* p, size_t len, bool is_end) {
+    assert(p >= &_buf.s[0] && p < (&_buf.s[0])+_buf.size);
+      // or this is a pointer to something else
+    assert(p == _buf.e + _buf.pending); // or this is not what get_read_buf returned
+    // Validate the new bytes, and the pending ones before them. The lexer only reads up to the
+    // end of complete sequences, or to the first bad byte, which it reports as an error.
+    bool ok;
+    char* end = p + len;
+    _buf.e = (char*)utf8::validate(_buf.e, end, is_end, ok);
+    _buf.pending = ok ? (size_t)(end - _buf.e) : 0;
+    _buf.bad_encoding = !ok;
+    _buf.is_end = is_end;
+  }
+  
+
+  Status parse() {
+    //
+    // Input bytes:    foo ba | r baz lolc | at\n
+    //                 0....5   0........9   0.2
+    //
+    // Parsed tokens:  foo, bar, baz, lolcat, \n
+    //   foo -> foo
+    //   ba...
+    //   r -> bar
+    //   baz -> baz
+    //   lolc...
+    //   at -> lolcat
+    //
+    // The lexer is a DFA over byte classes (see lex.hh). Each byte is classified with
+    // lex::kClasses and the action for the current state is looked up in `row`, a row of
+    // lex::kActions. Actions are labels jumped to directly when the compiler supports computed
+    // goto, or cases of a switch otherwise. All state lives in the Parser, so that we can return
+    // MORE at any byte and resume on the next call.
+    // -------------------------------------------
+    #define B /* current byte */ ((unsigned char)*_buf.p)
+    #define Bn(n) /* nth byte */ ((unsigned char)(_buf.p < _buf.e-(n) ? *(_buf.p+(n)) : 0))
+    #define CONSUME ++_buf.p;
+    #define SET_TOK_START _buf.ts = _buf.p;
+    #define SET_TOK_END   _buf.te = _buf.p;
+
+    #if SAT_LEX_COMPUTED_GOTO
+      static void* const action_labels[] = {
+        #define F(n) &&action_##n,
+        SAT_LEX_ACTIONS
+        #undef F
+      };
+      #define ACTION(n) action_##n:
+      #define DISPATCH { \
+        if (_buf.p == _buf.e) goto end_of_buf; \
+        goto *action_labels[(size_t)row[(size_t)lex::kClasses[B]]]; \
+      }
+      #define GOTO_ACTION(n) goto action_##n; // run action n for the current byte
+    #else
+      #define ACTION(n) case lex::Action::n:
+      #define DISPATCH goto dispatch;
+      #define GOTO_ACTION(n) { action = lex::Action::n; goto dispatch_action; }
+    #endif
+
+    // Like DISPATCH but first returns any results yielded by leaving a scope
+    #define DISPATCH_ROOT { \
+      if (_handler.has_results()) return Status::RESULT; \
+      DISPATCH \
+    }
+
+    #if SAT_PARSE_PROFILE
+      #define PROFILE_SWITCH(state) _profile_switch(state);
+    #else
+      #define PROFILE_SWITCH(state)
+    #endif
+    #define SWITCH_TO(state_name) { \
+      /*dprintf(">> %s --> " #state_name, read_state_name(_read_state));*/ \
+      PROFILE_SWITCH(ReadState::state_name) \
+      _read_state = ReadState::state_name; \
+      row = lex::kActions.row(_read_state); \
+    }
+    #define CONSUME_AND_CONTINUE_AS(state_name) { \
+      CONSUME \
+      SWITCH_TO(state_name) \
+      DISPATCH \
+    }
+    #define TRANSITION_TO(state_name) { \
+      SET_TOK_START \
+      SWITCH_TO(state_name) \
+      DISPATCH \
+    }
+    #define TRANSITION_TO_ROOT { \
+      SET_TOK_START \
+      SWITCH_TO(ROOT) \
+      DISPATCH_ROOT \
+    }
+    #define TRANSITION_TO_AND_CONSUME(state_name) { \
+      SET_TOK_START \
+      CONSUME \
+      SWITCH_TO(state_name) \
+      DISPATCH \
+    }
+    #define CONSUME_AND_TRANSITION_TO(state_name) { \
+      CONSUME \
+      SET_TOK_START \
+      SWITCH_TO(state_name) \
+      DISPATCH \
+    }
+
+    #define ACT_ENTER_LINEBREAK { \
+      _curr_indent_level = 0; \
+    }
+
+    #define ACT_ON_SPACE(c) { \
+      if (_indent_c == 0) { \
+        _indent_c = (c); \
+      } else if (_indent_c != (c)) { \
+        return report_error(Error::Indentation) \
+          << "Mixed line indentation"; \
+      } \
+      ++_curr_indent_level; \
+    }
+
+    #define LEAVE_BLOCK_SCOPE \
+      if (!leave_scope(Scope::Type::LIST) || !leave_scope(Scope::Type::BLOCK)) { \
+        return Status::ERROR; \
+      }
+
+    #define LEAVE_BLOCK_SCOPE_FROM_ENDPAREN \
+      if (_scope_stack.size() < 3) { \
+        return report_error(Error::Syntax) << "Unexpected ')'"; \
+      } \
+      _curr_indent_level = scope_at(2).indent_level(); \
+      LEAVE_BLOCK_SCOPE \
+      assert(_scope_stack.size() > 1); \
+      assert(scope_at(0).type() == Scope::Type::LIST); \
+      assert(scope_at(1).type() == Scope::Type::GROUP); \
+      _prev_indent_level = _curr_indent_level;
+
+    if (_doc_ended) {
+      if (_handler.has_results()) {
+        return Status::RESULT;
+      }
+      start_document();
+      return Status::DOCUMENT;
+    }
+
+    if (_read_state == ReadState::ROOT && _handler.has_results()) {
+      return Status::RESULT;
+    }
+
+    #if SAT_PARSE_PROFILE
+    _profile_begin();
+    defer [&]{ _profile_end(); };
+    #endif
+
+    const lex::Action* row = lex::kActions.row(_read_state);
+    #if !SAT_LEX_COMPUTED_GOTO
+    lex::Action action;
+    #endif
+    DISPATCH
+
+    #if !SAT_LEX_COMPUTED_GOTO
+    dispatch:
+    if (_buf.p == _buf.e) goto end_of_buf;
+    action = row[(size_t)lex::kClasses[B]];
+    dispatch_action:
+    switch (action) {
+    #endif
+
+    // ---------------------------------------------------------------------------
+    ACTION(SKIP) {
+      // Consume a run of bytes which don't change state, like the bytes of a name or comment
+      // or insignificant whitespace.
+      char* p = _buf.p + 1;
+      while (p != _buf.e && row[(size_t)lex::kClasses[(u8)*p]] == lex::Action::SKIP) {
+        ++p;
+      }
+      _buf.p = p;
+      DISPATCH
+    }
+
+    // ---------------------------------------------------------------------------
+    // ROOT
+
+    ACTION(ROOT_NL) {
+      ACT_ENTER_LINEBREAK
+      CONSUME_AND_TRANSITION_TO(LINEBREAK)
+    }
+
+    ACTION(ROOT_COMMENT) {
+      CONSUME_AND_TRANSITION_TO(COMMENT)
+    }
+
+    ACTION(ROOT_LPAREN) {
+      if (!enter_scope(Scope::Type::GROUP) || !enter_scope(Scope::Type::LIST)) {
+        return Status::ERROR;
+      }
+      CONSUME
+      DISPATCH
+    }
+
+    ACTION(ROOT_RPAREN) {
+      assert(_scope_stack.size() > 1);
+      if (scope_at(1).type() == Scope::Type::BLOCK) {
+        // Special case: Leaving a block scope inside a group w/o a trailing linebreak
+        //   a
+        //     (b
+        //      c)
+        //       ^-- We are here and should leave to...
+        //     ^-- ...here
+        LEAVE_BLOCK_SCOPE_FROM_ENDPAREN
+      }
+      if (!leave_scope(Scope::Type::LIST) || !leave_scope(Scope::Type::GROUP)) {
+        return Status::ERROR;
+      }
+      CONSUME
+      DISPATCH_ROOT
+    }
+
+    ACTION(ROOT_LBRACE) {
+      if (!enter_scope(Scope::Type::INLINE_BLOCK) || !enter_scope(Scope::Type::LIST)) {
+        return Status::ERROR;
+      }
+      CONSUME
+      DISPATCH
+    }
+
+    ACTION(ROOT_RBRACE) {
+      if (!leave_scope(Scope::Type::LIST) || !leave_scope(Scope::Type::INLINE_BLOCK)) {
+        return Status::ERROR;
+      }
+      CONSUME
+      DISPATCH_ROOT
+    }
+
+    ACTION(ROOT_SEMI) {
+      if (!leave_scope(Scope::Type::LIST) || !enter_scope(Scope::Type::LIST)) {
+        return Status::ERROR;
+      }
+      CONSUME
+      DISPATCH_ROOT
+    }
+
+    ACTION(ROOT_NAME) {
+      TRANSITION_TO_AND_CONSUME(NAME)
+    }
+
+    ACTION(ROOT_BAD) {
+      return report_error(Error::Parse)
+        << "Unexpected input '" << B << "' " << hex_byte(B);
+    }
+
+    ACTION(ROOT_USPACE) {
+      u32 c;
+      if (size_t n = utf8::space_len(_buf.p, _buf.e, c)) {
+        _buf.p += n;
+        DISPATCH
+      }
+      GOTO_ACTION(ROOT_NAME)
+    }
+
+    // ---------------------------------------------------------------------------
+    // NAME, ASSIGNMENT and QUALNAME
+
+    ACTION(NAME_END) {
+      // ! "x"
+      SET_TOK_END
+      if (find_keyword(_buf.ts, (size_t)(_buf.te - _buf.ts)) == Keyword::END) {
+        if (_multi_document) {
+          if (!leave_to_root()) {
+            return Status::ERROR;
+          }
+          if (!is_root_scope(top_scope())) {
+            return report_error(Error::Parse) << "Unexpected end of document";
+          }
+          if (B == '\n') {
+            CONSUME // the next document starts on the line after "__END__"
+          }
+          _doc_ended = true;
+          if (_handler.has_results()) {
+            return Status::RESULT;
+          }
+          start_document();
+          return Status::DOCUMENT;
+        }
+        _buf.is_end = true;
+        _buf.e = _buf.p;
+        _buf.pending = 0;
+        _buf.bad_encoding = false; // what follows "__END__" is not read
+        goto end_of_buf;
+      }
+      if (!on_token(Token::NAME)) return Status::ERROR;
+      TRANSITION_TO_ROOT
+    }
+
+    ACTION(ASSIGNMENT_END) {
+      // ! ("x:" | "x:y:")
+      SET_TOK_END
+      if (!on_token(Token::ASSIGNMENT)) return Status::ERROR;
+      TRANSITION_TO_ROOT
+    }
+
+    ACTION(QUALNAME_END) {
+      // ! "x:y"
+      SET_TOK_END
+      if (!on_token(Token::QUALNAME)) return Status::ERROR;
+      TRANSITION_TO_ROOT
+    }
+
+    ACTION(TO_ASSIGNMENT) {
+      // "x:" or "x:y:"
+      // not NAME "x", but ASSIGNMENT "x:" and possibly QUALNAME "x:y"
+      CONSUME_AND_CONTINUE_AS(ASSIGNMENT)
+    }
+
+    ACTION(TO_QUALNAME) {
+      // "x:y"
+      CONSUME_AND_CONTINUE_AS(QUALNAME)
+    }
+
+    ACTION(EXTRA_COLON) {
+      // "x::"
+      return report_error(Error::Syntax) << "Unexpected extra ':'";
+    }
+
+    // A non-ASCII space ends a name, like ' '. Other characters starting with the same byte are
+    // part of it.
+
+    ACTION(NAME_USPACE) {
+      if (utf8::is_space(_buf.p, _buf.e)) GOTO_ACTION(NAME_END)
+      CONSUME
+      DISPATCH
+    }
+
+    ACTION(QUALNAME_USPACE) {
+      if (utf8::is_space(_buf.p, _buf.e)) GOTO_ACTION(QUALNAME_END)
+      CONSUME
+      DISPATCH
+    }
+
+    ACTION(ASSIGNMENT_USPACE) {
+      if (utf8::is_space(_buf.p, _buf.e)) GOTO_ACTION(ASSIGNMENT_END)
+      GOTO_ACTION(TO_QUALNAME)
+    }
+
+    // ---------------------------------------------------------------------------
+    // LINEBREAK
+
+    ACTION(LINEBREAK_NL) {
+      ACT_ENTER_LINEBREAK
+      CONSUME
+      DISPATCH
+    }
+
+    ACTION(LINEBREAK_SPACE) {
+      ACT_ON_SPACE(B)
+      CONSUME
+      DISPATCH
+    }
+
+    ACTION(LINEBREAK_USPACE) {
+      u32 c;
+      if (size_t n = utf8::space_len(_buf.p, _buf.e, c)) {
+        ACT_ON_SPACE(c)
+        _buf.p += n;
+        DISPATCH
+      }
+      GOTO_ACTION(LINEBREAK_LEAVE)
+    }
+
+    ACTION(LINEBREAK_RPAREN) {
+      LEAVE_BLOCK_SCOPE_FROM_ENDPAREN
+      TRANSITION_TO_ROOT
+    }
+
+    ACTION(LINEBREAK_LEAVE) {
+      SET_TOK_END
+      if (_prev_indent_level == -1) {
+        // Special case: We just passed inital whitespace in input buffer
+        // dlog() << "Passed initial whitespace in input buffer";
+        if (_curr_indent_level != 0) {
+          // First non-comment line of input must be at level 0
+          return report_error(Error::Indentation) << "Unexpected indent";
+        }
+        if (!enter_scope(Scope::Type::LIST)) {
+          return Status::ERROR;
+        }
+
+      } else if (_prev_indent_level < _curr_indent_level) {
+        // Indentation increased
+        //   |a
+        //   |  b
+        //   |  ^-- we are here
+        //  ...
+        if (!enter_scope(Scope::Type::BLOCK) || !enter_scope(Scope::Type::LIST)) {
+          return Status::ERROR;
+        }
+
+      } else if (_prev_indent_level > _curr_indent_level) {
+        // Indentation decreased
+        //   |a
+        //   |  b
+        //   |c
+        //   |^-- we are here
+        //  ...
+        LEAVE_BLOCK_SCOPE
+        if (!leave_scope(Scope::Type::LIST) || !enter_scope(Scope::Type::LIST)) {
+          return Status::ERROR;
+        }
+
+      } else {
+        // newline to same indentation level means "new line scope"
+        // if (Bn(1) != '\\') ... // <- TODO: "A\n\B" == "A B"
+        if (!leave_scope(Scope::Type::LIST) || !enter_scope(Scope::Type::LIST)) {
+          return Status::ERROR;
+        }
+      }
+
+      _prev_indent_level = _curr_indent_level;
+      if (_curr_indent_level > _stats.max_indent_level) {
+        _stats.max_indent_level = _curr_indent_level;
+      }
+      TRANSITION_TO_ROOT
+    }
+
+    // ---------------------------------------------------------------------------
+    // COMMENT
+
+    ACTION(COMMENT_END) {
+      SET_TOK_END
+      if (!on_token(Token::COMMENT)) return Status::ERROR;
+      TRANSITION_TO_ROOT
+    }
+
+    // ---------------------------------------------------------------------------
+    #if !SAT_LEX_COMPUTED_GOTO
+    } // switch (action)
+    #endif
+
+    end_of_buf:
+    if (_buf.bad_encoding) {
+      return report_error(Error::Encoding)
+        << "Invalid UTF-8 byte " << hex_byte((u8)*_buf.e);
+    }
+    if (_buf.is_end) {
+      // We have reached the end of input
+      if (!leave_to_root()) {
+        return Status::ERROR;
+      }
+      if (!is_root_scope(top_scope())) {
+        report_error(Error::Parse) << "Unexpected end of input"; // TODO: Work on this one
+      }
+      // Note: Calling end_list when the scope is empty has no effect, so it's safe to call this
+      // multiple times, i.e. if the caller invokes `parse()` again after it returns `DONE`.
+      return _handler.has_results() ? Status::RESULT : Status::DONE;
+    }
+
+    return _handler.has_results() ? Status::RESULT : Status::MORE;
+
+    #undef B
+    #undef Bn
+    #undef CONSUME
+    #undef SET_TOK_START
+    #undef SET_TOK_END
+    #undef ACTION
+    #undef DISPATCH
+    #undef DISPATCH_ROOT
+    #undef GOTO_ACTION
+    #undef PROFILE_SWITCH
+    #undef SWITCH_TO
+    #undef CONSUME_AND_CONTINUE_AS
+    #undef TRANSITION_TO
+    #undef TRANSITION_TO_ROOT
+    #undef TRANSITION_TO_AND_CONSUME
+    #undef CONSUME_AND_TRANSITION_TO
+    #undef ACT_ENTER_LINEBREAK
+    #undef ACT_ON_SPACE
+    #undef LEAVE_BLOCK_SCOPE
+    #undef LEAVE_BLOCK_SCOPE_FROM_ENDPAREN
+  }
+
+
+  typedef std::vector<Scope,alloc::Allocator<Scope,alloc::Tag::PARSER>> ScopeStack;
+
+  Namespace           _root_ns;
+  Buf                 _buf;
+  int                 _prev_indent_level = -1;  // previous line indentation level
+  int                 _curr_indent_level = 0;  // current line indentation level
+  u32                 _indent_c = 0;            // code point of line indentation
+  ScopeStack          _scope_stack;             // innermost scope at the back
+  mutable LineIndex   _lines;                   // built on demand by pos()
+  ReadState           _read_state = ReadState::LINEBREAK;
+  bool                _multi_document = false;
+  bool                _doc_ended = false;       // results of the ended document are pending
+  size_t              _document = 0;            // index of the current document
+  Stats               _stats;                   // .bytes and .lines count previous documents
+  Handler             _handler;
+  #if SAT_PARSE_PROFILE
+  bool                _profile_active = false;  // inside parse()
+  size_t              _profile_slot = 0;        // Profile slot being charged
+  u64                 _profile_t = 0;           // when _profile_slot was last charged
+  const char*         _profile_p = 0;           // _buf.p when the state was last charged
+  #endif
+};
+
+
+struct Parser : BasicParser<TreeBuilder> {
+  // Parser which builds expression trees, available from `next_result()`
+
+  Parser(Str ns_qname, Namespace* parent_ns=0) : BasicParser(std::move(ns_qname)) {}
+
+  Expr* next_result() { return _handler.next_result(); }
+
+  void set_hashcons(HashCons* hc) { _handler.hashcons = hc; }
+    // Share the contents of identical lists in results through `hc`, which must outlive the
+    // parser. Null turns it off.
+
+  Stats stats() const {
+    Stats st = BasicParser::stats();
+    st.results = _handler.results();
+    return st;
+  }
+};
+
+} // namespace sat
@@ -0,0 +1,362 @@
+// Persistent hash map keyed by interned strings
+//
+// A hash array mapped trie. Copying a map is O(1) as copies share all of their nodes, and
+// changing a map copies only the nodes on the path to the changed key, so set() and erase() are
+// O(log32 n) in both time and memory no matter how many other maps share structure with it.
+// Nodes are immutable once created and reference counted; a node is freed when the last map
+// that uses it lets go of it.
+//
+// Like SymMap, keys must be interned; they are hashed with the hash stored in the string and
+// compared by pointer. The map holds a reference to each key.
+//
+// Example:
+//
+//   PMap<Expr*> std_io;
+//   std_io.set(strings.get("fread"), e1);
+//   PMap<Expr*> user = std_io; // shares all of std_io
+//   user.set(strings.get("x"), e2); // copies one path; std_io is unchanged
+//
+#pragma once
+#include "common.h"
+#include "str.hh"
+#include "alloc.hh"
+#include <utility>
+
+namespace sat {
+
+template <typename V, alloc::Tag tag = alloc::Tag::MAP>
+struct PMap {
+  typedef Str::Imp* Key;
+
+  PMap() {}
+  PMap(const PMap& other) : _root{other._root}, _size{other._size} { _retain(_root); }
+  PMap(PMap&& other) : _root{other._root}, _size{other._size} {
+    other._root = 0; other._size = 0; }
+  ~PMap() { _release(_root); }
+
+  PMap& operator=(const PMap& other) {
+    _retain(other._root);
+    _release(_root);
+    _root = other._root;
+    _size = other._size;
+    return *this;
+  }
+  PMap& operator=(PMap&& other) {
+    if (this != &other) {
+      _release(_root);
+      _root = other._root; other._root = 0;
+      _size = other._size; other._size = 0;
+    }
+    return *this;
+  }
+
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  bool shares_root(const PMap& other) const { return _root == other._root; }
+    // True if this and `other` are the same version of a map, i.e. one is a copy of the other
+    // and neither has changed since
+
+  const V* find(const Str::Imp* k) const {
+    if (!k || !_root) { return 0; }
+    u32 h = k->_hash;
+    const Node* n = _root;
+    for (unsigned shift = 0; shift < kHashBits; shift += kBits) {
+      u32 bit = _bit(h, shift);
+      if (n->datamap & bit) {
+        const Leaf& l = n->leaves()[_index(n->datamap, bit)];
+        return l.key == k ? &l.value : 0;
+      }
+      if (!(n->nodemap & bit)) {
+        return 0;
+      }
+      n = n->children()[_index(n->nodemap, bit)];
+    }
+    for (u32 i = 0; i < n->nleaves; i++) { // collision node
+      if (n->leaves()[i].key == k) { return &n->leaves()[i].value; }
+    }
+    return 0;
+  }
+  const V* find(const Str& k) const { return find(k.self); }
+
+  bool set(Key k, V v) {
+    // Associate `k` with `v`. Returns true if `k` was added, false if it was already in the map.
+    assert(k != 0);
+    bool added = !_root;
+    Node* root = _root ? _set(_root, k, v, 0, added) : _leaf_node(k, v);
+    _release(_root);
+    _root = root;
+    _size += added;
+    return added;
+  }
+  bool set(const Str& k, V v) { return set(k.self, std::move(v)); }
+
+  bool erase(const Str::Imp* k) {
+    if (!k || !_root) { return false; }
+    Node* root = _erase(_root, k, 0);
+    if (root == _root) {
+      _release(root); // not found
+      return false;
+    }
+    _release(_root);
+    _root = root;
+    --_size;
+    return true;
+  }
+  bool erase(const Str& k) { return erase(k.self); }
+
+  void clear() {
+    _release(_root);
+    _root = 0;
+    _size = 0;
+  }
+
+  template <typename F> void foreach(F f) const {
+    // Calls f(Key, const V&) for each entry, in no particular order
+    if (_root) { _foreach(_root, f); }
+  }
+
+  // ---------------------------------------------------------------------------------------------
+
+  static constexpr unsigned kBits = 5;      // hash bits consumed per level
+  static constexpr unsigned kHashBits = 32; // Str::Imp::_hash
+    // Keys whose hashes are equal end up together in a collision node at depth 7
+
+  struct Leaf {
+    Key key;
+    V   value;
+  };
+
+  struct Node {
+    // Followed in memory by `nleaves` Leafs and then popcount(nodemap) child pointers
+    SAT_REF_COUNT_MEMBER = SAT_REF_COUNT_INIT;
+    u32 datamap = 0; // hash fragments which have a leaf in this node
+    u32 nodemap = 0; // hash fragments which have a child node
+    u32 nleaves = 0;
+
+    Leaf* leaves() { return (Leaf*)(this + 1); }
+    const Leaf* leaves() const { return (const Leaf*)(this + 1); }
+    Node** children() { return (Node**)((char*)leaves() + _leaves_size(nleaves)); }
+    Node* const* children() const {
+      return (Node* const*)((const char*)leaves() + _leaves_size(nleaves)); }
+    u32 nchildren() const { return _popcount(nodemap); }
+  };
+
+  static size_t _leaves_size(u32 nleaves) {
+    // Size of the leaves of a node, rounded up to the alignment of the child pointers
+    return (sizeof(Leaf) * nleaves + sizeof(Node*) - 1) & ~(sizeof(Node*) - 1);
+  }
+  static size_t _node_size(u32 nleaves, u32 nchildren) {
+    return sizeof(Node) + _leaves_size(nleaves) + sizeof(Node*) * nchildren;
+  }
+
+  static u32 _popcount(u32 v) {
+    #if defined(__POPCNT__)
+    return (u32)__builtin_popcount(v);
+    #else
+    // Without a popcnt instruction __builtin_popcount may become a call into the runtime
+    v = v - ((v >> 1) & 0x55555555u);
+    v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+    return (((v + (v >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24;
+    #endif
+  }
+  static u32 _bit(u32 h, unsigned shift) { return 1u << ((h >> shift) & 31); }
+  static u32 _index(u32 bitmap, u32 bit) { return _popcount(bitmap & (bit - 1)); }
+
+  static Node* _alloc(u32 datamap, u32 nodemap, u32 nleaves) {
+    void* p = alloc::malloc(tag, _node_size(nleaves, _popcount(nodemap)));
+    if (!p) { throw std::bad_alloc(); }
+    Node* n = new (p) Node();
+    n->datamap = datamap;
+    n->nodemap = nodemap;
+    n->nleaves = nleaves;
+    return n;
+  }
+
+  static void _put_leaf(Node* n, u32 i, Key k, const V& v) {
+    Str::__retain(k);
+    new (&n->leaves()[i]) Leaf{k, v};
+  }
+
+  static void _put_child(Node* n, u32 i, Node* c) {
+    // `c` is retained by the caller
+    n->children()[i] = c;
+  }
+
+  static void _retain(Node* n) {
+    if (n) { sat_atomic_add_fetch((i32*)&n->__refcount, 1); }
+  }
+
+  static void _release(Node* n) {
+    if (!n || sat_atomic_sub_fetch(&n->__refcount, 1) != 0) { return; }
+    for (u32 i = 0; i < n->nleaves; i++) {
+      Str::__release(n->leaves()[i].key);
+      n->leaves()[i].~Leaf();
+    }
+    u32 nc = n->nchildren();
+    for (u32 i = 0; i < nc; i++) { _release(n->children()[i]); }
+    size_t size = _node_size(n->nleaves, nc);
+    n->~Node();
+    alloc::free(tag, (void*)n, size);
+  }
+
+  static Node* _copy(const Node* n, u32 datamap, u32 nodemap,
+                     u32 skip_leaf, u32 skip_child, u32 insert_leaf, u32 insert_child,
+                     Key k, const V* v, Node* child)
+  {
+    // Copy of `n` with the new bitmaps. The leaf at index `skip_leaf` and the child at
+    // `skip_child` are left out (~0u for none). `k`,`v` is inserted at leaf index `insert_leaf`
+    // and `child` at child index `insert_child` (~0u for none).
+    u32 nleaves = _popcount(datamap);
+    Node* c = _alloc(datamap, nodemap, nleaves);
+    for (u32 i = 0, j = 0; j < nleaves; j++) {
+      if (j == insert_leaf) { _put_leaf(c, j, k, *v); continue; }
+      if (i == skip_leaf) { i++; }
+      _put_leaf(c, j, n->leaves()[i].key, n->leaves()[i].value);
+      i++;
+    }
+    u32 nc = c->nchildren();
+    for (u32 i = 0, j = 0; j < nc; j++) {
+      if (j == insert_child) { _put_child(c, j, child); continue; }
+      if (i == skip_child) { i++; }
+      Node* cc = n->children()[i++];
+      _retain(cc);
+      _put_child(c, j, cc);
+    }
+    return c;
+  }
+
+  static Node* _leaf_node(Key k, const V& v) {
+    // Root node for a map with just one entry
+    Node* n = _alloc(_bit(k->_hash, 0), 0, 1);
+    _put_leaf(n, 0, k, v);
+    return n;
+  }
+
+  static Node* _merge(Key k1, const V& v1, Key k2, const V& v2, unsigned shift) {
+    // Node at `shift` holding two leaves with different keys
+    u32 h1 = k1->_hash, h2 = k2->_hash;
+    if (shift >= kHashBits) {
+      Node* n = _alloc(0, 0, 2);
+      _put_leaf(n, 0, k1, v1);
+      _put_leaf(n, 1, k2, v2);
+      return n;
+    }
+    u32 b1 = _bit(h1, shift), b2 = _bit(h2, shift);
+    if (b1 == b2) {
+      Node* n = _alloc(0, b1, 0);
+      _put_child(n, 0, _merge(k1, v1, k2, v2, shift + kBits));
+      return n;
+    }
+    Node* n = _alloc(b1 | b2, 0, 2);
+    bool first = b1 < b2;
+    _put_leaf(n, first ? 0 : 1, k1, v1);
+    _put_leaf(n, first ? 1 : 0, k2, v2);
+    return n;
+  }
+
+  static Node* _set(const Node* n, Key k, const V& v, unsigned shift, bool& added) {
+    // Copy of `n` with `k` set to `v`
+    if (shift >= kHashBits) {
+      // Collision node; leaves are unordered
+      u32 i = 0;
+      while (i < n->nleaves && n->leaves()[i].key != k) { i++; }
+      added = (i == n->nleaves);
+      Node* c = _alloc(0, 0, n->nleaves + added);
+      for (u32 j = 0; j < n->nleaves; j++) {
+        if (j == i) { _put_leaf(c, j, k, v); }
+        else        { _put_leaf(c, j, n->leaves()[j].key, n->leaves()[j].value); }
+      }
+      if (added) { _put_leaf(c, i, k, v); }
+      return c;
+    }
+    u32 bit = _bit(k->_hash, shift);
+    if (n->datamap & bit) {
+      u32 i = _index(n->datamap, bit);
+      const Leaf& l = n->leaves()[i];
+      if (l.key == k) {
+        return _copy(n, n->datamap, n->nodemap, i, ~0u, i, ~0u, k, &v, 0);
+      }
+      // Move the existing leaf and the new one down into a new child node
+      added = true;
+      Node* child = _merge(l.key, l.value, k, v, shift + kBits);
+      u32 nodemap = n->nodemap | bit;
+      return _copy(n, n->datamap & ~bit, nodemap, i, ~0u, ~0u, _index(nodemap, bit),
+                   0, 0, child);
+    }
+    if (n->nodemap & bit) {
+      u32 i = _index(n->nodemap, bit);
+      Node* child = _set(n->children()[i], k, v, shift + kBits, added);
+      return _copy(n, n->datamap, n->nodemap, ~0u, i, ~0u, i, 0, 0, child);
+    }
+    added = true;
+    u32 datamap = n->datamap | bit;
+    return _copy(n, datamap, n->nodemap, ~0u, ~0u, _index(datamap, bit), ~0u, k, &v, 0);
+  }
+
+  static Node* _erase(Node* n, const Str::Imp* k, unsigned shift) {
+    // Copy of `n` without `k`; null if that leaves it empty. Returns `n` (retained) if `k` is
+    // not in the map.
+    if (shift >= kHashBits) {
+      for (u32 i = 0; i < n->nleaves; i++) {
+        if (n->leaves()[i].key == k) {
+          if (n->nleaves == 1) { return 0; }
+          Node* c = _alloc(0, 0, n->nleaves - 1);
+          for (u32 j = 0, o = 0; j < n->nleaves; j++) {
+            if (j != i) { _put_leaf(c, o++, n->leaves()[j].key, n->leaves()[j].value); }
+          }
+          return c;
+        }
+      }
+      _retain(n);
+      return n;
+    }
+    u32 bit = _bit(k->_hash, shift);
+    if (n->datamap & bit) {
+      u32 i = _index(n->datamap, bit);
+      if (n->leaves()[i].key != k) {
+        _retain(n);
+        return n;
+      }
+      if (n->nleaves == 1 && n->nodemap == 0) {
+        return 0;
+      }
+      return _copy(n, n->datamap & ~bit, n->nodemap, i, ~0u, ~0u, ~0u, 0, 0, 0);
+    }
+    if (!(n->nodemap & bit)) {
+      _retain(n);
+      return n;
+    }
+    u32 i = _index(n->nodemap, bit);
+    Node* child = n->children()[i];
+    Node* c = _erase(child, k, shift + kBits);
+    if (c == child) {
+      _release(c); // not found
+      _retain(n);
+      return n;
+    }
+    if (!c) {
+      if (n->nleaves == 0 && n->nodemap == bit) { return 0; }
+      return _copy(n, n->datamap, n->nodemap & ~bit, ~0u, i, ~0u, ~0u, 0, 0, 0);
+    }
+    if (c->nleaves == 1 && c->nodemap == 0) {
+      // Pull a lone leaf up into this node so that the trie stays as shallow as possible
+      u32 datamap = n->datamap | bit;
+      Node* r = _copy(n, datamap, n->nodemap & ~bit, ~0u, i, _index(datamap, bit), ~0u,
+                      c->leaves()[0].key, &c->leaves()[0].value, 0);
+      _release(c);
+      return r;
+    }
+    return _copy(n, n->datamap, n->nodemap, ~0u, i, ~0u, i, 0, 0, c);
+  }
+
+  template <typename F> static void _foreach(const Node* n, F& f) {
+    for (u32 i = 0; i < n->nleaves; i++) { f(n->leaves()[i].key, n->leaves()[i].value); }
+    u32 nc = n->nchildren();
+    for (u32 i = 0; i < nc; i++) { _foreach(n->children()[i], f); }
+  }
+
+  Node*  _root = 0;
+  size_t _size = 0;
+};
+
+} // namespace sat
@@ -0,0 +1,268 @@
+#include "qindex.hh"
+
+namespace sat {
+
+bool QNameIndex::QName::parse(const char* s, size_t len, QName& out, bool intern) {
+  out.parts.clear();
+  out.is_ns = (len > 0 && s[len-1] == ':');
+  return len > 0 && split_qname(s, len, [&](const char* p, size_t n) {
+    Str part = intern ? strings.get(p, (u32)n) : strings.find(p, (u32)n);
+    if (!part) { return false; }
+    out.parts.push_back(std::move(part));
+    return true;
+  });
+}
+
+// ------------------------------------------------------------------------------------------------
+
+QNameIndex::QNameIndex(Str root) {
+  _cap = 16;
+  _slots = (Entry**)alloc::malloc(alloc::Tag::MAP, sizeof(Entry*) * _cap);
+  if (!_slots) { throw std::bad_alloc(); }
+  memset(_slots, 0, sizeof(Entry*) * _cap);
+  std::vector<Str> parts{root};
+  _root = _get(parts, 1, true);
+}
+
+QNameIndex::~QNameIndex() {
+  _clear_ns(_root);
+  _erase(_root);
+  delete _root;
+  assert(_size == 0);
+  assert(_result_refs.empty());
+  alloc::free(alloc::Tag::MAP, (void*)_slots, sizeof(Entry*) * _cap);
+}
+
+void QNameIndex::add(Expr* result) {
+  _adding = result;
+  _result_refs[result] = 0;
+  // The lines of namespace blocks are added with a stack of the namespaces being defined and the
+  // next line of each one's block, rather than recursively, as blocks can be nested arbitrarily
+  // deep
+  std::vector<std::pair<Entry*, const Expr*>,
+              alloc::Allocator<std::pair<Entry*, const Expr*>, alloc::Tag::MAP>> stack;
+  const Expr* block;
+  if (Entry* ns = _add_line(_root, result, result, block)) {
+    stack.emplace_back(ns, block->_value.head);
+  }
+  while (!stack.empty()) {
+    const Expr* l = stack.back().second;
+    if (!l) {
+      stack.pop_back();
+      continue;
+    }
+    stack.back().second = l->next();
+    if (l->type() == Expr::Type::LIST) {
+      if (Entry* ns = _add_line(stack.back().first, l, result, block)) {
+        stack.emplace_back(ns, block->_value.head);
+      }
+    }
+  }
+  _adding = 0;
+  auto I = _result_refs.find(result);
+  if (I->second == 0) {
+    _result_refs.erase(I);
+    _delete(result);
+  }
+}
+
+static bool is_equals_sign(const Expr* e) {
+  return e->type() == Expr::Type::SYM && e->str_value()->_size == 1
+      && e->str_value()->c_str()[0] == '=';
+}
+
+QNameIndex::Entry* QNameIndex::_add_line(
+  Entry* ns, const Expr* line, Expr* result, const Expr*& block)
+{
+  const Expr* head = line->_value.head;
+  if (!head || !head->next()) {
+    return 0;
+  }
+  const Expr* second = head->next();
+  bool is_ns;
+  if (head->type() == Expr::Type::ASSIGNMENT && second->type() == Expr::Type::BLOCK
+      && !second->next()) {
+    is_ns = true;  // ns:\n  ...
+  } else if (head->type() == Expr::Type::SYM && is_equals_sign(second)) {
+    is_ns = false; // name = ...
+  } else {
+    return 0;
+  }
+
+  std::vector<Str> parts = ns->qn.parts;
+  const Str::Imp* name = head->str_value();
+  if (!split_qname(name->c_str(), name->_size, [&](const char* p, size_t n) {
+    parts.push_back(strings.get(p, (u32)n));
+    return true;
+  })) {
+    return 0; // e.g. "a::b"
+  }
+
+  Entry* e = _get(parts, parts.size(), is_ns);
+  if (is_ns) {
+    _clear_ns(e); // a namespace which is defined again starts out empty
+  }
+  _set_def(e, line, result);
+  if (!is_ns) {
+    return 0;
+  }
+  block = second;
+  return e;
+}
+
+const Expr* QNameIndex::lookup(const QName& qn) const {
+  const Str* parts = qn.parts.data();
+  size_t n = qn.parts.size();
+  Entry* e = _find(parts, n, qn.is_ns, _hash(parts, n, qn.is_ns));
+  return e ? e->def : 0;
+}
+
+const Expr* QNameIndex::lookup(const char* qname, size_t len) const {
+  QName qn;
+  return QName::parse(qname, len, qn) ? lookup(qn) : 0;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+u64 QNameIndex::_hash(const Str* parts, size_t n, bool is_ns) {
+  // FNV-1a over the hashes of the parts
+  u64 h = 0xcbf29ce484222325ull ^ (u64)is_ns;
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ parts[i].self->_hash) * 0x100000001b3ull;
+  }
+  return h ^ (h >> 29);
+}
+
+QNameIndex::Entry* QNameIndex::_find(
+  const Str* parts, size_t n, bool is_ns, u64 hash) const
+{
+  size_t mask = _cap - 1;
+  for (size_t i = hash & mask; _slots[i]; i = (i + 1) & mask) {
+    Entry* e = _slots[i];
+    if (e->hash == hash && e->qn.is_ns == is_ns && e->qn.parts.size() == n) {
+      size_t j = 0;
+      while (j < n && e->qn.parts[j].self == parts[j].self) { j++; }
+      if (j == n) { return e; }
+    }
+  }
+  return 0;
+}
+
+QNameIndex::Entry* QNameIndex::_get(std::vector<Str>& parts, size_t n, bool is_ns) {
+  // Entry for parts[0..n), created along with any namespaces it implies if it doesn't exist.
+  // In loops rather than recursively, as a name can have any number of parts: find the longest
+  // existing namespace parts[0..i), then create the entries below it.
+  u64 hash = _hash(parts.data(), n, is_ns);
+  Entry* e = _find(parts.data(), n, is_ns, hash);
+  if (e) {
+    return e;
+  }
+  Entry* parent = 0;
+  size_t i = n - 1;
+  while (i > 0 && !(parent = _find(parts.data(), i, true, _hash(parts.data(), i, true)))) {
+    i--;
+  }
+  for (size_t k = i + 1; k <= n; k++) {
+    e = new Entry;
+    e->qn.is_ns = k < n || is_ns;
+    e->hash = k < n ? _hash(parts.data(), k, true) : hash;
+    e->qn.parts.assign(parts.begin(), parts.begin() + k);
+    e->parent = parent;
+    if (parent) {
+      parent->children.push_back(e);
+    }
+    _insert(e);
+    parent = e;
+  }
+  return e;
+}
+
+void QNameIndex::_insert(Entry* e) {
+  if ((_size + 1) * 4 > _cap * 3) {
+    // Keep the load factor at or below 3/4
+    Entry** old = _slots;
+    size_t oldcap = _cap;
+    _cap *= 2;
+    _slots = (Entry**)alloc::malloc(alloc::Tag::MAP, sizeof(Entry*) * _cap);
+    if (!_slots) { throw std::bad_alloc(); }
+    memset(_slots, 0, sizeof(Entry*) * _cap);
+    _size = 0;
+    for (size_t i = 0; i < oldcap; i++) {
+      if (old[i]) { _insert(old[i]); }
+    }
+    alloc::free(alloc::Tag::MAP, (void*)old, sizeof(Entry*) * oldcap);
+  }
+  size_t mask = _cap - 1;
+  size_t i = e->hash & mask;
+  while (_slots[i]) { i = (i + 1) & mask; }
+  _slots[i] = e;
+  ++_size;
+}
+
+void QNameIndex::_erase(Entry* e) {
+  size_t mask = _cap - 1;
+  size_t i = e->hash & mask;
+  while (_slots[i] != e) { i = (i + 1) & mask; }
+  // Shift back following entries of the same probe run (see SymMap::erase)
+  for (size_t j = (i + 1) & mask; _slots[j]; j = (j + 1) & mask) {
+    size_t home = _slots[j]->hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      _slots[i] = _slots[j];
+      i = j;
+    }
+  }
+  _slots[i] = 0;
+  --_size;
+}
+
+void QNameIndex::_clear_ns(Entry* ns) {
+  // Delete everything defined in `ns`, innermost first, with a stack of the namespaces being
+  // cleared rather than recursively
+  std::vector<Entry*,alloc::Allocator<Entry*,alloc::Tag::MAP>> stack{ns};
+  while (!stack.empty()) {
+    Entry* n = stack.back();
+    if (n->children.empty()) {
+      stack.pop_back();
+      continue;
+    }
+    Entry* e = n->children.back();
+    if (!e->children.empty()) {
+      stack.push_back(e);
+      continue;
+    }
+    n->children.pop_back();
+    _set_def(e, 0, 0);
+    _erase(e);
+    delete e;
+  }
+}
+
+void QNameIndex::_set_def(Entry* e, const Expr* def, Expr* result) {
+  if (result) {
+    ++_result_refs[result];
+  }
+  if (e->result) {
+    _release(e->result);
+  }
+  e->def = def;
+  e->result = result;
+}
+
+void QNameIndex::_release(Expr* result) {
+  auto I = _result_refs.find(result);
+  assert(I != _result_refs.end() && I->second > 0);
+  if (--I->second == 0 && result != _adding) {
+    _result_refs.erase(I);
+    _delete(result);
+  }
+}
+
+void QNameIndex::_delete(Expr* result) {
+  if (_deleter) {
+    _deleter(result);
+  } else {
+    delete result;
+  }
+}
+
+} // namespace sat
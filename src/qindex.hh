@@ -0,0 +1,102 @@
+// Index from fully qualified name to the expression which defines it
+//
+// Built after parsing by feeding it the top-level results of a Parser. Two kinds of lines are
+// definitions:
+//
+//   ns:                 defines the namespace "ns:" containing the definitions of the block
+//     ...
+//   name = ...          defines "name"; `name` may be qualified, e.g. `a:b:x = 1`
+//
+// A namespace and a name may share a symbol (`a:` and `a`) since they are different keys.
+// Defining a namespace again replaces everything that was defined in it before.
+//
+// A qualified name is a sequence of interned symbols. Lookups hash the sequence and compare
+// symbols by pointer, so they never look at string bytes once the name has been split up.
+//
+// Example:
+//
+//   QNameIndex index;  // root namespace "user:"
+//   while (Expr* e = P.next_result()) { index.add(e); }
+//   const Expr* def = index.lookup("user:milk:kind"); // (kind = Dairy)
+//
+#pragma once
+#include "common.h"
+#include "str.hh"
+#include "expr.hh"
+#include "alloc.hh"
+#include "parse.hh"
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace sat {
+
+struct QNameIndex {
+  struct QName {
+    // A qualified name such as "user:milk:kind" (a name) or "user:milk:" (a namespace)
+    std::vector<Str> parts; // interned symbols
+    bool is_ns = false;
+
+    static bool parse(const char* s, size_t len, QName& out, bool intern=false);
+      // Split `s` on ':' into `out`. Returns false if a part is empty, or if `intern` is false
+      // and a part is not an interned symbol (in which case nothing can be defined by that name).
+  };
+
+  QNameIndex(Str root = kStr_user);
+  ~QNameIndex();
+  QNameIndex(const QNameIndex&) = delete;
+  QNameIndex& operator=(const QNameIndex&) = delete;
+
+  void add(Expr* result);
+    // Index the definitions in `result`, a top-level result from Parser::next_result(). The index
+    // takes ownership of `result` and deletes it once nothing it defines is left in the index.
+
+  void set_deleter(std::function<void(Expr*)> f) { _deleter = std::move(f); }
+    // Pass results which are no longer needed to `f` instead of deleting them, e.g. to delete
+    // them on the thread which parsed them. An empty `f` makes the index delete them again.
+
+  const Expr* lookup(const QName& qn) const;
+  const Expr* lookup(const char* qname, size_t len) const;
+  const Expr* lookup(const char* qname) const { return lookup(qname, strlen(qname)); }
+    // The line which defines `qname`, or null if it's not defined. Namespaces which are only
+    // implied by a qualified name (`a:b:x = 1` implies "a:" and "a:b:") have no defining line.
+
+  size_t size() const { return _size; } // number of names and namespaces, including implied
+
+  // ---------------------------------------------------------------------------------------------
+
+  struct Entry {
+    SAT_ALLOC_TAGGED(MAP)
+    u64         hash;
+    QName       qn;
+    const Expr* def = 0;     // defining line
+    Expr*       result = 0;  // top-level result which `def` is part of
+    Entry*      parent = 0;  // namespace this is defined in
+    std::vector<Entry*,alloc::Allocator<Entry*,alloc::Tag::MAP>> children; // for namespaces
+  };
+
+  static u64 _hash(const Str* parts, size_t n, bool is_ns);
+  Entry* _find(const Str* parts, size_t n, bool is_ns, u64 hash) const;
+  Entry* _get(std::vector<Str>& parts, size_t n, bool is_ns);
+  void _insert(Entry*);
+  void _erase(Entry*);
+  void _clear_ns(Entry*);
+  void _set_def(Entry*, const Expr* def, Expr* result);
+  void _release(Expr* result);
+  void _delete(Expr* result);
+  Entry* _add_line(Entry* ns, const Expr* line, Expr* result, const Expr*& block);
+    // Index `line` if it's a definition. Returns the entry of a namespace it defines, with
+    // `block` set to the block holding its definitions, or else null.
+
+  Entry**  _slots = 0;
+  size_t   _cap = 0;   // power of two
+  size_t   _size = 0;
+  Entry*   _root;
+  Expr*    _adding = 0; // result being added; kept alive until add() returns
+  std::function<void(Expr*)> _deleter;
+  std::unordered_map<Expr*, size_t, std::hash<Expr*>, std::equal_to<Expr*>,
+                     alloc::Allocator<std::pair<Expr* const, size_t>, alloc::Tag::MAP>>
+    _result_refs; // number of entries defined by each result
+};
+
+} // namespace sat
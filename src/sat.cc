@@ -5,6 +5,13 @@
 #include "list.hh"
 #include "defer.hh"
 #include "expr.hh"
+#include "parse.hh"
+#include "qindex.hh"
+#include "eval.hh"
+#include "io.hh"
+#include "serve.hh"
+#include "spsc.hh"
+#include "trace.hh"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -16,11 +23,19 @@
 #include <deque>
 #include <list>
 #include <map>
+#include <vector>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
+#include <memory>
+#include <functional>
+#include <thread>
 
-#include <unistd.h> // sysconf(), isatty()
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h> // isatty()
 
 namespace sat {
 
@@ -29,900 +44,664 @@ template <typename... Tn> static void printx(Tn... args) {
   std::clog << std::endl;
 }
 
-// todo: move these into `list` ns:
-template <typename T, typename F>
-static inline void foreach_const(const T* e, F f) {
-  f(e); if ((e = (T*)e->_next_link)) foreach_const<T,F>(e, f); }
-
-template <typename T, typename F>
-static inline void foreach(T* e, F f) {
-  if (!e) return;
-  T* e2 = e->_next_link;
-  f(e);
-  foreach<T,F>(e2, f);
-}
-
 template <typename T, typename F>
 std::string join_const(const T* e, const std::string& glue, F filter) {
   std::ostringstream ss;
   bool nth = false;
-  foreach_const(e, [&](const T* e) {
+  list::foreach(e, [&](const T* e) {
     if (nth) { ss << glue; } else { nth = true; }
     ss << filter(e);
   });
   return ss.str();
 }
 
-// ----------------------------------------------------------------------------------------------
-
-#define SAT_ERRORS \
-  _(Parse) \
-  _(Syntax) \
-  _(Indentation) \
-  _(Memory) \
-
-enum class Error {
-  #define _(name) name,
-  SAT_ERRORS
-  #undef _
-};
-
-static const char* ErrorName(Error e) { switch (e) {
-  #define _(name) case Error::name: return #name;
-  SAT_ERRORS
-  #undef _
-}}
-
-// ----------------------------------------------------------------------------------------------
-// Interned strings and symbols
-
-#define CONST_SYMBOLS \
-  F(user, "user") \
-  F(user_ns, "user:") \
-
-#define F(name, cstr) \
-static constexpr auto kStr_##name = ConstStr(cstr);
-CONST_SYMBOLS
-#undef F
-
-static Str::WeakSet strings{
-  // Initialize the map with our constant symbols
-  #define F(name, cstr) &kStr_##name,
-  CONST_SYMBOLS
-  #undef F
-};
-
-// --------------------------------------------------------------------------------------------
-
-struct Namespace {
-  // Maps names to expressions
-
-  Namespace(Str&& qname) : _qname{qname} {}
-  Namespace(Str&& qname, const Str::Map<Expr*>& import_names)
-    : _qname{qname}, _names{import_names} {}
-
-  const Str& name() const { return _qname; }
-
-  Str             _qname;
-    // Qualified name, i.e. "user:foo:bar:". Always ends in ":".
-  Str::Map<Expr*> _names;
-    // Unqualified names to expressions defined in this namespace. Filled in during parsing and
-    // accessed during evaluation (for looking up symbols).
-};
-
-
-#define SAT_SCOPE_TYPES \
-  /* Should match the names of the `Expr::Type` they represent */ \
-  _(LIST) \
-  _(BLOCK) \
-  _(INLINE_BLOCK) \
-  _(GROUP) \
-
-struct Scope {
-  // Represents some kind of list of expressions during parsing
-
-  enum class Type {
-    #define _(NAME) NAME,
-    SAT_SCOPE_TYPES
-    #undef _
-  };
-  static const char* type_name(Type t) { switch (t) {
-    #define _(NAME) case Type::NAME: return #NAME;
-    SAT_SCOPE_TYPES
-    #undef _
-  }}
-
-  Scope(Type t, int il, Namespace* ns)
-    : _type(t), _indent_level(il), _ns(ns) {}
-
-  Type type() const { return _type; }
-  int indent_level() const { return _indent_level; }
-  Namespace* ns() const { return _ns; }
-
-  Expr* expr_list() const { return _list; }
-  void expr_list_append(Expr* expr) {
-    if (!_list_tail) {
-      Expr::Type list_type;
-      switch (_type) {
-        #define _(NAME) case Type::NAME: list_type = Expr::Type::NAME; break;
-        SAT_SCOPE_TYPES
-        #undef _
-      }
-      _list = new Expr{list_type};
-      _list->_value.head = expr;
-    } else {
-      _list_tail->_next_link = expr;
-    }
-    _list_tail = expr;
-  }
+} // namespace sat
 
-  // data
-  Type        _type;
-  int         _indent_level;
-  Namespace*  _ns; // weak
-    // What namespace this scope is operating in. In most cases this is no different from its
-    // parent scope.
-  Expr* _list = 0;
-  Expr* _list_tail = 0;
-};
-
-
-// Read system memory page size. Parser::Buf uses this value in an advisory manner.
-static long MEM_PAGE_SIZE = -1;
-struct _MEM_PAGE_SIZE { _MEM_PAGE_SIZE() {
-  #if defined(PAGESIZE)
-  MEM_PAGE_SIZE = sysconf(PAGESIZE);
-  #elif defined(PAGE_SIZE)
-  MEM_PAGE_SIZE = sysconf(PAGE_SIZE);
-  #elif defined(_SC_PAGESIZE)
-  MEM_PAGE_SIZE = sysconf(_SC_PAGESIZE);
-  #else
-  MEM_PAGE_SIZE = -1;
-  #endif
-  if (MEM_PAGE_SIZE == -1 || (MEM_PAGE_SIZE/8)*8 != MEM_PAGE_SIZE) { MEM_PAGE_SIZE = 4096; }
-}} __MEM_PAGE_SIZE;
-
-
-struct Parser {
-  enum class Status {
-    ERROR,  // There was an error. Caller should either stop parsing or repair the error and retry
-    RESULT, // There's results available by calling `next_result()`
-    MORE,   // Parser needs more data. Call `fill()` and `parse()` to resume.
-    DONE,   // There's nothing more to parse.
-  };
+// ------------------------------------------------------------------------------------------------
 
-  Parser(Str ns_qname, Namespace* parent_ns=0) {
-    Namespace* ns = new Namespace{std::move(ns_qname)};
-    Scope* scope = new Scope{Scope::Type::BLOCK, 0, ns};
-    _scope_stack.emplace_front(scope);
-  }
+using namespace sat;
 
-  size_t lineno() const { return _lineno+1; }
-  size_t colno() const { return (size_t)(_buf.p - _buf.line_s)+1; }
-  Scope& top_scope() const { assert(!_scope_stack.empty()); return *_scope_stack.front(); }
-
-  // -------------------------------------------
-  // BEGIN logging
-
-  struct SEndl {
-    SEndl(std::ostream& os) : _valid(true), _os(os) {}
-    SEndl(const SEndl& other) : _valid(true), _os(other._os) {
-      const_cast<SEndl&>(other)._valid = false; }
-    ~SEndl() { if (_valid) { _os << std::endl; } }
-    template <typename... Args>
-    SEndl& operator<<(Args&&... args) { pass( (_os << args)... ); return *this; }
-    // template <typename T> SEndl& operator<<(T& v) { _os << v; return *this; }
-    bool _valid;
-    std::ostream& _os;
-  };
+static const char* kUsage =
+  "usage: %s [options] <file>...\n"
+  "options:\n"
+  "  --alloc-stats  Print heap allocations per subsystem to stderr at exit\n"
+  "  --stats        Print parser and interner counters to stderr at exit\n"
+  "  --hashcons     Share identical lists in results (see --stats for the dedup ratio)\n"
+  "  --lookup <qname>\n"
+  "                 Print the line which defines <qname> (e.g. user:milk:kind) after parsing\n"
+  "  --eval[=tree]  Evaluate each result as it's parsed; \"tree\" uses the tree-walking\n"
+  "                 interpreter instead of the bytecode VM\n"
+  "  --multi-doc    Treat \"__END__\" as the end of a document rather than of the input.\n"
+  "                 Results are printed with the index of their document.\n"
+  "  --io=pread     Read files with a pool of threads calling pread() rather than io_uring\n"
+  "  --pipeline[=<n>]\n"
+  "                 Read, parse and print on separate threads, with <n> threads formatting\n"
+  "                 results (default 2). Results are printed in the same order as\n"
+  "                 without --pipeline.\n"
+  "  --trace=<file>\n"
+  "                 Write a timeline of reads, parse() calls, results, printing and interner\n"
+  "                 resizes, per thread, to <file> in Chrome's trace event format (open it\n"
+  "                 in ui.perfetto.dev or chrome://tracing)\n"
+  "  --serve <socket>\n"
+  "                 Run a parse daemon on a Unix domain socket (see src/serve.hh)\n"
+  "  --threads <n>  Number of --serve workers (default 4)\n"
+  "  --timeout <ms> Default --serve request timeout (default 5000)\n"
+  "  --client <socket>\n"
+  "                 Send the files (or stdin) to a --serve daemon and print the results.\n"
+  "                 With --stats, print the daemon's latency histogram and interner counters.\n"
+  "  --format=binary\n"
+  "                 Ask --client results in the binary format rather than as text\n"
+  ;
+
+static Server* g_server = nullptr; // for stopping on SIGINT and SIGTERM
+
+static void on_stop_signal(int) {
+  g_server->stop();
+}
 
-  SEndl dlog(std::ostream& os=std::cerr) {
-    Namespace* ns = current_ns();
-    return SEndl{
-      os << std::left << std::setw(25) << (ns ? ns->name() : "")
-         << std::setw((top_scope().indent_level()*2)+1) << ' ' };
-         // << std::setw((_scope_stack.size()*2)+1) << ' ' };
+static int serve(const char* prog, Server::Options opt) {
+  Server server(opt);
+  std::string err;
+  if (!server.listen(err)) {
+    fprintf(stderr, "%s: %s: %s\n", prog, opt.path.c_str(), err.c_str());
+    return 1;
   }
+  g_server = &server;
+  signal(SIGINT, on_stop_signal);
+  signal(SIGTERM, on_stop_signal);
+  server.run();
+  g_server = nullptr;
+  return 0;
+}
 
-  struct ELog {
-    ELog(std::ostream& os, ssize_t lineno, ssize_t column, const char* startp, const char* endp)
-      : _valid(true), _os(os), _lineno(lineno), _column(column), _startp(startp), _endp(endp) {}
-    ELog(const ELog& other)
-      : _valid(true), _os(other._os), _lineno(other._lineno), _column(other._column)
-      , _startp(other._startp), _endp(other._endp)
-    {
-      const_cast<ELog&>(other)._valid = false;
+static bool read_fd(int fd, std::string& s) {
+  StreamReader in(fd);
+  while (!in.at_end()) {
+    size_t len = s.size();
+    s.resize(len + in.block_size());
+    ssize_t n = in.read(&s[len], in.block_size());
+    if (n < 0) {
+      return false;
     }
-    ~ELog() {
-      if (_valid) {
-        if (_lineno || _column) {
-          _os << " at " << _lineno << ':' << _column;
-        }
-        _os << std::endl;
-        if (_startp) {
-          if (!_endp) { _endp = _startp; while (*_endp && *_endp != '\n') { ++_endp; } }
-          _os << "  " << std::string(_startp, size_t(_endp - _startp)) << std::endl
-              << "  " << std::right << std::setw(_column) << "^" << std::endl;
-        }
-      }
+    s.resize(len + (size_t)n);
+  }
+  return true;
+}
+
+static int client(const char* prog, const std::string& path, const char* format,
+                  const std::vector<std::string>& filenames, bool print_stats)
+{
+  Client c;
+  if (!c.connect(path)) {
+    fprintf(stderr, "%s: %s: %s\n", prog, path.c_str(), strerror(errno));
+    return 1;
+  }
+  Client::Response r;
+  auto report = [&](const std::string& name) -> bool {
+    if (!r.ok) {
+      fprintf(stderr, "%s: %s: %s: %s", prog, name.c_str(), r.reason.c_str(), r.body.c_str());
+      return false;
     }
-    template <typename... Args>
-    ELog& operator<<(Args&&... args) { pass( (_os << args)... ); return *this; }
-    operator bool() const { return false; }
-    operator Status() const { return Status::ERROR; }
-
-    bool _valid;
-    std::ostream& _os;
-    ssize_t _lineno;
-    ssize_t _column;
-    const char* _startp;
-    const char* _endp;
+    fwrite(r.body.data(), 1, r.body.size(), stdout);
+    return true;
   };
-
-  ELog report_error(
-    Error e,
-    const char* startp = (const char*)-1,
-    const char* endp = 0,
-    ssize_t line = -1,
-    ssize_t col = 0)
-  {
-    // set to start and end of current line
-    if (startp == (const char*)-1) {
-      // use current values
-      startp = _buf.line_s;
-      endp = _buf.p > startp ? _buf.p : startp;
-      while (endp != _buf.e && *endp != '\n') { ++endp; }
+  std::vector<std::string> names = filenames;
+  if (names.empty()) {
+    names.push_back("-");
+  }
+  for (size_t i = 0; i < names.size(); i++) {
+    std::string src;
+    int fd = names[i] == "-" ? STDIN_FILENO : open(names[i].c_str(), O_RDONLY);
+    if (fd == -1 || !read_fd(fd, src)) {
+      fprintf(stderr, "%s: %s: %s\n", prog, names[i].c_str(), strerror(errno));
+      return 1;
     }
-    if (line == -1) {
-      line = lineno();
-      col = colno();
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+    if (!c.parse(std::to_string(i), format, 0, src, r)) {
+      fprintf(stderr, "%s: %s: connection lost\n", prog, path.c_str());
+      return 1;
+    }
+    if (!report(names[i])) {
+      return 1;
     }
-    return ELog{std::cerr, line, col, startp, endp} << ErrorName(e) << "Error: ";
   }
-
-  // END logging
-  // -------------------------------------------
-
-
-  std::string scope_path() {
-    std::string s;
-    int i = 0;
-    auto I = _scope_stack.crbegin();
-    auto E = _scope_stack.crend();
-    for (;I != E; ++I) {
-      if (i++) {
-        s.append(1, '/');
-        s.append("_");
-      } else s.append("@");
+  if (print_stats) {
+    if (!c.stats(r)) {
+      fprintf(stderr, "%s: %s: connection lost\n", prog, path.c_str());
+      return 1;
     }
-    return s;
+    fwrite(r.body.data(), 1, r.body.size(), stderr);
   }
+  return 0;
+}
 
-  bool is_root_scope(const Scope& s) {
-    return &s == _scope_stack.back();
+int main(int argc, const char** argv) {
+  std::vector<std::string> filenames;
+  FileReader::Options io_opt;
+  bool alloc_stats = false;
+  bool print_stats = false;
+  bool use_hashcons = false;
+  bool multi_doc = false;
+  std::vector<const char*> lookups;
+  Server::Options serve_opt;
+  const char* client_path = nullptr;
+  const char* client_format = "text";
+  size_t pipeline_formatters = 0; // 0 = no pipeline
+  const char* trace_path = nullptr;
+  enum class EvalMode { NONE, VM, TREE } eval_mode = EvalMode::NONE;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strcmp(arg, "--alloc-stats") == 0) {
+      alloc_stats = true;
+    } else if (strcmp(arg, "--stats") == 0) {
+      print_stats = true;
+    } else if (strcmp(arg, "--hashcons") == 0) {
+      use_hashcons = true;
+    } else if (strcmp(arg, "--multi-doc") == 0) {
+      multi_doc = true;
+    } else if (strcmp(arg, "--lookup") == 0 && i + 1 < argc) {
+      lookups.push_back(argv[++i]);
+    } else if (strcmp(arg, "--eval") == 0 || strcmp(arg, "--eval=vm") == 0) {
+      eval_mode = EvalMode::VM;
+    } else if (strcmp(arg, "--eval=tree") == 0) {
+      eval_mode = EvalMode::TREE;
+    } else if (strcmp(arg, "--io=uring") == 0) {
+      io_opt.use_uring = true;
+    } else if (strcmp(arg, "--io=pread") == 0) {
+      io_opt.use_uring = false;
+    } else if (strcmp(arg, "--pipeline") == 0) {
+      pipeline_formatters = 2;
+    } else if (strncmp(arg, "--pipeline=", strlen("--pipeline=")) == 0) {
+      pipeline_formatters = (size_t)SAT_MAX(1, atoi(arg + strlen("--pipeline=")));
+    } else if (strncmp(arg, "--trace=", strlen("--trace=")) == 0 && arg[strlen("--trace=")]) {
+      trace_path = arg + strlen("--trace=");
+    } else if (strcmp(arg, "--serve") == 0 && i + 1 < argc) {
+      serve_opt.path = argv[++i];
+    } else if (strcmp(arg, "--threads") == 0 && i + 1 < argc) {
+      serve_opt.nthreads = (size_t)SAT_MAX(1, atoi(argv[++i]));
+    } else if (strcmp(arg, "--timeout") == 0 && i + 1 < argc) {
+      serve_opt.timeout_ms = (u32)SAT_MAX(1, atoi(argv[++i]));
+    } else if (strcmp(arg, "--client") == 0 && i + 1 < argc) {
+      client_path = argv[++i];
+    } else if (strcmp(arg, "--format=binary") == 0 || strcmp(arg, "--format=text") == 0) {
+      client_format = arg + strlen("--format=");
+    } else if (arg[0] == '-' && arg[1] == '-') {
+      fprintf(stderr, "%s: Unknown option '%s'\n", argv[0], arg);
+      fprintf(stderr, kUsage, argv[0]);
+      return 1;
+    } else {
+      filenames.push_back(arg);
+    }
   }
 
-  Namespace* current_ns() {
-    if (_scope_stack.empty()) return 0;
-    return _scope_stack.front()->ns();
+  if (!serve_opt.path.empty()) {
+    return serve(argv[0], serve_opt);
   }
-
-  bool enter_scope(Scope::Type scope_type) {
-    Namespace* ns = current_ns();
-    Scope* scope = new Scope{scope_type, _curr_indent_level, ns};
-    _scope_stack.emplace_front(scope);
-    dlog() << "-> " << Scope::type_name(scope->type())
-           << " at level " << scope->indent_level();
-    return true;
+  if (client_path) {
+    return client(argv[0], client_path, client_format, filenames, print_stats);
   }
 
+  if (filenames.empty() && isatty(0)) {
+    fprintf(stderr, kUsage, argv[0]);
+    return 1;
+  } // else printf("Reading from stdin\n");
 
-  bool leave_scope(Scope::Type scope_type) {
-    dlog() << "<< leave " << Scope::type_name(scope_type) << " scope"
-           << " to level " << _curr_indent_level;
-    assert(!_scope_stack.empty());
-    
-    if (top_scope().type() != scope_type) {
-      // Error: Type mis-match
-      auto descr = [](Scope::Type scope_type) -> const char* {
-        switch (scope_type) {
-        case Scope::Type::LIST:         return "linebreak to same indentation level or ';'";
-        case Scope::Type::BLOCK:        return "block dentation";
-        case Scope::Type::INLINE_BLOCK: return "'}'";
-        case Scope::Type::GROUP:        return "')'";
-      }};
-      return report_error(Error::Indentation)
-        << "Unexpected " << descr(scope_type)
-        << " when expecting " << descr(top_scope().type()) << ".";
-    }
-
-    do {
-      if (!pop_scope()) return false;
-      if (scope_type != Scope::Type::BLOCK) return true;
-
-      // Now, consider the parent scope. Are we at the target indent level?
-      Scope& scope = top_scope();
-
-      if (scope.type() == Scope::Type::GROUP) {
-        dlog() << "-- inline group";
-        return true;
-      }
-
-      if (_curr_indent_level > scope.indent_level()) {
-        // Fell below target -- misalinged indentation. Break to error case.
-        break;
-      } else if (_curr_indent_level == scope.indent_level()) {
-        // We are at the correct scope. Return with success.
-        return true;
-      }
-    } while (!_scope_stack.empty());
-
-    return report_error(Error::Indentation)
-      << "unindent does not match any outer indentation level";
-  }
-
-
-  bool pop_scope() {
-    assert(!_scope_stack.empty());
-    Scope* prev_scope = _scope_stack.front();
-    dlog() << "<- " << Scope::type_name(prev_scope->type())
-           << " at level " << prev_scope->indent_level();
-    _scope_stack.pop_front();
-
-    // Take care of any expressions in the scope we just left
-    Expr* prev_expr_list = prev_scope->expr_list();
-    if (prev_expr_list) {
-      assert(prev_expr_list->is_list());
-      if (is_root_scope(top_scope())) {
-        // As we are at the root scope, yield results
-        yield_result(prev_expr_list);
-      } else {
-        top_scope().expr_list_append(prev_expr_list);
-      }
-    }
-
-    delete prev_scope;
-      // We no longer need prev_scope
-
-    return true;
+  if (alloc_stats) {
+    alloc::enable(true);
+    alloc::reset_peaks();
   }
+  defer [&]{ if (alloc_stats) alloc::print_stats(std::cerr); };
 
-  void yield_result(Expr* expr) {
-    // dlog() << "yield_result " << expr;
-    _results.push_back(expr);
+  if (trace_path) {
+    trace::enable(true);
+    trace::set_thread_name("main");
   }
-
-  #define TOKEN_NAMES \
-    F(COMMENT) \
-    F(NAME) \
-    F(QUALNAME) \
-    F(ASSIGNMENT) \
-
-  #define READ_STATES \
-    F(ROOT) \
-    F(COMMENT) \
-    F(LINEBREAK) \
-    F(NAME) \
-    F(QUALNAME) \
-    F(ASSIGNMENT) \
-
-  enum class Token {
-    #define F(n) n,
-    TOKEN_NAMES
-    #undef F
+  defer [&]{
+    // After the readers' and pipeline's threads have finished
+    if (trace_path && !trace::write(trace_path)) {
+      fprintf(stderr, "%s: %s: %s\n", argv[0], trace_path, strerror(errno));
+    }
   };
 
-  static const char* token_name(Token v) {
-    switch (v) {
-      #define F(n) case Token::n: return #n;
-      TOKEN_NAMES
-      #undef F
+  HashCons hashcons; // outlives the parsers, which point to it
+  QNameIndex index;
+  Env env;
+  Compiler compiler(env);
+  TreeInterp interp(env);
+  Parser::Stats parser_stats;
+  std::unique_ptr<FileReader> reader;
+  std::unique_ptr<StreamReader> stream;
+  std::unique_ptr<Parser> P; // of the current file
+  defer [&]{
+    if (P) {
+      parser_stats += P->stats();
     }
-  }
-
-  std::string copy_symbol_name(size_t skipn_tail=0) {
-    return std::string(_buf.ts, (size_t)(_buf.te - _buf.ts - skipn_tail));
-  }
-
-  bool on_token(Token t) {
-    dlog() << "■ " << token_name(t)
-           << " \"" << std::string(_buf.ts, size_t(_buf.te-_buf.ts)) << "\"";
-    assert(!_scope_stack.empty());
-
-    Expr::Type type;
-    size_t len = (u32)(_buf.te - _buf.ts);
-
-    switch (t) {
-      case Token::COMMENT:   type = Expr::Type::COMMENT; break;
-      case Token::ASSIGNMENT: {
-        assert(len > 0);
-        assert(_buf.ts[len-1] == ':'); // or our parse code is bad
-        --len; // skip 
-        type = Expr::Type::ASSIGNMENT;
-        break;
+    #if SAT_PARSE_PROFILE
+    std::cerr << parser_stats.profile;
+    #endif
+    if (print_stats) {
+      std::cerr << parser_stats << strings.stats();
+      if (use_hashcons) {
+        std::cerr << hashcons.stats();
+      }
+      if (reader) {
+        std::cerr << reader->stats();
+      }
+      if (stream) {
+        std::cerr << stream->stats();
       }
-      default: type = Expr::Type::SYM;
-    }
-
-    if (len > (size_t)0xffffffffu) {
-      return report_error(Error::Memory, "String too large");
     }
-    
-    Str s = (t == Token::COMMENT) ? std::move(Str{_buf.ts, (u32)len}) :
-                                    strings.get(_buf.ts, (u32)len);
-                                    // intern all but comments
-    Expr* expr = new Expr{type, s.steal_self()};
-    top_scope().expr_list_append(expr);
-    return true;
-  }
-
-  // --------------------------------------------------------------------
-  // Reading
-
-  enum class ReadState {
-    #define F(n) n,
-    READ_STATES
-    #undef F
   };
 
-  static const char* read_state_name(ReadState v) {
-    switch (v) {
-      #define F(n) case ReadState::n: return #n;
-      READ_STATES
-      #undef F
-    }
-  }
-
-  struct Buf {
-    bool  is_end = false; // true if there will be no more buffer fills
-    char* line_s = 0;     // current line start in buffer
-
-    char* ts = 0;    // current/last token start in buffer
-    char* te = 0;    // current/last token end in buffer
-
-    size_t size = 0; // size of memory region pointed to by `s`
-    char* s = 0;     // buffer start
-    char* p = 0;     // current buffer position
-    char* e = 0;     // end of data in buffer
-
-    char* ensure_fillable(size_t& bytes_available) {
-      const size_t SIZE_LOW_WATERMARK = 512;
-      bytes_available = size - (size_t)(p - s);
-      if (bytes_available < SIZE_LOW_WATERMARK) {
-        size += MEM_PAGE_SIZE;
-        bytes_available += MEM_PAGE_SIZE;
-        char* s2 = (char*)realloc((void*)s, size);
-        if (!s2) { return 0; } // errno ENOMEM
-        if (s2 != s) {
-          // reallocate pointers if we were moved to a different region
-          line_s = s2 + (line_s - s);
-          ts     = s2 + (ts - s);
-          te     = s2 + (te - s);
-          p      = s2 + (p - s);
-          e      = s2 + (e - s);
+  // Output of parsing: a status line, or a result (with status null) of document `document`
+  typedef std::function<void(const char* status, Expr* e, size_t document)> Emit;
+
+  // Parses what has been filled into P, passing status lines and results to `emit`. Returns false
+  // on error.
+  auto parse = [&](Parser& P, bool is_eof, const Emit& emit) -> bool {
+    for (;;) {
+      trace::Span span("parse", "parse");
+      Parser::Status status = P.parse();
+      span.arg("status", Parser::status_name(status));
+      span.end();
+      switch (status) {
+        case Parser::Status::ERROR: {
+          emit("main: Parser::Status::ERROR", 0, 0);
+          return false;
+        }
+        case Parser::Status::RESULT: {
+          emit("main: Parser::Status::RESULT", 0, 0);
+          trace::Span results("parse", "results");
+          i64 n = 0;
+          while (Expr* e = P.next_result()) {
+            emit(0, e, P.document());
+            n++;
+          }
+          results.arg("count", n);
+          break;
+        }
+        case Parser::Status::MORE: {
+          emit("main: Parser::Status::MORE", 0, 0);
+          assert(!is_eof);
+          return true;
+        }
+        case Parser::Status::DONE: {
+          emit("main: Parser::Status::DONE", 0, 0);
+          assert(is_eof);
+          return true;
+        }
+        case Parser::Status::DOCUMENT: {
+          emit("main: Parser::Status::DOCUMENT", 0, 0);
+          break;
         }
-        s = s2;
       }
-      return e;
     }
-    ~Buf() { if (s) free(s); }
   };
 
-
-  char* get_read_buf(size_t& bytes_available) {
-    assert(_buf.p == _buf.e); // or previous call to parse() failed with an error
-    return _buf.ensure_fillable(bytes_available);
-  }
-
-
-  void fill(char* p, size_t len, bool is_end) {
-    assert(p >= &_buf.s[0] && p < (&_buf.s[0])+_buf.size);
-      // or this is a pointer to something else
-    _buf.e += len;
-    _buf.is_end = is_end;
-  }
-  
-
-  Status parse() {
-    //
-    // Input bytes:    foo ba | r baz lolc | at\n
-    //                 0....5   0........9   0.2
-    //
-    // Parsed tokens:  foo, bar, baz, lolcat, \n
-    //   foo -> foo
-    //   ba...
-    //   r -> bar
-    //   baz -> baz
-    //   lolc...
-    //   at -> lolcat
-    // -------------------------------------------
-    #define B /* current byte */ ((unsigned char)*_buf.p)
-    #define Bn(n) /* nth byte */ ((unsigned char)(_buf.p < _buf.e-(n) ? *(_buf.p+(n)) : 0))
-    #define CONSUME ++_buf.p;
-    #define SET_TOK_START _buf.ts = _buf.p;
-    #define SET_TOK_END   _buf.te = _buf.p;
-
-    #define SWITCH_TO(state_name) { \
-      /*dprintf(">> %s --> " #state_name, read_state_name(_read_state));*/ \
-      _read_state = ReadState::state_name; \
-      goto read_loop; \
+  auto print_result = [&](std::ostream& os, const Expr* e, size_t document) {
+    trace::Span span("output", "print");
+    if (multi_doc) {
+      os << "result " << document << ": " << e << std::endl;
+    } else {
+      os << "result: " << e << std::endl;
     }
-    #define CONSUME_AND_CONTINUE_AS(state_name) { \
-      CONSUME \
-      SWITCH_TO(state_name) \
+  };
+
+  // Evaluates a printed result and then keeps it for lookups or deletes it with `del`
+  auto use_result = [&](Expr* e, const std::function<void(Expr*)>& del) {
+    bool ok = true;
+    if (eval_mode == EvalMode::TREE) {
+      ok = interp.eval(e);
+    } else if (eval_mode == EvalMode::VM) {
+      Code code(env);
+      ok = compiler.compile(e, code);
+      run(env, code);
     }
-    #define TRANSITION_TO(state_name) { \
-      SET_TOK_START \
-      SWITCH_TO(state_name) \
+    if (!ok) {
+      fprintf(stderr, "%s: Result is nested too deeply to evaluate (more than %d levels)\n",
+              argv[0], SAT_EVAL_MAX_DEPTH);
     }
-    #define TRANSITION_TO_AND_CONSUME(state_name) { \
-      SET_TOK_START \
-      CONSUME \
-      SWITCH_TO(state_name) \
+    if (lookups.empty()) {
+      del(e);
+    } else {
+      index.add(e);
     }
-    #define CONSUME_AND_TRANSITION_TO(state_name) { \
-      CONSUME \
-      SET_TOK_START \
-      SWITCH_TO(state_name) \
+  };
+
+  auto new_parser = [&]() {
+    P.reset(new Parser(kStr_user_ns));
+    if (use_hashcons) {
+      P->set_hashcons(&hashcons);
     }
+    P->set_multi_document(multi_doc);
+  };
 
-    #define ACT_ENTER_LINEBREAK { \
-      _curr_indent_level = 0; \
-      ++_lineno; \
-      _buf.line_s = _buf.p+1; /* +1 since linebreak has not yet been CONSUMEd */ \
+  // Copies p[0..n) into P's buffer, as that is what it parses from, and parses it. Returns false
+  // on error.
+  auto feed = [&](const char* p, size_t n, bool is_last, const Emit& emit) -> bool {
+    do {
+      size_t bufsize;
+      char* buf = P->get_read_buf(bufsize);
+      assert(bufsize > 0);
+      size_t len = SAT_MIN(bufsize, n);
+      memcpy(buf, p, len);
+      p += len;
+      n -= len;
+      bool is_eof = is_last && n == 0;
+      trace::Span span("parse", "fill");
+      span.arg("bytes", (i64)len);
+      P->fill(buf, len, is_eof);
+      span.end();
+      if (!parse(*P, is_eof, emit)) {
+        return false;
+      }
+    } while (n > 0);
+    return true;
+  };
+
+  // Files are read ahead in chunks while earlier ones are parsed. Each file is parsed from the
+  // start by a parser which is reset between files, so that its buffers are reused. Returns the
+  // exit status.
+  auto parse_files = [&](const Emit& emit) -> int {
+    reader.reset(new FileReader(filenames, io_opt));
+    FileReader::Chunk c;
+    while (reader->next(c)) {
+      if (c.error) {
+        if (c.error == ENOENT) {
+          fprintf(stderr, "%s: No such file '%s'\n", argv[0], reader->path(c.file).c_str());
+        } else {
+          fprintf(stderr, "%s: %s: %s\n", argv[0], reader->path(c.file).c_str(),
+                  strerror(c.error));
+        }
+        return 1;
+      }
+      if (!P) {
+        new_parser();
+      }
+      if (!feed(c.data, c.len, c.is_last, emit)) {
+        return 1;
+      }
+      reader->release(c);
+      if (c.is_last) {
+        parser_stats += P->stats();
+        P->reset();
+      }
     }
+    return 0;
+  };
 
-    #define ACT_ON_SPACE { \
-      if (_indent_c == 0) { \
-        _indent_c = B; \
-      } else if (_indent_c != B) { \
-        return report_error(Error::Indentation) \
-          << "Mixed line indentation"; \
-      } \
-      ++_curr_indent_level; \
+  // --pipeline: Reading stdin, parsing, formatting results and writing them out run on threads
+  // of their own, connected by SPSCQueues:
+  //
+  //   reader -> parser -> formatter 1..N -> main
+  //
+  // Results are dealt round-robin to the formatters and collected in the same order, so output
+  // is the same as without --pipeline, but for where "MORE" falls when reading stdin, as stdin
+  // is read into blocks of the reader's rather than straight into the parser's buffer. The main
+  // thread writes out results and then evaluates them and indexes them for --lookup, one at a
+  // time. Results are sent back to the parser thread to be deleted, as deleting shares state
+  // with parsing (e.g. the HashCons), and so are those which the index of --lookup lets go of
+  // when names are redefined. Files are read by FileReader, which already reads ahead on
+  // threads of its own.
+  auto pipeline = [&]() -> int {
+    struct Block {
+      char*  data = 0;
+      size_t size = 0;
+      size_t len = 0;
+      bool   is_end = false;
+      int    error = 0;
+    };
+    struct Item {
+      const char* status;
+      Expr*       e;
+      size_t      document;
+      std::string text; // of `e`, made by a formatter
+    };
+    const size_t kBlocks = 8;
+    const size_t kItems = 1024;
+
+    if (eval_mode != EvalMode::NONE || !lookups.empty()) {
+      Str::WeakSet::set_threadsafe(true); // both interning strings, while the parser does
     }
 
-    #define LEAVE_BLOCK_SCOPE \
-      if (!leave_scope(Scope::Type::LIST) || !leave_scope(Scope::Type::BLOCK)) { \
-        return Status::ERROR; \
+    SPSCQueue<Block> blocks(kBlocks), free_blocks(kBlocks); // reader <-> parser
+    std::vector<std::unique_ptr<SPSCQueue<Item>>> parsed, formatted;
+    for (size_t i = 0; i < pipeline_formatters; i++) {
+      parsed.emplace_back(new SPSCQueue<Item>(kItems));
+      formatted.emplace_back(new SPSCQueue<Item>(kItems));
+    }
+    SPSCQueue<Expr*> used(kItems); // main -> parser, for deletion
+    bool aborted = false; // set by the parser on error; atomic
+    int wake[2] = {-1, -1}; // pipe written to by the parser on error, as the reader may be
+                            // waiting for stdin, which can stay open indefinitely
+    int status = 0;
+    defer [&]{
+      if (wake[0] != -1) {
+        close(wake[0]);
+        close(wake[1]);
       }
+    };
 
-    #define LEAVE_BLOCK_SCOPE_FROM_ENDPAREN \
-      if (_scope_stack.size() < 3) { \
-        return report_error(Error::Syntax) << "Unexpected ')'"; \
-      } \
-      _curr_indent_level = _scope_stack[2]->indent_level(); \
-      LEAVE_BLOCK_SCOPE \
-      assert(_scope_stack.size() > 1); \
-      assert(_scope_stack[0]->type() == Scope::Type::LIST); \
-      assert(_scope_stack[1]->type() == Scope::Type::GROUP); \
-      _prev_indent_level = _curr_indent_level;
-
-    // #define IS_SPACE \
-    //   (  B == 0x09 /* CHARACTER TABULATION */ \
-    //   || B == 0x20 /* SPACE */ \
-    //   || B == 0xa0 /* NO-BREAK SPACE */ \
-    //   ) // todo: Beyond ASCII UTF-8 spaces
-
-    #define IS_CTRL \
-      ( B < 0x9 || B == 0xb || B == 0xc || (B > 0xd && B < 0x20) )
-
-    #define IS_NAME (B > 0x20 && B != '\\' && !(B > 0x7e && B < 0xa1) \
-                     && B != '(' && B != ')' \
-                     && B != '{' && B != '}' \
-                     && B != ';' \
-                     /*&& B != '='*/ )
-
-    read_loop:
-    while (_buf.p != _buf.e) switch (_read_state) {
-
-      // ---------------------------------------------------------------------------
-      case ReadState::ROOT: {
-      if (!_results.empty()) {
-        return Status::RESULT;
+    std::thread reader_thread;
+    if (filenames.empty()) {
+      if (pipe(wake) != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        return 1;
       }
-      switch (B) {
-        case '\n': {
-          ACT_ENTER_LINEBREAK
-          CONSUME_AND_TRANSITION_TO(LINEBREAK)
-        }
-        case '#': {
-          CONSUME_AND_TRANSITION_TO(COMMENT)
-        }
-        case '(': {
-          if (!enter_scope(Scope::Type::GROUP) || !enter_scope(Scope::Type::LIST)) {
-            return Status::ERROR;
-          }
-          CONSUME
-          break;
-        }
-        case ')': {
-          assert(_scope_stack.size() > 1);
-          if (_scope_stack[1]->type() == Scope::Type::BLOCK) {
-            // Special case: Leaving a block scope inside a group w/o a trailing linebreak
-            //   a
-            //     (b
-            //      c)
-            //       ^-- We are here and should leave to...
-            //     ^-- ...here
-            LEAVE_BLOCK_SCOPE_FROM_ENDPAREN
-          }
-          if (!leave_scope(Scope::Type::LIST) || !leave_scope(Scope::Type::GROUP)) {
-            return Status::ERROR;
-          }
-          CONSUME
-          break;
-        }
-        case '{': {
-          if (!enter_scope(Scope::Type::INLINE_BLOCK) || !enter_scope(Scope::Type::LIST)) {
-            return Status::ERROR;
-          }
-          CONSUME
-          break;
-        }
-        case '}': {
-          if (!leave_scope(Scope::Type::LIST) || !leave_scope(Scope::Type::INLINE_BLOCK)) {
-            return Status::ERROR;
-          }
-          CONSUME
-          break;
-        }
-        case ';': {
-          if (!leave_scope(Scope::Type::LIST) || !enter_scope(Scope::Type::LIST)) {
-            return Status::ERROR;
-          }
-          CONSUME
-          break;
-        }
-        default: {
-          if (B < 0x21) {
-            // ignore control chars et al
-            CONSUME
+      stream.reset(new StreamReader(STDIN_FILENO));
+      for (size_t i = 0; i < kBlocks; i++) {
+        free_blocks.push(Block());
+      }
+      reader_thread = std::thread([&]{
+        trace::set_thread_name("reader");
+        Block b;
+        while (!sat_atomic_load_acq(&aborted) && free_blocks.pop(b)) {
+          pollfd pfds[2] = { { STDIN_FILENO, POLLIN, 0 }, { wake[0], POLLIN, 0 } };
+          while (poll(pfds, 2, -1) < 0 && errno == EINTR) {}
+          if (pfds[1].revents) {
+            alloc::free(alloc::Tag::QUEUE, b.data, b.size); // as the parser has stopped taking them
             break;
           }
-          if (IS_NAME) {
-            TRANSITION_TO_AND_CONSUME(NAME)
+          size_t size = stream->block_size();
+          if (b.size < size) {
+            b.data = (char*)alloc::realloc(alloc::Tag::QUEUE, b.data, b.size, size);
+            b.size = size;
           }
-          return report_error(Error::Parse)
-            << "Unexpected input '" << B << "' 0x" << std::hex << (unsigned)B;
-        }
-      } break; };
-
-      // ---------------------------------------------------------------------------
-      case ReadState::NAME: if (!IS_NAME) {
-        // ! "x"
-        SET_TOK_END
-        if (copy_symbol_name() == "__END__") {
-          _buf.is_end = true;
-          _buf.e = _buf.p;
-          break;
-        }
-        if (!on_token(Token::NAME)) return Status::ERROR;
-        TRANSITION_TO(ROOT)
-      } else if (B == ':') {
-        // "x:"
-        // not NAME "x", but ASSIGNMENT "x:" and possibly QUALNAME "x:y"
-        CONSUME_AND_CONTINUE_AS(ASSIGNMENT)
-      } else {
-        CONSUME
-      } break;
-
-      // ---------------------------------------------------------------------------
-      case ReadState::ASSIGNMENT: if (!IS_NAME) {
-        // ! ("x:" | "x:y:")
-        SET_TOK_END
-        if (!on_token(Token::ASSIGNMENT)) return Status::ERROR;
-        TRANSITION_TO(ROOT)
-      } else if (B == ':') {
-        // "x::"
-        return report_error(Error::Syntax) << "Unexpected extra ':'";
-      } else {
-        // "x:y"
-        CONSUME_AND_CONTINUE_AS(QUALNAME)
-      } break;
-
-      // ---------------------------------------------------------------------------
-      case ReadState::QUALNAME: if (!IS_NAME) {
-        // ! "x:y"
-        SET_TOK_END
-        if (!on_token(Token::QUALNAME)) return Status::ERROR;
-        TRANSITION_TO(ROOT)
-      } else if (B == ':') {
-        // "x:y:"
-        CONSUME_AND_CONTINUE_AS(ASSIGNMENT)
-      } else {
-        CONSUME
-      } break;
-
-      // ---------------------------------------------------------------------------
-      case ReadState::LINEBREAK: switch (B) {
-        case '\n': {
-          ACT_ENTER_LINEBREAK
-          CONSUME
-          break;
-        }
-        case ' ': case '\t': case 0xa0: /* NBSP */ {
-          ACT_ON_SPACE
-          CONSUME
-          break;
-        }
-        case ')': {
-          LEAVE_BLOCK_SCOPE_FROM_ENDPAREN
-          TRANSITION_TO(ROOT)
-        }
-        default: {
-          if (IS_CTRL) {
-            CONSUME
+          ssize_t n = stream->read(b.data, b.size);
+          b.error = n < 0 ? errno : 0;
+          b.len = n < 0 ? 0 : (size_t)n;
+          b.is_end = n < 0 || stream->at_end();
+          bool is_end = b.is_end;
+          blocks.push(b);
+          if (is_end) {
             break;
           }
-          // Leave
-          SET_TOK_END
-          if (_prev_indent_level == -1) {
-            // Special case: We just passed inital whitespace in input buffer
-            // dlog() << "Passed initial whitespace in input buffer";
-            if (_curr_indent_level != 0 /*&& _lineno != 1*/) {
-              // First non-comment line of input must be at level 0
-              return report_error(Error::Indentation) << "Unexpected indent";
-            }
-            if (!enter_scope(Scope::Type::LIST)) {
-              return Status::ERROR;
-            }
-
-          } else if (_prev_indent_level < _curr_indent_level) {
-            // Indentation increased
-            //   |a
-            //   |  b
-            //   |  ^-- we are here
-            //  ...
-            if (!enter_scope(Scope::Type::BLOCK) || !enter_scope(Scope::Type::LIST)) {
-              return Status::ERROR;
-            }
+        }
+        blocks.close();
+      });
+    }
 
-          } else if (_prev_indent_level > _curr_indent_level) {
-            // Indentation decreased
-            //   |a
-            //   |  b
-            //   |c
-            //   |^-- we are here
-            //  ...
-            LEAVE_BLOCK_SCOPE
-            if (!leave_scope(Scope::Type::LIST) || !enter_scope(Scope::Type::LIST)) {
-              return Status::ERROR;
+    std::thread parser_thread([&]{
+      trace::set_thread_name("parser");
+      size_t next = 0; // formatter to give the next item to
+      auto delete_used = [&]{
+        Expr* e;
+        while (used.try_pop(e)) { delete e; }
+      };
+      Emit emit = [&](const char* status, Expr* e, size_t document) {
+        parsed[next]->push(Item{status, e, document, std::string()});
+        next = (next + 1) % parsed.size();
+        delete_used();
+      };
+      if (!filenames.empty()) {
+        status = parse_files(emit);
+      } else {
+        new_parser();
+        Block b;
+        while (blocks.pop(b)) {
+          if (status == 0) {
+            if (b.error) {
+              fprintf(stderr, "%s: stdin: %s\n", argv[0], strerror(b.error));
+              status = 1;
+            } else if (!feed(b.data, b.len, b.is_end, emit)) {
+              status = 1;
             }
-
-          } else {
-            // newline to same indentation level means "new line scope"
-            // if (Bn(1) != '\\') ... // <- TODO: "A\n\B" == "A B"
-            if (!leave_scope(Scope::Type::LIST) || !enter_scope(Scope::Type::LIST)) {
-              return Status::ERROR;
+            if (status != 0) {
+              // Let the reader stop, and take what it has read
+              sat_atomic_store_rel(&aborted, true);
+              char c = 0;
+              if (write(wake[1], &c, 1) < 0) {
+                // the reader will still see `aborted` before its next read
+              }
             }
           }
-
-          _prev_indent_level = _curr_indent_level;
-          TRANSITION_TO(ROOT)
+          free_blocks.push(b);
         }
-      } break;
-
-      // ---------------------------------------------------------------------------
-      case ReadState::COMMENT: switch (B) {
-        case '\n': {
-          SET_TOK_END
-          if (!on_token(Token::COMMENT)) return Status::ERROR;
-          TRANSITION_TO(ROOT)
+        // free_blocks now holds all blocks but any the reader freed, as it has finished
+        while (free_blocks.try_pop(b)) {
+          alloc::free(alloc::Tag::QUEUE, b.data, b.size);
         }
-        default: {
-          CONSUME
-          break;
-        }
-      } break;
-
-      // ---------------------------------------------------------------------------
-    } // read_loop: while (_buf.p != _buf.e) switch (_read_state)
-
-    if (_buf.is_end) {
-      // We have reached the end of input
-      assert(!_scope_stack.empty());
-      if (!is_root_scope(top_scope())) {
-        // Special case: The source ends with an indented block. Leave to our root block.
-        _curr_indent_level = 0;
-        if (_prev_indent_level != -1) {
-          // There was at least one thing in the input, which means there's a line scope we must
-          // leave before leaving the root block scope.
-          if (!leave_scope(Scope::Type::LIST)) {
-            return Status::ERROR;
+      }
+      for (auto& q : parsed) {
+        q->close();
+      }
+      Expr* e;
+      while (used.pop(e)) { delete e; }
+    });
+
+    std::vector<std::thread> formatters;
+    for (size_t i = 0; i < pipeline_formatters; i++) {
+      formatters.emplace_back([&, i]{
+        trace::set_thread_name(("format " + std::to_string(i)).c_str());
+        Item it;
+        std::ostringstream ss;
+        while (parsed[i]->pop(it)) {
+          if (it.e) {
+            ss.str(std::string());
+            print_result(ss, it.e, it.document);
+            it.text = ss.str();
           }
-        } // else: Empty input
-
-        if (!is_root_scope(top_scope())) {
-          report_error(Error::Parse) << "Unexpected end of input"; // TODO: Work on this one
+          formatted[i]->push(std::move(it));
         }
-      }
-      // Note: Calling end_list when the scope is empty has no effect, so it's safe to call this
-      // multiple times, i.e. if the caller invokes `parse()` again after it returns `DONE`.
-      return _results.empty() ? Status::DONE : Status::RESULT;
+        formatted[i]->close();
+      });
     }
 
-    return Status::MORE;
-  }
-
-
-  Expr* next_result() {
-    return _results.pop_front();
-  }
-
-
-  Buf                 _buf;
-  size_t              _lineno = 0;              // current line number
-  int                 _prev_indent_level = -1;  // previous line indentation level
-  int                 _curr_indent_level = 0;  // current line indentation level
-  char                _indent_c = 0;            // type of line indentation
-  std::deque<Scope*>  _scope_stack;
-  Expr*               _expr_tail = 0;           // tail of current expression list
-  ReadState           _read_state = ReadState::LINEBREAK;
-  list::FIFO<Expr>    _results;  // Queue of expressions ready to e.g. be evaulated
-};
-
-// ------------------------------------------------------------------------------------------------
-
-
-} // namespace sat
-
-// ------------------------------------------------------------------------------------------------
-
-using namespace sat;
+    // Results to delete are held here while `used` is full rather than waited on, as a
+    // redefinition can let go of many results at once while the parser waits for a formatter
+    std::deque<Expr*> unused;
+    auto give_back = [&](Expr* e) {
+      unused.push_back(e);
+      while (!unused.empty() && used.try_push(std::move(unused.front()))) {
+        unused.pop_front();
+      }
+    };
+    index.set_deleter(give_back);
+    Item it;
+    for (size_t i = 0; formatted[i]->pop(it); i = (i + 1) % formatted.size()) {
+      if (it.status) {
+        printf("%s\n", it.status);
+      } else {
+        trace::Span span("output", "write");
+        fwrite(it.text.data(), 1, it.text.size(), stdout);
+        span.end();
+        use_result(it.e, give_back);
+      }
+    }
+    index.set_deleter(nullptr); // the rest is deleted after the parser thread has finished
+    for (Expr* e : unused) {
+      used.push(e); // the parser is only deleting now
+    }
+    used.close();
 
-int main(int argc, const char** argv) {
-  FILE* fp = stdin;
+    for (auto& t : formatters) { t.join(); }
+    parser_thread.join();
+    if (reader_thread.joinable()) {
+      reader_thread.join();
+    }
 
-  if (argc > 1) {
-    if ( (fp = fopen(argv[1], "r")) == NULL ) {
-      fprintf(stderr, "%s: No such file '%s'\n", argv[0], argv[1]);
-      return 1;
+    if (print_stats) {
+      // Waits tell which stage holds up the others: full_waits of a queue mean that its
+      // consumer is the slower side, empty_waits that its producer is.
+      auto print_queue = [&](const std::string& name, const SPSCQueueStats& st) {
+        #define ROW(k, value) \
+          std::cerr << std::left << std::setw(26) << (name + "." k) << std::right \
+                    << std::setw(14) << (value) << '\n';
+        ROW("items", st.items)
+        ROW("full_waits", st.full_waits)
+        ROW("empty_waits", st.empty_waits)
+        #undef ROW
+      };
+      if (filenames.empty()) {
+        print_queue("pipeline.read", blocks.stats()); // reader -> parser
+      }
+      for (size_t i = 0; i < parsed.size(); i++) {
+        print_queue("pipeline.fmt" + std::to_string(i), parsed[i]->stats()); // parser -> formatter
+        print_queue("pipeline.out" + std::to_string(i), formatted[i]->stats()); // -> main
+      }
     }
-  } else if (isatty(0)) {
-    fprintf(stderr, "usage: %s <file>\n", argv[0]);
-    return 1;
-  } // else printf("Reading from stdin\n");
+    return status;
+  };
 
-  Parser P(kStr_user_ns);
-  bool is_eof = false;
-
-  while (!is_eof) {
-    size_t bufsize;
-    char* buf = P.get_read_buf(bufsize);
-    // printf("bufsize: %zu\n", bufsize); bufsize = 4; // debug
-    assert(bufsize > 0 && "TODO: parser: fill move pending in buffer");
-    assert(bufsize < SIZE_MAX/2);
-    size_t len = fread(buf, 1, bufsize, fp);
-    is_eof = (len < bufsize);
-    P.fill(buf, len, is_eof);
-
-    parse:
-    switch (P.parse()) {
-      case Parser::Status::ERROR: {
-        printf("main: Parser::Status::ERROR\n");
-        return 1;
+  if (pipeline_formatters > 0) {
+    if (int status = pipeline()) {
+      return status;
+    }
+  } else if (filenames.empty()) {
+    // Read straight into the parser's buffer, in blocks which grow while stdin keeps up
+    Emit emit = [&](const char* status, Expr* e, size_t document) {
+      if (status) {
+        printf("%s\n", status);
+      } else {
+        print_result(std::cout, e, document);
+        use_result(e, [](Expr* e) { delete e; });
       }
-      case Parser::Status::RESULT: {
-        printf("main: Parser::Status::RESULT\n");
-        Expr* e;
-        while ( (e = P.next_result()) ) {
-          std::cout << "result: " << e << std::endl;
-          delete e;
-        }
-        // todo eval
-        goto parse;
+    };
+    new_parser();
+    stream.reset(new StreamReader(STDIN_FILENO));
+    bool is_eof = false;
+    while (!is_eof) {
+      size_t bufsize;
+      char* buf = P->get_read_buf(bufsize, stream->block_size());
+      assert(bufsize > 0);
+      assert(bufsize < SIZE_MAX/2);
+      ssize_t len = stream->read(buf, bufsize);
+      if (len < 0) {
+        fprintf(stderr, "%s: stdin: %s\n", argv[0], strerror(errno));
+        return 1;
       }
-      case Parser::Status::MORE: {
-        printf("main: Parser::Status::MORE\n");
-        assert(!is_eof);
-        break;
+      is_eof = stream->at_end();
+      trace::Span span("parse", "fill");
+      span.arg("bytes", (i64)len);
+      P->fill(buf, (size_t)len, is_eof);
+      span.end();
+      if (!parse(*P, is_eof, emit)) {
+        return 1;
       }
-      case Parser::Status::DONE: {
-        printf("main: Parser::Status::DONE\n");
-        assert(is_eof);
-        break;
+    }
+  } else {
+    Emit emit = [&](const char* status, Expr* e, size_t document) {
+      if (status) {
+        printf("%s\n", status);
+      } else {
+        print_result(std::cout, e, document);
+        use_result(e, [](Expr* e) { delete e; });
       }
+    };
+    if (int status = parse_files(emit)) {
+      return status;
+    }
+  }
+
+  for (const char* qname : lookups) {
+    const Expr* e = index.lookup(qname);
+    if (e) {
+      std::cout << "lookup: " << qname << ": " << e << std::endl;
+    } else {
+      std::cout << "lookup: " << qname << ": undefined" << std::endl;
     }
   }
 
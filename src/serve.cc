@@ -0,0 +1,601 @@
+#include "serve.hh"
+#include "parse.hh"
+#include "io.hh"
+#include "defer.hh"
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <iomanip>
+#include <sstream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace sat {
+
+static u64 now_us() {
+  return (u64)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void no_sigpipe(int fd) {
+  // Writing to a closed connection fails with EPIPE rather than killing the process
+  #ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  #else
+  (void)fd;
+  #endif
+}
+
+static bool write_all(int fd, const char* p, size_t len) {
+  #ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+  #else
+  const int flags = 0;
+  #endif
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, flags);
+    if (n < 0) {
+      if (errno == EINTR) { continue; }
+      return false;
+    }
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool write_response(int fd, const char* reason, const std::string& body) {
+  // reason is null for OK
+  std::string header = reason ? std::string("ERR ") + reason + " " : std::string("OK ");
+  header += std::to_string(body.size());
+  header += '\n';
+  return write_all(fd, (header + body).data(), header.size() + body.size());
+}
+
+struct Server::Conn {
+  // Buffered reading from a socket
+  int         fd;
+  std::string buf;
+  size_t      pos = 0;
+
+  enum class Result { OK, END, TIMEOUT };
+
+  Result fill(u64 deadline_us) {
+    // Read more into buf. A deadline of 0 waits forever.
+    if (pos == buf.size()) {
+      buf.clear();
+      pos = 0;
+    }
+    for (;;) {
+      if (deadline_us) {
+        u64 now = now_us();
+        if (now >= deadline_us) {
+          return Result::TIMEOUT;
+        }
+        pollfd pfd = { fd, POLLIN, 0 };
+        int n = poll(&pfd, 1, (int)SAT_MIN((deadline_us - now + 999) / 1000, (u64)INT32_MAX));
+        if (n < 0 && errno != EINTR) {
+          return Result::END;
+        }
+        if (n <= 0) {
+          continue;
+        }
+      }
+      char tmp[16 * 1024];
+      ssize_t n = ::read(fd, tmp, sizeof(tmp));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return Result::END;
+      }
+      buf.append(tmp, (size_t)n);
+      return Result::OK;
+    }
+  }
+
+  Result read_line(std::string& line, size_t max_len, u64 deadline_us) {
+    for (;;) {
+      size_t i = buf.find('\n', pos);
+      if (i != std::string::npos) {
+        line.assign(buf, pos, i - pos);
+        pos = i + 1;
+        return Result::OK;
+      }
+      if (buf.size() - pos > max_len) {
+        return Result::END;
+      }
+      Result r = fill(deadline_us);
+      if (r != Result::OK) {
+        return r;
+      }
+    }
+  }
+
+  Result read_n(size_t n, std::string& out, u64 deadline_us) {
+    out.clear();
+    for (;;) {
+      size_t take = SAT_MIN(n - out.size(), buf.size() - pos);
+      out.append(buf, pos, take);
+      pos += take;
+      if (out.size() == n) {
+        return Result::OK;
+      }
+      Result r = fill(deadline_us);
+      if (r != Result::OK) {
+        return r;
+      }
+    }
+  }
+
+  bool peer_gone() const {
+    // True if the other end has closed the connection, e.g. because it gave up on a request
+    pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) <= 0) {
+      return false;
+    }
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+  }
+};
+
+// ------------------------------------------------------------------------------------------------
+
+void LatencyHistogram::add(u64 us) {
+  size_t b = 0;
+  while (b + 1 < kBuckets && (1ull << b) <= us) { b++; }
+  sat_atomic_add_fetch(&counts[b], (u64)1);
+  sat_atomic_add_fetch(&total, (u64)1);
+  sat_atomic_add_fetch(&sum_us, us);
+  u64 max;
+  while (us > (max = max_us) && !sat_atomic_cas_bool(&max_us, max, us)) {}
+}
+
+u64 LatencyHistogram::percentile(double p) const {
+  u64 want = (u64)((double)total * p / 100.0 + 0.5);
+  u64 n = 0;
+  for (size_t b = 0; b < kBuckets; b++) {
+    n += counts[b];
+    if (n >= want && n > 0) {
+      return 1ull << b;
+    }
+  }
+  return 0;
+}
+
+std::ostream& operator<< (std::ostream& os, const LatencyHistogram& h) {
+  #define ROW(name, value) \
+    os << std::left << std::setw(26) << name << std::right << std::setw(14) << (value) << '\n';
+  ROW("latency.requests", h.total)
+  ROW("latency.mean_us", h.total ? h.sum_us / h.total : 0)
+  ROW("latency.p50_us", h.percentile(50))
+  ROW("latency.p90_us", h.percentile(90))
+  ROW("latency.p99_us", h.percentile(99))
+  ROW("latency.max_us", h.max_us)
+  for (size_t b = 0; b < LatencyHistogram::kBuckets; b++) {
+    if (h.counts[b]) {
+      ROW(std::string("latency.lt_") + std::to_string(1ull << b) + "us", h.counts[b])
+    }
+  }
+  #undef ROW
+  return os;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+static void put_u32(std::string& out, u32 v) {
+  char b[4] = { (char)v, (char)(v >> 8), (char)(v >> 16), (char)(v >> 24) };
+  out.append(b, 4);
+}
+
+static void encode_one(std::string& out, const Expr* e) {
+  out.push_back((char)e->type());
+  put_u32(out, e->offset());
+  if (e->is_str()) {
+    const Str::Imp* s = e->str_value();
+    put_u32(out, s->_size);
+    out.append(s->c_str(), s->_size);
+  } else if (e->is_list()) {
+    u32 n = 0;
+    for (const Expr* c = e->head(); c; c = c->next()) { n++; }
+    put_u32(out, n);
+  }
+}
+
+void encode_binary(std::string& out, const Expr* e) {
+  // In preorder, without recursion as lists can be nested arbitrarily deep
+  std::vector<const Expr*> next; // next expression to encode at each level of nesting
+  encode_one(out, e);
+  next.push_back(e->head());
+  while (!next.empty()) {
+    const Expr* x = next.back();
+    if (!x) {
+      next.pop_back();
+      continue;
+    }
+    next.back() = x->next();
+    encode_one(out, x);
+    if (x->head()) {
+      next.push_back(x->head());
+    }
+  }
+}
+
+// ------------------------------------------------------------------------------------------------
+
+Server::Server(Options opt) : _opt{std::move(opt)} {
+  _opt.nthreads = SAT_MAX(_opt.nthreads, (size_t)1);
+  // Workers intern symbols in and release them from the same set. This is never turned off
+  // again, since strings may outlive the server.
+  Str::WeakSet::set_threadsafe(true);
+}
+
+Server::~Server() {
+  if (_listen_fd != -1) {
+    ::close(_listen_fd);
+    unlink(_opt.path.c_str());
+  }
+  if (_wake[0] != -1) {
+    ::close(_wake[0]);
+    ::close(_wake[1]);
+  }
+}
+
+bool Server::listen(std::string& err) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (_opt.path.size() >= sizeof(addr.sun_path)) {
+    err = "socket path too long";
+    return false;
+  }
+  memcpy(addr.sun_path, _opt.path.c_str(), _opt.path.size() + 1);
+  _listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (_listen_fd == -1 || pipe(_wake) != 0) {
+    err = strerror(errno);
+    return false;
+  }
+  fcntl(_listen_fd, F_SETFD, FD_CLOEXEC);
+  unlink(_opt.path.c_str());
+  if (bind(_listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(_listen_fd, 128) != 0) {
+    err = strerror(errno);
+    ::close(_listen_fd);
+    _listen_fd = -1;
+    return false;
+  }
+  return true;
+}
+
+void Server::run() {
+  assert(_listen_fd != -1);
+  for (size_t i = 0; i < _opt.nthreads; i++) {
+    _threads.emplace_back([this]{ _worker(); });
+  }
+  while (!sat_atomic_load_acq(&_stopping)) {
+    pollfd pfds[2] = { { _listen_fd, POLLIN, 0 }, { _wake[0], POLLIN, 0 } };
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+    if (pfds[1].revents) {
+      break;
+    }
+    int fd = accept(_listen_fd, 0, 0);
+    if (fd == -1) {
+      continue;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    no_sigpipe(fd);
+    std::lock_guard<std::mutex> lock(_mu);
+    _conns.push_back(fd);
+    _cv.notify_one();
+  }
+  {
+    // Wake workers waiting for connections and those waiting for requests
+    std::lock_guard<std::mutex> lock(_mu);
+    sat_atomic_store_rel(&_stopping, true);
+    for (int fd : _active) { shutdown(fd, SHUT_RDWR); }
+    _cv.notify_all();
+  }
+  for (auto& t : _threads) { t.join(); }
+  _threads.clear();
+  for (int fd : _conns) { ::close(fd); }
+  _conns.clear();
+}
+
+void Server::stop() {
+  sat_atomic_store_rel(&_stopping, true);
+  char c = 0;
+  if (write(_wake[1], &c, 1) < 0) {
+    // the pipe is full, meaning that stop() was already called
+  }
+}
+
+LatencyHistogram Server::latency() const {
+  return _latency;
+}
+
+void Server::_worker() {
+  Parser P(kStr_user_ns); // reset for each request, keeping its buffers
+  std::unique_lock<std::mutex> lock(_mu);
+  for (;;) {
+    _cv.wait(lock, [&]{ return sat_atomic_load_acq(&_stopping) || !_conns.empty(); });
+    if (sat_atomic_load_acq(&_stopping)) {
+      return;
+    }
+    int fd = _conns.front();
+    _conns.pop_front();
+    _active.push_back(fd);
+    lock.unlock();
+    _serve(fd, P);
+    lock.lock();
+    _active.erase(std::find(_active.begin(), _active.end(), fd));
+    ::close(fd);
+  }
+}
+
+void Server::_serve(int fd, Parser& P) {
+  Conn c;
+  c.fd = fd;
+  std::string line;
+  while (!sat_atomic_load_acq(&_stopping)) {
+    // An idle connection is closed after a while rather than holding on to this worker
+    u64 deadline = _opt.idle_timeout_ms ? now_us() + (u64)_opt.idle_timeout_ms * 1000 : 0;
+    if (c.read_line(line, 64 * 1024, deadline) != Conn::Result::OK || !_handle(c, line, P)) {
+      break;
+    }
+  }
+}
+
+bool Server::_handle(Conn& c, const std::string& line, Parser& P) {
+  u64 start = now_us();
+  std::istringstream ss(line);
+  std::string cmd, id, format;
+  ss >> cmd;
+
+  if (cmd == "STATS") {
+    std::ostringstream body;
+    body << latency() << strings.stats();
+    return write_response(c.fd, 0, body.str());
+  }
+
+  if (cmd == "CANCEL") {
+    ss >> id;
+    size_t n = 0;
+    {
+      std::lock_guard<std::mutex> lock(_mu);
+      auto range = _requests.equal_range(id);
+      for (auto I = range.first; I != range.second; ++I, ++n) {
+        sat_atomic_store_rel(&I->second->cancelled, true);
+      }
+    }
+    return write_response(c.fd, 0, std::to_string(n) + "\n");
+  }
+
+  if (cmd != "PARSE" && cmd != "FILE") {
+    write_response(c.fd, "request", "unknown request '" + cmd + "'\n");
+    return false; // the rest of the request can't be told apart from the next one
+  }
+
+  u64 timeout_ms = 0;
+  ss >> id >> format >> timeout_ms;
+  bool binary = format == "binary";
+  if (!ss || (!binary && format != "text")) {
+    write_response(c.fd, "request", "bad request line\n");
+    return false;
+  }
+  u64 deadline = start + (timeout_ms ? timeout_ms : _opt.timeout_ms) * 1000;
+
+  // The source, in memory for PARSE and from a file for FILE
+  std::string src;
+  size_t src_offs = 0;
+  int file_fd = -1;
+  std::unique_ptr<StreamReader> file;
+  if (cmd == "PARSE") {
+    size_t nbytes = 0;
+    ss >> nbytes;
+    if (!ss || nbytes > 0xffffffffu) {
+      write_response(c.fd, "request", "bad request line\n");
+      return false;
+    }
+    if (nbytes > _opt.max_request_bytes) {
+      write_response(c.fd, "request", "request of " + std::to_string(nbytes) +
+                     " bytes is larger than the limit of " +
+                     std::to_string(_opt.max_request_bytes) + " bytes\n");
+      return false; // the payload isn't read, so the next request can't be found
+    }
+    Conn::Result r = c.read_n(nbytes, src, deadline);
+    if (r != Conn::Result::OK) {
+      if (r == Conn::Result::TIMEOUT) {
+        write_response(c.fd, "timeout", "timed out reading the request\n");
+      }
+      return false;
+    }
+  } else {
+    std::string path;
+    std::getline(ss >> std::ws, path);
+    file_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file_fd == -1) {
+      return write_response(c.fd, "io", path + ": " + strerror(errno) + "\n");
+    }
+    file.reset(new StreamReader(file_fd));
+  }
+  defer [&]{ if (file_fd != -1) { ::close(file_fd); } };
+
+  Request req{id, false};
+  std::multimap<std::string,Request*>::iterator reg;
+  {
+    std::lock_guard<std::mutex> lock(_mu);
+    reg = _requests.emplace(id, &req);
+  }
+  defer [&]{
+    std::lock_guard<std::mutex> lock(_mu);
+    _requests.erase(reg);
+  };
+
+  const char* reason = 0;
+  std::string body;
+  u32 nresults = 0;
+  std::ostringstream text;
+  P.reset();
+  bool is_end = false;
+  while (!is_end && !reason) {
+    if (sat_atomic_load_acq(&req.cancelled) || sat_atomic_load_acq(&_stopping) ||
+        c.peer_gone())
+    {
+      reason = "cancelled";
+      break;
+    }
+    if (now_us() > deadline) {
+      reason = "timeout";
+      break;
+    }
+    // Feed the parser in slices, so that cancellation and timeouts are noticed within one
+    const size_t kSliceSize = 64 * 1024;
+    size_t bufsize;
+    char* buf = P.get_read_buf(bufsize, kSliceSize);
+    size_t len = SAT_MIN(bufsize, kSliceSize);
+    if (file) {
+      ssize_t n = file->read(buf, len);
+      if (n < 0) {
+        reason = "io";
+        body = std::string(strerror(errno)) + "\n";
+        break;
+      }
+      len = (size_t)n;
+      is_end = file->at_end();
+    } else {
+      len = SAT_MIN(len, src.size() - src_offs);
+      memcpy(buf, src.data() + src_offs, len);
+      src_offs += len;
+      is_end = src_offs == src.size();
+    }
+    P.fill(buf, len, is_end);
+    for (;;) {
+      Parser::Status status = P.parse();
+      if (status == Parser::Status::RESULT) {
+        while (Expr* e = P.next_result()) {
+          if (binary) {
+            encode_binary(body, e);
+          } else {
+            text << e << '\n';
+          }
+          nresults++;
+          delete e;
+        }
+      } else if (status == Parser::Status::ERROR) {
+        SrcPos pos = P.pos();
+        reason = "parse";
+        body = "syntax error at " + std::to_string(pos.line) + ":" + std::to_string(pos.col) +
+               "\n";
+        break;
+      } else if (status != Parser::Status::DOCUMENT) {
+        break; // MORE or DONE
+      }
+    }
+  }
+
+  if (!reason) {
+    if (binary) {
+      std::string counted;
+      put_u32(counted, nresults);
+      body = counted + body;
+    } else {
+      body = text.str();
+    }
+  } else if (body.empty()) {
+    body = std::string(reason) + "\n";
+  }
+  bool ok = write_response(c.fd, reason, body);
+  _latency.add(now_us() - start);
+  return ok;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+Client::~Client() {
+  close();
+}
+
+bool Client::connect(const std::string& path) {
+  close();
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  _fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (_fd == -1) {
+    return false;
+  }
+  no_sigpipe(_fd);
+  if (::connect(_fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void Client::close() {
+  if (_fd != -1) {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+bool Client::request(const std::string& header, const std::string& payload, Response& r) {
+  r = Response();
+  std::string msg = header + "\n" + payload;
+  if (_fd == -1 || !write_all(_fd, msg.data(), msg.size())) {
+    return false;
+  }
+  Server::Conn c;
+  c.fd = _fd;
+  std::string line;
+  if (c.read_line(line, 1024, 0) != Server::Conn::Result::OK) {
+    return false;
+  }
+  std::istringstream ss(line);
+  std::string status;
+  size_t nbytes = 0;
+  ss >> status;
+  r.ok = status == "OK";
+  if (!r.ok) {
+    ss >> r.reason;
+  }
+  ss >> nbytes;
+  return ss && c.read_n(nbytes, r.body, 0) == Server::Conn::Result::OK;
+}
+
+bool Client::parse(const std::string& id, const char* format, u32 timeout_ms,
+                   const std::string& src, Response& r)
+{
+  return request("PARSE " + id + " " + format + " " + std::to_string(timeout_ms) + " " +
+                 std::to_string(src.size()), src, r);
+}
+
+bool Client::parse_file(const std::string& id, const char* format, u32 timeout_ms,
+                        const std::string& path, Response& r)
+{
+  return request("FILE " + id + " " + format + " " + std::to_string(timeout_ms) + " " + path,
+                 "", r);
+}
+
+bool Client::cancel(const std::string& id, Response& r) {
+  return request("CANCEL " + id, "", r);
+}
+
+bool Client::stats(Response& r) {
+  return request("STATS", "", r);
+}
+
+} // namespace sat
@@ -0,0 +1,163 @@
+// Parse daemon
+//
+// Server listens on a Unix domain socket and parses sources sent to it, so that clients don't
+// pay for starting a process and warming up the interner for every parse. Connections are
+// served by a pool of worker threads which share the string interner (`strings`.)
+//
+// The protocol is a header line followed by a payload of the length given in the header.
+// Requests:
+//
+//   PARSE <id> <format> <timeout_ms> <nbytes>\n<nbytes of source text>
+//   FILE <id> <format> <timeout_ms> <path>\n
+//   CANCEL <id>\n
+//   STATS\n
+//
+// <id> is chosen by the client and used by CANCEL, which can be sent on any connection, to stop
+// requests with that id. <format> is "text" for results printed one per line, or "binary" (see
+// encode_binary.) A <timeout_ms> of 0 uses the server's default. STATS returns a histogram of
+// request latencies and the counters of the interner. Every request gets one response:
+//
+//   OK <nbytes>\n<payload>
+//   ERR <reason> <nbytes>\n<message>
+//
+// where <reason> is one of "request", "io", "parse", "timeout" or "cancelled". A connection on
+// which no complete request line arrives within the idle timeout is closed, so that idle clients
+// don't keep the workers from serving others. A PARSE of more than the server's max_request_bytes
+// gets "ERR request" without its payload being read, after which the connection is closed.
+//
+// Example:
+//
+//   Server::Options opt;
+//   opt.path = "/tmp/sat.sock";
+//   Server server(opt);
+//   std::string err;
+//   if (!server.listen(err)) { ... }
+//   server.run(); // until server.stop()
+//
+//   Client c;
+//   c.connect("/tmp/sat.sock");
+//   Client::Response r;
+//   c.parse("1", "text", 0, "a b\n", r); // r.body == "a b\n"
+//
+#pragma once
+#include "common.h"
+#include "expr.hh"
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <ostream>
+
+namespace sat {
+
+struct Parser;
+
+struct LatencyHistogram {
+  // Durations in power-of-two buckets of microseconds. Bucket 0 holds durations under 1us and
+  // bucket i > 0 those in [2^(i-1), 2^i) us. add() may be called from any thread.
+  static const size_t kBuckets = 32;
+
+  u64 counts[kBuckets] = {};
+  u64 total = 0;
+  u64 sum_us = 0;
+  u64 max_us = 0;
+
+  void add(u64 us);
+  u64 percentile(double p) const;
+    // Upper bound in microseconds of the bucket holding the `p`th percentile (0 < p <= 100)
+};
+
+std::ostream& operator<< (std::ostream& os, const LatencyHistogram&);
+
+void encode_binary(std::string& out, const Expr* e);
+  // Appends `e` to `out` as: u8 type, u32 offset, then for strings u32 length and bytes, and for
+  // lists u32 count and that many expressions. Integers are little endian. A binary response is
+  // u32 number of results followed by the results.
+
+// ------------------------------------------------------------------------------------------------
+
+struct Server {
+  struct Options {
+    std::string path;                             // of the socket
+    size_t      nthreads = 4;                     // workers; each serves one connection at a time
+    u32         timeout_ms = 5000;                // for requests which don't give a timeout
+    u32         idle_timeout_ms = 30000;          // to wait for a request line; 0 waits forever
+    size_t      max_request_bytes = 64*1024*1024; // largest PARSE source accepted
+  };
+
+  Server(Options);
+  ~Server();
+  Server(const Server&) = delete;
+  Server& operator=(const Server&) = delete;
+
+  bool listen(std::string& err);
+    // Create the socket, replacing any file at its path. Sets `err` and returns false on error.
+  void run();
+    // Accept and serve connections until stop() is called
+  void stop();
+    // Make run() return after closing all connections. May be called from any thread.
+
+  LatencyHistogram latency() const;
+
+  // internal
+
+  struct Request {
+    std::string id;
+    bool        cancelled; // atomic, set by CANCEL on another connection
+  };
+  struct Conn;
+
+  void _worker();
+  void _serve(int fd, Parser&);
+  bool _handle(Conn&, const std::string& line, Parser&);
+    // Serve one request. Returns false if the connection should be closed.
+
+  Options                        _opt;
+  int                            _listen_fd = -1;
+  int                            _wake[2] = {-1, -1}; // pipe written to by stop()
+  bool                           _stopping = false; // atomic
+  std::vector<std::thread>       _threads;
+  std::mutex                     _mu;
+  std::condition_variable        _cv;
+  std::deque<int>                _conns;       // accepted, waiting for a worker
+  std::vector<int>               _active;      // being served
+  std::multimap<std::string,Request*> _requests; // in progress, by id
+  LatencyHistogram               _latency;
+};
+
+// ------------------------------------------------------------------------------------------------
+
+struct Client {
+  // Connection to a Server, for tests and `sat --client`
+
+  struct Response {
+    bool        ok = false;
+    std::string reason; // of an error
+    std::string body;
+  };
+
+  Client() {}
+  ~Client();
+  Client(const Client&) = delete;
+  Client& operator=(const Client&) = delete;
+
+  bool connect(const std::string& path);
+  void close();
+
+  bool request(const std::string& header, const std::string& payload, Response& r);
+    // Send a request line (without "\n") and payload, and wait for the response. Returns false
+    // if the connection failed.
+  bool parse(const std::string& id, const char* format, u32 timeout_ms, const std::string& src,
+             Response& r);
+  bool parse_file(const std::string& id, const char* format, u32 timeout_ms,
+                  const std::string& path, Response& r);
+  bool cancel(const std::string& id, Response& r);
+  bool stats(Response& r);
+
+  int _fd = -1;
+};
+
+} // namespace sat
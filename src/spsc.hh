@@ -0,0 +1,164 @@
+// Bounded queue between one producer thread and one consumer thread
+//
+// Neither side takes a lock: the producer owns the tail index and the consumer the head index,
+// and each only reads the other's. The two indices live on separate cache lines, and each side
+// keeps a copy of the other's index which it only refreshes when the queue looks full (or
+// empty), so that in steady state the threads don't take turns owning a cache line per item.
+//
+// push() waits while the queue is full and pop() while it is empty. This is the backpressure
+// which makes a producer run at the pace of its consumer rather than buffer without bound.
+// close() tells the consumer that no more items will come.
+//
+// Example:
+//
+//   SPSCQueue<Expr*> q(1024);
+//   std::thread t([&]{ for (Expr* e : results) q.push(e); q.close(); });
+//   Expr* e;
+//   while (q.pop(e)) { ... }
+//   t.join();
+//
+#pragma once
+#include "common.h"
+#include "alloc.hh"
+#include <thread>
+#include <vector>
+
+#include <time.h>
+
+namespace sat {
+
+struct SpinWait {
+  // Waiting for another thread to make progress: spin for a short while, then yield, then sleep
+  // for increasingly long up to 1ms, so that a thread waiting on a slow stage doesn't burn a
+  // core, nor sleep long after the other thread has moved on.
+  u32 n = 0;
+  void wait() {
+    if (n < 64) {
+      sat_cpu_relax();
+    } else if (n < 80) {
+      std::this_thread::yield();
+    } else {
+      struct timespec ts = { 0, (long)1000 << SAT_MIN(n - 80, (u32)10) }; // 1us .. 1ms
+      nanosleep(&ts, 0);
+    }
+    n++;
+  }
+};
+
+
+struct SPSCQueueStats {
+  u64 items = 0;       // pushed
+  u64 full_waits = 0;  // push() calls which found the queue full
+  u64 empty_waits = 0; // pop() calls which found the queue empty
+};
+
+
+template <typename T>
+struct SPSCQueue {
+  typedef SPSCQueueStats Stats;
+
+  explicit SPSCQueue(size_t capacity) {
+    // Capacity is rounded up to a power of two
+    size_t n = 1;
+    while (n < capacity) { n <<= 1; }
+    _slots.resize(n);
+    _mask = n - 1;
+  }
+  SPSCQueue(const SPSCQueue&) = delete;
+  SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+  // Plain operator new ignores the alignas(64) of the indices before C++17
+  static void* operator new(size_t z) {
+    void* p = alloc::aligned_malloc(alloc::Tag::QUEUE, alignof(SPSCQueue), z);
+    if (!p) { throw std::bad_alloc(); }
+    return p;
+  }
+  static void operator delete(void* p, size_t z) { alloc::free(alloc::Tag::QUEUE, p, z); }
+
+  size_t capacity() const { return _mask + 1; }
+
+  // Producer
+
+  bool try_push(T&& v) {
+    size_t t = _tail;
+    if (t - _head_cache > _mask) {
+      _head_cache = sat_atomic_load_acq(&_head);
+      if (t - _head_cache > _mask) {
+        return false; // full
+      }
+    }
+    _slots[t & _mask] = std::move(v);
+    sat_atomic_store_rel(&_tail, t + 1);
+    ++_items;
+    return true;
+  }
+
+  void push(T v) {
+    if (!try_push(std::move(v))) {
+      ++_full_waits;
+      SpinWait w;
+      do { w.wait(); } while (!try_push(std::move(v)));
+    }
+  }
+
+  void close() { sat_atomic_store_rel(&_closed, true); }
+    // No more items will be pushed
+
+  // Consumer
+
+  bool try_pop(T& v) {
+    size_t h = _head;
+    if (h == _tail_cache) {
+      _tail_cache = sat_atomic_load_acq(&_tail);
+      if (h == _tail_cache) {
+        return false; // empty
+      }
+    }
+    v = std::move(_slots[h & _mask]);
+    sat_atomic_store_rel(&_head, h + 1);
+    return true;
+  }
+
+  bool pop(T& v) {
+    // Take the next item, waiting for one if needed. Returns false once the queue is closed and
+    // all of its items have been taken.
+    if (try_pop(v)) {
+      return true;
+    }
+    ++_empty_waits;
+    SpinWait w;
+    for (;;) {
+      if (sat_atomic_load_acq(&_closed)) {
+        return try_pop(v); // items pushed before close() are visible now
+      }
+      w.wait();
+      if (try_pop(v)) {
+        return true;
+      }
+    }
+  }
+
+  Stats stats() const {
+    // Only exact when neither thread is using the queue
+    Stats st;
+    st.items = _items;
+    st.full_waits = _full_waits;
+    st.empty_waits = _empty_waits;
+    return st;
+  }
+
+  std::vector<T,alloc::Allocator<T,alloc::Tag::QUEUE>> _slots;
+  size_t _mask;
+
+  alignas(64) size_t _tail = 0;  // next slot to push to; written by the producer
+  size_t _head_cache = 0;        // the producer's copy of _head
+  u64    _items = 0;
+  u64    _full_waits = 0;
+  bool   _closed = false;
+
+  alignas(64) size_t _head = 0;  // next slot to pop from; written by the consumer
+  size_t _tail_cache = 0;        // the consumer's copy of _tail
+  u64    _empty_waits = 0;
+};
+
+} // namespace sat
@@ -1,4 +1,6 @@
 #include "str.hh"
+#include "trace.hh"
+#include <iomanip>
 
 namespace sat {
 
@@ -6,7 +8,7 @@ const char* kStrEmptyCStr = "";
 
 Str::Imp* Str::Imp::create(const char* s, uint32_t length, uint32_t hash) {
   uint32_t cstr_size = length+1;
-  Imp* self = (Imp*)malloc(sizeof(Imp) + cstr_size);
+  Imp* self = (Imp*)alloc::malloc(alloc::Tag::STR, sizeof(Imp) + cstr_size);
   if (self) {
     self->_hash = hash;
     self->_size = length;
@@ -27,7 +29,7 @@ Str::Imp* Str::Imp::create(const char* s, uint32_t length, uint32_t hash) {
 #define STRSET_TMPWRAP \
   assert(s); \
   if (len == 0xffffffffu) len = strlen(s); \
-  auto sw = ConstStr(s, len); \
+  Str::Wrap sw{SAT_REF_COUNT_CONSTANT, hash::fnv1a32_iter(s, len), len, s, {'\0'}}; \
   Str::Imp* obj = (Str::Imp*)&sw;
 
 
@@ -56,6 +58,51 @@ Str Str::Set::find(const char* s, uint32_t len) {
 }
 
 
+bool   Str::WeakSet::_threadsafe = false;
+Lock   Str::WeakSet::_mu;
+size_t Str::WeakSet::_invalidated = 0;
+
+void Str::WeakSet::set_threadsafe(bool on) {
+  _threadsafe = on;
+  _mu.set_counting(on);
+}
+
+bool Str::WeakSet::_try_retain(Str::Imp* s) {
+  // Retain `s` unless its last reference is being released on another thread, in which case it
+  // is about to be unbound from its slot by _unbind() (waiting for our lock.)
+  if (!_threadsafe) {
+    s->__retain();
+    return true;
+  }
+  for (;;) {
+    refcount_t n = s->__refcount;
+    if (n == SAT_REF_COUNT_CONSTANT) {
+      return true;
+    }
+    if (n == 0) {
+      return false;
+    }
+    if (sat_atomic_cas_bool(&s->__refcount, n, n + 1)) {
+      return true;
+    }
+  }
+}
+
+void Str::WeakSet::_unbind(Str::Imp* s) {
+  // Called for a string without references when _threadsafe. If its slot has been given to a
+  // new string with the same contents since its count reached zero (see _try_retain), get() has
+  // unbound it from the slot, and the slot is left alone.
+  std::lock_guard<Lock> lock(_mu);
+  if (s->_p.ps == kStrEmptyCStr) {
+    return;
+  }
+  WeakRef* w = s->_p.weak_self;
+  if (w && w->self == s) {
+    w->invalidate();
+    ++_invalidated;
+  }
+}
+
 Str Str::WeakSet::get(const char* s, uint32_t len) {
   // Return or create a Str object representing the byte array of `len` at `s`
   STRSET_TMPWRAP
@@ -63,19 +110,43 @@ Str Str::WeakSet::get(const char* s, uint32_t len) {
     // is already represented in the set, the whole operation is cheap in the sense that no copies
     // are created to deallocated.
 
+  std::unique_lock<Lock> lock(_mu, std::defer_lock);
+  if (_threadsafe) {
+    lock.lock();
+  }
+  if (_compact_ratio > 0 && _set.size() >= _compact_min_size &&
+      (float)(_invalidated - _invalidated_at_compact) > _compact_ratio * (float)_set.size())
+  {
+    _compact();
+  }
+  size_t buckets = trace::is_enabled() ? _set.bucket_count() : 0;
   auto P = _set.emplace(obj);
-  if (P.second || !P.first->self) {
+  if (trace::is_enabled() && _set.bucket_count() != buckets) {
+    trace::instant("intern", "rehash", trace::Arg("buckets", (i64)_set.bucket_count()),
+                   trace::Arg("size", (i64)_set.size()));
+  }
+  ++_stats.lookups;
+  if (P.second || !P.first->self || !_try_retain(P.first->self)) {
+    ++_stats.misses;
+    if (!P.second) {
+      ++_stats.slot_reuses;
+    }
     // Did insert. Update inserted pointer with the address of a new Str::Imp
     // printf("intern MISS (%s) '%s'\n", (!P.first->self ? "reuse-slot" : "new-slot"), s);
     obj = Str::Imp::create(s, len);
     WeakRef* ws = ((WeakRef*)(&*P.first));
+    if (!P.second) {
+      // Unbind a string which is being deallocated on another thread, so that its _unbind()
+      // doesn't touch the slot, which may have been removed by a compaction by then.
+      ws->reset();
+    }
     ws->self = obj;
     ws->_bind();
   } else {
     // Does exist
     // printf("intern HIT '%s'\n", s);
-    obj = P.first->self;
-    obj->__retain();
+    ++_stats.hits;
+    obj = P.first->self; // retained by _try_retain
   }
 
   return std::move(Str{obj, false/* give reference as we already incremented it */});
@@ -83,8 +154,108 @@ Str Str::WeakSet::get(const char* s, uint32_t len) {
 
 Str Str::WeakSet::find(const char* s, uint32_t len) {
   STRSET_TMPWRAP
+  std::unique_lock<Lock> lock(_mu, std::defer_lock);
+  if (_threadsafe) {
+    lock.lock();
+  }
   auto I = _set.find(obj);
-  return I == _set.end() ? nullptr : std::move(Str{I->self, true/* +1 reference */});
+  ++_stats.lookups;
+  if (I == _set.end() || !I->self || !_try_retain(I->self)) {
+    ++_stats.misses;
+    return nullptr;
+  }
+  ++_stats.hits;
+  return std::move(Str{I->self, false/* retained by _try_retain */});
+}
+
+size_t Str::WeakSet::compact() {
+  std::unique_lock<Lock> lock(_mu, std::defer_lock);
+  if (_threadsafe) {
+    lock.lock();
+  }
+  return _compact();
+}
+
+size_t Str::WeakSet::_compact() {
+  // Slots of live strings are left where they are, as the strings point to them (weak_self)
+  trace::Span span("intern", "compact");
+  size_t removed = 0;
+  for (auto I = _set.begin(); I != _set.end(); ) {
+    if (I->self) {
+      ++I;
+    } else {
+      I = _set.erase(I);
+      ++removed;
+    }
+  }
+  // Room to grow by as much again before the next rehash
+  _set.rehash(SAT_MAX(_min_buckets, (size_t)((float)_set.size() * 2 / _set.max_load_factor())));
+  _invalidated_at_compact = _invalidated;
+  ++_stats.compactions;
+  _stats.compacted += removed;
+  span.arg("removed", (i64)removed);
+  return removed;
+}
+
+void Str::WeakSet::set_compaction(float max_dead_ratio, size_t min_size) {
+  std::unique_lock<Lock> lock(_mu, std::defer_lock);
+  if (_threadsafe) {
+    lock.lock();
+  }
+  _compact_ratio = max_dead_ratio;
+  _compact_min_size = min_size;
+}
+
+Str::WeakSet::Stats Str::WeakSet::stats() const {
+  std::unique_lock<Lock> lock(_mu, std::defer_lock);
+  if (_threadsafe) {
+    lock.lock();
+  }
+  Stats st = _stats;
+  st.size = _set.size();
+  st.buckets = _set.bucket_count();
+  st.load_factor = _set.load_factor();
+  size_t probes = 0;
+  for (size_t b = 0; b < st.buckets; b++) {
+    size_t n = _set.bucket_size(b);
+    if (n > st.max_probe_len) {
+      st.max_probe_len = n;
+    }
+    probes += (n * (n + 1)) / 2; // finding the i:th slot in a chain takes i compares
+    for (auto I = _set.begin(b), E = _set.end(b); I != E; ++I) {
+      if (!I->self) ++st.dead;
+    }
+  }
+  st.mean_probe_len = st.size ? (double)probes / (double)st.size : 0.0;
+  // A slot is a node holding a WeakRef, a link to the next node and the cached hash
+  st.memory = st.buckets * sizeof(void*) + st.size * (sizeof(WeakRef) + 2 * sizeof(void*));
+  st.lock_contended = _mu._stats.contended;
+  st.lock_wait_us = (double)_mu._stats.wait_ns / 1000.0;
+  return st;
+}
+
+std::ostream& operator<< (std::ostream& os, const Str::WeakSet::Stats& st) {
+  os << std::dec;
+  #define ROW(name, value) \
+    os << std::left << std::setw(26) << name << std::right << std::setw(14) << value << '\n';
+  ROW("intern.lookups", st.lookups)
+  ROW("intern.hits", st.hits)
+  ROW("intern.misses", st.misses)
+  ROW("intern.slot_reuses", st.slot_reuses)
+  ROW("intern.compactions", st.compactions)
+  ROW("intern.compacted", st.compacted)
+  ROW("intern.size", st.size)
+  ROW("intern.dead", st.dead)
+  ROW("intern.dead_ratio", st.dead_ratio())
+  ROW("intern.buckets", st.buckets)
+  ROW("intern.load_factor", st.load_factor)
+  ROW("intern.max_probe_len", st.max_probe_len)
+  ROW("intern.mean_probe_len", st.mean_probe_len)
+  ROW("intern.memory", st.memory)
+  ROW("intern.lock_contended", st.lock_contended)
+  ROW("intern.lock_wait_us", st.lock_wait_us)
+  #undef ROW
+  return os;
 }
 
 #undef STRSET_TMPWRAP
@@ -39,6 +39,8 @@
 #pragma once
 #include "common.h"
 #include "hash.hh"
+#include "alloc.hh"
+#include "lock.hh"
 #include <ostream>
 #include <unordered_set>
 #include <unordered_map>
@@ -85,8 +87,9 @@ struct Str {
     // As long as a string is in use, it will remain in the set. But when the string is deallocated,
     // the slot in the set used to hold that string will be invalidated, and marked for reuse.
 
-  template<typename V> using Map =
-    typename std::unordered_map<Str,V,Str::Hash,Str::Equal>;
+  template<typename V, alloc::Tag tag = alloc::Tag::MAP> using Map =
+    typename std::unordered_map<Str,V,Str::Hash,Str::Equal,
+                                alloc::Allocator<std::pair<const Str,V>,tag>>;
     // Uniquely maps strings to values of type `V`
 
   SAT_REF_MIXIN_NOVTABLE_IMPL(Str, Imp)
@@ -154,7 +157,7 @@ struct __attribute__((packed)) Str::Imp : ref_counted_novtable {
   static Imp* create(const char* s, uint32_t length, uint32_t hash);
 
   static Imp* create(const char* s, uint32_t length) {
-    return create(s, length, Str::hash(s, length));
+    return create(s, length, hash::fnv1a32_iter(s, length));
   }
 
   bool equals(const Imp* other) const {
@@ -303,27 +306,6 @@ struct Str::WeakRef {
 };
 
 
-inline void Str::__dealloc(Imp* self) {
-  assert(*self->_cstr || self->_p.ps == kStrEmptyCStr); // or this is a Wrap type
-    // Wrap should not be subject to ref counting.
-    // Const objects are not subject to ref counting.
-  // printf("Str::__dealloc: self = %p\n"
-  //        "                _p.weak_self = %p\n"
-  //        "                self->_p.ps == kStrEmptyCStr: %s\n"
-  //        "                c_str():   '%s'\n"
-  //        "Str::__dealloc: c_str()[0]: 0x%x\n"
-  //        ,self
-  //        ,self->_p.weak_self
-  //        ,(self->_p.ps == kStrEmptyCStr ? "true" : "false")
-  //        ,self->c_str()
-  //        ,self->c_str()[0] );
-  if (self->_p.ps != kStrEmptyCStr && self->_p.weak_self) {
-    self->_p.weak_self->invalidate();
-  }
-  std::free(self);
-}
-
-
 // A constant-expression initializable string which is bridge-free
 // compatible with a Str::Imp.
 
@@ -397,7 +379,8 @@ struct Str::Set {
     // Return a Str if the set contains `s` of `len`. Otherwise a null Str is returned.
 
 protected:
-  typedef std::unordered_set<Str::Imp*, Str::Hash, Str::Equal> set_type;
+  typedef std::unordered_set<Str::Imp*, Str::Hash, Str::Equal,
+                             alloc::Allocator<Str::Imp*, alloc::Tag::INTERN>> set_type;
   set_type _set;
 };
 
@@ -409,7 +392,7 @@ struct Str::WeakSet {
   // the slot in the set used to hold that string will be invalidated, and marked for reuse.
 
   WeakSet(std::initializer_list<WeakRef> items, size_t min_buckets=8)
-    : _set{items, min_buckets} {}
+    : _set{items, min_buckets}, _min_buckets{min_buckets} {}
     // Initialize the set with `items`. Use a minimum of `min_buckets` for hashing.
 
   template <typename... Args> WeakSet(Args... items)
@@ -422,9 +405,87 @@ struct Str::WeakSet {
   Str find(const char* s, uint32_t len=0xffffffffu);
     // Return a Str if the set contains `s` of `len`. Otherwise a null Str is returned.
 
+  size_t compact();
+    // Remove the slots of deallocated strings and resize the table to fit the strings which are
+    // left. Returns the number of slots removed. O(size + buckets)
+
+  void set_compaction(float max_dead_ratio, size_t min_size=1024);
+    // Make get() compact the set once more strings have been deallocated since the last
+    // compaction than `max_dead_ratio` times its size, if its size is at least `min_size`.
+    // Deallocations are counted for all WeakSets together, so with several sets this may compact
+    // early but never late. A ratio of 0 turns it off. Default is 0.25 with a min_size of 1024.
+
+  struct Stats {
+    size_t lookups = 0;         // calls to get() and find()
+    size_t hits = 0;            // lookups that found a live string
+    size_t misses = 0;          // lookups that did not
+    size_t slot_reuses = 0;     // misses in get() that reused the slot of a deallocated string
+    size_t compactions = 0;     // calls to compact(), including those made by get()
+    size_t compacted = 0;       // dead slots removed by compactions
+    // The following are computed by stats() by visiting every bucket
+    size_t size = 0;            // slots in use, including dead ones
+    size_t dead = 0;            // slots of deallocated strings
+    size_t buckets = 0;
+    float  load_factor = 0;
+    size_t max_probe_len = 0;   // longest bucket chain
+    double mean_probe_len = 0;  // average number of slots compared by a successful lookup
+    size_t memory = 0;          // approximate bytes used by buckets and slots
+    // Of the lock shared by all sets, when threadsafe
+    u64    lock_contended = 0;  // lookups which found the lock taken by another thread
+    double lock_wait_us = 0;    // total time spent waiting for it
+
+    double dead_ratio() const { return size ? (double)dead / (double)size : 0.0; }
+  };
+
+  Stats stats() const;
+    // Return counters and the current shape of the hash table. O(buckets)
+
+  static void set_threadsafe(bool);
+    // Make get(), find() and stats() of all WeakSets safe to call from many threads at once, and
+    // strings safe to release on any thread. Off by default, as it costs a lock and unlock per
+    // lookup. Must not be changed while other threads use strings.
+
+  static bool   _threadsafe;
+  static Lock   _mu;  // held while looking up strings and while unbinding dying ones
+  static size_t _invalidated; // slots invalidated in all sets; guarded by _mu if _threadsafe
+  static void _unbind(Str::Imp*);
+  static bool _try_retain(Str::Imp*);
+  size_t _compact();
+
 protected:
-  typedef std::unordered_set<WeakRef, WeakRef::Hash, WeakRef::EqualNullTrue> set_type;
+  Stats _stats;
+  typedef std::unordered_set<WeakRef, WeakRef::Hash, WeakRef::EqualNullTrue,
+                             alloc::Allocator<WeakRef, alloc::Tag::INTERN>> set_type;
   set_type _set;
+  size_t   _min_buckets;
+  float    _compact_ratio = 0.25f;
+  size_t   _compact_min_size = 1024;
+  size_t   _invalidated_at_compact = 0; // value of _invalidated at the last compaction
 };
 
+std::ostream& operator<< (std::ostream& os, const Str::WeakSet::Stats&);
+
+inline void Str::__dealloc(Imp* self) {
+  assert(*self->_cstr || self->_p.ps == kStrEmptyCStr); // or this is a Wrap type
+    // Wrap should not be subject to ref counting.
+    // Const objects are not subject to ref counting.
+  // printf("Str::__dealloc: self = %p\n"
+  //        "                _p.weak_self = %p\n"
+  //        "                self->_p.ps == kStrEmptyCStr: %s\n"
+  //        "                c_str():   '%s'\n"
+  //        "Str::__dealloc: c_str()[0]: 0x%x\n"
+  //        ,self
+  //        ,self->_p.weak_self
+  //        ,(self->_p.ps == kStrEmptyCStr ? "true" : "false")
+  //        ,self->c_str()
+  //        ,self->c_str()[0] );
+  if (WeakSet::_threadsafe) {
+    WeakSet::_unbind(self); // weak_self may be changed by WeakSet::get() until we hold the lock
+  } else if (self->_p.ps != kStrEmptyCStr && self->_p.weak_self) {
+    self->_p.weak_self->invalidate();
+    ++WeakSet::_invalidated;
+  }
+  alloc::free(alloc::Tag::STR, (void*)self, sizeof(Imp) + self->_size + 1);
+}
+
 } // namespace sat
@@ -0,0 +1,210 @@
+// Hash map keyed by interned strings
+//
+// Since every interned string is unique, keys are compared by pointer and hashed with the hash
+// already stored in the string, so a lookup never looks at the bytes of a key. Keys must have
+// been interned (e.g. with `strings.get()`); two equal but separately allocated strings are
+// different keys. The map holds a reference to each key.
+//
+// Open addressing with linear probing. Erasing shifts following entries back instead of
+// leaving tombstones. Up to `InlineCap * 3/4` entries are stored inside the map itself.
+//
+// Example:
+//
+//   SymMap<Expr*> m;
+//   m.set(strings.get("x"), e);
+//   Expr** v = m.find(strings.get("x"));
+//
+#pragma once
+#include "common.h"
+#include "str.hh"
+#include "alloc.hh"
+#include <utility>
+
+namespace sat {
+
+template <typename V, size_t InlineCap = 8, alloc::Tag tag = alloc::Tag::MAP>
+struct SymMap {
+  static_assert(InlineCap >= 2 && (InlineCap & (InlineCap - 1)) == 0,
+                "InlineCap must be a power of two");
+  typedef Str::Imp* Key;
+
+  struct Slot {
+    Key key = 0; // null when the slot is free
+    V   value;
+  };
+
+  SymMap() {}
+  SymMap(const SymMap& other) { *this = other; }
+  SymMap(SymMap&& other) { *this = std::move(other); }
+  ~SymMap() { clear(); _free_slots(); }
+
+  SymMap& operator=(const SymMap& other) {
+    if (this != &other) {
+      clear();
+      _reserve(other._size);
+      other.foreach([&](Key k, const V& v) { set(k, v); });
+    }
+    return *this;
+  }
+
+  SymMap& operator=(SymMap&& other) {
+    if (this != &other) {
+      clear();
+      _free_slots();
+      if (other._slots == other._inline) {
+        for (size_t i = 0; i < InlineCap; i++) {
+          _inline[i].key = other._inline[i].key;
+          _inline[i].value = std::move(other._inline[i].value);
+          other._inline[i].key = 0;
+        }
+      } else {
+        _slots = other._slots;
+        other._slots = other._inline;
+      }
+      _cap = other._cap;   other._cap = InlineCap;
+      _size = other._size; other._size = 0;
+    }
+    return *this;
+  }
+
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+  size_t capacity() const { return _cap; } // number of slots
+
+  V* find(const Str::Imp* k) {
+    if (!k) { return 0; }
+    size_t mask = _cap - 1;
+    for (size_t i = k->_hash & mask; ; i = (i + 1) & mask) {
+      Slot& s = _slots[i];
+      if (s.key == k) { return &s.value; }
+      if (!s.key) { return 0; }
+    }
+  }
+  const V* find(const Str::Imp* k) const { return const_cast<SymMap*>(this)->find(k); }
+  V* find(const Str& k) { return find(k.self); }
+  const V* find(const Str& k) const { return find(k.self); }
+
+  V& operator[](Key k) {
+    // Value for `k`, inserting a default-constructed value if `k` is not in the map
+    Slot& s = _insert_slot(k);
+    return s.value;
+  }
+  V& operator[](const Str& k) { return (*this)[k.self]; }
+
+  bool set(Key k, V v) {
+    // Associate `k` with `v`. Returns true if `k` was added, false if it was already in the map.
+    size_t size = _size;
+    _insert_slot(k).value = std::move(v);
+    return _size != size;
+  }
+  bool set(const Str& k, V v) { return set(k.self, std::move(v)); }
+
+  bool erase(const Str::Imp* k) {
+    if (!k) { return false; }
+    size_t mask = _cap - 1;
+    size_t i = k->_hash & mask;
+    while (_slots[i].key != k) {
+      if (!_slots[i].key) { return false; }
+      i = (i + 1) & mask;
+    }
+    Str::__release(_slots[i].key);
+    // Shift back following entries of the same probe run which would otherwise become
+    // unreachable
+    for (size_t j = (i + 1) & mask; _slots[j].key; j = (j + 1) & mask) {
+      size_t home = _slots[j].key->_hash & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        _slots[i].key = _slots[j].key;
+        _slots[i].value = std::move(_slots[j].value);
+        i = j;
+      }
+    }
+    _slots[i].key = 0;
+    _slots[i].value = V();
+    --_size;
+    return true;
+  }
+  bool erase(const Str& k) { return erase(k.self); }
+
+  void clear() {
+    for (size_t i = 0; i < _cap; i++) {
+      if (_slots[i].key) {
+        Str::__release(_slots[i].key);
+        _slots[i].key = 0;
+        _slots[i].value = V();
+      }
+    }
+    _size = 0;
+  }
+
+  template <typename F> void foreach(F f) const {
+    // Calls f(Key, const V&) for each entry, in no particular order
+    for (size_t i = 0; i < _cap; i++) {
+      if (_slots[i].key) { f(_slots[i].key, _slots[i].value); }
+    }
+  }
+
+  // ---------------------------------------------------------------------------------------------
+
+  Slot& _insert_slot(Key k) {
+    assert(k != 0);
+    size_t mask = _cap - 1;
+    size_t i = k->_hash & mask;
+    for (; _slots[i].key; i = (i + 1) & mask) {
+      if (_slots[i].key == k) { return _slots[i]; }
+    }
+    if ((_size + 1) * 4 > _cap * 3) {
+      // Keep the load factor at or below 3/4
+      _rehash(_cap * 2);
+      return _insert_slot(k);
+    }
+    Str::__retain(k);
+    _slots[i].key = k;
+    ++_size;
+    return _slots[i];
+  }
+
+  void _reserve(size_t n) {
+    size_t cap = _cap;
+    while (n * 4 > cap * 3) { cap *= 2; }
+    if (cap != _cap) { _rehash(cap); }
+  }
+
+  void _rehash(size_t cap) {
+    Slot* old = _slots;
+    size_t oldcap = _cap;
+    _slots = (Slot*)alloc::malloc(tag, sizeof(Slot) * cap);
+    if (!_slots) { throw std::bad_alloc(); }
+    for (size_t i = 0; i < cap; i++) { new (&_slots[i]) Slot(); }
+    _cap = cap;
+    size_t mask = cap - 1;
+    for (size_t i = 0; i < oldcap; i++) {
+      if (old[i].key) {
+        size_t j = old[i].key->_hash & mask;
+        while (_slots[j].key) { j = (j + 1) & mask; }
+        _slots[j].key = old[i].key; // reference moves along with the key
+        _slots[j].value = std::move(old[i].value);
+        old[i].key = 0;
+      }
+    }
+    if (old != _inline) {
+      for (size_t i = 0; i < oldcap; i++) { old[i].~Slot(); }
+      alloc::free(tag, (void*)old, sizeof(Slot) * oldcap);
+    }
+  }
+
+  void _free_slots() {
+    if (_slots != _inline) {
+      for (size_t i = 0; i < _cap; i++) { _slots[i].~Slot(); }
+      alloc::free(tag, (void*)_slots, sizeof(Slot) * _cap);
+      _slots = _inline;
+      _cap = InlineCap;
+    }
+  }
+
+  Slot*  _slots = _inline;
+  size_t _cap = InlineCap; // number of slots at _slots; always a power of two
+  size_t _size = 0;        // number of entries
+  Slot   _inline[InlineCap];
+};
+
+} // namespace sat
@@ -0,0 +1,138 @@
+#include "trace.hh"
+#include "alloc.hh"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <unistd.h> // getpid()
+
+namespace sat {
+namespace trace {
+
+bool _enabled = false;
+u64  _t0 = 0;
+
+struct ThreadBuf {
+  u32         tid;
+  std::string name;
+  std::vector<Event,alloc::Allocator<Event,alloc::Tag::TRACE>> events;
+};
+
+static std::mutex _mu; // guards _threads
+static std::vector<std::unique_ptr<ThreadBuf>> _threads;
+static thread_local ThreadBuf* _tbuf = nullptr;
+
+static ThreadBuf& thread_buf() {
+  // The calling thread's buffer, which is kept after the thread exits so that write() sees it
+  if (!_tbuf) {
+    std::lock_guard<std::mutex> lock(_mu);
+    _threads.emplace_back(new ThreadBuf());
+    _tbuf = _threads.back().get();
+    _tbuf->tid = (u32)_threads.size();
+  }
+  return *_tbuf;
+}
+
+void enable(bool enabled) {
+  if (enabled && !_enabled) {
+    std::lock_guard<std::mutex> lock(_mu);
+    for (auto& t : _threads) {
+      t->events.clear();
+    }
+    _t0 = 0;
+    _t0 = now();
+  }
+  _enabled = enabled;
+}
+
+void set_thread_name(const char* name) {
+  if (_enabled) {
+    thread_buf().name = name;
+  }
+}
+
+void _record(const Event& e) {
+  thread_buf().events.push_back(e);
+}
+
+size_t count() {
+  std::lock_guard<std::mutex> lock(_mu);
+  size_t n = 0;
+  for (auto& t : _threads) {
+    n += t->events.size();
+  }
+  return n;
+}
+
+static void write_str(FILE* f, const char* s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    u8 c = (u8)*s;
+    if (c == '"' || c == '\\') {
+      fputc('\\', f);
+      fputc(c, f);
+    } else if (c < 0x20) {
+      fprintf(f, "\\u%04x", c);
+    } else {
+      fputc(c, f);
+    }
+  }
+  fputc('"', f);
+}
+
+bool write(const char* path) {
+  FILE* f = fopen(path, "w");
+  if (!f) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(_mu);
+  int pid = (int)getpid();
+  const char* sep = "\n";
+  fputs("{\"traceEvents\":[", f);
+  for (auto& t : _threads) {
+    if (!t->name.empty()) {
+      fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":",
+              sep, pid, t->tid);
+      write_str(f, t->name.c_str());
+      fputs("}}", f);
+      sep = ",\n";
+    }
+    for (const Event& e : t->events) {
+      fputs(sep, f);
+      sep = ",\n";
+      fputs("{\"cat\":", f);
+      write_str(f, e.cat);
+      fputs(",\"name\":", f);
+      write_str(f, e.name);
+      fprintf(f, ",\"ph\":\"%c\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f",
+              e.ph, pid, t->tid, (double)e.ts / 1000.0);
+      if (e.ph == 'X') {
+        fprintf(f, ",\"dur\":%.3f", (double)e.dur / 1000.0);
+      } else {
+        fputs(",\"s\":\"t\"", f); // instant scoped to the thread
+      }
+      if (e.args[0].name) {
+        fputs(",\"args\":{", f);
+        for (size_t i = 0; i < 2 && e.args[i].name; i++) {
+          if (i) { fputc(',', f); }
+          write_str(f, e.args[i].name);
+          fputc(':', f);
+          if (e.args[i].str) {
+            write_str(f, e.args[i].str);
+          } else {
+            fprintf(f, "%lld", (long long)e.args[i].num);
+          }
+        }
+        fputc('}', f);
+      }
+      fputc('}', f);
+    }
+  }
+  fputs("\n],\"displayTimeUnit\":\"ns\"}\n", f);
+  bool ok = !ferror(f);
+  return (fclose(f) == 0) && ok;
+}
+
+}} // namespace sat::trace
@@ -0,0 +1,122 @@
+// Opt-in timeline of what each thread is doing, written out in Chrome's trace event format.
+//
+// Spans (a name with a start and a duration) and instants are recorded into a buffer of the
+// thread which makes them, and written out by write() as JSON which Perfetto (ui.perfetto.dev)
+// and chrome://tracing can open, with a track per thread. Tracing is off by default, in which
+// case a trace point costs a predictable branch.
+//
+// Example:
+//
+//   trace::enable(true);
+//   trace::set_thread_name("main");
+//   {
+//     trace::Span span("parse", "parse");
+//     Parser::Status status = P.parse();
+//     span.arg("status", Parser::status_name(status));
+//   } // span ends here
+//   trace::instant("intern", "rehash", trace::Arg("buckets", (i64)n));
+//   trace::write("out.json");
+//
+// Categories, names and string arguments are kept by pointer, so they must outlive the trace,
+// e.g. be string literals. A thread's events must all be recorded before write() is called.
+//
+#pragma once
+#include "common.h"
+#include <chrono>
+
+namespace sat {
+namespace trace {
+
+struct Arg {
+  Arg() {}
+  Arg(const char* name, i64 v) : name{name}, num{v} {}
+  Arg(const char* name, const char* v) : name{name}, str{v} {}
+  const char* name = nullptr; // null if there's no argument
+  const char* str = nullptr;  // value if it's a string, else `num` is
+  i64         num = 0;
+};
+
+struct Event {
+  const char* cat = nullptr;
+  const char* name = nullptr;
+  char        ph = 'X'; // 'X' for a span, 'i' for an instant
+  u64         ts = 0;   // start, in nanoseconds since enable(true)
+  u64         dur = 0;  // nanoseconds, of a span
+  Arg         args[2];
+};
+
+extern bool _enabled;
+extern u64  _t0;
+
+inline static bool is_enabled() { return _enabled; }
+void enable(bool);
+  // Start or stop recording. Starting again clears what has been recorded.
+
+inline static u64 now() {
+  return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count() - _t0;
+}
+
+void set_thread_name(const char* name);
+  // Name the calling thread's track, if tracing is enabled. The name is copied.
+
+bool write(const char* path);
+  // Write all recorded events to a file at `path`. Returns false with errno set if that fails.
+
+size_t count();
+  // Number of events recorded
+
+void _record(const Event&);
+
+struct Span {
+  // Records a span from construction to destruction, or to end()
+  Span(const char* cat, const char* name) {
+    if (_enabled) {
+      e.cat = cat;
+      e.name = name;
+      e.ts = now();
+    }
+  }
+  ~Span() { end(); }
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+  Span& arg(const char* name, i64 v) { return arg(Arg(name, v)); }
+  Span& arg(const char* name, const char* v) { return arg(Arg(name, v)); }
+  Span& arg(const Arg& a) {
+    // Sets the first argument, then the second; more than two are ignored
+    if (e.name) {
+      if (!e.args[0].name) {
+        e.args[0] = a;
+      } else if (!e.args[1].name) {
+        e.args[1] = a;
+      }
+    }
+    return *this;
+  }
+
+  void end() {
+    if (e.name) {
+      e.dur = now() - e.ts;
+      _record(e);
+      e.name = nullptr;
+    }
+  }
+
+  Event e; // e.name is null when not tracing
+};
+
+inline static void instant(const char* cat, const char* name, Arg a0 = Arg(), Arg a1 = Arg()) {
+  if (_enabled) {
+    Event e;
+    e.cat = cat;
+    e.name = name;
+    e.ph = 'i';
+    e.ts = now();
+    e.args[0] = a0;
+    e.args[1] = a1;
+    _record(e);
+  }
+}
+
+}} // namespace sat::trace
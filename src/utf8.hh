@@ -0,0 +1,140 @@
+// UTF-8 validation and Unicode spaces, for the lexer
+//
+// Input is validated as it's filled into the parser's buffer (see BasicParser::fill), while the
+// bytes are still in cache, so that the lexer, which works on bytes, can take any byte >= 0x80
+// to be part of a well-formed sequence. Runs of ASCII are skipped 16 bytes at a time with SSE2
+// or NEON (8 at a time elsewhere), so that for ASCII input validation costs a load, a compare and
+// a branch per 16 bytes. Other bytes are checked a sequence at a time against the table of
+// well-formed byte sequences in the Unicode standard (Table 3-7), which rules out overlong
+// forms, surrogates and code points above U+10FFFF.
+//
+#pragma once
+#include "common.h"
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  #include <arm_neon.h>
+#endif
+
+namespace sat {
+namespace utf8 {
+
+inline static const u8* skip_ascii(const u8* p, const u8* e) {
+  // Returns the first byte >= 0x80 in p..e, or e
+  #if defined(__SSE2__)
+    while (e - p >= 16) {
+      int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+      if (mask) {
+        return p + __builtin_ctz((unsigned)mask);
+      }
+      p += 16;
+    }
+  #elif defined(__aarch64__) && defined(__ARM_NEON)
+    while (e - p >= 16 && vmaxvq_u8(vld1q_u8(p)) < 0x80) {
+      p += 16;
+    }
+  #else
+    while (e - p >= 8) {
+      u64 w;
+      memcpy(&w, p, 8);
+      if (w & 0x8080808080808080ull) {
+        break;
+      }
+      p += 8;
+    }
+  #endif
+  while (p != e && *p < 0x80) {
+    ++p;
+  }
+  return p;
+}
+
+inline static int sequence_len(const u8* p, const u8* e) {
+  // Length of the well-formed sequence at p, 0 if it's ill-formed, or -1 if e cuts it off
+  u8 b = p[0];
+  int n;
+  u8 lo = 0x80, hi = 0xbf; // range of the second byte
+  if (b < 0x80) {
+    return 1;
+  } else if (b < 0xc2) {
+    return 0; // continuation byte, or lead byte of an overlong 2-byte form
+  } else if (b < 0xe0) {
+    n = 2;
+  } else if (b < 0xf0) {
+    n = 3;
+    if (b == 0xe0) { lo = 0xa0; } // overlong
+    if (b == 0xed) { hi = 0x9f; } // surrogates
+  } else if (b < 0xf5) {
+    n = 4;
+    if (b == 0xf0) { lo = 0x90; } // overlong
+    if (b == 0xf4) { hi = 0x8f; } // above U+10FFFF
+  } else {
+    return 0;
+  }
+  for (int i = 1; i < n; i++) {
+    if (p + i == e) {
+      return -1;
+    }
+    if (p[i] < lo || p[i] > hi) {
+      return 0;
+    }
+    lo = 0x80;
+    hi = 0xbf;
+  }
+  return n;
+}
+
+inline static const char* validate(const char* start, const char* end, bool is_end, bool& ok) {
+  // Validates start..end. Returns `end` if it's all well-formed. Otherwise, if a sequence is cut
+  // off by `end` and more input is to come (!is_end), returns the start of that sequence. If
+  // there's an ill-formed sequence, sets `ok` to false and returns its first byte.
+  const u8* p = (const u8*)start;
+  const u8* e = (const u8*)end;
+  ok = true;
+  for (;;) {
+    p = skip_ascii(p, e);
+    if (p == e) {
+      return end;
+    }
+    int n = sequence_len(p, e);
+    if (n <= 0) {
+      ok = n == -1 && !is_end;
+      return (const char*)p;
+    }
+    p += n;
+  }
+}
+
+inline static size_t space_len(const char* p, const char* e, u32& cp) {
+  // Length of the non-ASCII space (Unicode general category Zs) at p, setting `cp` to its code
+  // point, or 0 if there's none. p..e must be well-formed.
+  const u8* s = (const u8*)p;
+  size_t n = (size_t)(e - p);
+  switch (s[0]) {
+    case 0xc2: // U+00A0 no-break space
+      if (n >= 2 && s[1] == 0xa0) { cp = 0xa0; return 2; }
+      break;
+    case 0xe1: // U+1680 ogham space mark
+      if (n >= 3 && s[1] == 0x9a && s[2] == 0x80) { cp = 0x1680; return 3; }
+      break;
+    case 0xe2: // U+2000-U+200A en quad .. hair space, U+202F narrow no-break, U+205F math space
+      if (n >= 3 && ((s[1] == 0x80 && (s[2] <= 0x8a || s[2] == 0xaf)) ||
+                     (s[1] == 0x81 && s[2] == 0x9f)))
+      {
+        cp = 0x2000 | (u32)(s[1] & 0x3f) << 6 | (u32)(s[2] & 0x3f);
+        return 3;
+      }
+      break;
+    case 0xe3: // U+3000 ideographic space
+      if (n >= 3 && s[1] == 0x80 && s[2] == 0x80) { cp = 0x3000; return 3; }
+      break;
+  }
+  return 0;
+}
+
+inline static bool is_space(const char* p, const char* e) {
+  u32 cp;
+  return space_len(p, e, cp) != 0;
+}
+
+}} // namespace sat::utf8
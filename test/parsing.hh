@@ -0,0 +1,55 @@
+// Feeds a string to a parser, for the tests which parse sources:
+//
+//   Parser P(kStr_user_ns);
+//   auto status = parse_string(P, "a b\n", [](Expr* e) { delete e; });
+//
+#pragma once
+#include "../src/parse.hh"
+#include "test.hh" // after parse.hh as its print() macro clashes with Expr::print
+#include <string>
+#include <stdint.h>
+#include <string.h>
+
+namespace sat {
+
+struct NoDocumentEnd {
+  void operator()() const {}
+};
+
+// Parses `src` in chunks of up to `chunk_size` bytes, calling `on_result(e)` with each result,
+// which it then owns, and `on_document()` at the end of each document of a multi-document parser.
+// Chunks of 4096 bytes or more get their room up front, as when reading a stream. Returns the
+// status parsing ended with: DONE, or ERROR.
+template <typename F, typename D = NoDocumentEnd>
+Parser::Status parse_string(Parser& P, const std::string& src, F on_result,
+                            size_t chunk_size = SIZE_MAX, D on_document = D()) {
+  Parser::Status status = Parser::Status::MORE;
+  size_t offs = 0;
+  while (status == Parser::Status::MORE) {
+    size_t bufsize;
+    char* buf;
+    if (chunk_size >= 4096 && chunk_size != SIZE_MAX) {
+      buf = P.get_read_buf(bufsize, chunk_size);
+      assert_true(bufsize >= chunk_size);
+    } else {
+      buf = P.get_read_buf(bufsize);
+    }
+    size_t len = SAT_MIN(SAT_MIN(bufsize, chunk_size), src.size() - offs);
+    memcpy(buf, src.data() + offs, len);
+    offs += len;
+    P.fill(buf, len, offs == src.size());
+    for (;;) {
+      status = P.parse();
+      if (status == Parser::Status::RESULT) {
+        while (Expr* e = P.next_result()) { on_result(e); }
+      } else if (status == Parser::Status::DOCUMENT) {
+        on_document();
+      } else {
+        break;
+      }
+    }
+  }
+  return status;
+}
+
+} // namespace sat
@@ -0,0 +1,125 @@
+//!DEP ../src/parse.cc ../src/hashcons.cc ../src/str.cc ../src/expr.cc ../src/trace.cc ../src/alloc.cc
+// Parses generated inputs of size N, 2N, 4N and 8N for a few input shapes and fails if time or
+// memory grows faster than linearly, within a tolerance.
+#include "parsing.hh"
+#include <time.h>
+#include <string>
+
+using namespace sat;
+
+// How much worse than linear we accept. Timings are noisy, so be generous: quadratic growth
+// over 8x the input is 64x, which is far above 8 * kTimeTolerance.
+static const double kTimeTolerance = 2.5;
+static const double kMemTolerance = 2.0;
+static const int kRuns = 3; // best-of
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+static i64 peak_live_bytes() {
+  i64 n = 0;
+  for (size_t i = 0; i < (size_t)alloc::Tag::_COUNT; i++) {
+    n += alloc::stats((alloc::Tag)i).peak;
+  }
+  return n;
+}
+
+// ------------------------------------------------------------------------------------------------
+// Input shapes. Each returns source text of about `size` bytes.
+
+static std::string gen_many_lines(size_t size) {
+  std::string s;
+  while (s.size() < size) { s.append("a b c = d\n"); }
+  return s;
+}
+
+static std::string gen_deep_dedent(size_t size) {
+  // Indentation increasing by one level per line, then a dedent of all levels at once
+  std::string s;
+  for (size_t i = 0; s.size() < size; i++) {
+    s.append(i, ' ');
+    s.append("a\n");
+  }
+  s.append("z\n");
+  return s;
+}
+
+static std::string gen_long_line(size_t size) {
+  std::string s;
+  while (s.size() < size) { s.append("abc "); }
+  s.append("\n");
+  return s;
+}
+
+static std::string gen_long_comment(size_t size) {
+  std::string s{"# "};
+  s.append(size, 'x');
+  s.append("\nx\n");
+  return s;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+static void parse(const std::string& input, size_t chunk_size) {
+  Parser P(kStr_user_ns);
+  auto status = parse_string(P, input, [](Expr* e) { delete e; }, chunk_size);
+  if (status == Parser::Status::ERROR) {
+    assert_not_reached("Parser::Status::ERROR");
+  }
+}
+
+struct Measurement {
+  double seconds;
+  i64 peak_bytes;
+};
+
+static Measurement measure(const std::string& input, size_t chunk_size) {
+  Measurement m{1e9, 0};
+  for (int i = 0; i < kRuns; i++) {
+    alloc::reset_peaks();
+    i64 live0 = peak_live_bytes();
+    double t = now();
+    parse(input, chunk_size);
+    t = now() - t;
+    m.seconds = SAT_MIN(m.seconds, t);
+    m.peak_bytes = SAT_MAX(m.peak_bytes, peak_live_bytes() - live0);
+  }
+  return m;
+}
+
+static void test_shape(const char* name, std::string(*gen)(size_t), size_t n, size_t chunk_size) {
+  Measurement m[4];
+  size_t sizes[4];
+  for (int i = 0; i < 4; i++) {
+    std::string input = gen(n << i);
+    sizes[i] = input.size();
+    m[i] = measure(input, chunk_size);
+    print("  %-14s %8zu bytes %10.6f s %10lld bytes peak",
+          name, sizes[i], m[i].seconds, (long long)m[i].peak_bytes);
+  }
+  // Compare the largest against the smallest, normalized by their actual input sizes
+  double size_ratio = (double)sizes[3] / (double)sizes[0];
+  double time_ratio = m[3].seconds / SAT_MAX(m[0].seconds, 1e-6);
+  double mem_ratio = (double)m[3].peak_bytes / (double)SAT_MAX(m[0].peak_bytes, (i64)1);
+  if (time_ratio > size_ratio * kTimeTolerance) {
+    print("  %s: time grew %.1fx for %.1fx input", name, time_ratio, size_ratio);
+    assert_not_reached("super-linear time");
+  }
+  if (mem_ratio > size_ratio * kMemTolerance) {
+    print("  %s: memory grew %.1fx for %.1fx input", name, mem_ratio, size_ratio);
+    assert_not_reached("super-linear memory");
+  }
+}
+
+int main(int argc, const char** argv) {
+  alloc::enable(true);
+  test_shape("many_lines",   gen_many_lines,   128*1024, 4096);
+  test_shape("deep_dedent",  gen_deep_dedent,  128*1024, 4096);
+  test_shape("long_line",    gen_long_line,    256*1024, 4096);
+  test_shape("long_comment", gen_long_comment, 128*1024, 4096);
+  test_shape("tiny_chunks",  gen_many_lines,   32*1024,  1);
+  return 0;
+}
@@ -0,0 +1,211 @@
+//!DEP ../src/eval.cc ../src/parse.cc ../src/hashcons.cc ../src/str.cc ../src/expr.cc ../src/trace.cc ../src/alloc.cc
+#include "../src/eval.hh"
+#include "parsing.hh"
+#include <sstream>
+
+using namespace sat;
+
+template <typename F>
+static void parse_source(const std::string& src, F f) {
+  Parser P(kStr_user_ns);
+  auto status = parse_string(P, src, [&](Expr* e) {
+    f(e);
+    delete e;
+  });
+  assert_true(status == Parser::Status::DONE);
+}
+
+static std::string eval_tree(Env& env, const std::string& src) {
+  std::ostringstream out;
+  env.set_out(out);
+  TreeInterp interp(env);
+  parse_source(src, [&](Expr* e) { interp.eval(e); });
+  env.set_out(std::cout);
+  return out.str();
+}
+
+static std::string eval_vm(Env& env, const std::string& src) {
+  std::ostringstream out;
+  env.set_out(out);
+  Compiler compiler(env);
+  parse_source(src, [&](Expr* e) {
+    Code code(env);
+    compiler.compile(e, code);
+    run(env, code);
+  });
+  env.set_out(std::cout);
+  return out.str();
+}
+
+static std::string str(const Value& v) {
+  std::ostringstream ss;
+  ss << v;
+  return ss.str();
+}
+
+static const char* kFoo =
+  "a:\n"
+  "  x = A\n"
+  "  b:\n"
+  "    x = B\n"
+  "    c:\n"
+  "      x = C\n"
+  "print a:b:c:x\n"
+  "a = World\n"
+  "foo:\n"
+  "  x = 1\n"
+  "  y = a:b:c: x\n"
+  "  z = a:b:c:x # comment\n"
+  "print Hello name From location\n"
+  "  name = \"Smith\"\n"
+  "  location = \"Stockholm\" Or gbg\n"
+  "    gbg = \"Goteborg\"\n"
+  "    fail = 123\n"
+  "a = b = c\n"
+  "print a b (x y) nothing\n"
+  "x = a\n"
+  "print x foo:x\n";
+
+static void test_engines() {
+  // Both engines produce the same output and bindings
+  Env env1, env2;
+  std::string out1 = eval_tree(env1, kFoo);
+  std::string out2 = eval_vm(env2, kFoo);
+  assert_eq(out1,
+    "C\n"
+    "Hello \"Smith\" From (\"Stockholm\" Or \"Goteborg\")\n"
+    "c c (x y) nothing\n"
+    "c 1\n");
+  assert_eq(out2, out1);
+  const char* names[] = {
+    "user:a", "user:b", "user:x", "user:a:x", "user:a:b:c:x", "user:foo:y", "user:foo:z",
+    "user:name", "user:location", "user:gbg", "user:nothing", "user:a:nothing",
+  };
+  for (const char* name : names) {
+    assert_eq(str(env2.get(name)), str(env1.get(name)));
+  }
+  assert_eq(str(env1.get("user:a")), "c");
+  assert_eq(str(env1.get("user:b")), "c");
+  assert_eq(str(env1.get("user:foo:y")), "C");
+  assert_eq(str(env1.get("user:foo:z")), "C");
+  assert_eq(str(env1.get("user:location")), "nil"); // only bound in the where block
+  assert_eq(env2.slot_count(), env1.slot_count());
+}
+
+static void test_where() {
+  // Names bound in where blocks are gone after the line
+  Env env;
+  assert_eq(eval_vm(env, "x = 1\n"), "");
+  size_t nslots = env.slot_count();
+  {
+    std::ostringstream out;
+    env.set_out(out);
+    Compiler compiler(env);
+    parse_source("print y\n  y = x\nend\n", [&](Expr* e) {
+      Code code(env);
+      compiler.compile(e, code);
+      if (!code.scopes.empty()) {
+        assert_eq(env.slot_count(), nslots + 1); // y
+      }
+      run(env, code);
+    });
+    env.set_out(std::cout);
+    assert_eq(out.str(), "1\n");
+  }
+  assert_eq(env.slot_count(), nslots);
+  assert_eq(eval_tree(env, "print y\n  y = x\nend\n"), "1\n");
+  assert_eq(env.slot_count(), nslots);
+
+  // An assignment with a where block binds the name outside of it
+  assert_eq(eval_vm(env, "z = w w\n  w = 2\nprint z w\n"), "(2 2) w\n");
+}
+
+static void test_shadowing() {
+  // A name can be bound and looked up in the same result, and a binding named like a builtin
+  // hides the builtin
+  Env env;
+  const char* src =
+    "ns:\n"
+    "  x = 1\n"
+    "  y = x\n"
+    "  x = 2\n"
+    "  print x y\n"
+    "print = 3\n"
+    "print x\n"
+    "ns: print\n";
+  std::string out = eval_tree(env, src);
+  assert_eq(out, "2 1\n");
+  Env env2;
+  assert_eq(eval_vm(env2, src), out);
+  assert_eq(str(env2.get("user:print")), "3");
+}
+
+static void test_disassembly() {
+  Env env;
+  Compiler compiler(env);
+  std::ostringstream ss, out;
+  env.set_out(out);
+  parse_source("x = A\nprint x B\n", [&](Expr* e) {
+    Code code(env);
+    compiler.compile(e, code);
+    ss << code;
+    run(env, code);
+  });
+  assert_eq(ss.str(),
+    "   0  CONST  0 0  ; A\n"
+    "   3  STORE  0 0\n"
+    "   6  END   \n"
+    "   0  LOAD   1 0\n"
+    "   3  CONST  2 0  ; B\n"
+    "   6  CALL   0 0 1 2\n"
+    "  11  END   \n");
+}
+
+static void test_depth() {
+  // Results nested too deeply are not evaluated, instead of running out of stack
+  for (int n : { 400, 100000 }) {
+    std::string src = "print " + std::string(n, '(') + "x" + std::string(n, ')') + "\n";
+    Env env;
+    std::ostringstream out;
+    env.set_out(out);
+    TreeInterp interp(env);
+    Compiler compiler(env);
+    parse_source(src, [&](Expr* e) {
+      assert_eq(interp.eval(e), n < SAT_EVAL_MAX_DEPTH / 2);
+      Code code(env);
+      assert_eq(compiler.compile(e, code), n < SAT_EVAL_MAX_DEPTH / 2);
+      assert_eq(str(run(env, code)), "nil");
+    });
+    assert_eq(out.str(), n < SAT_EVAL_MAX_DEPTH / 2 ? "x\nx\n" : "");
+  }
+
+  // Any number of names can be bound on one line
+  std::string src;
+  for (int i = 0; i < 100000; i++) { src += "a" + std::to_string(i) + " = "; }
+  src += "x\nprint a0 a99999\n";
+  Env env1, env2;
+  assert_eq(eval_tree(env1, src), "x x\n");
+  assert_eq(eval_vm(env2, src), "x x\n");
+}
+
+static void test_memory() {
+  alloc::enable(true);
+  i64 live0 = alloc::stats(alloc::Tag::EVAL).live;
+  {
+    Env env;
+    eval_vm(env, kFoo);
+    eval_tree(env, kFoo);
+  }
+  assert_eq(alloc::stats(alloc::Tag::EVAL).live, live0);
+  alloc::enable(false);
+}
+
+int main(int argc, const char** argv) {
+  test_engines();
+  test_where();
+  test_shadowing();
+  test_disassembly();
+  test_depth();
+  test_memory();
+  return 0;
+}
@@ -7,6 +7,8 @@ int main(int argc, const char** argv) {
 
   // Test the two different implementations
   assert_eq(hash::fnv1a32("foo"), hash::fnv1a32("foo", 3));
+  assert_eq(hash::fnv1a32("foo"), hash::fnv1a32_iter("foo", 3));
+  assert_eq(hash::fnv1a32("", 0), hash::fnv1a32_iter("", 0));
 
   // Known collisions for FNV-1a 32
   assert_eq(hash::fnv1a32("costarring"), hash::fnv1a32("liquid"));
@@ -0,0 +1,184 @@
+//!DEP ../src/parse.cc ../src/hashcons.cc ../src/str.cc ../src/expr.cc ../src/trace.cc ../src/alloc.cc
+#include "parsing.hh"
+#include <sstream>
+#include <vector>
+
+using namespace sat;
+
+static std::vector<Expr*> parse(const std::string& src, HashCons* hc) {
+  Parser P(kStr_user_ns);
+  P.set_hashcons(hc);
+  std::vector<Expr*> results;
+  auto status = parse_string(P, src, [&](Expr* e) { results.push_back(e); });
+  assert_true(status == Parser::Status::DONE);
+  return results;
+}
+
+static std::string repr(const std::vector<Expr*>& results) {
+  std::ostringstream ss;
+  for (const Expr* e : results) { ss << e << '\n'; }
+  return ss.str();
+}
+
+static void free_all(std::vector<Expr*>& results) {
+  for (Expr* e : results) { delete e; }
+  results.clear();
+}
+
+static const char* kSource =
+  "milk:\n"
+  "  kind = Dairy\n"
+  "  sour = No # not yet\n"
+  "cheese:\n"
+  "  kind = Dairy\n"
+  "  sour = No # not yet\n"
+  "yoghurt:\n"
+  "  kind = Dairy\n"
+  "  sour = Yes\n"
+  "x = (a b) { c; d } (a b)\n"
+  "y = (a b) { c; d } (a b)\n"
+  "end\n";
+
+static void test_sharing() {
+  HashCons hc;
+  std::vector<Expr*> plain = parse(kSource, 0);
+  std::vector<Expr*> shared = parse(kSource, &hc);
+  assert_eq(repr(shared), repr(plain)); // same trees
+
+  // milk: and cheese: have the same block
+  const Expr* milk = shared[0]->head()->next();
+  const Expr* cheese = shared[1]->head()->next();
+  const Expr* yoghurt = shared[2]->head()->next();
+  assert_true(milk->type() == Expr::Type::BLOCK);
+  assert_true(milk != cheese);
+  assert_true(milk->head() == cheese->head());
+  assert_true(HashCons::equal(milk, cheese));
+  assert_false(HashCons::equal(milk, yoghurt));
+  // ...and yoghurt: shares the line `kind = Dairy` with them
+  assert_true(milk->head()->head() == yoghurt->head()->head());
+
+  // Lines x and y differ in their first symbol, but share their groups and inline block
+  assert_false(shared[3]->head() == shared[4]->head());
+  const Expr* g1 = shared[3]->head()->next()->next();
+  const Expr* g2 = shared[4]->head()->next()->next();
+  assert_true(g1->type() == Expr::Type::GROUP);
+  assert_true(HashCons::equal(g1, g2));
+  assert_true(HashCons::equal(g1, g1->next()->next()));
+  assert_true(HashCons::equal(g1->next(), g2->next()));
+
+  HashCons::Stats st = hc.stats();
+  assert_true(st.hits > 0);
+  assert_true(st.dedup_ratio() > 1.0);
+  free_all(plain);
+  free_all(shared);
+}
+
+static void test_lifetime() {
+  // Results and the HashCons can go away in any order
+  alloc::enable(true);
+  i64 live0 = alloc::stats(alloc::Tag::EXPR).live;
+  {
+    std::vector<Expr*> results;
+    {
+      HashCons hc;
+      results = parse(kSource, &hc);
+      std::vector<Expr*> more = parse(kSource, &hc);
+      free_all(more);
+    }
+    std::vector<Expr*> plain = parse(kSource, 0);
+    assert_eq(repr(results), repr(plain));
+    free_all(plain);
+    // Free the results in reverse order
+    while (!results.empty()) {
+      delete results.back();
+      results.pop_back();
+    }
+  }
+  assert_eq(alloc::stats(alloc::Tag::EXPR).live, live0);
+
+  {
+    HashCons hc;
+    std::vector<Expr*> results = parse(kSource, &hc);
+    free_all(results);
+    // Contents which only the table references are dropped when it needs room
+    for (int round = 0; round < 4; round++) {
+      std::string src;
+      for (size_t i = 0; i < 2000; i++) {
+        src += "line" + std::to_string(round) + "_" + std::to_string(i) + " x\n";
+      }
+      results = parse(src, &hc);
+      free_all(results);
+    }
+    assert_true(hc.stats().size < 3 * 2000);
+  }
+  assert_eq(alloc::stats(alloc::Tag::EXPR).live, live0);
+  alloc::enable(false);
+}
+
+static void test_bounded() {
+  // The table is sized for the contents in use, not for all that were ever interned
+  HashCons hc;
+  size_t max_capacity = 0;
+  for (int round = 0; round < 100; round++) {
+    std::string src;
+    for (size_t i = 0; i < 1000; i++) {
+      src += "line" + std::to_string(round) + "_" + std::to_string(i) + " x\n";
+    }
+    std::vector<Expr*> results = parse(src, &hc);
+    free_all(results);
+    max_capacity = SAT_MAX(max_capacity, hc.stats().capacity);
+  }
+  assert_true(hc.stats().lists >= 100 * 1000);
+  assert_true(max_capacity <= 8 * 1024);
+}
+
+static void test_memory() {
+  // Repeated blocks cost as much as one
+  std::string src;
+  for (size_t i = 0; i < 1000; i++) {
+    src += "item" + std::to_string(i) + ":\n";
+    src += "  kind = Dairy\n  has_a_dry_sensation = No\n  tags = (a b c) (d e f)\n";
+  }
+  src += "end\n";
+  alloc::enable(true);
+  i64 live0 = alloc::stats(alloc::Tag::EXPR).live;
+  std::vector<Expr*> plain = parse(src, 0);
+  i64 plain_bytes = alloc::stats(alloc::Tag::EXPR).live - live0;
+  HashCons hc;
+  std::vector<Expr*> shared = parse(src, &hc);
+  i64 shared_bytes = alloc::stats(alloc::Tag::EXPR).live - live0 - plain_bytes;
+  assert_eq(repr(shared), repr(plain));
+  assert_true(shared_bytes * 4 < plain_bytes);
+  assert_true(hc.stats().dedup_ratio() > 4.0);
+  free_all(plain);
+  free_all(shared);
+  alloc::enable(false);
+}
+
+static void test_saturation() {
+  // Contents referenced by more lists than a reference count can hold are copied
+  std::string src;
+  for (size_t i = 0; i < 70000; i++) { src += "a b\n"; }
+  alloc::enable(true);
+  i64 live0 = alloc::stats(alloc::Tag::EXPR).live;
+  {
+    HashCons hc;
+    std::vector<Expr*> results = parse(src, &hc);
+    assert_eq(results.size(), 70000u);
+    assert_true(results[0]->head() == results[65533]->head());
+    assert_true(results[0]->head() != results[69999]->head());
+    assert_true(HashCons::equal(results[69999]->head(), results[0]->head()));
+    free_all(results);
+  }
+  assert_eq(alloc::stats(alloc::Tag::EXPR).live, live0);
+  alloc::enable(false);
+}
+
+int main(int argc, const char** argv) {
+  test_sharing();
+  test_lifetime();
+  test_bounded();
+  test_memory();
+  test_saturation();
+  return 0;
+}
@@ -0,0 +1,191 @@
+//!DEP ../src/io.cc ../src/trace.cc ../src/alloc.cc
+#include "../src/io.hh"
+#include "test.hh"
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace sat;
+
+static std::string make_file(const std::string& contents) {
+  char path[] = "/tmp/sat_test_io.XXXXXX";
+  int fd = mkstemp(path);
+  assert_true(fd != -1);
+  assert_eq((size_t)write(fd, contents.data(), contents.size()), contents.size());
+  close(fd);
+  return path;
+}
+
+static std::string make_contents(size_t len, size_t seed) {
+  std::string s(len, ' ');
+  for (size_t i = 0; i < len; i++) {
+    s[i] = (char)('a' + (i * 7 + seed) % 26);
+  }
+  return s;
+}
+
+struct Read {
+  std::vector<std::string> contents; // per file
+  std::vector<int>         errors;   // per file
+  size_t                   chunks = 0;
+};
+
+static Read read_all(const std::vector<std::string>& paths, FileReader::Options opt) {
+  FileReader r(paths, opt);
+  Read rd;
+  rd.contents.resize(paths.size());
+  rd.errors.resize(paths.size());
+  std::vector<bool> ended(paths.size());
+  size_t file = 0;
+  FileReader::Chunk c;
+  while (r.next(c)) {
+    // in order: all chunks of a file before those of the next
+    assert_true(c.file >= file);
+    for (; file < c.file; file++) { assert_true(ended[file]); }
+    assert_false(ended[c.file]);
+    assert_true(c.len <= opt.chunk_size);
+    rd.contents[c.file].append(c.data, c.len);
+    rd.errors[c.file] = c.error;
+    ended[c.file] = c.is_last;
+    rd.chunks++;
+    r.release(c);
+  }
+  for (size_t i = 0; i < paths.size(); i++) { assert_true(ended[i]); }
+  assert_eq(r.stats().files, paths.size());
+  return rd;
+}
+
+static void test_files(FileReader::Options opt) {
+  std::vector<std::string> want = {
+    make_contents(100, 1),
+    "",
+    make_contents(opt.chunk_size * 5, 2),     // exact multiple of chunk_size
+    make_contents(opt.chunk_size * 3 + 1, 3),
+  };
+  for (size_t i = 0; i < 20; i++) { want.push_back(make_contents(i * 13, i)); }
+  std::vector<std::string> paths;
+  for (const std::string& s : want) { paths.push_back(make_file(s)); }
+
+  Read rd = read_all(paths, opt);
+  for (size_t i = 0; i < want.size(); i++) {
+    assert_eq(rd.errors[i], 0);
+    assert_true(rd.contents[i] == want[i]);
+  }
+
+  // A missing file in the middle of the list
+  std::vector<std::string> paths2 = { paths[0], "/tmp/sat_test_io.missing", paths[2] };
+  rd = read_all(paths2, opt);
+  assert_true(rd.contents[0] == want[0]);
+  assert_eq(rd.errors[1], ENOENT);
+  assert_true(rd.contents[1].empty());
+  assert_true(rd.contents[2] == want[2]);
+
+  // A directory can be opened but not read; no more chunks of it are delivered after the error
+  std::vector<std::string> paths3 = { "/tmp", paths[3] };
+  rd = read_all(paths3, opt);
+  assert_not_eq(rd.errors[0], 0);
+  assert_true(rd.contents[1] == want[3]);
+
+  for (const std::string& path : paths) { unlink(path.c_str()); }
+}
+
+static void test_stream(FileReader::Options opt) {
+  // Pipes are read until EOF, as their size is unknown
+  int fds[2];
+  assert_eq(pipe(fds), 0);
+  std::string want = make_contents(opt.chunk_size * 4 + 7, 4);
+  std::string path = "/dev/fd/" + std::to_string(fds[0]);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    for (size_t i = 0; i < want.size(); i += 100) {
+      size_t n = SAT_MIN((size_t)100, want.size() - i);
+      if (write(fds[1], want.data() + i, n) != (ssize_t)n) { _exit(1); }
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  std::string other = make_file("after the pipe");
+  Read rd = read_all({ path, other }, opt);
+  close(fds[0]);
+  waitpid(pid, 0, 0);
+  assert_eq(rd.errors[0], 0);
+  assert_true(rd.contents[0] == want);
+  assert_true(rd.contents[1] == "after the pipe");
+  unlink(other.c_str());
+}
+
+static std::string read_stream(StreamReader& in) {
+  std::string s;
+  while (!in.at_end()) {
+    size_t len = s.size();
+    s.resize(len + in.block_size());
+    ssize_t n = in.read(&s[len], in.block_size());
+    assert_true(n >= 0);
+    s.resize(len + (size_t)n);
+  }
+  return s;
+}
+
+static void test_stream_reader() {
+  // Blocks grow while a pipe has more data than we ask for
+  int fds[2];
+  assert_eq(pipe(fds), 0);
+  std::string want = make_contents(1024 * 1024, 5);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    for (size_t i = 0; i < want.size(); ) {
+      ssize_t n = write(fds[1], want.data() + i, want.size() - i);
+      if (n <= 0) { _exit(1); }
+      i += (size_t)n;
+    }
+    _exit(0);
+  }
+  close(fds[1]);
+  usleep(100 * 1000); // let the writer fill the pipe
+  StreamReader in(fds[0], 4096, 64 * 1024);
+  assert_true(read_stream(in) == want);
+  close(fds[0]);
+  waitpid(pid, 0, 0);
+  StreamReader::Stats st = in.stats();
+  assert_eq(st.bytes, want.size());
+  assert_true(st.block_size > 4096);
+  assert_true(st.block_size <= 64 * 1024);
+
+  // The end of a regular file is known without another read returning 0
+  std::string path = make_file(make_contents(100, 6));
+  int fd = open(path.c_str(), O_RDONLY);
+  StreamReader in2(fd, 4096);
+  assert_true(read_stream(in2) == make_contents(100, 6));
+  assert_eq(in2.stats().reads, 1u);
+  close(fd);
+  unlink(path.c_str());
+
+  std::string empty = make_file("");
+  fd = open(empty.c_str(), O_RDONLY);
+  StreamReader in3(fd);
+  assert_true(in3.at_end());
+  close(fd);
+  unlink(empty.c_str());
+}
+
+int main(int argc, const char** argv) {
+  for (bool use_uring : { false, true }) {
+    FileReader::Options opt;
+    opt.use_uring = use_uring;
+    opt.chunk_size = 64;
+    opt.queue_depth = 4;
+    test_files(opt);
+    test_stream(opt);
+    opt.queue_depth = 1;
+    test_files(opt);
+  }
+  test_stream_reader();
+  return 0;
+}
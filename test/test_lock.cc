@@ -0,0 +1,67 @@
+#include "../src/lock.hh"
+#include "test.hh"
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace sat;
+
+template <typename L, typename F>
+static void test_exclusion(L& lock, F locked) {
+  // Threads incrementing a plain counter under the lock don't lose increments
+  const size_t kThreads = 4;
+  const size_t kIncrements = 100000;
+  size_t counter = 0;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kThreads; i++) {
+    threads.emplace_back([&]{
+      for (size_t n = 0; n < kIncrements; n++) {
+        locked(lock, [&]{ counter++; });
+        if (n % 512 == 0) { std::this_thread::yield(); }
+      }
+    });
+  }
+  for (auto& t : threads) { t.join(); }
+  assert_eq(counter, kThreads * kIncrements);
+}
+
+static void test_lock() {
+  Lock l;
+  assert_true(l.try_lock());
+  assert_false(l.try_lock());
+  l.unlock();
+  assert_eq(l.stats().acquires, 0u); // not counting
+
+  l.set_counting(true);
+  test_exclusion(l, [](Lock& l, std::function<void()> f) { std::lock_guard<Lock> g(l); f(); });
+  Lock::Stats st = l.stats();
+  assert_eq(st.acquires, 4u * 100000u);
+  assert_true(st.spun <= st.contended);
+
+  // A thread waiting for longer than it spins parks, and is woken by unlock()
+  l.lock();
+  std::thread t([&]{ l.lock(); l.unlock(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  l.unlock();
+  t.join();
+  Lock::Stats st2 = l.stats();
+  assert_eq(st2.contended, st.contended + 1);
+  assert_true(st2.parks > st.parks);
+  assert_true(st2.wait_ns - st.wait_ns >= 10000000u);
+  assert_eq(l._state, 0);
+}
+
+static void test_spinlock() {
+  Spinlock l = SB_SPINLOCK_INIT;
+  assert_true(spinlock_try_lock(l));
+  assert_false(spinlock_try_lock(&l));
+  spinlock_unlock(l);
+  test_exclusion(l, [](Spinlock& l, std::function<void()> f) { ScopedSpinlock g(l); f(); });
+}
+
+int main(int argc, const char** argv) {
+  test_lock();
+  test_spinlock();
+  return 0;
+}
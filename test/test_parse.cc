@@ -0,0 +1,498 @@
+//!DEP ../src/parse.cc ../src/hashcons.cc ../src/str.cc ../src/expr.cc ../src/trace.cc ../src/alloc.cc
+// Parses sources whole and in chunks of various sizes and checks that the results are the same,
+// i.e. that the lexer resumes correctly at every byte. Also tests the event interface.
+#include "parsing.hh"
+#include <sstream>
+#include <fstream>
+#include <vector>
+
+using namespace sat;
+
+static const char* kSources[] = {
+  "a b c\n",
+  "a b c", // no trailing linebreak
+  "",
+  "\n\n  \n",
+  "# comment\nx = y # trailing\n",
+  "a:\n  x = A\n  b:\n    x = B\n    c:\n      x = C\n  # back at a:\nprint a:b:c:x\n",
+  "a (b c (d e)) { f g; h (i j) } k\n",
+  "a\n  (b\n   c)\nd\n",
+  "x = a:b:c:\ny = a:b:c:x\n",
+  "a\r\nb\r\n",
+  "tab\n\tindent\n\t\tdeeper\nback\n",
+  "x\x01y \x7ez\n",
+  "a b\n__END__\nnot parsed (\n",
+  "a:\n  b\n", // ends inside a block
+  "caf\u00e9 \u0101 \u65e5\u672c:\n  x\u3000=\u2003y \u2192 \U0001f600\n", // UTF-8 names, spaces
+  "a:\n\u00a0\u00a0b\n\u00a0\u00a0c\u00a0d\n", // indented by no-break spaces
+};
+
+static std::string parse(Parser& P, const std::string& input, size_t chunk_size,
+                         Parser::Status& end_status) {
+  std::ostringstream out;
+  end_status = parse_string(P, input, [&](Expr* e) { out << e << '\n'; delete e; }, chunk_size);
+  return out.str();
+}
+
+static std::string parse(const std::string& input, size_t chunk_size, Parser::Status& end_status) {
+  Parser P(kStr_user_ns);
+  return parse(P, input, chunk_size, end_status);
+}
+
+static void test_chunked(const std::string& input) {
+  Parser::Status whole_status;
+  std::string whole = parse(input, input.size() + 1, whole_status);
+  const size_t chunk_sizes[] = { 1, 2, 3, 7, 64, 64 * 1024 };
+  for (size_t chunk_size : chunk_sizes) {
+    Parser::Status status;
+    std::string s = parse(input, chunk_size, status);
+    if (s != whole || status != whole_status) {
+      print("chunk size %zu:\n--- whole:\n%s--- chunked:\n%s---", chunk_size,
+            whole.c_str(), s.c_str());
+      assert_not_reached("chunked parse differs from whole parse");
+    }
+  }
+}
+
+static void test_errors() {
+  // Errors are reported at the same byte regardless of how the input is split up
+  const char* sources[] = {
+    "a b::c\n",
+    "a \x7f\n",
+    "a\n  b\n\tc\n",
+    "  a\n",
+    "a \xff\n",         // not UTF-8
+    "a\xe2\x80",        // cut off by the end of input
+    "a\n  b\n\u00a0\u00a0c\n", // mixed indentation
+  };
+  for (const char* src : sources) {
+    for (size_t chunk_size : { 1, 3, 4096 }) {
+      Parser::Status status;
+      parse(src, chunk_size, status);
+      assert_true(status == Parser::Status::ERROR);
+    }
+  }
+
+  // Bytes are shown in hex without leaving the error stream in hex
+  std::ostringstream err;
+  std::streambuf* prev = std::cerr.rdbuf(err.rdbuf());
+  Parser::Status status;
+  parse("ab \x7f\n", 4096, status);
+  std::cerr << 10;
+  std::cerr.rdbuf(prev);
+  assert_true(err.str().find("'\x7f' 0x7f at 1:4\n") != std::string::npos);
+  assert_eq(err.str().substr(err.str().size() - 4), "^\n10");
+}
+
+struct EventRecorder : ParseHandler {
+  std::string events;
+  bool enter(Scope::Type t, size_t offset) {
+    events += "<" + std::string(Scope::type_name(t)) + "@" + std::to_string(offset);
+    return true;
+  }
+  bool leave(Scope::Type t) { events += ">"; return true; }
+  bool token(Token t, const char* p, size_t len, size_t offset) {
+    events += " " + std::string(p, len) + "@" + std::to_string(offset);
+    return true;
+  }
+};
+
+template <typename Handler>
+static Parser::Status parse_events(BasicParser<Handler>& P, const std::string& input) {
+  Parser::Status status = Parser::Status::MORE;
+  size_t offs = 0;
+  while (status == Parser::Status::MORE) {
+    size_t bufsize;
+    char* buf = P.get_read_buf(bufsize);
+    size_t len = SAT_MIN(bufsize, input.size() - offs);
+    memcpy(buf, input.data() + offs, len);
+    offs += len;
+    P.fill(buf, len, offs == input.size());
+    status = P.parse();
+  }
+  return status;
+}
+
+static void test_events() {
+  BasicParser<EventRecorder> P(kStr_user_ns);
+  assert_true(parse_events(P, "a (b c:)\n  # x\nd\n") == Parser::Status::DONE);
+  assert_eq(P.handler().events,
+    "<BLOCK@0<LIST@0 a@0<GROUP@2<LIST@2 b@3 c:@5>><BLOCK@11<LIST@11  x@12>>><LIST@15 d@15>");
+}
+
+static void test_validate_allocs() {
+  // Parsing without building a tree does not allocate expressions or strings
+  std::string input;
+  while (input.size() < 64*1024) { input.append("a b:c (d e) { f; g } # h\n  i j:\n"); }
+  input.append("k\n");
+  alloc::enable(true);
+  alloc::Stats expr0 = alloc::stats(alloc::Tag::EXPR);
+  alloc::Stats str0 = alloc::stats(alloc::Tag::STR);
+  {
+    BasicParser<ParseHandler> P(kStr_user_ns);
+    assert_true(parse_events(P, input) == Parser::Status::DONE);
+    assert_eq(P.stats().tokens[(size_t)Parser::Token::NAME] > 0, true);
+  }
+  assert_eq(alloc::stats(alloc::Tag::EXPR).calls, expr0.calls);
+  assert_eq(alloc::stats(alloc::Tag::STR).calls, str0.calls);
+  alloc::enable(false);
+}
+
+static void test_positions() {
+  Parser P(kStr_user_ns);
+  std::vector<Expr*> results;
+  auto status = parse_string(P, "ab cd\n  # c\nx (y z)\n", [&](Expr* e) { results.push_back(e); });
+  assert_true(status == Parser::Status::DONE);
+  assert_eq(results.size(), 2u);
+
+  Expr* e = results[0]; // (ab cd (# c))
+  assert_eq(e->offset(), 0u);
+  assert_eq(e->_value.head->next()->offset(), 3u);
+  SrcPos p = P.pos(e->_value.head->next());
+  assert_eq(p.line, 1u);
+  assert_eq(p.col, 4u);
+
+  e = results[1]; // (x ((y z)))
+  assert_eq(e->offset(), 12u);
+  const Expr* group = e->_value.head->next();
+  assert_true(group->type() == Expr::Type::GROUP);
+  assert_eq(group->offset(), 14u);
+  const Expr* y = group->_value.head->_value.head;
+  assert_eq(y->offset(), 15u);
+  p = P.pos(y);
+  assert_eq(p.line, 3u);
+  assert_eq(p.col, 4u);
+
+  assert_eq(P.stats().lines, 3u);
+  for (Expr* e : results) { delete e; }
+}
+
+static std::vector<Expr*> parse_results(const std::string& input) {
+  Parser P(kStr_user_ns);
+  std::vector<Expr*> results;
+  auto status = parse_string(P, input, [&](Expr* e) { results.push_back(e); });
+  assert_true(status == Parser::Status::DONE);
+  return results;
+}
+
+static std::string visit_str(const Expr* e, bool post) {
+  std::string s;
+  auto f = [&](const Expr* e) {
+    if (!s.empty()) { s += ' '; }
+    s += e->is_str() ? std::string(e->str_value()->c_str()) : Expr::type_name(e->type());
+  };
+  if (post) { e->visit_post(f); } else { e->visit_pre(f); }
+  return s;
+}
+
+static void test_traversal() {
+  std::vector<Expr*> results = parse_results("a (b c) { d }\n  e\nf\n");
+  assert_eq(results.size(), 2u);
+  assert_eq(visit_str(results[0], false),
+    "LIST a GROUP LIST b c INLINE_BLOCK LIST d BLOCK LIST e");
+  assert_eq(visit_str(results[0], true),
+    "a b c LIST GROUP d LIST INLINE_BLOCK e LIST BLOCK LIST");
+  assert_eq(visit_str(results[1], false), "LIST f"); // a result's siblings are not visited
+  assert_true(results[0]->head()->type() == Expr::Type::SYM);
+  assert_null(results[0]->head()->head());
+  for (Expr* e : results) { delete e; }
+
+  // Lines with very many terms are printed and freed without recursing per term
+  std::string input;
+  for (size_t i = 0; i < 1000000; i++) { input.append("x "); }
+  input.append("\n");
+  results = parse_results(input);
+  assert_eq(results.size(), 1u);
+  size_t n = 0;
+  results[0]->visit_post([&](const Expr*) { n++; });
+  assert_eq(n, 1000001u);
+  std::ostringstream ss;
+  ss << results[0];
+  assert_eq(ss.str().size(), input.size() - 2);
+  delete results[0];
+}
+
+static void test_line_index() {
+  // The vectorized scan finds the same linebreaks as a plain loop, at any alignment and length
+  std::string s;
+  for (size_t i = 0; i < 1000; i++) {
+    s.push_back((i * 7919) % 13 == 0 ? '\n' : 'x');
+  }
+  for (size_t start = 0; start < 40; start++) {
+    for (size_t len = 0; start + len <= s.size(); len += 37) {
+      std::vector<size_t> expect;
+      for (size_t i = 0; i < len; i++) {
+        if (s[start + i] == '\n') expect.push_back(i);
+      }
+      std::vector<size_t> actual;
+      find_linebreaks(s.data() + start, len, [&](size_t i) { actual.push_back(i); });
+      assert_true(actual == expect);
+    }
+  }
+
+  // Incremental updates give the same positions as indexing everything at once
+  LineIndex a, b;
+  a.update(s.data(), s.size());
+  for (size_t len = 0; len <= s.size(); len += 61) {
+    b.update(s.data(), len);
+  }
+  b.update(s.data(), s.size());
+  for (size_t i = 0; i <= s.size(); i++) {
+    assert_eq(a.pos(i).line, b.pos(i).line);
+    assert_eq(a.pos(i).col, b.pos(i).col);
+  }
+}
+
+static void test_classes() {
+  // The class table agrees with the byte predicates the lexer was originally written with, but
+  // for bytes >= 0x80, which are parts of UTF-8 sequences
+  for (unsigned b = 0; b < 256; b++) {
+    bool is_ctrl = b < 0x9 || b == 0xb || b == 0xc || (b > 0xd && b < 0x20);
+    bool is_uspace = b == 0xc2 || b == 0xe1 || b == 0xe2 || b == 0xe3;
+    bool is_name = b > 0x20 && b != '\\' && b != 0x7f && b != 0xc0 && b != 0xc1 && b < 0xf5
+                   && !is_uspace
+                   && b != '(' && b != ')' && b != '{' && b != '}' && b != ';';
+    lex::Class c = lex::kClasses[(u8)b];
+    assert_eq(lex::is_name(c), is_name);
+    assert_eq(c == lex::Class::CTRL, is_ctrl);
+    assert_eq(c == lex::Class::USPACE, is_uspace);
+  }
+}
+
+static void test_keywords() {
+  auto kw = [](const char* s) { return find_keyword(s, strlen(s)); };
+  assert_true(kw("__END__") == Keyword::END);
+  assert_true(kw("=") == Keyword::eq);
+  assert_true(kw("print") == Keyword::print);
+  assert_true(kw("user") == Keyword::user);
+  // Same length and first and last bytes as a reserved word, but not one
+  for (const char* s : { "__ENX__", "pxxxt", "uxxr", "", "END", "__END__x", "_" }) {
+    assert_true(kw(s) == Keyword::NONE);
+  }
+  assert_true(keyword_symbol(Keyword::eq) == Str::imp_cast(kStr_eq));
+  assert_true(keyword_symbol(Keyword::END) == nullptr);
+
+  // Constant symbols in the input are the preinterned ones, found without an interner lookup
+  size_t lookups = strings.stats().lookups;
+  std::vector<Expr*> results = parse_results("a = print\n");
+  assert_eq(strings.stats().lookups, lookups + 1); // "a"
+  const Expr* e = results[0]->head();
+  assert_true(e->next()->str_value() == Str::imp_cast(kStr_eq));
+  assert_true(e->next()->next()->str_value() == Str::imp_cast(kStr_print));
+  for (Expr* e : results) { delete e; }
+}
+
+static void test_utf8() {
+  // Non-ASCII spaces separate names like ' ' does; other characters are parts of names
+  Parser::Status status;
+  assert_eq(parse("a\u00a0b\u3000c \u00a0\u205f\u0101\u00e9\u2192 \u2000\n", 1, status),
+            "a b c \u0101\u00e9\u2192\n");
+  assert_true(status == Parser::Status::DONE);
+
+  // Ill-formed input is reported at its first byte, after the results before it
+  const char* bad[] = {
+    "\x80",             // continuation byte without a lead byte
+    "\xc0\xaf",         // overlong '/'
+    "\xe0\x80\xaf",     // overlong '/'
+    "\xed\xa0\x80",     // surrogate U+D800
+    "\xf4\x90\x80\x80", // above U+10FFFF
+    "\xe2\x80",         // cut off by the end of input
+    "\xe2(",            // cut off by another character
+  };
+  for (const char* b : bad) {
+    for (size_t chunk_size : { 1, 2, 4096 }) {
+      std::string input = std::string("ok\nx y") + b;
+      std::ostringstream err;
+      std::streambuf* prev = std::cerr.rdbuf(err.rdbuf());
+      std::string out = parse(input, chunk_size, status);
+      std::cerr << 10;
+      std::cerr.rdbuf(prev);
+      assert_true(status == Parser::Status::ERROR);
+      assert_eq(out, "ok\n");
+      assert_true(err.str().find("EncodingError: ") == 0);
+      assert_true(err.str().find(" at 2:4\n") != std::string::npos); // the bad byte
+      assert_eq(err.str().substr(err.str().size() - 3), "\n10"); // not left in hex
+    }
+  }
+
+  // Input after "__END__" is not read
+  assert_eq(parse("a\n__END__\n\xff", 4096, status), "a\n");
+  assert_true(status == Parser::Status::DONE);
+
+  // An ASCII-only path for blocks without high bytes, and sequences straddling 16-byte blocks
+  std::string s(100, 'a');
+  for (size_t i = 0; i < 40; i++) {
+    std::string t = s;
+    t.replace(i, 3, "\u65e5");
+    bool ok;
+    assert_true(utf8::validate(t.data(), t.data() + t.size(), true, ok) == t.data() + t.size());
+    assert_true(ok);
+    t[i + 1] = 'x';
+    assert_true(utf8::validate(t.data(), t.data() + t.size(), true, ok) == t.data() + i);
+    assert_false(ok);
+    assert_true(utf8::validate(t.data(), t.data() + i + 1, false, ok) == t.data() + i);
+    assert_true(ok); // pending
+  }
+}
+
+static std::string parse_documents(const std::string& input, size_t chunk_size,
+                                   Parser::Stats* stats = 0) {
+  // Results as "<document> <line>:<col> <expr>" lines, with "--" after each ended document
+  Parser P(kStr_user_ns);
+  P.set_multi_document(true);
+  std::ostringstream out;
+  auto status = parse_string(P, input, [&](Expr* e) {
+    SrcPos pos = P.pos(e);
+    out << P.document() << ' ' << pos.line << ':' << pos.col << ' ' << e << '\n';
+    delete e;
+  }, chunk_size, [&]() { out << "--\n"; });
+  if (status == Parser::Status::ERROR) {
+    out << "error " << P.document() << ' ' << P.lineno() << '\n';
+  }
+  if (stats) {
+    *stats = P.stats();
+  }
+  return out.str();
+}
+
+static void test_multi_document() {
+  const std::string input =
+    "a b\n"
+    "  c\n"
+    "__END__\n"
+    "x:\n"
+    "  y = 1\n"
+    "z\n"
+    "__END__\n"
+    "__END__\n"
+    "\n"
+    "# last\n"
+    "w (v)\n";
+  const std::string want =
+    "0 1:1 a b\n  c\n"
+    "--\n"
+    "1 1:1 x:\n  y = 1\n"
+    "1 3:1 z\n"
+    "--\n"
+    "--\n"
+    "3 2:1 # last\n"
+    "3 3:1 w (v)\n";
+  for (size_t chunk_size : { (size_t)1, (size_t)3, (size_t)7, input.size() }) {
+    Parser::Stats st;
+    assert_eq(parse_documents(input, chunk_size, &st), want);
+    assert_eq(st.documents, 3u);
+    assert_eq(st.bytes, input.size());
+    assert_eq(st.lines, 11u);
+    assert_eq(st.results, 5u);
+  }
+
+  // Each document starts at indentation level 0, and errors are reported at lines of their
+  // document
+  assert_eq(parse_documents("a\n  b\n__END__\n  c\n", 1000),
+            "0 1:1 a\n  b\n--\nerror 1 1\n");
+  assert_eq(parse_documents("a\n__END__\nb )\n", 1000), "0 1:1 a\n--\nerror 1 1\n");
+
+  // The buffer only holds the current document
+  std::string many;
+  for (size_t i = 0; i < 5000; i++) {
+    many += "doc" + std::to_string(i) + ":\n  kind = Dairy\n__END__\n";
+  }
+  Parser::Stats st;
+  std::string out = parse_documents(many, 4096, &st);
+  assert_eq(st.documents, 5000u);
+  assert_true(st.buf_high_water <= 16 * 1024);
+  assert_true(out.find("4999 1:1 doc4999:") != std::string::npos);
+
+  // Without multi-document mode, "__END__" still ends the input
+  Parser::Status status;
+  assert_eq(parse("a\n__END__\nb\n", 1000, status), "a\n");
+  assert_true(status == Parser::Status::DONE);
+}
+
+static void test_reset() {
+  // A parser which is reset gives the same results as a new one
+  Parser P(kStr_user_ns);
+  for (const char* src : kSources) {
+    for (size_t chunk_size : { (size_t)1, (size_t)7, (size_t)4096 }) {
+      Parser::Status status1, status2;
+      P.reset();
+      assert_eq(parse(P, src, chunk_size, status1), parse(src, chunk_size, status2));
+      assert_true(status1 == status2);
+    }
+  }
+
+  // ...also when reset in the middle of the input, with open scopes and results not taken
+  P.reset();
+  size_t bufsize;
+  char* buf = P.get_read_buf(bufsize);
+  const char* partial = "a b\nc:\n  d (e\n";
+  memcpy(buf, partial, strlen(partial));
+  P.fill(buf, strlen(partial), false);
+  assert_true(P.parse() == Parser::Status::RESULT);
+  P.reset();
+  Parser::Status status;
+  assert_eq(parse(P, "x y\n", 1, status), "x y\n");
+  assert_true(status == Parser::Status::DONE);
+  assert_eq(P.stats().results, 1u);
+  assert_eq(P.lineno(), 2u);
+
+  // Once warmed up by one input, inputs of the same shape are parsed without allocating
+  // anything other than results and strings. A parser frees what it allocated.
+  auto make_input = [](size_t n) {
+    std::string s;
+    for (size_t i = 0; i < 200; i++) {
+      s += "item" + std::to_string(n) + ":\n  a = (b c { d; e }) # f\n  g:\n    h i\n";
+    }
+    return s + "end\n";
+  };
+  const std::vector<alloc::Tag> kTags = {
+    alloc::Tag::PARSER, alloc::Tag::BUF, alloc::Tag::NAMESPACE };
+  alloc::enable(true);
+  std::vector<alloc::Stats> before;
+  for (alloc::Tag tag : kTags) { before.push_back(alloc::stats(tag)); }
+  {
+    Parser P2(kStr_user_ns);
+    for (size_t chunk_size : { (size_t)4096, (size_t)64 }) {
+      P2.reset();
+      parse(P2, make_input(0), chunk_size, status);
+      std::vector<alloc::Stats> warm;
+      for (alloc::Tag tag : kTags) { warm.push_back(alloc::stats(tag)); }
+      for (size_t n = 1; n < 10; n++) {
+        P2.reset();
+        assert_true(parse(P2, make_input(n), chunk_size, status).size() > 0);
+        assert_true(status == Parser::Status::DONE);
+      }
+      for (size_t i = 0; i < kTags.size(); i++) {
+        assert_eq(alloc::stats(kTags[i]).calls, warm[i].calls);
+      }
+    }
+  }
+  for (size_t i = 0; i < kTags.size(); i++) {
+    assert_eq(alloc::stats(kTags[i]).live, before[i].live);
+  }
+  alloc::enable(false);
+}
+
+int main(int argc, const char** argv) {
+  test_classes();
+  for (const char* src : kSources) {
+    test_chunked(src);
+  }
+  std::ifstream f("../foo.sat");
+  if (f) {
+    std::stringstream ss;
+    ss << f.rdbuf();
+    test_chunked(ss.str());
+  }
+  test_errors();
+  test_events();
+  test_validate_allocs();
+  test_positions();
+  test_traversal();
+  test_line_index();
+  test_multi_document();
+  test_reset();
+  test_keywords();
+  test_utf8();
+  return 0;
+}
@@ -0,0 +1,169 @@
+//!DEP ../src/str.cc ../src/trace.cc ../src/alloc.cc
+#include "test.hh"
+#include "../src/pmap.hh"
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace sat;
+
+static constexpr auto kStr_a = ConstStr("a");
+static Str::WeakSet syms{&kStr_a};
+
+static std::vector<Str> make_keys(size_t n) {
+  std::vector<Str> keys;
+  for (size_t i = 0; i < n; i++) {
+    std::string s = "k" + std::to_string(i);
+    keys.push_back(syms.get(s.c_str(), (u32)s.size()));
+  }
+  return keys;
+}
+
+template <typename M>
+static void check_equal(const PMap<int>& m, const M& expect, const std::vector<Str>& keys) {
+  assert_eq(m.size(), expect.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    auto I = expect.find(i);
+    const int* v = m.find(keys[i]);
+    if (I == expect.end()) {
+      assert_null(v);
+    } else {
+      assert_not_null(v);
+      assert_eq(*v, I->second);
+    }
+  }
+  size_t n = 0;
+  m.foreach([&](Str::Imp* k, int v) { n++; });
+  assert_eq(n, expect.size());
+}
+
+void test_basics() {
+  PMap<int> m;
+  Str a = syms.get("a");
+  Str b = syms.get("b");
+  assert_true(m.empty());
+  assert_null(m.find(a));
+  assert_true(m.set(a, 1));
+  assert_false(m.set(a, 2)); // replaces
+  assert_eq(*m.find(a), 2);
+  assert_null(m.find(b));
+  assert_true(m.set(b, 3));
+  assert_eq(m.size(), 2u);
+  assert_true(m.erase(a));
+  assert_false(m.erase(a));
+  assert_null(m.find(a));
+  assert_eq(*m.find(b), 3);
+  assert_true(m.erase(b));
+  assert_true(m.empty());
+}
+
+void test_persistence() {
+  // Every version of a map stays as it was, no matter what is done to its copies
+  std::vector<Str> keys = make_keys(2000);
+  std::vector<PMap<int>> versions;
+  std::vector<std::map<size_t,int>> expect;
+  PMap<int> m;
+  std::map<size_t,int> e;
+  u32 r = 1;
+  for (int step = 0; step < 20000; step++) {
+    r = r * 1103515245 + 12345;
+    size_t i = (r >> 8) % keys.size();
+    if ((r >> 4) % 4 == 0) {
+      assert_eq(m.erase(keys[i]), e.erase(i) == 1);
+    } else {
+      assert_eq(m.set(keys[i], step), e.find(i) == e.end());
+      e[i] = step;
+    }
+    if (step % 1000 == 0) {
+      versions.push_back(m);
+      expect.push_back(e);
+    }
+  }
+  check_equal(m, e, keys);
+  for (size_t i = 0; i < versions.size(); i++) {
+    check_equal(versions[i], expect[i], keys);
+  }
+  // Erase everything
+  for (size_t i = 0; i < keys.size(); i++) {
+    m.erase(keys[i]);
+  }
+  assert_true(m.empty());
+  check_equal(versions.back(), expect.back(), keys);
+}
+
+void test_collisions() {
+  // Keys with equal hashes. These are not interned; keys are compared by pointer so that's fine.
+  std::vector<Str> keys;
+  for (int i = 0; i < 5; i++) {
+    keys.push_back(Str{("c" + std::to_string(i)).c_str()});
+    keys.back().self->_hash = 0xabcdef01;
+  }
+  PMap<int> m;
+  std::map<size_t,int> e;
+  for (size_t i = 0; i < keys.size(); i++) {
+    m.set(keys[i], (int)i);
+    e[i] = (int)i;
+  }
+  check_equal(m, e, keys);
+  PMap<int> m2 = m;
+  m2.set(keys[2], 20);
+  assert_eq(*m2.find(keys[2]), 20);
+  assert_eq(*m.find(keys[2]), 2);
+  for (size_t i = 0; i < keys.size(); i += 2) {
+    m.erase(keys[i]);
+    e.erase(i);
+    check_equal(m, e, keys);
+  }
+}
+
+void test_sharing() {
+  // Copying is free and a change costs a path, not a copy of the map
+  std::vector<Str> keys = make_keys(10000);
+  PMap<int> base;
+  for (size_t i = 0; i < keys.size(); i++) { base.set(keys[i], (int)i); }
+  Str x = syms.get("x");
+
+  alloc::enable(true);
+  alloc::Stats st0 = alloc::stats(alloc::Tag::MAP);
+  std::vector<PMap<int>> imports(100, base);
+  assert_eq(alloc::stats(alloc::Tag::MAP).calls, st0.calls);
+  for (auto& m : imports) {
+    assert_true(m.shares_root(base));
+    m.set(x, 1);
+    m.set(keys[0], -1); // shadow
+  }
+  alloc::Stats st1 = alloc::stats(alloc::Tag::MAP);
+  // At most a path of nodes per change (7 levels for 32-bit hashes)
+  assert_true(st1.calls - st0.calls <= imports.size() * 2 * 7);
+  assert_eq(*imports[5].find(keys[0]), -1);
+  assert_eq(*base.find(keys[0]), 0);
+  assert_null(base.find(x));
+  imports.clear();
+  assert_eq(alloc::stats(alloc::Tag::MAP).live, st0.live);
+  alloc::enable(false);
+}
+
+void test_references() {
+  // The map keeps its keys alive, as long as any version of it holds them
+  PMap<int> m;
+  Str::WeakRef wr;
+  {
+    Str k = syms.get("held");
+    wr = k;
+    m.set(k, 1);
+  }
+  PMap<int> m2 = m;
+  m.clear();
+  assert_true(wr == true);
+  m2.clear();
+  assert_true(wr == false);
+}
+
+int main() {
+  test_basics();
+  test_persistence();
+  test_collisions();
+  test_sharing();
+  test_references();
+  return 0;
+}
@@ -0,0 +1,209 @@
+//!DEP ../src/qindex.cc ../src/parse.cc ../src/hashcons.cc ../src/str.cc ../src/expr.cc ../src/trace.cc ../src/alloc.cc
+#include "../src/qindex.hh"
+#include "../src/hashcons.hh"
+#include "../src/spsc.hh"
+#include "parsing.hh"
+#include <sstream>
+#include <thread>
+
+#include <pthread.h>
+
+using namespace sat;
+
+static void add_source(QNameIndex& index, const std::string& src) {
+  Parser P(kStr_user_ns);
+  auto status = parse_string(P, src, [&](Expr* e) { index.add(e); });
+  assert_true(status == Parser::Status::DONE);
+}
+
+static std::string lookup(const QNameIndex& index, const char* qname) {
+  const Expr* e = index.lookup(qname);
+  if (!e) { return "-"; }
+  std::ostringstream ss;
+  ss << e;
+  return ss.str();
+}
+
+static void test_lookup() {
+  QNameIndex index;
+  add_source(index,
+    "a:\n"
+    "  x = A\n"
+    "  b:\n"
+    "    x = B\n"
+    "print a:b:x\n"
+    "a = World\n"
+    "c:d:y = Y\n");
+  assert_eq(lookup(index, "user:a:x"), "x = A");
+  assert_eq(lookup(index, "user:a:b:x"), "x = B");
+  assert_eq(lookup(index, "user:a"), "a = World");   // the name a
+  assert_eq(lookup(index, "user:a:").substr(0, 2), "a:"); // the namespace a:
+  assert_eq(lookup(index, "user:c:d:y"), "c:d:y = Y");
+  assert_eq(lookup(index, "user:c:"), "-"); // implied by c:d:y, not defined by any line
+  assert_eq(lookup(index, "user:print"), "-");
+  assert_eq(lookup(index, "user:a:b:y"), "-");
+  assert_eq(lookup(index, "user:nosuchname"), "-");
+  assert_eq(lookup(index, "user::a"), "-");
+  assert_eq(lookup(index, "a:x"), "-"); // not qualified with the root namespace
+
+  // Lookups with a prepared name
+  QNameIndex::QName qn;
+  assert_true(QNameIndex::QName::parse("user:a:b:x", 10, qn));
+  assert_eq(qn.parts.size(), 4u);
+  assert_false(qn.is_ns);
+  assert_true(index.lookup(qn) == index.lookup("user:a:b:x"));
+}
+
+static void test_redefine() {
+  // Defining a namespace again replaces its contents
+  QNameIndex index;
+  add_source(index,
+    "milk:\n"
+    "  kind = Dairy\n"
+    "  sour = No\n"
+    "  b:\n"
+    "    x = 1\n"
+    "milk:\n"
+    "  kind = Cheese\n"
+    "milk:sour = Yes\n");
+  assert_eq(lookup(index, "user:milk:kind"), "kind = Cheese");
+  assert_eq(lookup(index, "user:milk:sour"), "milk:sour = Yes");
+  assert_eq(lookup(index, "user:milk:b:x"), "-");
+  assert_eq(lookup(index, "user:milk:b:"), "-");
+
+  // Names are replaced one by one
+  add_source(index, "x = 1\nx = 2\n");
+  assert_eq(lookup(index, "user:x"), "x = 2");
+}
+
+static void test_ownership() {
+  // Results which no longer define anything are freed
+  alloc::enable(true);
+  i64 live0 = alloc::stats(alloc::Tag::EXPR).live;
+  {
+    QNameIndex index;
+    add_source(index, "x = 1\nprint x\n");
+    i64 live1 = alloc::stats(alloc::Tag::EXPR).live;
+    assert_true(live1 > live0); // holds on to "x = 1" but not "print x"
+    add_source(index, "x = 2\nx = 3\n");
+    assert_eq(alloc::stats(alloc::Tag::EXPR).live, live1);
+    add_source(index, "ns:\n  y = 1\n  z = 2\nns:\n  y = 3\nend\n");
+    assert_eq(lookup(index, "user:ns:y"), "y = 3");
+    assert_eq(lookup(index, "user:ns:z"), "-");
+  }
+  assert_eq(alloc::stats(alloc::Tag::EXPR).live, live0);
+  alloc::enable(false);
+}
+
+static void test_deleter() {
+  // As with sat --pipeline --hashcons --lookup: results are parsed on one thread, with lists
+  // shared through a HashCons, and indexed on another, which hands the results that
+  // redefinitions replace back to the parser's thread to be deleted
+  std::string src;
+  for (int i = 0; i < 2000; i++) {
+    src += "ns" + std::to_string(i % 10) + ":\n  kind = (a b c)\n  n = " + std::to_string(i) + "\n";
+    src += "x = (a b c)\n";
+  }
+  Str::WeakSet::set_threadsafe(true); // both threads hold on to symbols
+  alloc::enable(true);
+  i64 live0 = alloc::stats(alloc::Tag::EXPR).live;
+  {
+    HashCons hc;
+    QNameIndex index;
+    SPSCQueue<Expr*> parsed(64), used(8192);
+    std::thread parser([&]{
+      Parser P(kStr_user_ns);
+      P.set_hashcons(&hc);
+      auto status = parse_string(P, src, [&](Expr* e) {
+        parsed.push(e);
+        Expr* u;
+        while (used.try_pop(u)) { delete u; }
+      }, 4096);
+      assert_true(status == Parser::Status::DONE);
+      parsed.close();
+      Expr* u;
+      while (used.pop(u)) { delete u; }
+    });
+    size_t released = 0;
+    index.set_deleter([&](Expr* e) {
+      used.push(e);
+      released++;
+    });
+    Expr* e;
+    while (parsed.pop(e)) { index.add(e); }
+    index.set_deleter(nullptr);
+    used.close();
+    parser.join();
+    assert_eq(released, 1990u + 1999u); // all but the last of each namespace, and of x
+    assert_eq(lookup(index, "user:ns3:n"), "n = 1993");
+    assert_eq(lookup(index, "user:ns3:kind"), "kind = (a b c)");
+    assert_eq(lookup(index, "user:x"), "x = (a b c)");
+    assert_eq(index.size(), 1u + 10u + 10u + 10u + 1u); // user:, ns0..9:, their kind and n, x
+  }
+  assert_eq(alloc::stats(alloc::Tag::EXPR).live, live0);
+  alloc::enable(false);
+  Str::WeakSet::set_threadsafe(false);
+}
+
+static void test_many() {
+  QNameIndex index;
+  std::string src;
+  for (int i = 0; i < 1000; i++) {
+    src += "ns" + std::to_string(i % 10) + ":\n";
+    src += "  n" + std::to_string(i) + " = " + std::to_string(i) + "\n";
+  }
+  src += "end\n";
+  add_source(index, src);
+  // Every namespace was defined again 100 times, so only the last definition of each remains
+  for (int i = 0; i < 1000; i++) {
+    std::string qname = "user:ns" + std::to_string(i % 10) + ":n" + std::to_string(i);
+    std::string expect = i >= 990 ? "n" + std::to_string(i) + " = " + std::to_string(i) : "-";
+    assert_eq(lookup(index, qname.c_str()), expect);
+  }
+  assert_eq(index.size(), 1u + 10u + 10u); // user:, ns0..9:, n990..999
+}
+
+static void test_deep() {
+  // Deeply nested namespaces and names with many parts are indexed and freed without recursing
+  // per level. This runs on a thread with a small stack, where that recursion would crash.
+  const size_t kDepth = 2000;
+  QNameIndex index;
+  std::string src, qname = "user:";
+  for (size_t i = 0; i < kDepth; i++) {
+    src += std::string(i, ' ') + "n" + std::to_string(i) + ":\n";
+    qname += "n" + std::to_string(i) + ":";
+  }
+  src += std::string(kDepth, ' ') + "x = 1\n";
+  src += "q";
+  for (size_t i = 0; i < kDepth; i++) { src += ":q"; }
+  src += " = 2\nend\n";
+  add_source(index, src);
+  assert_eq(lookup(index, (qname + "x").c_str()), "x = 1");
+  assert_eq(index.size(), 1u + kDepth + 1u + kDepth + 1u);
+
+  add_source(index, "n0:\n  y = 3\nq:\n  z = 4\nend\n"); // clears both
+  assert_eq(lookup(index, (qname + "x").c_str()), "-");
+  assert_eq(lookup(index, "user:n0:y"), "y = 3");
+  assert_eq(index.size(), 1u + 2u + 2u);
+}
+
+static void run_with_small_stack(void (*f)()) {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 128 * 1024);
+  pthread_t t;
+  assert_eq(pthread_create(&t, &attr, [](void* f) -> void* { ((void(*)())f)(); return 0; },
+                           (void*)f), 0);
+  pthread_join(t, 0);
+  pthread_attr_destroy(&attr);
+}
+
+int main(int argc, const char** argv) {
+  test_lookup();
+  test_redefine();
+  test_ownership();
+  test_deleter();
+  test_many();
+  run_with_small_stack(test_deep);
+  return 0;
+}
@@ -0,0 +1,236 @@
+//!DEP ../src/serve.cc ../src/io.cc ../src/parse.cc ../src/hashcons.cc ../src/str.cc ../src/expr.cc ../src/trace.cc ../src/alloc.cc
+#include "../src/serve.hh"
+#include "parsing.hh"
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace sat;
+
+static const char* kSource =
+  "milk:\n"
+  "  kind = Dairy\n"
+  "  sour = No # not yet\n"
+  "x = (a b) { c; d }\n"
+  "end\n";
+
+static std::string make_source(size_t nlines, size_t seed) {
+  std::string s;
+  for (size_t i = 0; i < nlines; i++) {
+    s += "ns" + std::to_string((i + seed) % 50) + ":\n  sym" + std::to_string(i * seed % 997) +
+         " = Value" + std::to_string(i) + "\n";
+  }
+  return s + "end\n";
+}
+
+static std::string parse_text(const std::string& src) {
+  // What the server should respond with
+  Parser P(kStr_user_ns);
+  std::ostringstream ss;
+  parse_string(P, src, [&](Expr* e) { ss << e << '\n'; delete e; });
+  return ss.str();
+}
+
+static u32 get_u32(const std::string& s, size_t i) {
+  return (u32)(u8)s[i] | (u32)(u8)s[i+1] << 8 | (u32)(u8)s[i+2] << 16 | (u32)(u8)s[i+3] << 24;
+}
+
+static void test_requests(const std::string& path) {
+  std::string expected = parse_text(kSource);
+  assert_true(expected.find("milk") == 0);
+  Client c;
+  assert_true(c.connect(path));
+  Client::Response r;
+
+  assert_true(c.parse("1", "text", 0, kSource, r));
+  assert_true(r.ok);
+  assert_eq(r.body, expected);
+
+  // binary: 3 results, the first a LIST of ASSIGNMENT "milk" and a BLOCK
+  assert_true(c.parse("2", "binary", 0, kSource, r));
+  assert_true(r.ok);
+  assert_eq(get_u32(r.body, 0), 3u);
+  assert_eq((Expr::Type)r.body[4], Expr::Type::LIST);
+  assert_eq(get_u32(r.body, 9), 2u);
+  assert_eq((Expr::Type)r.body[13], Expr::Type::ASSIGNMENT);
+  assert_eq(get_u32(r.body, 18), 4u);
+  assert_eq(r.body.substr(22, 4), "milk");
+
+  assert_true(c.parse("3", "text", 0, "a\nb )\n", r));
+  assert_false(r.ok);
+  assert_eq(r.reason, "parse");
+  assert_eq(r.body, "syntax error at 2:3\n");
+
+  // The connection is still good after an error
+  assert_true(c.parse("4", "text", 0, "", r));
+  assert_true(r.ok);
+  assert_eq(r.body, "");
+
+  char file[] = "/tmp/sat_test_serve.XXXXXX";
+  int fd = mkstemp(file);
+  assert_true(write(fd, kSource, strlen(kSource)) == (ssize_t)strlen(kSource));
+  close(fd);
+  assert_true(c.parse_file("5", "text", 0, file, r));
+  assert_true(r.ok);
+  assert_eq(r.body, expected);
+  unlink(file);
+  assert_true(c.parse_file("6", "text", 0, file, r));
+  assert_false(r.ok);
+  assert_eq(r.reason, "io");
+
+  assert_true(c.request("HELLO", "", r));
+  assert_false(r.ok);
+  assert_eq(r.reason, "request");
+}
+
+static void test_timeout(const std::string& path) {
+  // The request promises more bytes than it sends
+  Client c;
+  assert_true(c.connect(path));
+  Client::Response r;
+  assert_true(c.request("PARSE t text 50 100", "a b\n", r));
+  assert_false(r.ok);
+  assert_eq(r.reason, "timeout");
+}
+
+static void test_idle(const std::string& path, size_t nthreads) {
+  // Connections which don't send a request line are closed after the idle timeout, so that they
+  // can't keep every worker busy
+  std::vector<std::unique_ptr<Client>> idle;
+  for (size_t i = 0; i < nthreads; i++) {
+    idle.emplace_back(new Client);
+    assert_true(idle.back()->connect(path));
+  }
+  assert_true(write(idle[0]->_fd, "PARSE i text 0", 14) == 14); // not a complete line
+  Client c;
+  assert_true(c.connect(path));
+  Client::Response r;
+  assert_true(c.parse("after_idle", "text", 0, "a b\n", r));
+  assert_true(r.ok);
+  assert_eq(r.body, "a b\n");
+  for (auto& ic : idle) {
+    char ch;
+    assert_eq(read(ic->_fd, &ch, 1), 0); // closed by the server
+  }
+}
+
+static void test_too_large(const std::string& path) {
+  // Sources up to the limit are parsed, and larger ones refused without reading them
+  Server::Options opt;
+  opt.path = path;
+  opt.nthreads = 1;
+  opt.max_request_bytes = 64*1024;
+  Server server(opt);
+  std::string err;
+  assert_true(server.listen(err));
+  std::thread t([&]{ server.run(); });
+
+  std::string src;
+  while (src.size() < opt.max_request_bytes) { src += "a\n"; }
+  src.resize(opt.max_request_bytes - 1);
+  src += '\n';
+  Client c;
+  assert_true(c.connect(path));
+  Client::Response r;
+  assert_true(c.parse("max", "text", 0, src, r));
+  assert_true(r.ok);
+  assert_eq(r.body, parse_text(src));
+  assert_true(c.request("PARSE big text 0 " + std::to_string(opt.max_request_bytes + 1), "", r));
+  assert_false(r.ok);
+  assert_eq(r.reason, "request");
+  assert_true(r.body.find("larger than the limit") != std::string::npos);
+  char ch;
+  assert_eq(read(c._fd, &ch, 1), 0); // closed, as the payload wasn't read
+
+  server.stop();
+  t.join();
+}
+
+static void test_cancel(const std::string& path) {
+  std::string big = make_source(400000, 3);
+  Client::Response r;
+  std::thread t([&]{
+    Client c;
+    assert_true(c.connect(path));
+    assert_true(c.parse("big", "text", 60000, big, r));
+  });
+  Client c;
+  assert_true(c.connect(path));
+  Client::Response cr;
+  do {
+    assert_true(c.cancel("big", cr));
+    assert_true(cr.ok);
+  } while (cr.body == "0\n");
+  t.join();
+  assert_false(r.ok);
+  assert_eq(r.reason, "cancelled");
+}
+
+static void test_concurrency(const std::string& path) {
+  // Many clients at once, sharing the interner with each other and with this thread
+  const size_t kClients = 8;
+  const size_t kRequests = 100;
+  std::vector<std::string> sources, expected;
+  for (size_t i = 0; i < kClients; i++) {
+    sources.push_back(make_source(50 + i, i + 1));
+    expected.push_back(parse_text(sources.back()));
+  }
+  std::vector<std::thread> threads;
+  std::vector<size_t> failures(kClients);
+  for (size_t i = 0; i < kClients; i++) {
+    threads.emplace_back([&, i]{
+      Client c;
+      if (!c.connect(path)) { failures[i] = kRequests; return; }
+      Client::Response r;
+      for (size_t n = 0; n < kRequests; n++) {
+        if (!c.parse(std::to_string(i), "text", 0, sources[i], r) || !r.ok ||
+            r.body != expected[i])
+        {
+          failures[i]++;
+        }
+      }
+    });
+  }
+  for (size_t n = 0; n < 200; n++) { parse_text(sources[n % kClients]); }
+  for (auto& t : threads) { t.join(); }
+  for (size_t i = 0; i < kClients; i++) { assert_eq(failures[i], 0u); }
+}
+
+int main(int argc, const char** argv) {
+  std::string path = "/tmp/sat_test_serve." + std::to_string(getpid()) + ".sock";
+  Server::Options opt;
+  opt.path = path;
+  opt.nthreads = 4;
+  opt.idle_timeout_ms = 500;
+  Server server(opt);
+  std::string err;
+  assert_true(server.listen(err));
+  std::thread t([&]{ server.run(); });
+
+  test_requests(path);
+  test_timeout(path);
+  test_idle(path, opt.nthreads);
+  test_too_large(path + ".small");
+  test_cancel(path);
+  strings.set_compaction(0.05f, 64); // compact often while the workers share the interner
+  test_concurrency(path);
+  assert_true(strings.stats().compactions > 0);
+
+  Client c;
+  assert_true(c.connect(path));
+  Client::Response r;
+  assert_true(c.stats(r));
+  assert_true(r.ok);
+  assert_true(r.body.find("latency.p99_us") != std::string::npos);
+  assert_true(r.body.find("intern.dead_ratio") != std::string::npos);
+  LatencyHistogram h = server.latency();
+  assert_true(h.total >= 8 * 100);
+  assert_true(h.percentile(50) <= h.percentile(99));
+
+  server.stop();
+  t.join();
+  return 0;
+}
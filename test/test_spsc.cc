@@ -0,0 +1,60 @@
+//!DEP ../src/alloc.cc
+#include "../src/spsc.hh"
+#include "test.hh"
+#include <string>
+#include <thread>
+
+using namespace sat;
+
+static void test_single_thread() {
+  SPSCQueue<int> q(3);
+  assert_eq(q.capacity(), 4u);
+  int v = 0;
+  assert_false(q.try_pop(v));
+  for (int i = 0; i < 4; i++) { assert_true(q.try_push(std::move(i))); }
+  int x = 5;
+  assert_false(q.try_push(std::move(x))); // full
+  assert_true(q.try_pop(v));
+  assert_eq(v, 0);
+  assert_true(q.try_push(std::move(x)));
+  for (int want : { 1, 2, 3, 5 }) {
+    assert_true(q.try_pop(v));
+    assert_eq(v, want);
+  }
+  q.close();
+  assert_false(q.pop(v));
+  assert_eq(q.stats().items, 5u);
+}
+
+static void test_threads(size_t capacity, size_t count) {
+  // Items arrive in order, with a producer much faster than its consumer and vice versa
+  for (bool slow_consumer : { false, true }) {
+    SPSCQueue<std::string> q(capacity);
+    std::thread producer([&]{
+      for (size_t i = 0; i < count; i++) {
+        q.push(std::to_string(i));
+        if (!slow_consumer && i % 1000 == 0) { std::this_thread::yield(); }
+      }
+      q.close();
+    });
+    std::string s;
+    size_t n = 0;
+    while (q.pop(s)) {
+      if (s != std::to_string(n)) {
+        break;
+      }
+      n++;
+      if (slow_consumer && n % 1000 == 0) { std::this_thread::yield(); }
+    }
+    producer.join();
+    assert_eq(n, count);
+    assert_eq(q.stats().items, (u64)count);
+  }
+}
+
+int main(int argc, const char** argv) {
+  test_single_thread();
+  test_threads(1, 20000);
+  test_threads(64, 200000);
+  return 0;
+}
@@ -1,6 +1,8 @@
-//!DEP ../src/str.cc
+//!DEP ../src/str.cc ../src/trace.cc ../src/alloc.cc
 #include "test.hh"
 #include "../src/str.hh"
+#include <string>
+#include <vector>
 
 using namespace sat;
 
@@ -160,6 +162,48 @@ void test_weak_str_set() {
 }
 
 
+void test_weak_str_set_compaction() {
+  // Slots of deallocated strings are removed once they make up enough of the set
+  Str::WeakSet set{&kStr_A};
+  set.set_compaction(0.5, 100);
+  std::vector<Str> keep;
+  for (int i = 0; i < 1000; i++) {
+    keep.push_back(set.get(("keep" + std::to_string(i)).c_str()));
+  }
+  for (int i = 0; i < 10000; i++) {
+    set.get(("temp" + std::to_string(i)).c_str()); // deallocated right away
+  }
+  Str::WeakSet::Stats st = set.stats();
+  assert(st.compactions > 0);
+  assert(st.size < 2100); // live strings plus at most as many dead ones
+  for (int i = 0; i < 1000; i++) {
+    assert(set.find(("keep" + std::to_string(i)).c_str()).self == keep[i].self);
+  }
+  assert(set.get("keep1").self == keep[1].self);
+
+  // An explicit compaction removes all dead slots and shrinks the table
+  size_t buckets = set.stats().buckets;
+  keep.clear();
+  assert(set.compact() > 0);
+  st = set.stats();
+  assert(st.dead == 0);
+  assert(st.size == 1); // kStr_A
+  assert(st.buckets < buckets);
+  assert(set.find("A").self == (Str::Imp*)&kStr_A);
+
+  // Turned off, dead slots are only reused
+  Str::WeakSet set2{&kStr_A};
+  set2.set_compaction(0);
+  for (int i = 0; i < 5000; i++) {
+    set2.get(("temp" + std::to_string(i)).c_str());
+  }
+  st = set2.stats();
+  assert(st.compactions == 0);
+  assert(st.dead > 1000);
+  assert(st.dead_ratio() > 0.5);
+}
+
+
 void test_weak_str() {
   Str::WeakRef ws1;
   {
@@ -188,5 +232,6 @@ int main(int argc, const char** argv) {
   test_weak_str();
   test_strong_str_set();
   test_weak_str_set();
+  test_weak_str_set_compaction();
   test_map();
 }
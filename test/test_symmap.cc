@@ -0,0 +1,135 @@
+//!DEP ../src/str.cc ../src/trace.cc ../src/alloc.cc
+#include "test.hh"
+#include "../src/symmap.hh"
+#include <string>
+#include <vector>
+
+using namespace sat;
+
+static constexpr auto kStr_a = ConstStr("a");
+static Str::WeakSet syms{&kStr_a};
+
+static std::vector<Str> make_keys(size_t n) {
+  std::vector<Str> keys;
+  for (size_t i = 0; i < n; i++) {
+    std::string s = "k" + std::to_string(i);
+    keys.push_back(syms.get(s.c_str(), (u32)s.size()));
+  }
+  return keys;
+}
+
+void test_basics() {
+  SymMap<int> m;
+  Str a = syms.get("a");
+  Str b = syms.get("b");
+  assert_true(m.empty());
+  assert_null(m.find(a));
+  assert_true(m.set(a, 1));
+  assert_false(m.set(a, 2)); // replaces
+  assert_eq(*m.find(a), 2);
+  assert_null(m.find(b));
+  m[b] = 3;
+  assert_eq(m.size(), 2u);
+  assert_eq(*m.find(b), 3);
+  assert_true(m.erase(a));
+  assert_false(m.erase(a));
+  assert_null(m.find(a));
+  assert_eq(m.size(), 1u);
+}
+
+void test_identity() {
+  // Keys are compared by pointer: a separately allocated string with the same bytes is a
+  // different key
+  SymMap<int> m;
+  Str a = syms.get("x");
+  Str a2{"x"};
+  m.set(a, 1);
+  assert_not_null(m.find(syms.get("x")));
+  assert_null(m.find(a2));
+}
+
+void test_grow_and_erase() {
+  std::vector<Str> keys = make_keys(1000);
+  SymMap<size_t> m;
+  for (size_t i = 0; i < keys.size(); i++) {
+    assert_true(m.set(keys[i], i));
+  }
+  assert_eq(m.size(), keys.size());
+  assert_true(m.capacity() * 3 >= m.size() * 4);
+  for (size_t i = 0; i < keys.size(); i++) {
+    assert_eq(*m.find(keys[i]), i);
+  }
+  // Erase every other key; the rest must still be found
+  for (size_t i = 0; i < keys.size(); i += 2) {
+    assert_true(m.erase(keys[i]));
+  }
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (i % 2) {
+      assert_eq(*m.find(keys[i]), i);
+    } else {
+      assert_null(m.find(keys[i]));
+    }
+  }
+  size_t n = 0;
+  m.foreach([&](Str::Imp* k, size_t v) { assert_eq(v % 2, 1u); n++; });
+  assert_eq(n, m.size());
+}
+
+void test_copy_move() {
+  std::vector<Str> keys = make_keys(20);
+  SymMap<size_t> small, large;
+  for (size_t i = 0; i < 4; i++) { small.set(keys[i], i); }
+  for (size_t i = 0; i < keys.size(); i++) { large.set(keys[i], i); }
+
+  SymMap<size_t> c{large};
+  assert_eq(c.size(), large.size());
+  assert_eq(*c.find(keys[19]), 19u);
+
+  SymMap<size_t> m1{std::move(small)};
+  assert_eq(m1.size(), 4u);
+  assert_eq(*m1.find(keys[3]), 3u);
+  assert_true(small.empty());
+
+  SymMap<size_t> m2{std::move(large)};
+  assert_eq(m2.size(), keys.size());
+  assert_true(large.empty());
+  assert_null(large.find(keys[0]));
+}
+
+void test_references() {
+  // The map keeps its keys alive, so an interned key stays interned while it's in the map
+  SymMap<int> m;
+  Str::WeakRef wr;
+  {
+    Str k = syms.get("held");
+    wr = k;
+    m.set(k, 1);
+  }
+  assert_true(wr == true);
+  m.clear();
+  assert_true(wr == false);
+}
+
+void test_inline_storage() {
+  // Small maps don't allocate
+  std::vector<Str> keys = make_keys(6);
+  alloc::enable(true);
+  u64 calls = alloc::stats(alloc::Tag::MAP).calls;
+  {
+    SymMap<int> m;
+    for (size_t i = 0; i < 6; i++) { m.set(keys[i], (int)i); }
+    assert_eq(m.capacity(), 8u);
+  }
+  assert_eq(alloc::stats(alloc::Tag::MAP).calls, calls);
+  alloc::enable(false);
+}
+
+int main() {
+  test_basics();
+  test_identity();
+  test_grow_and_erase();
+  test_copy_move();
+  test_references();
+  test_inline_storage();
+  return 0;
+}
@@ -0,0 +1,75 @@
+//!DEP ../src/trace.cc ../src/alloc.cc
+#include "../src/trace.hh"
+#include "test.hh"
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace sat;
+
+static std::string read_file(const char* path) {
+  std::ifstream f(path);
+  std::stringstream ss;
+  ss << f.rdbuf();
+  return ss.str();
+}
+
+static bool contains(const std::string& s, const char* substr) {
+  return s.find(substr) != std::string::npos;
+}
+
+static void test_disabled() {
+  // Nothing is recorded until tracing is enabled
+  { trace::Span span("test", "off"); span.arg("n", (i64)1); }
+  trace::instant("test", "off");
+  trace::set_thread_name("ignored");
+  assert_eq(trace::count(), 0u);
+}
+
+static void test_events() {
+  trace::enable(true);
+  trace::set_thread_name("main \"thread\"");
+  {
+    trace::Span span("test", "outer");
+    span.arg("status", "MORE").arg("bytes", (i64)42).arg("ignored", (i64)3);
+    trace::Span inner("test", "inner");
+    inner.end();
+    inner.end(); // only recorded once
+  }
+  trace::instant("test", "mark", trace::Arg("size", (i64)-7));
+  std::thread t([]{
+    trace::set_thread_name("worker");
+    trace::Span span("test", "on_thread");
+  });
+  t.join();
+  assert_eq(trace::count(), 4u);
+
+  const char* path = "/tmp/sat-test-trace.json";
+  assert_true(trace::write(path));
+  std::string json = read_file(path);
+  remove(path);
+  assert_true(contains(json, "{\"traceEvents\":["));
+  assert_true(contains(json, "\"args\":{\"name\":\"main \\\"thread\\\"\"}"));
+  assert_true(contains(json, "\"name\":\"outer\",\"ph\":\"X\""));
+  assert_true(contains(json, "\"args\":{\"status\":\"MORE\",\"bytes\":42}}"));
+  assert_true(contains(json, "\"name\":\"mark\",\"ph\":\"i\""));
+  assert_true(contains(json, "\"args\":{\"size\":-7}}"));
+  assert_true(contains(json, "\"tid\":2,\"args\":{\"name\":\"worker\"}"));
+  assert_true(contains(json, "\"name\":\"on_thread\",\"ph\":\"X\",\"pid\":"));
+  assert_false(contains(json, "ignored"));
+
+  // Enabling again starts over
+  trace::enable(false);
+  trace::enable(true);
+  assert_eq(trace::count(), 0u);
+  trace::enable(false);
+
+  assert_false(trace::write("/nonexistent/dir/trace.json"));
+}
+
+int main(int argc, const char** argv) {
+  test_disabled();
+  test_events();
+  return 0;
+}